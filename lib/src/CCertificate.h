@@ -228,8 +228,15 @@ public:
     }
 
     CCertificate(const idpass::Certificate& c)
+        : CCertificate(c, true)
     {
-        if (crypto_sign_verify_detached(
+    }
+
+    // The signature check can be skipped by callers that have already
+    // verified this exact certificate
+    CCertificate(const idpass::Certificate& c, bool verify)
+    {
+        if (verify && crypto_sign_verify_detached(
                 reinterpret_cast<const unsigned char*>(c.signature().data()),
                 reinterpret_cast<const unsigned char*>(c.pubkey().data()),
                 crypto_sign_PUBLICKEYBYTES,
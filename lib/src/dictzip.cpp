@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2020 Newlogic Pte. Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "dictzip.h"
+#include "sodium.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+namespace
+{
+const unsigned char FRAME_MARKER = 0x00;
+const unsigned char FRAME_VERSION = 0x01;
+const int FRAME_HEADER_LEN = 6;
+const int MIN_MATCH = 3;
+const int MAX_CHAIN = 64;
+const int MAX_OUTPUT = 65536;
+const int HASH_BITS = 12;
+
+std::mutex& registry_mutex()
+{
+    static std::mutex m;
+    return m;
+}
+
+std::map<std::uint32_t, std::vector<unsigned char>>& registry()
+{
+    static std::map<std::uint32_t, std::vector<unsigned char>> r;
+    return r;
+}
+
+void put_varint(std::vector<unsigned char>& out, std::uint32_t v)
+{
+    while (v >= 0x80) {
+        out.push_back(static_cast<unsigned char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(v));
+}
+
+bool get_varint(const unsigned char* in, int in_len, int& pos, std::uint32_t& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (pos >= in_len) {
+            return false;
+        }
+        unsigned char b = in[pos++];
+        v |= static_cast<std::uint32_t>(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::uint32_t hash3(const unsigned char* p)
+{
+    std::uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+} // namespace
+
+std::uint32_t dictzip::add_dictionary(const unsigned char* dict, int dict_len)
+{
+    if (dict == nullptr || dict_len <= 0) {
+        return NONE;
+    }
+
+    unsigned char hash[crypto_generichash_BYTES];
+    crypto_generichash(hash, sizeof hash, dict, dict_len, nullptr, 0);
+
+    std::uint32_t id = hash[0] | (hash[1] << 8) | (hash[2] << 16)
+                       | (static_cast<std::uint32_t>(hash[3]) << 24);
+    if (id == NONE) {
+        id = 1;
+    }
+
+    std::lock_guard<std::mutex> guard(registry_mutex());
+    auto it = registry().find(id);
+    if (it != registry().end()) {
+        // A different dictionary with the same truncated hash must not
+        // replace the one that frames already name by this id
+        if (it->second.size() != static_cast<std::size_t>(dict_len)
+            || !std::equal(it->second.begin(), it->second.end(), dict)) {
+            return NONE;
+        }
+        return id;
+    }
+    registry()[id].assign(dict, dict + dict_len);
+    return id;
+}
+
+bool dictzip::find_dictionary(std::uint32_t dict_id,
+                              std::vector<unsigned char>& dict)
+{
+    if (dict_id == NONE) {
+        dict.clear();
+        return true;
+    }
+
+    std::lock_guard<std::mutex> guard(registry_mutex());
+    auto it = registry().find(dict_id);
+    if (it == registry().end()) {
+        return false;
+    }
+    dict = it->second;
+    return true;
+}
+
+bool dictzip::compress(const unsigned char* in,
+                       int in_len,
+                       std::uint32_t dict_id,
+                       std::vector<unsigned char>& out)
+{
+    if (in == nullptr || in_len <= 0 || in_len > MAX_OUTPUT) {
+        return false;
+    }
+
+    std::vector<unsigned char> buf;
+    if (!find_dictionary(dict_id, buf)) {
+        return false;
+    }
+
+    const int start = buf.size();
+    buf.insert(buf.end(), in, in + in_len);
+    const int size = buf.size();
+
+    std::vector<int> head(1 << HASH_BITS, -1);
+    std::vector<int> prev(size, -1);
+
+    auto insert = [&](int pos) {
+        if (pos + MIN_MATCH <= size) {
+            std::uint32_t h = hash3(&buf[pos]);
+            prev[pos] = head[h];
+            head[h] = pos;
+        }
+    };
+
+    for (int i = 0; i < start; i++) {
+        insert(i);
+    }
+
+    out.clear();
+    out.push_back(FRAME_MARKER);
+    out.push_back(FRAME_VERSION);
+    for (int b = 0; b < 4; b++) {
+        out.push_back(static_cast<unsigned char>(dict_id >> (8 * b)));
+    }
+    put_varint(out, in_len);
+
+    int i = start;
+    int lit = start;
+
+    while (i < size) {
+        int best_len = 0;
+        int best_off = 0;
+
+        if (i + MIN_MATCH <= size) {
+            int cand = head[hash3(&buf[i])];
+            for (int chain = 0; cand >= 0 && chain < MAX_CHAIN; chain++) {
+                int len = 0;
+                while (i + len < size && buf[cand + len] == buf[i + len]) {
+                    len++;
+                }
+                if (len > best_len) {
+                    best_len = len;
+                    best_off = i - cand;
+                }
+                cand = prev[cand];
+            }
+        }
+
+        if (best_len >= MIN_MATCH) {
+            put_varint(out, i - lit);
+            out.insert(out.end(), buf.begin() + lit, buf.begin() + i);
+            put_varint(out, best_len);
+            put_varint(out, best_off);
+            for (int k = 0; k < best_len; k++) {
+                insert(i + k);
+            }
+            i += best_len;
+            lit = i;
+        } else {
+            insert(i);
+            i++;
+        }
+    }
+
+    put_varint(out, i - lit);
+    out.insert(out.end(), buf.begin() + lit, buf.begin() + i);
+    put_varint(out, 0);
+
+    return true;
+}
+
+bool dictzip::is_compressed(const unsigned char* in, int in_len)
+{
+    return in != nullptr && in_len >= FRAME_HEADER_LEN && in[0] == FRAME_MARKER
+           && in[1] == FRAME_VERSION;
+}
+
+bool dictzip::decompress(const unsigned char* in,
+                         int in_len,
+                         std::vector<unsigned char>& out)
+{
+    if (!is_compressed(in, in_len)) {
+        return false;
+    }
+
+    std::uint32_t dict_id = in[2] | (in[3] << 8) | (in[4] << 16)
+                            | (static_cast<std::uint32_t>(in[5]) << 24);
+
+    int pos = FRAME_HEADER_LEN;
+    std::uint32_t orig_len;
+    if (!get_varint(in, in_len, pos, orig_len) || orig_len == 0
+        || orig_len > MAX_OUTPUT) {
+        return false;
+    }
+
+    std::vector<unsigned char> buf;
+    if (!find_dictionary(dict_id, buf)) {
+        return false;
+    }
+
+    const std::size_t start = buf.size();
+    const std::size_t end = start + orig_len;
+    buf.reserve(end);
+
+    while (true) {
+        std::uint32_t lit_len;
+        if (!get_varint(in, in_len, pos, lit_len)
+            || lit_len > static_cast<std::uint32_t>(in_len - pos)
+            || buf.size() + lit_len > end) {
+            return false;
+        }
+        buf.insert(buf.end(), in + pos, in + pos + lit_len);
+        pos += lit_len;
+
+        std::uint32_t match_len;
+        if (!get_varint(in, in_len, pos, match_len)) {
+            return false;
+        }
+        if (match_len == 0) {
+            break;
+        }
+
+        std::uint32_t offset;
+        if (!get_varint(in, in_len, pos, offset) || offset == 0
+            || offset > buf.size() || buf.size() + match_len > end) {
+            return false;
+        }
+
+        // Byte by byte, as a match may overlap its own output
+        std::size_t from = buf.size() - offset;
+        for (std::uint32_t k = 0; k < match_len; k++) {
+            buf.push_back(buf[from + k]);
+        }
+    }
+
+    if (pos != in_len || buf.size() != end) {
+        return false;
+    }
+
+    out.assign(buf.begin() + start, buf.end());
+    return true;
+}
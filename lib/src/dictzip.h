@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2020 Newlogic Pte. Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/**
+* Small LZ77 codec with preset dictionaries, for the short and highly
+* repetitive serialized card regions. Back-references may reach into
+* the dictionary as if it preceded the input.
+*
+* A compressed frame starts with a 0x00 byte, which never starts a
+* serialized protobuf message, so decoders can tell frames apart from
+* plain regions of older cards. The frame names its dictionary by id,
+* and decoding succeeds only if that dictionary has been registered.
+* There is no built-in dictionary, as one that suits the cards of every
+* deployment does not exist.
+* The id is a truncated hash of the dictionary bytes, and adding a
+* dictionary whose id is already taken by other bytes fails with NONE.
+*/
+
+class dictzip
+{
+public:
+    static const std::uint32_t NONE = 0;
+
+    static std::uint32_t add_dictionary(const unsigned char* dict, int dict_len);
+
+    static bool compress(const unsigned char* in,
+                         int in_len,
+                         std::uint32_t dict_id,
+                         std::vector<unsigned char>& out);
+    static bool is_compressed(const unsigned char* in, int in_len);
+    static bool decompress(const unsigned char* in,
+                           int in_len,
+                           std::vector<unsigned char>& out);
+
+private:
+    static bool find_dictionary(std::uint32_t dict_id,
+                                std::vector<unsigned char>& dict);
+};
@@ -15,6 +15,7 @@
  */
 
 #include "bin16.h"
+#include "dictzip.h"
 #include "sodium.h"
 
 #include <stddef.h>
@@ -27,15 +28,33 @@
 #include "proto/api/api.pb.h"
 #include "proto/idpasslite/idpasslite.pb.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <ios>
 #include <list>
 #include <array>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
+#include <thread>
 #include <vector>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #ifdef ANDROID
 #include <android/log.h>
 
@@ -99,6 +118,7 @@ double computeFaceDiff(char* photo,
 bool decryptCard(unsigned char* full_card_buf,
                  int full_card_buf_len,
                  api::KeySet& keyset,
+                 const KeyHashSet& verificationKeys,
                  idpass::IDPassCard& card,
                  idpass::IDPassCards& fullCard)
 {
@@ -139,17 +159,8 @@ bool decryptCard(unsigned char* full_card_buf,
     // Find the card's signer key in the reader's trusted verification key(s)
     // only if the card has no attached certificate(s)
     if (fullCard.certificates_size() == 0) {
-        bool found = false;
-        for (auto& pub : keyset.verificationkeys()) {
-            if (pub.typ() == api::byteArray_Typ_ED25519PUBKEY) {
-                if (std::memcmp(pub.val().data(), pubkey, 32) == 0) {
-                    found = true;
-                    break;
-                }
-            }
-        }
-
-        if (!found) {
+        if (fullCard.signerpublickey().size() != crypto_sign_PUBLICKEYBYTES
+            || !verificationKeys.contains(pubkey)) {
             return false;
         }
     } 
@@ -184,7 +195,16 @@ bool decryptCard(unsigned char* full_card_buf,
     }
 
     idpass::SignedIDPassCard privateRegion;
-    bool flag = privateRegion.ParseFromArray(privateRegionBuf, decrypted_len);
+    bool flag;
+
+    if (dictzip::is_compressed(privateRegionBuf, decrypted_len)) {
+        std::vector<unsigned char> inflated;
+        flag = dictzip::decompress(privateRegionBuf, decrypted_len, inflated)
+               && privateRegion.ParseFromArray(inflated.data(),
+                                               inflated.size());
+    } else {
+        flag = privateRegion.ParseFromArray(privateRegionBuf, decrypted_len);
+    }
 
     if (flag) {
         card = privateRegion.card();
@@ -194,20 +214,736 @@ bool decryptCard(unsigned char* full_card_buf,
     return flag;
 }
 
-bool isRevoked(std::list<std::array<unsigned char,32>>& rkeys, unsigned char* key, int key_len)
+KeyHashSet::KeyHashSet()
+    : m_mask(0)
+    , m_count(0)
+{
+    randombytes_buf(m_hashkey, sizeof m_hashkey);
+}
+
+std::size_t KeyHashSet::slot(const unsigned char* key) const
+{
+    unsigned char h[crypto_shorthash_BYTES];
+    crypto_shorthash(h, key, crypto_sign_PUBLICKEYBYTES, m_hashkey);
+    std::uint64_t v;
+    std::memcpy(&v, h, sizeof v);
+    return static_cast<std::size_t>(v) & m_mask;
+}
+
+void KeyHashSet::reserve(std::size_t n)
+{
+    // Keep the load factor at or below 1/2
+    std::size_t capacity = 8;
+    while (capacity < 2 * n) {
+        capacity <<= 1;
+    }
+
+    if (capacity <= m_keys.size()) {
+        return;
+    }
+
+    std::vector<std::array<unsigned char, crypto_sign_PUBLICKEYBYTES>> keys(
+        capacity);
+    std::vector<unsigned char> used(capacity, 0);
+
+    keys.swap(m_keys);
+    used.swap(m_used);
+    m_mask = capacity - 1;
+
+    for (std::size_t i = 0; i < used.size(); i++) {
+        if (used[i]) {
+            std::size_t j = slot(keys[i].data());
+            while (m_used[j]) {
+                j = (j + 1) & m_mask;
+            }
+            m_keys[j] = keys[i];
+            m_used[j] = 1;
+        }
+    }
+}
+
+bool KeyHashSet::insert(const unsigned char* key)
+{
+    reserve(m_count + 1);
+
+    std::size_t i = slot(key);
+    while (m_used[i]) {
+        if (std::memcmp(m_keys[i].data(), key, crypto_sign_PUBLICKEYBYTES)
+            == 0) {
+            return false;
+        }
+        i = (i + 1) & m_mask;
+    }
+
+    std::memcpy(m_keys[i].data(), key, crypto_sign_PUBLICKEYBYTES);
+    m_used[i] = 1;
+    m_count++;
+    return true;
+}
+
+void KeyHashSet::clear()
+{
+    m_keys.clear();
+    m_used.clear();
+    m_mask = 0;
+    m_count = 0;
+}
+
+bool KeyHashSet::contains(const unsigned char* key) const
+{
+    if (m_count == 0) {
+        return false;
+    }
+
+    std::size_t i = slot(key);
+    while (m_used[i]) {
+        if (std::memcmp(m_keys[i].data(), key, crypto_sign_PUBLICKEYBYTES)
+            == 0) {
+            return true;
+        }
+        i = (i + 1) & m_mask;
+    }
+
+    return false;
+}
+
+const char REVOCATION_MAGIC[4] = {'I', 'D', 'P', 'R'};
+const std::uint32_t REVOCATION_VERSION = 1;
+const std::size_t REVOCATION_HEADER_LEN = 16;
+
+RevocationStore::RevocationStore()
+    : m_map(nullptr)
+    , m_map_len(0)
+    , m_keys(nullptr)
+    , m_count(0)
+    , m_digest(nullptr)
 {
-    std::array<char, crypto_sign_PUBLICKEYBYTES> rkey;
-    std::copy(key, key + key_len, std::begin(rkey));
+}
 
-    std::list<std::array<unsigned char, 32>>::iterator it =
+RevocationStore::~RevocationStore()
+{
+#ifndef _WIN32
+    if (m_map != nullptr) {
+        munmap(m_map, m_map_len);
+    }
+#endif
+}
 
-    std::find_if(rkeys.begin(),
-                 rkeys.end(),
-                 [&rkey](const std::array<unsigned char, 32>& x) {
-                     return std::memcmp(x.data(), rkey.data(), 32) == 0;
-                 });
+bool RevocationStore::open(const char* filename)
+{
+    const unsigned char* base = nullptr;
+    std::size_t len = 0;
 
-    return it != rkeys.end();
+#ifndef _WIN32
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+
+    len = static_cast<std::size_t>(st.st_size);
+    void* map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    m_map = map;
+    m_map_len = len;
+    base = static_cast<const unsigned char*>(map);
+#else
+    std::ifstream f(filename, std::ios::binary);
+    if (!f) {
+        return false;
+    }
+    m_buf.assign(std::istreambuf_iterator<char>(f), {});
+    len = m_buf.size();
+    base = m_buf.data();
+#endif
+
+    if (len < REVOCATION_HEADER_LEN + crypto_generichash_BYTES
+        || std::memcmp(base, REVOCATION_MAGIC, 4) != 0) {
+        return false;
+    }
+
+    std::uint32_t version;
+    std::uint64_t count;
+    std::memcpy(&version, base + 4, sizeof version);
+    std::memcpy(&count, base + 8, sizeof count);
+
+    std::size_t body_len = len - REVOCATION_HEADER_LEN - crypto_generichash_BYTES;
+    if (version != REVOCATION_VERSION
+        || count != body_len / crypto_sign_PUBLICKEYBYTES
+        || body_len % crypto_sign_PUBLICKEYBYTES != 0) {
+        return false;
+    }
+
+    unsigned char hash[crypto_generichash_BYTES];
+    crypto_generichash(hash,
+                       sizeof hash,
+                       base,
+                       len - crypto_generichash_BYTES,
+                       nullptr,
+                       0);
+
+    if (sodium_memcmp(hash, base + len - crypto_generichash_BYTES, sizeof hash)
+        != 0) {
+        return false;
+    }
+
+    m_keys = base + REVOCATION_HEADER_LEN;
+    m_count = static_cast<std::size_t>(count);
+    m_digest = base + len - crypto_generichash_BYTES;
+    return true;
+}
+
+static std::uint64_t key_prefix(const unsigned char* key)
+{
+    std::uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | key[i];
+    }
+    return v;
+}
+
+bool RevocationStore::contains(const unsigned char* key) const
+{
+    if (m_count == 0) {
+        return false;
+    }
+
+    // Public keys are uniformly distributed, so interpolating on the
+    // leading 8 bytes lands next to the key in a few probes. Every other
+    // probe bisects to keep the worst case logarithmic.
+    std::uint64_t t = key_prefix(key);
+    std::size_t lo = 0;
+    std::size_t hi = m_count - 1;
+    bool bisect = false;
+
+    while (lo <= hi) {
+        const unsigned char* lokey = m_keys + lo * crypto_sign_PUBLICKEYBYTES;
+        const unsigned char* hikey = m_keys + hi * crypto_sign_PUBLICKEYBYTES;
+        std::uint64_t lk = key_prefix(lokey);
+        std::uint64_t hk = key_prefix(hikey);
+
+        if (t < lk || t > hk) {
+            return false;
+        }
+
+        std::size_t mid = lo + (hi - lo) / 2;
+        if (!bisect && hk != lk) {
+            mid = lo
+                  + static_cast<std::size_t>(static_cast<long double>(t - lk)
+                                             / (hk - lk) * (hi - lo));
+        }
+        bisect = !bisect;
+
+        int cmp = std::memcmp(m_keys + mid * crypto_sign_PUBLICKEYBYTES,
+                              key,
+                              crypto_sign_PUBLICKEYBYTES);
+        if (cmp == 0) {
+            return true;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            if (mid == 0) {
+                return false;
+            }
+            hi = mid - 1;
+        }
+    }
+
+    return false;
+}
+
+// Sorts and de-duplicates keys then lays out the store file image in buf
+static void revocation_image(
+    std::vector<std::array<unsigned char, crypto_sign_PUBLICKEYBYTES>>& keys,
+    std::vector<unsigned char>& buf)
+{
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    std::size_t body_len = keys.size() * crypto_sign_PUBLICKEYBYTES;
+    buf.assign(REVOCATION_HEADER_LEN + body_len + crypto_generichash_BYTES, 0);
+
+    std::uint32_t version = REVOCATION_VERSION;
+    std::uint64_t count = keys.size();
+    std::memcpy(&buf[0], REVOCATION_MAGIC, 4);
+    std::memcpy(&buf[4], &version, sizeof version);
+    std::memcpy(&buf[8], &count, sizeof count);
+
+    for (std::size_t i = 0; i < keys.size(); i++) {
+        std::memcpy(&buf[REVOCATION_HEADER_LEN + i * crypto_sign_PUBLICKEYBYTES],
+                    keys[i].data(),
+                    crypto_sign_PUBLICKEYBYTES);
+    }
+
+    crypto_generichash(&buf[REVOCATION_HEADER_LEN + body_len],
+                       crypto_generichash_BYTES,
+                       buf.data(),
+                       REVOCATION_HEADER_LEN + body_len,
+                       nullptr,
+                       0);
+}
+
+bool write_revocation_store(
+    const char* filename,
+    std::vector<std::array<unsigned char, crypto_sign_PUBLICKEYBYTES>>& keys)
+{
+    std::vector<unsigned char> buf;
+    revocation_image(keys, buf);
+
+    std::string tmpfile = std::string(filename) + ".tmp";
+    std::ofstream f(tmpfile, std::ios::binary | std::ios::trunc);
+    f.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+    f.close();
+
+    if (!f) {
+        std::remove(tmpfile.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    std::remove(filename);
+#endif
+    return std::rename(tmpfile.c_str(), filename) == 0;
+}
+
+static bool read_keys_file(const std::string& filename,
+                           std::vector<unsigned char>& pubkeys)
+{
+    std::ifstream f(filename, std::ios::binary);
+    if (!f) {
+        return false;
+    }
+
+    std::vector<unsigned char> buf((std::istreambuf_iterator<char>(f)), {});
+    // Ignore a torn trailing record from an interrupted append
+    buf.resize(buf.size() - buf.size() % crypto_sign_PUBLICKEYBYTES);
+    pubkeys.insert(pubkeys.end(), buf.begin(), buf.end());
+    return true;
+}
+
+bool read_revocation_delta(const char* filename,
+                           std::vector<unsigned char>& pubkeys)
+{
+    bool a = read_keys_file(std::string(filename) + ".delta.merging", pubkeys);
+    bool b = read_keys_file(std::string(filename) + ".delta", pubkeys);
+    return a || b;
+}
+
+bool merge_revocation_delta(const char* filename, std::mutex& delta_mutex)
+{
+    static std::mutex merge_mutex;
+    std::lock_guard<std::mutex> guard(merge_mutex);
+
+    std::string delta = std::string(filename) + ".delta";
+    std::string merging = delta + ".merging";
+
+    // A leftover .merging file is from an interrupted merge and is
+    // folded in first. Otherwise take the current delta aside so that
+    // appends during the merge go into a fresh delta file. No append is
+    // under way while it is renamed, so none can land in the file being
+    // merged.
+    std::vector<unsigned char> pubkeys;
+    {
+        std::lock_guard<std::mutex> files(delta_mutex);
+        if (!read_keys_file(merging, pubkeys)) {
+            if (std::rename(delta.c_str(), merging.c_str()) != 0
+                || !read_keys_file(merging, pubkeys)) {
+                return false;
+            }
+        }
+    }
+
+    std::vector<std::array<unsigned char, crypto_sign_PUBLICKEYBYTES>> keys;
+
+    std::ifstream exists(filename);
+    if (exists) {
+        exists.close();
+        RevocationStore store;
+        if (!store.open(filename)) {
+            return false;
+        }
+        keys.resize(store.size());
+        for (std::size_t i = 0; i < store.size(); i++) {
+            std::memcpy(keys[i].data(),
+                        store.keys() + i * crypto_sign_PUBLICKEYBYTES,
+                        crypto_sign_PUBLICKEYBYTES);
+        }
+    }
+
+    std::size_t n = pubkeys.size() / crypto_sign_PUBLICKEYBYTES;
+    std::size_t base = keys.size();
+    keys.resize(base + n);
+    for (std::size_t i = 0; i < n; i++) {
+        std::memcpy(keys[base + i].data(),
+                    &pubkeys[i * crypto_sign_PUBLICKEYBYTES],
+                    crypto_sign_PUBLICKEYBYTES);
+    }
+
+    if (!write_revocation_store(filename, keys)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> files(delta_mutex);
+    std::remove(merging.c_str());
+    return true;
+}
+
+const char FILTER_MAGIC[4] = {'I', 'D', 'P', 'F'};
+const unsigned char FILTER_VERSION = 2;
+const std::size_t FILTER_HEADER_LEN
+    = 8 + 8 + 8 + crypto_shorthash_KEYBYTES + crypto_generichash_BYTES;
+const int FILTER_BUCKET_SLOTS = 4;
+const int FILTER_MAX_KICKS = 500;
+
+RevocationFilter::RevocationFilter()
+    : m_buckets(0)
+    , m_count(0)
+    , m_fpbytes(0)
+{
+    std::memset(m_seed, 0, sizeof m_seed);
+    std::memset(m_digest, 0, sizeof m_digest);
+}
+
+void RevocationFilter::hash(const unsigned char* key,
+                            std::size_t& i,
+                            std::uint32_t& fp) const
+{
+    unsigned char h[crypto_shorthash_BYTES];
+    crypto_shorthash(h, key, crypto_sign_PUBLICKEYBYTES, m_seed);
+    std::uint64_t v;
+    std::memcpy(&v, h, sizeof v);
+
+    i = static_cast<std::size_t>(v) & (m_buckets - 1);
+    fp = static_cast<std::uint32_t>(v >> 32);
+    if (m_fpbytes < 4) {
+        fp &= (1u << (8 * m_fpbytes)) - 1;
+    }
+    // 0 marks an empty slot
+    if (fp == 0) {
+        fp = 1;
+    }
+}
+
+std::size_t RevocationFilter::alt(std::size_t i, std::uint32_t fp) const
+{
+    return (i ^ (static_cast<std::size_t>(fp) * 0x5bd1e995u)) & (m_buckets - 1);
+}
+
+std::uint32_t RevocationFilter::get(std::size_t slot) const
+{
+    const unsigned char* p = &m_table[slot * m_fpbytes];
+    std::uint32_t fp = 0;
+    for (int b = m_fpbytes - 1; b >= 0; b--) {
+        fp = (fp << 8) | p[b];
+    }
+    return fp;
+}
+
+void RevocationFilter::set(std::size_t slot, std::uint32_t fp)
+{
+    unsigned char* p = &m_table[slot * m_fpbytes];
+    for (int b = 0; b < m_fpbytes; b++) {
+        p[b] = static_cast<unsigned char>(fp >> (8 * b));
+    }
+}
+
+bool RevocationFilter::insert(const unsigned char* key)
+{
+    std::size_t i;
+    std::uint32_t fp;
+    hash(key, i, fp);
+
+    for (std::size_t b : {i, alt(i, fp)}) {
+        for (int s = 0; s < FILTER_BUCKET_SLOTS; s++) {
+            std::uint32_t cur = get(b * FILTER_BUCKET_SLOTS + s);
+            if (cur == fp) {
+                return true;
+            }
+            if (cur == 0) {
+                set(b * FILTER_BUCKET_SLOTS + s, fp);
+                return true;
+            }
+        }
+    }
+
+    // Evict a random resident to its alternate bucket
+    for (int kick = 0; kick < FILTER_MAX_KICKS; kick++) {
+        std::size_t slot = i * FILTER_BUCKET_SLOTS
+                           + randombytes_uniform(FILTER_BUCKET_SLOTS);
+        std::uint32_t victim = get(slot);
+        set(slot, fp);
+        fp = victim;
+        i = alt(i, fp);
+
+        for (int s = 0; s < FILTER_BUCKET_SLOTS; s++) {
+            if (get(i * FILTER_BUCKET_SLOTS + s) == 0) {
+                set(i * FILTER_BUCKET_SLOTS + s, fp);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+bool RevocationFilter::build(const unsigned char* keys, std::size_t n, double fpr)
+{
+    if (fpr <= 0.0 || fpr >= 1.0) {
+        return false;
+    }
+
+    // A lookup compares against 2 buckets of 4 fingerprints, so the
+    // false positive rate is about 8 / 2^bits
+    m_fpbytes = 1;
+    while (m_fpbytes < 4 && 8.0 / std::ldexp(1.0, 8 * m_fpbytes) > fpr) {
+        m_fpbytes++;
+    }
+
+    m_count = 0;
+    std::size_t buckets = 1;
+    while (buckets * FILTER_BUCKET_SLOTS * 95 < n * 100) {
+        buckets <<= 1;
+    }
+
+    // An unlucky seed can leave a key with no free slot, so retry with
+    // a new seed and then with twice the buckets
+    for (int attempt = 0; attempt < 8; attempt++) {
+        if (attempt == 4) {
+            buckets <<= 1;
+        }
+        m_buckets = buckets;
+        m_table.assign(m_buckets * FILTER_BUCKET_SLOTS * m_fpbytes, 0);
+        randombytes_buf(m_seed, sizeof m_seed);
+
+        std::size_t i = 0;
+        while (i < n && insert(keys + i * crypto_sign_PUBLICKEYBYTES)) {
+            i++;
+        }
+
+        if (i == n) {
+            m_count = n;
+            break;
+        }
+    }
+
+    if (m_count != n) {
+        return false;
+    }
+
+    std::vector<std::array<unsigned char, crypto_sign_PUBLICKEYBYTES>> sorted(n);
+    for (std::size_t i = 0; i < n; i++) {
+        std::memcpy(sorted[i].data(),
+                    keys + i * crypto_sign_PUBLICKEYBYTES,
+                    crypto_sign_PUBLICKEYBYTES);
+    }
+    std::vector<unsigned char> image;
+    revocation_image(sorted, image);
+    std::memcpy(m_digest,
+                &image[image.size() - crypto_generichash_BYTES],
+                sizeof m_digest);
+    return true;
+}
+
+void RevocationFilter::serialize(std::vector<unsigned char>& blob) const
+{
+    std::uint64_t buckets = m_buckets;
+    std::uint64_t count = m_count;
+
+    blob.assign(FILTER_HEADER_LEN, 0);
+    std::memcpy(&blob[0], FILTER_MAGIC, 4);
+    blob[4] = FILTER_VERSION;
+    blob[5] = m_fpbytes;
+    std::memcpy(&blob[8], &buckets, sizeof buckets);
+    std::memcpy(&blob[16], &count, sizeof count);
+    std::memcpy(&blob[24], m_seed, sizeof m_seed);
+    std::memcpy(&blob[24 + sizeof m_seed], m_digest, sizeof m_digest);
+    blob.insert(blob.end(), m_table.begin(), m_table.end());
+}
+
+bool RevocationFilter::load(const unsigned char* blob, std::size_t blob_len)
+{
+    if (blob_len < FILTER_HEADER_LEN
+        || std::memcmp(blob, FILTER_MAGIC, 4) != 0
+        || blob[4] != FILTER_VERSION || blob[5] < 1 || blob[5] > 4) {
+        return false;
+    }
+
+    std::uint64_t buckets;
+    std::uint64_t count;
+    std::memcpy(&buckets, &blob[8], sizeof buckets);
+    std::memcpy(&count, &blob[16], sizeof count);
+
+    if (buckets == 0 || (buckets & (buckets - 1)) != 0
+        || buckets > (blob_len - FILTER_HEADER_LEN)
+        || blob_len - FILTER_HEADER_LEN
+               != buckets * FILTER_BUCKET_SLOTS * blob[5]) {
+        return false;
+    }
+
+    m_fpbytes = blob[5];
+    m_buckets = static_cast<std::size_t>(buckets);
+    m_count = static_cast<std::size_t>(count);
+    std::memcpy(m_seed, &blob[24], sizeof m_seed);
+    std::memcpy(m_digest, &blob[24 + sizeof m_seed], sizeof m_digest);
+    m_table.assign(blob + FILTER_HEADER_LEN, blob + blob_len);
+    return true;
+}
+
+bool RevocationFilter::contains(const unsigned char* key) const
+{
+    if (m_buckets == 0) {
+        return false;
+    }
+
+    std::size_t i;
+    std::uint32_t fp;
+    hash(key, i, fp);
+
+    for (std::size_t b : {i, alt(i, fp)}) {
+        for (int s = 0; s < FILTER_BUCKET_SLOTS; s++) {
+            if (get(b * FILTER_BUCKET_SLOTS + s) == fp) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// Size classes of 64 bytes to 64 KiB, with up to 64 KiB of free blocks
+// of each class kept per thread
+const int ARENA_CLASSES = 11;
+const int ARENA_MIN_SHIFT = 6;
+const std::size_t ARENA_CACHE_BYTES = 64 * 1024;
+
+struct ArenaCache {
+    std::vector<void*> lists[ARENA_CLASSES];
+
+    ~ArenaCache()
+    {
+        for (auto& list : lists) {
+            for (void* block : list) {
+                ::operator delete(block);
+            }
+        }
+    }
+};
+
+static ArenaCache& arenaCache()
+{
+    thread_local ArenaCache cache;
+    return cache;
+}
+
+// Size class of a block of n bytes, or ARENA_CLASSES past the largest
+static int arenaClass(int n)
+{
+    int cls = 0;
+    while (cls < ARENA_CLASSES
+           && (std::size_t(1) << (cls + ARENA_MIN_SHIFT)) < std::size_t(n)) {
+        cls++;
+    }
+    return cls;
+}
+
+ByteArena::ByteArena()
+{
+}
+
+ByteArena::~ByteArena()
+{
+    for (auto& block : m_blocks) {
+        sodium_memzero(block.first, block.second);
+        ::operator delete(block.first);
+    }
+}
+
+unsigned char* ByteArena::allocate(int n)
+{
+    if (n <= 0) {
+        return nullptr;
+    }
+
+    int cls = arenaClass(n);
+    void* block = nullptr;
+    if (cls < ARENA_CLASSES) {
+        std::vector<void*>& list = arenaCache().lists[cls];
+        if (!list.empty()) {
+            block = list.back();
+            list.pop_back();
+        } else {
+            block = ::operator new(std::size_t(1) << (cls + ARENA_MIN_SHIFT));
+        }
+    } else {
+        block = ::operator new(n);
+    }
+
+    try {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_blocks.emplace(block, n);
+    } catch (...) {
+        ::operator delete(block);
+        throw;
+    }
+
+    std::memset(block, 0, n);
+    return static_cast<unsigned char*>(block);
+}
+
+bool ByteArena::release(void* addr)
+{
+    int n = 0;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto it = m_blocks.find(addr);
+        if (it == m_blocks.end()) {
+            return false;
+        }
+        n = it->second;
+        m_blocks.erase(it);
+    }
+    sodium_memzero(addr, n);
+
+    int cls = arenaClass(n);
+    if (cls < ARENA_CLASSES) {
+        std::vector<void*>& list = arenaCache().lists[cls];
+        std::size_t size = std::size_t(1) << (cls + ARENA_MIN_SHIFT);
+        if ((list.size() + 1) * size <= ARENA_CACHE_BYTES) {
+            list.push_back(addr);
+            return true;
+        }
+    }
+
+    ::operator delete(addr);
+    return true;
+}
+
+bool isRevoked(const KeyHashSet* rkeys, const unsigned char* key, int key_len)
+{
+    if (rkeys == nullptr || key_len != crypto_sign_PUBLICKEYBYTES) {
+        return false;
+    }
+
+    return rkeys->contains(key);
+}
+
+bool isRevoked(const RevocationStore* store, const unsigned char* key, int key_len)
+{
+    if (store == nullptr || key_len != crypto_sign_PUBLICKEYBYTES) {
+        return false;
+    }
+
+    return store->contains(key);
 }
 
 bool sign_object(std::vector<unsigned char>& blob,
@@ -229,7 +965,8 @@ bool sign_object(std::vector<unsigned char>& blob,
 
 int encrypt_object(idpass::SignedIDPassCard& object,
                    const char* key,
-                   std::vector<unsigned char>& encrypted)
+                   std::vector<unsigned char>& encrypted,
+                   std::uint32_t dict_id)
 {
     int buf_len = object.ByteSizeLong();
     std::vector<unsigned char> buf(buf_len);
@@ -239,6 +976,14 @@ int encrypt_object(idpass::SignedIDPassCard& object,
         return 0;
     }
 
+    std::vector<unsigned char> compressed;
+    if (dict_id != dictzip::NONE
+        && dictzip::compress(buf.data(), buf_len, dict_id, compressed)
+        && compressed.size() < buf.size()) {
+        buf.swap(compressed);
+        buf_len = buf.size();
+    }
+
     unsigned char nonce[crypto_aead_chacha20poly1305_IETF_NPUBBYTES]; // 12
     randombytes_buf(nonce, sizeof nonce);
 
@@ -304,6 +1049,176 @@ bool serialize(idpass::SignedIDPassCard& object,
     return true;
 }
 #endif
+bool unpack_blobs(const unsigned char* buf,
+                  int buf_len,
+                  std::vector<std::pair<const unsigned char*, int>>& blobs)
+{
+    if (buf == nullptr || buf_len < 0) {
+        return false;
+    }
+
+    int offset = 0;
+    while (offset < buf_len) {
+        int len;
+        if (buf_len - offset < (int)sizeof len) {
+            return false;
+        }
+        std::memcpy(&len, buf + offset, sizeof len);
+        offset += sizeof len;
+
+        if (len < 0 || len > buf_len - offset) {
+            return false;
+        }
+        blobs.emplace_back(buf + offset, len);
+        offset += len;
+    }
+
+    return true;
+}
+
+// Threads shared by every parallel_for, started on first use and joined
+// when the library is unloaded
+class WorkerPool
+{
+public:
+    static WorkerPool& instance()
+    {
+        static WorkerPool pool;
+        return pool;
+    }
+
+    int size() const
+    {
+        return static_cast<int>(m_threads.size());
+    }
+
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+        m_wake.notify_one();
+    }
+
+    // Set on the pool's own threads, and on a caller while it runs its
+    // share of a call, so that nested calls run inline
+    static bool& nested()
+    {
+        thread_local bool inside = false;
+        return inside;
+    }
+
+private:
+    WorkerPool()
+    {
+        int hw = std::thread::hardware_concurrency();
+        for (int i = 1; i < hw; i++) {
+            m_threads.emplace_back([this] { work(); });
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& t : m_threads) {
+            t.join();
+        }
+    }
+
+    void work()
+    {
+        nested() = true;
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+                if (m_tasks.empty()) {
+                    return;
+                }
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::list<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stop = false;
+};
+
+// Ranges of one parallel_for, claimed in turn by the caller and by as
+// many pool threads as pick up its tasks before they run out
+struct ParallelJob {
+    const std::function<void(int, int)>* fn;
+    int n;
+    int chunk;
+    int nchunks;
+    std::atomic<int> next{0};
+    int done = 0;
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    void run()
+    {
+        int count = 0;
+        for (int i = next++; i < nchunks; i = next++) {
+            int begin = i * chunk;
+            (*fn)(begin, std::min(n, begin + chunk));
+            count++;
+        }
+        if (count > 0) {
+            std::lock_guard<std::mutex> guard(mutex);
+            done += count;
+            if (done == nchunks) {
+                finished.notify_all();
+            }
+        }
+    }
+};
+
+void parallel_for(int n, int grain, const std::function<void(int, int)>& fn)
+{
+    int nthreads = n / (grain > 0 ? grain : 1);
+    if (nthreads <= 1 || WorkerPool::nested()) {
+        fn(0, n);
+        return;
+    }
+
+    WorkerPool& pool = WorkerPool::instance();
+    nthreads = std::min(nthreads, pool.size() + 1);
+    if (nthreads <= 1) {
+        fn(0, n);
+        return;
+    }
+
+    auto job = std::make_shared<ParallelJob>();
+    job->fn = &fn;
+    job->n = n;
+    job->chunk = (n + nthreads - 1) / nthreads;
+    job->nchunks = (n + job->chunk - 1) / job->chunk;
+
+    // fn is only called for ranges claimed before the caller returns, a
+    // task picked up later finds none left
+    for (int i = 1; i < job->nchunks; i++) {
+        pool.submit([job] { job->run(); });
+    }
+    WorkerPool::nested() = true;
+    job->run();
+    WorkerPool::nested() = false;
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&] { return job->done == job->nchunks; });
+}
+
 bool is_valid_ed25519_key(const unsigned char* key)
 {
     const char* msg = "attack at dawn!";
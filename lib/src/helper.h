@@ -25,12 +25,172 @@
 #include <functional>
 #include <list>
 #include <map>
+#include <mutex>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 #include <array>
+#include <cstdint>
 
 namespace helper
 {
+// Open-addressing hash set of 32 bytes ed25519 public keys. Lookups
+// into a set that is no longer modified need no locking. Slots are
+// hashed with a per-set random SipHash key so that chosen keys cannot
+// force long probe sequences
+class KeyHashSet
+{
+public:
+    KeyHashSet();
+
+    void reserve(std::size_t n);
+    bool insert(const unsigned char* key);
+    bool contains(const unsigned char* key) const;
+    void clear();
+
+    std::size_t size() const
+    {
+        return m_count;
+    }
+
+private:
+    std::size_t slot(const unsigned char* key) const;
+
+    std::vector<std::array<unsigned char, crypto_sign_PUBLICKEYBYTES>> m_keys;
+    std::vector<unsigned char> m_used;
+    std::size_t m_mask;
+    std::size_t m_count;
+    unsigned char m_hashkey[crypto_shorthash_KEYBYTES];
+};
+
+// Read-only view of a revocation store file, as written by
+// write_revocation_store: a 16 bytes header (magic, version, key count),
+// the sorted 32 bytes keys, and a BLAKE2b hash of everything before it.
+// The file is memory-mapped where available.
+class RevocationStore
+{
+public:
+    RevocationStore();
+    ~RevocationStore();
+
+    bool open(const char* filename);
+    bool contains(const unsigned char* key) const;
+
+    std::size_t size() const
+    {
+        return m_count;
+    }
+
+    const unsigned char* keys() const
+    {
+        return m_keys;
+    }
+
+    // The BLAKE2b hash ending the file
+    const unsigned char* digest() const
+    {
+        return m_digest;
+    }
+
+private:
+    RevocationStore(const RevocationStore&) = delete;
+    RevocationStore& operator=(const RevocationStore&) = delete;
+
+    void* m_map;
+    std::size_t m_map_len;
+    std::vector<unsigned char> m_buf;
+    const unsigned char* m_keys;
+    std::size_t m_count;
+    const unsigned char* m_digest;
+};
+
+// Cuckoo filter over 32 bytes public keys, with 4 slots per bucket and
+// 1 to 4 bytes fingerprints chosen from the requested false positive
+// rate. A negative answer is exact, a positive one needs confirming
+// against an exact revocation backend. The filter records the digest of
+// the revocation store holding its keys, so that it can be told apart
+// from a store that has since changed.
+class RevocationFilter
+{
+public:
+    RevocationFilter();
+
+    bool build(const unsigned char* keys, std::size_t n, double fpr);
+    bool load(const unsigned char* blob, std::size_t blob_len);
+    void serialize(std::vector<unsigned char>& blob) const;
+    bool contains(const unsigned char* key) const;
+
+    std::size_t size() const
+    {
+        return m_count;
+    }
+
+    // Digest of the revocation store its keys make up
+    const unsigned char* digest() const
+    {
+        return m_digest;
+    }
+
+private:
+    bool insert(const unsigned char* key);
+    void hash(const unsigned char* key, std::size_t& i, std::uint32_t& fp) const;
+    std::size_t alt(std::size_t i, std::uint32_t fp) const;
+    std::uint32_t get(std::size_t slot) const;
+    void set(std::size_t slot, std::uint32_t fp);
+
+    std::vector<unsigned char> m_table;
+    std::size_t m_buckets;
+    std::size_t m_count;
+    unsigned char m_fpbytes;
+    unsigned char m_seed[crypto_shorthash_KEYBYTES];
+    unsigned char m_digest[crypto_generichash_BYTES];
+};
+
+// Allocator of the byte arrays handed out through the API. Outstanding
+// blocks are indexed by address, so that allocate and release are O(1)
+// on average whatever the count of blocks held, and releasing anything
+// but an outstanding block of the arena, twice included, is a no-op.
+// Blocks of up to 64 KiB are rounded up to power of two size classes
+// and recycled through per-thread free lists, shared by all arenas;
+// larger ones go back to the heap. Outstanding blocks are freed along
+// with the arena. Blocks are wiped as they are released, so that secrets
+// left in them, such as the card key of an abandoned sign stream, do not
+// outlive them.
+class ByteArena
+{
+public:
+    ByteArena();
+    ~ByteArena();
+
+    // Returns n zeroed bytes, or null if n <= 0
+    unsigned char* allocate(int n);
+
+    // Returns false, leaving it alone, if addr is not an outstanding
+    // block of this arena
+    bool release(void* addr);
+
+private:
+    ByteArena(const ByteArena&) = delete;
+    ByteArena& operator=(const ByteArena&) = delete;
+
+    std::mutex m_mutex;
+    // Length asked for each outstanding block
+    std::unordered_map<void*, int> m_blocks;
+};
+
+// Sorts and de-duplicates keys then atomically replaces filename
+bool write_revocation_store(
+    const char* filename,
+    std::vector<std::array<unsigned char, crypto_sign_PUBLICKEYBYTES>>& keys);
+
+// Reads the keys of the append-only delta file(s) of a revocation store
+bool read_revocation_delta(const char* filename,
+                           std::vector<unsigned char>& pubkeys);
+
+// Folds the delta file of a revocation store into the store itself.
+// delta_mutex must be the one held by appends to the delta file.
+bool merge_revocation_delta(const char* filename, std::mutex& delta_mutex);
+
 std::vector<std::string> split(std::string& s, char delimiter);
 std::map<std::string, std::string> parseToMap(std::string& s);
 
@@ -44,6 +204,7 @@ float euclidean_diff(float face1[], float face2[], int n);
 bool decryptCard(unsigned char* full_card_buf,
                  int full_card_buf_len,
                  api::KeySet& keyset,
+                 const KeyHashSet& verificationKeys,
                  idpass::IDPassCard& card,
                  idpass::IDPassCards& fullCard);
 
@@ -61,7 +222,8 @@ std::vector<float> get128f(unsigned char* facearray, int facearray_len);
 double vectorDistance(float* first, float* last, float* first2);
 
 std::vector<char> readfile(const char* filename);
-bool isRevoked(std::list<std::array<unsigned char, 32>>& rkey, unsigned char* key, int key_len);
+bool isRevoked(const KeyHashSet* rkeys, const unsigned char* key, int key_len);
+bool isRevoked(const RevocationStore* store, const unsigned char* key, int key_len);
 bool sign_object(idpass::IDPassCard& object,
                  unsigned char* key,
                  unsigned char* sig);
@@ -74,14 +236,29 @@ bool sign_object(idpass::CardDetails& object,
 bool sign_object(std::vector<unsigned char>& blob,
                  const char* key,
                  unsigned char* sig);
+// Compresses the serialized object with dictionary dict_id, unless
+// dictzip::NONE, when that makes it smaller
 int encrypt_object(idpass::SignedIDPassCard& object,
                    const char* key,
-                   std::vector<unsigned char>&);
+                   std::vector<unsigned char>&,
+                   std::uint32_t dict_id = 0);
 // PublicSignedIDPassCard
 bool serialize(idpass::PublicSignedIDPassCard& object,
                std::vector<unsigned char>&);
 //bool serialize(idpass::SignedIDPassCard& object, std::vector<unsigned char>&);
 
+// Splits a buffer of 4 bytes length-prefixed blobs, as returned by
+// idpass_lite_uio, into (pointer, length) pairs pointing into buf
+bool unpack_blobs(const unsigned char* buf,
+                  int buf_len,
+                  std::vector<std::pair<const unsigned char*, int>>& blobs);
+
+// Runs fn over [0, n) split into contiguous ranges across the calling
+// thread and a pool of threads shared by all calls, using the calling
+// thread alone when n is below two grains of work or when called from
+// within another parallel_for
+void parallel_for(int n, int grain, const std::function<void(int, int)>& fn);
+
 bool is_valid_ed25519_key(const unsigned char* key);
 
 bool is_valid(api::KeySet& ckeys);
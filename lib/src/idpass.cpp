@@ -18,22 +18,28 @@
 
 #include "CCertificate.h"
 #include "bin16.h"
+#include "dictzip.h"
 #include "dlibapi.h"
 #include "dxtracker.h"
 #include "helper.h"
 #include "proto/api/api.pb.h"
 #include "proto/idpasslite/idpasslite.pb.h"
 #include "qrcode.h"
+#include "qrraster.h"
+#include "qrscan.h"
 #include "sodium.h"
 
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <climits>
 #include <ctime>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <sstream>
 #include <string>
@@ -61,13 +67,60 @@
 char dxtracker[] = DXTRACKER;
 int binary_encoding_max[] = {2953, 2331, 1663, 1273};
 
+// Writers serialize on g_mutex and publish a new immutable revocation
+// set with std::atomic_store. Readers take a snapshot with
+// std::atomic_load and never lock.
 std::mutex g_mutex;
-std::list<std::array<unsigned char, crypto_sign_PUBLICKEYBYTES>> g_revokedKeys;
+std::shared_ptr<const helper::KeyHashSet> g_revokedKeys;
+std::shared_ptr<const helper::RevocationStore> g_revokedStore;
+std::shared_ptr<const helper::RevocationFilter> g_revokedFilter;
+// Bumped after each revocation change is published, to invalidate the
+// validated chains cached in each Context
+std::atomic<unsigned long> g_revocationEpoch(0);
+const std::size_t CHAIN_CACHE_MAX = 4096;
+// A card may carry, instead of its certificate chain, a single
+// Certificate whose pubkey is the first CHAIN_ID_LEN bytes of the chain
+// digest and whose issuerkey and signature are empty
+const std::size_t CHAIN_ID_LEN = 8;
+
+// Keys added in-process are checked exactly. With a revocation filter
+// loaded, only its positive hits go to the exact store lookup, and a hit
+// with no store loaded counts as revoked. A filter built from other keys
+// than the loaded store is bypassed, so that keys revoked since it was
+// built are still found.
+static bool is_revoked_key(const unsigned char* key)
+{
+    if (helper::isRevoked(std::atomic_load(&g_revokedKeys).get(), key, 32)) {
+        return true;
+    }
+
+    std::shared_ptr<const helper::RevocationFilter> filter
+        = std::atomic_load(&g_revokedFilter);
+    std::shared_ptr<const helper::RevocationStore> store
+        = std::atomic_load(&g_revokedStore);
+
+    if (filter
+        && (!store
+            || sodium_memcmp(filter->digest(),
+                             store->digest(),
+                             crypto_generichash_BYTES)
+                   == 0)) {
+        if (!filter->contains(key)) {
+            return false;
+        }
+        if (!store) {
+            return true;
+        }
+    }
+
+    return helper::isRevoked(store.get(), key, 32);
+}
 
 #ifdef WITH_JNI
 #include <jni.h>
 extern JNINativeMethod IDPASS_JNI[];
 extern int IDPASS_JNI_TLEN;
+extern bool idpass_jni_init(JNIEnv* env);
 
 jint JNI_OnLoad(JavaVM* vm, void* reserved)
 {
@@ -102,6 +155,9 @@ jint JNI_OnLoad(JavaVM* vm, void* reserved)
 #ifdef WITH_JNI
         map_JNI(
             "org/idpass/lite/IDPassReader", &IDPASS_JNI[0], IDPASS_JNI_TLEN);
+        if (!idpass_jni_init(env)) {
+            throw "idpass_jni_init failed";
+        }
 #endif
     } catch (...) {
         return JNI_ERR;
@@ -134,14 +190,33 @@ public:
 
 struct Context {
     std::mutex ctxMutex;
-    std::mutex mtx;
-    std::vector<std::vector<unsigned char>> m;
+    helper::ByteArena arena;
 
     api::KeySet m_keyset;
+    helper::KeyHashSet m_verificationKeys;
 
     std::vector<CCertificate> m_rootCerts;
     std::vector<CCertificate> m_intermedCerts;
 
+    // Digests of certificates whose signature has been verified, and of
+    // chains validated up to a root certificate. Signatures never change
+    // but revocations do, so validated chains are dropped whenever
+    // g_revocationEpoch moves.
+    std::mutex cacheMutex;
+    helper::KeyHashSet m_validEdges;
+    helper::KeyHashSet m_validChains;
+    unsigned long m_cacheEpoch = 0;
+
+    // Chains preloaded with idpass_lite_add_known_chain, by chain id.
+    // Guarded by cacheMutex.
+    std::map<std::string, std::vector<CCertificate>> m_knownChains;
+    bool chain_by_reference = false;
+
+    // Dictionary used to compress the private region of issued cards
+    // when compress_card is set
+    std::uint32_t m_dictionary = dictzip::NONE;
+    bool compress_card = false;
+
     float facediff_half;
     float facediff_full;
     bool fdimension; // 128/4 if true else 64/2
@@ -151,52 +226,152 @@ struct Context {
 
     unsigned char* NewByteArray(int n)
     {
-        if (n <= 0)
-            return nullptr;
-        std::lock_guard<std::mutex> guard(mtx);
-        m.emplace_back(n);
-        return m.back().data();
+        return arena.allocate(n);
     }
 
     bool ReleaseByteArray(void* addr)
     {
-        if (addr == nullptr)
+        return arena.release(addr);
+    }
+
+    static void edge_digest(const std::string& pubkey,
+                            const std::string& issuerkey,
+                            const std::string& signature,
+                            unsigned char* digest)
+    {
+        crypto_generichash_state state;
+        crypto_generichash_init(&state, nullptr, 0, crypto_generichash_BYTES);
+        for (const std::string* f : {&pubkey, &issuerkey, &signature}) {
+            std::uint32_t len = static_cast<std::uint32_t>(f->size());
+            crypto_generichash_update(
+                &state, reinterpret_cast<const unsigned char*>(&len), sizeof len);
+            crypto_generichash_update(
+                &state,
+                reinterpret_cast<const unsigned char*>(f->data()),
+                f->size());
+        }
+        crypto_generichash_final(&state, digest, crypto_generichash_BYTES);
+    }
+
+    static void edge_digest(const CCertificate& c, unsigned char* digest)
+    {
+        edge_digest(std::string(c.m_pk.begin(), c.m_pk.end()),
+                    std::string(c.m_issuerkey.begin(), c.m_issuerkey.end()),
+                    std::string(c.m_signature.begin(), c.m_signature.end()),
+                    digest);
+    }
+
+    static void chain_digest(const std::vector<CCertificate>& chain,
+                             unsigned char* digest)
+    {
+        crypto_generichash_state state;
+        crypto_generichash_init(&state, nullptr, 0, crypto_generichash_BYTES);
+        for (auto& c : chain) {
+            unsigned char edge[crypto_generichash_BYTES];
+            edge_digest(c, edge);
+            crypto_generichash_update(&state, edge, sizeof edge);
+        }
+        crypto_generichash_final(&state, digest, crypto_generichash_BYTES);
+    }
+
+    static std::string chain_id(const std::vector<CCertificate>& chain)
+    {
+        unsigned char digest[crypto_generichash_BYTES];
+        chain_digest(chain, digest);
+        return std::string(reinterpret_cast<char*>(digest), CHAIN_ID_LEN);
+    }
+
+    static bool is_chain_reference(const idpass::IDPassCards& fullCard)
+    {
+        if (fullCard.certificates_size() != 1) {
             return false;
-        std::lock_guard<std::mutex> guard(mtx);
-        std::vector<std::vector<unsigned char>>::iterator mit;
-        for (mit = m.begin(); mit != m.end();) {
-            if (mit->data() == addr) {
-                mit = m.erase(mit);
-                return true;
-            } else {
-                mit++;
-            }
         }
-        return false;
+        const idpass::Certificate& c = fullCard.certificates(0);
+        return c.pubkey().size() == CHAIN_ID_LEN && c.issuerkey().empty()
+               && c.signature().empty();
+    }
+
+    bool find_known_chain(const std::string& id,
+                          std::vector<CCertificate>& chain)
+    {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        auto it = m_knownChains.find(id);
+        if (it == m_knownChains.end()) {
+            return false;
+        }
+        chain = it->second;
+        return true;
+    }
+
+    // Number of certificates of the card's chain, resolving a reference
+    int chain_size(const idpass::IDPassCards& fullCard)
+    {
+        std::vector<CCertificate> chain;
+        if (is_chain_reference(fullCard)) {
+            return find_known_chain(fullCard.certificates(0).pubkey(), chain)
+                       ? chain.size()
+                       : 0;
+        }
+        return fullCard.certificates_size();
+    }
+
+    // Call with cacheMutex held
+    void sync_cache_epoch()
+    {
+        unsigned long epoch = g_revocationEpoch.load();
+        if (epoch != m_cacheEpoch) {
+            m_validChains.clear();
+            m_cacheEpoch = epoch;
+        }
+    }
+
+    bool is_cached(helper::KeyHashSet& cache, const unsigned char* digest)
+    {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        sync_cache_epoch();
+        return cache.contains(digest);
+    }
+
+    void cache(helper::KeyHashSet& cache,
+               const unsigned char* digest,
+               unsigned long epoch)
+    {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        sync_cache_epoch();
+        if (epoch != m_cacheEpoch) {
+            return; // revocations changed while validating
+        }
+        if (cache.size() >= CHAIN_CACHE_MAX) {
+            cache.clear();
+        }
+        cache.insert(digest);
     }
 
     bool verify_chain(idpass::IDPassCards& fullCard)
     {
-        int n = fullCard.certificates_size();
+        if (is_chain_reference(fullCard)) {
+            std::vector<CCertificate> chain;
+            if (!find_known_chain(fullCard.certificates(0).pubkey(), chain)) {
+                return false;
+            }
+            return verify_chain(chain);
+        }
+
         if (fullCard.certificates_size() > 0) {
             std::vector<CCertificate> chain;
 
             try {
                 for (auto& c : fullCard.certificates()) {
-                    CCertificate cer(c);
-                    // context->m_intermedCerts.push_back(cer);
+                    unsigned char edge[crypto_generichash_BYTES];
+                    edge_digest(c.pubkey(), c.issuerkey(), c.signature(), edge);
+                    CCertificate cer(c, !is_cached(m_validEdges, edge));
                     chain.push_back(cer);
                 }
             } catch (std::exception& e) {
                 return false;
             }
 
-            if (chain.size() > 0 && verify_chain(chain)) {
-                // m_intermedCerts = chain;
-                return true;
-            }
-
-            return false;
+            return verify_chain(chain);
         }
 
         return true;
@@ -220,12 +395,33 @@ struct Context {
             return false;
         }
 
+        unsigned long epoch = g_revocationEpoch.load();
+        unsigned char digest[crypto_generichash_BYTES];
+        chain_digest(chain, digest);
+
+        if (is_cached(m_validChains, digest)) {
+            return true;
+        }
+
+        auto has_valid_signature = [this, epoch](CCertificate* c) {
+            unsigned char edge[crypto_generichash_BYTES];
+            edge_digest(*c, edge);
+            if (is_cached(m_validEdges, edge)) {
+                return true;
+            }
+            if (!c->hasValidSignature()) {
+                return false;
+            }
+            cache(m_validEdges, edge, epoch);
+            return true;
+        };
+
         CCertificate* pCert = &chain.back();
         unsigned char* startkey = pCert->m_pk.data();
 
         while (pCert != nullptr) {
-            if (pCert->hasValidSignature()) {
-                if (helper::isRevoked(g_revokedKeys, pCert->m_pk.data(), 32)) {
+            if (has_valid_signature(pCert)) {
+                if (is_revoked_key(pCert->m_pk.data())) {
                     return false;
                 }
                 if (!pCert->isSelfSigned()) {
@@ -240,7 +436,11 @@ struct Context {
                     continue;
 
                 } else {
-                    return in_root_certificates(pCert);
+                    if (!in_root_certificates(pCert)) {
+                        return false;
+                    }
+                    cache(m_validChains, digest, epoch);
+                    return true;
                 }
             } else {
                 return false;
@@ -266,8 +466,7 @@ namespace M
 {
 std::mutex mtx;
 std::vector<Context*> context;
-std::mutex m_mtx;
-std::vector<std::vector<unsigned char>> m_m;
+helper::ByteArena m_arena;
 
 Context* newContext()
 {
@@ -296,31 +495,40 @@ void releaseContext(Context* addr)
 
 unsigned char* NewByteArray(int n)
 {
-    if (n <= 0)
-        return nullptr;
-    std::lock_guard<std::mutex> guard(m_mtx);
-    m_m.emplace_back(n);
-    return m_m.back().data();
+    return m_arena.allocate(n);
 }
 
 bool ReleaseByteArray(void* addr)
 {
-    if (addr == nullptr)
-        return false;
-    std::lock_guard<std::mutex> guard(m_mtx);
-    std::vector<std::vector<unsigned char>>::iterator mit;
-    for (mit = m_m.begin(); mit != m_m.end();) {
-        if (mit->data() == addr) {
-            mit = m_m.erase(mit);
-            return true;
-        } else {
-            mit++;
-        }
-    }
-    return false;
+    return m_arena.release(addr);
 }
 };
 
+/* The SignStream holds the state of an incremental Ed25519ph sign or
+ * verify. It lives in the context's managed memory so that an abandoned
+ * stream is still reclaimed, its card key wiped, by idpass_lite_freemem
+ * or along with the context */
+struct SignStream {
+    crypto_sign_state state;
+    unsigned char skpk[crypto_sign_SECRETKEYBYTES];
+    unsigned char pubkey[crypto_sign_PUBLICKEYBYTES];
+    unsigned char mode;
+    bool signing;
+};
+
+// Serializes msg into buf if it holds it. Returns the serialized length
+// either way, or -1 if serialization fails.
+static int serialize_into(const google::protobuf::MessageLite& msg,
+                          unsigned char* buf,
+                          int buf_len)
+{
+    int n = msg.ByteSizeLong();
+    if (buf != nullptr && buf_len >= n && !msg.SerializeToArray(buf, n)) {
+        return -1;
+    }
+    return n;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -372,9 +580,9 @@ int idpass_lite_verify_certificate(void* self,
         return -2;
     }
 
-    int count = cards.certificates_size();
-    if (count > 0) {
-        if (!context->verify_chain(cards)) {
+    int count = context->chain_size(cards);
+    if (cards.certificates_size() > 0) {
+        if (count == 0 || !context->verify_chain(cards)) {
             return -3;
         }
     } else {
@@ -480,19 +688,10 @@ int idpass_lite_verify_card_signature(void* self,
         // The card signature verifies alright, but we still need to
         // check if the card's signer public key is in our context
         // verification list, ie Context::m_keyset::verificationKeys
-        bool found = false;
-        for (auto& pub : context->m_keyset.verificationkeys()) {
-            if (pub.typ() == api::byteArray_Typ_ED25519PUBKEY) {
-                if (std::memcmp(
-                        pub.val().data(), fullCard.signerpublickey().data(), 32)
-                    == 0) {
-                    found = true;
-                    break;
-                }
-            }
-        }
-
-        if (!found) {
+        if (fullCard.signerpublickey().size() != crypto_sign_PUBLICKEYBYTES
+            || !context->m_verificationKeys.contains(
+                reinterpret_cast<const unsigned char*>(
+                    fullCard.signerpublickey().data()))) {
             return 4;
         }
 
@@ -522,6 +721,57 @@ int idpass_lite_verify_card_signature(void* self,
 }
 
 
+/**
+* Verifies the signature of many fullcards at once.
+*
+* @param self Calling context
+* @param outlen The count of cards, which is the bytes length of the result
+* @param cards_buf The fullcards, each prefixed by its 4 bytes length
+* @param cards_buf_len The bytes length of cards_buf
+* @param skipcheckcert Same as in idpass_lite_verify_card_signature
+* @return Returns one status byte per card, 0 if the card verifies
+*/
+
+MODULE_API
+unsigned char* idpass_lite_verify_card_signatures_batch(void* self,
+                                                        int* outlen,
+                                                        unsigned char* cards_buf,
+                                                        int cards_buf_len,
+                                                        int skipcheckcert)
+{
+    if (self == nullptr || outlen == nullptr || cards_buf == nullptr
+        || cards_buf_len <= 0) {
+        return nullptr;
+    }
+    Context* context = (Context*)self;
+    *outlen = 0;
+
+    std::vector<std::pair<const unsigned char*, int>> cards;
+    if (!helper::unpack_blobs(cards_buf, cards_buf_len, cards)
+        || cards.empty()) {
+        return nullptr;
+    }
+
+    int n = cards.size();
+    unsigned char* status = context->NewByteArray(n);
+
+    // Each card is checked independently. Cards are individually
+    // verified rather than ed25519 batch verified, so that a bad card
+    // is pinpointed without a second pass.
+    helper::parallel_for(n, 16, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            status[i] = idpass_lite_verify_card_signature(
+                self,
+                const_cast<unsigned char*>(cards[i].first),
+                cards[i].second,
+                skipcheckcert);
+        }
+    });
+
+    *outlen = n;
+    return status;
+}
+
 /**
 * Adds intermediate certificates into the calling context.
 * Cards created, thereafter, shall attached these certificates
@@ -575,6 +825,85 @@ int idpass_lite_add_certificates(void* self,
     return 1;
 }
 
+/**
+* Preloads a certificate chain so that cards carrying it by reference
+* can be verified. An issuing context with IOCTL_SET_CHAINREF set
+* attaches its chain by reference only if the chain was preloaded here,
+* otherwise the full chain is embedded in the card.
+*
+* @param self Calling context
+* @param certs_buf The serialized api::Certificates chain
+* @param certs_buf_len Length bytes of certs_buf
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_add_known_chain(void* self,
+                                unsigned char* certs_buf,
+                                int certs_buf_len)
+{
+    if (self == nullptr || certs_buf == nullptr || certs_buf_len <= 0) {
+        return 1;
+    }
+    Context* context = (Context*)self;
+
+    api::Certificates certs;
+    if (!certs.ParseFromArray(certs_buf, certs_buf_len)) {
+        return 2;
+    }
+
+    std::vector<CCertificate> chain;
+
+    try {
+        for (auto& c : certs.cert()) {
+            chain.push_back(CCertificate(c));
+        }
+    } catch (std::exception& e) {
+        return 3;
+    }
+
+    if (chain.size() == 0 || !context->verify_chain(chain)) {
+        return 1;
+    }
+
+    std::string id = Context::chain_id(chain);
+    std::lock_guard<std::mutex> guard(context->cacheMutex);
+    context->m_knownChains[id] = chain;
+    return 0;
+}
+
+/**
+* Sets a preset dictionary, trained on representative CardDetails, for
+* compressing the private region of cards issued with IOCTL_SET_COMPRESS.
+* The dictionary is also registered for decoding, so readers of such
+* cards must set the same dictionary. The private region is not
+* compressed until a dictionary is set.
+*
+* @param self Calling context
+* @param dict The dictionary bytes
+* @param dict_len Length bytes of dict
+* @return Returns 0 on success, or 2 if the dictionary id collides with
+* a different dictionary already set
+*/
+
+MODULE_API
+int idpass_lite_set_dictionary(void* self, unsigned char* dict, int dict_len)
+{
+    if (self == nullptr || dict == nullptr || dict_len <= 0) {
+        return 1;
+    }
+    Context* context = (Context*)self;
+
+    std::uint32_t id = dictzip::add_dictionary(dict, dict_len);
+    if (id == dictzip::NONE) {
+        return 2;
+    }
+
+    std::lock_guard<std::mutex> guard(context->ctxMutex);
+    context->m_dictionary = id;
+    return 0;
+}
+
 /**
 * The main initilizationfunction of the library.
 *
@@ -640,6 +969,12 @@ void* idpass_lite_init(unsigned char* keyset_buf,
 
     context->m_keyset = cryptoKeys;
 
+    context->m_verificationKeys.reserve(cryptoKeys.verificationkeys_size());
+    for (auto& pub : cryptoKeys.verificationkeys()) {
+        context->m_verificationKeys.insert(
+            reinterpret_cast<const unsigned char*>(pub.val().data()));
+    }
+
     context->facediff_half = DEFAULT_FACEDIFF_HALF;
     context->facediff_full = DEFAULT_FACEDIFF_FULL;
     context->fdimension = false; // defaults to 64/2
@@ -674,35 +1009,18 @@ void idpass_lite_freemem(void* self, void* buf)
     }
 }
 
-/**
-* Returns a QR code ID of a registered identity.
-*
-* @param self Calling context
-* @param outlen Bytes length of returned bytes
-* @ident_buf The personal details of the registered identity
-* @ident_buf_len Bytes length of ident_buf
-* @return Returns an encrypted QR code ID
-*/
-
-MODULE_API
-unsigned char* idpass_lite_create_card_with_face(void* self,
-                                                 int* outlen,
-                                                 unsigned char* ident_buf,
-                                                 int ident_buf_len)
+// Issues the card of the identity in ident_buf into idpassCards
+static bool issue_card(Context* context,
+                       const unsigned char* ident_buf,
+                       int ident_buf_len,
+                       idpass::IDPassCards& idpassCards)
 {
-    if (self == nullptr || outlen == nullptr || ident_buf == nullptr
-        || ident_buf_len <= 0) {
-        return nullptr;
-    }
-
-    Context* context = (Context*)self;
-    *outlen = 0;
     unsigned long int epochSeconds = std::time(nullptr);
     float faceArray[128];
 
     api::Ident ident;
     if (!ident.ParseFromArray(ident_buf, ident_buf_len)) {
-        return nullptr;
+        return false;
     }
 
     if (ident.photo().size() > 0) {
@@ -710,7 +1028,7 @@ unsigned char* idpass_lite_create_card_with_face(void* self,
                 ident.photo().data(), ident.photo().size(), faceArray)
             != 1) {
             LOGI("idpass_api_create_card_with_face: fail");
-            return nullptr;
+            return false;
         }
     }
 
@@ -850,10 +1168,11 @@ unsigned char* idpass_lite_create_card_with_face(void* self,
     int privateRegionEncrypted_len = 0;
     std::vector<unsigned char> privateRegionEncrypted;
 
-    privateRegionEncrypted_len
-        = helper::encrypt_object(privateRegion,
-                                 context->m_keyset.encryptionkey().data(),
-                                 privateRegionEncrypted);
+    privateRegionEncrypted_len = helper::encrypt_object(
+        privateRegion,
+        context->m_keyset.encryptionkey().data(),
+        privateRegionEncrypted,
+        context->compress_card ? context->m_dictionary : dictzip::NONE);
 
     ////////////////////////////////////////////////////////////
     // concatinate privateRegion and publicRegion (in this order)
@@ -878,7 +1197,6 @@ unsigned char* idpass_lite_create_card_with_face(void* self,
 
     ///////////////////////////////
     // assemble final output object
-    idpass::IDPassCards idpassCards;
     idpassCards.set_signature(card_blob_sig, crypto_sign_BYTES);
     idpassCards.set_signerpublickey(card_signerPublicKey,
                                     sizeof card_signerPublicKey);
@@ -890,8 +1208,17 @@ unsigned char* idpass_lite_create_card_with_face(void* self,
 
     ///////////////////////////////////////////////////////////////////
     // now attach certificate chain if any into the final output object
+    // A chain that readers have preloaded is attached by reference
     n = context->m_intermedCerts.size();
-    if (n > 0) {
+    std::string chainid;
+    std::vector<CCertificate> known;
+    if (n > 0 && context->chain_by_reference) {
+        chainid = Context::chain_id(context->m_intermedCerts);
+    }
+    if (!chainid.empty() && context->find_known_chain(chainid, known)) {
+        idpass::Certificate* c = idpassCards.add_certificates();
+        c->set_pubkey(chainid.data(), chainid.size());
+    } else if (n > 0) {
         for (auto& cer : context->m_intermedCerts) {
             idpass::Certificate* c = idpassCards.add_certificates();
             c->set_pubkey(cer.m_pk.data(), 32);
@@ -901,6 +1228,38 @@ unsigned char* idpass_lite_create_card_with_face(void* self,
         }
     }
 
+    return true;
+}
+
+/**
+* Returns a QR code ID of a registered identity.
+*
+* @param self Calling context
+* @param outlen Bytes length of returned bytes
+* @ident_buf The personal details of the registered identity
+* @ident_buf_len Bytes length of ident_buf
+* @return Returns an encrypted QR code ID
+*/
+
+MODULE_API
+unsigned char* idpass_lite_create_card_with_face(void* self,
+                                                 int* outlen,
+                                                 unsigned char* ident_buf,
+                                                 int ident_buf_len)
+{
+    if (self == nullptr || outlen == nullptr || ident_buf == nullptr
+        || ident_buf_len <= 0) {
+        return nullptr;
+    }
+
+    Context* context = (Context*)self;
+    *outlen = 0;
+
+    idpass::IDPassCards idpassCards;
+    if (!issue_card(context, ident_buf, ident_buf_len, idpassCards)) {
+        return nullptr;
+    }
+
     ////////////////////////////////////////////////////////
     // finally, serialiaze final output object as byte[] and
     // return it
@@ -918,81 +1277,246 @@ unsigned char* idpass_lite_create_card_with_face(void* self,
 }
 
 /**
-* Verify user's QR code ID against a matching photo template.
+* Returns a QR code ID of a registered identity into the caller's buffer.
 *
 * @param self Calling context
-* @param *outlen Bytes length of returned bytes
-* @param encrypted_card The user's QR code ID
-* @param encrypted_card_len Bytes length of encrypted_card
-* @param photo The ID owner's photo capture template
-* @param photo_len Length of bytes of photo template
-* @return Returns the user's CardDetails if there is facial match.
+* @ident_buf The personal details of the registered identity
+* @ident_buf_len Bytes length of ident_buf
+* @param buf Caller buffer receiving the QR code ID, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the QR code ID, or -1 on failure
 */
 
-// Returns CardDetails object if face matches
-MODULE_API unsigned char*
-idpass_lite_verify_card_with_face_template(void* self,
-                                  int* outlen,
-                                  unsigned char* encrypted_card,
-                                  int encrypted_card_len,
-                                  unsigned char* photo,
-                                  int photo_len)
+MODULE_API
+int idpass_lite_create_card_with_face_into(void* self,
+                                           unsigned char* ident_buf,
+                                           int ident_buf_len,
+                                           unsigned char* buf,
+                                           int buf_len)
 {
-    if (self == nullptr || outlen == nullptr ||
-        encrypted_card == nullptr || encrypted_card_len <= 0 
-        || photo == nullptr || photo_len <= 0) 
-    {
-        return nullptr; 
+    if (self == nullptr || ident_buf == nullptr || ident_buf_len <= 0
+        || buf_len < 0) {
+        return -1;
     }
+
     Context* context = (Context*)self;
-    *outlen = 0;
+    idpass::IDPassCards idpassCards;
+    if (!issue_card(context, ident_buf, ident_buf_len, idpassCards)) {
+        return -1;
+    }
 
+    return serialize_into(idpassCards, buf, buf_len);
+}
+
+// Decrypts the card and verifies its certificate chain
+static bool open_card(Context* context,
+                      unsigned char* encrypted_card,
+                      int encrypted_card_len,
+                      idpass::IDPassCard& card)
+{
     idpass::IDPassCards cards;
-    idpass::IDPassCard card;
 
     if (!helper::decryptCard(encrypted_card,
                              encrypted_card_len,
                              context->m_keyset,
+                             context->m_verificationKeys,
                              card,
                              cards)) {
-        return nullptr;
+        return false;
     }
 
-    if (!context->verify_chain(cards)) {
-        return nullptr;
+    return context->verify_chain(cards);
+}
+
+// Opens the card into details if its face matches the photo template
+static bool open_card_with_face_template(Context* context,
+                                         unsigned char* encrypted_card,
+                                         int encrypted_card_len,
+                                         unsigned char* photo,
+                                         int photo_len,
+                                         idpass::CardDetails& details)
+{
+    idpass::IDPassCard card;
+    if (!open_card(context, encrypted_card, encrypted_card_len, card)) {
+        return false;
     }
 
     idpass::CardAccess access = card.access();
-    int flen = access.face().size();
     if (access.face().size() == 0) {
-        return nullptr;
+        return false;
     }
-    
+
     float face_diff = 0.0;
     std::string faceString = access.face();
     std::vector<unsigned char> cardFaceCopy(faceString.begin(), faceString.end());
     unsigned char* cardFace = cardFaceCopy.data();
     int err = idpass_lite_compare_face_template(photo, photo_len, cardFace, cardFaceCopy.size(), &face_diff);
-    
+
     if(err != 0) {
-        return nullptr;
+        return false;
     }
 
     double threshold = access.face().length() == 128 * 4 ?
                            context->facediff_full :
                            context->facediff_half;
-    if (face_diff <= threshold) {
-        idpass::CardDetails details = card.details();
-        int n = details.ByteSizeLong();
-        unsigned char* buf = context->NewByteArray(n);
-
-        if (details.SerializeToArray(buf, n)) {
-            *outlen = n;
-            return buf;
-        }
+    if (face_diff > threshold) {
+        return false;
     }
 
-    return nullptr;
+    details = card.details();
+    return true;
+}
+
+// Opens the card into details if its face matches the photo
+static bool open_card_with_face(Context* context,
+                                unsigned char* encrypted_card,
+                                int encrypted_card_len,
+                                char* photo,
+                                int photo_len,
+                                idpass::CardDetails& details)
+{
+    idpass::IDPassCard card;
+    if (!open_card(context, encrypted_card, encrypted_card_len, card)) {
+        return false;
+    }
+
+    idpass::CardAccess access = card.access();
+    if (access.face().size() == 0) {
+        return false;
+    }
+    double face_diff = helper::computeFaceDiff(photo, photo_len, access.face());
+    double threshold = access.face().length() == 128 * 4 ?
+                           context->facediff_full :
+                           context->facediff_half;
+    if (face_diff > threshold) {
+        return false;
+    }
+
+    details = card.details();
+    return true;
+}
+
+// Opens the card into details if its pin matches
+static bool open_card_with_pin(Context* context,
+                               unsigned char* encrypted_card,
+                               int encrypted_card_len,
+                               const char* pin,
+                               idpass::CardDetails& details)
+{
+    idpass::IDPassCard card;
+    if (!open_card(context, encrypted_card, encrypted_card_len, card)) {
+        return false;
+    }
+
+    if (card.access().pin().compare(pin) != 0) {
+        return false;
+    }
+
+    details = card.details();
+    return true;
+}
+
+// Serializes details into a byte array of the context
+static unsigned char* new_details(Context* context,
+                                  const idpass::CardDetails& details,
+                                  int* outlen)
+{
+    int n = details.ByteSizeLong();
+    unsigned char* buf = context->NewByteArray(n);
+
+    if (!details.SerializeToArray(buf, n)) {
+        context->ReleaseByteArray(buf);
+        return nullptr;
+    }
+
+    *outlen = n;
+    return buf;
+}
+
+/**
+* Verify user's QR code ID against a matching photo template.
+*
+* @param self Calling context
+* @param *outlen Bytes length of returned bytes
+* @param encrypted_card The user's QR code ID
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param photo The ID owner's photo capture template
+* @param photo_len Length of bytes of photo template
+* @return Returns the user's CardDetails if there is facial match.
+*/
+
+// Returns CardDetails object if face matches
+MODULE_API unsigned char*
+idpass_lite_verify_card_with_face_template(void* self,
+                                  int* outlen,
+                                  unsigned char* encrypted_card,
+                                  int encrypted_card_len,
+                                  unsigned char* photo,
+                                  int photo_len)
+{
+    if (self == nullptr || outlen == nullptr ||
+        encrypted_card == nullptr || encrypted_card_len <= 0
+        || photo == nullptr || photo_len <= 0)
+    {
+        return nullptr;
+    }
+    Context* context = (Context*)self;
+    *outlen = 0;
+
+    idpass::CardDetails details;
+    if (!open_card_with_face_template(context,
+                                      encrypted_card,
+                                      encrypted_card_len,
+                                      photo,
+                                      photo_len,
+                                      details)) {
+        return nullptr;
+    }
+
+    return new_details(context, details, outlen);
+}
+
+/**
+* Verify user's QR code ID against a matching photo template, into the
+* caller's buffer.
+*
+* @param self Calling context
+* @param encrypted_card The user's QR code ID
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param photo The ID owner's photo capture template
+* @param photo_len Length of bytes of photo template
+* @param buf Caller buffer receiving the CardDetails, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the CardDetails, or -1 if no match
+*/
+
+MODULE_API
+int idpass_lite_verify_card_with_face_template_into(void* self,
+                                                    unsigned char* encrypted_card,
+                                                    int encrypted_card_len,
+                                                    unsigned char* photo,
+                                                    int photo_len,
+                                                    unsigned char* buf,
+                                                    int buf_len)
+{
+    if (self == nullptr || encrypted_card == nullptr
+        || encrypted_card_len <= 0 || photo == nullptr || photo_len <= 0
+        || buf_len < 0) {
+        return -1;
+    }
+    Context* context = (Context*)self;
+
+    idpass::CardDetails details;
+    if (!open_card_with_face_template(context,
+                                      encrypted_card,
+                                      encrypted_card_len,
+                                      photo,
+                                      photo_len,
+                                      details)) {
+        return -1;
+    }
+
+    return serialize_into(details, buf, buf_len);
 }
 
 /**
@@ -1017,50 +1541,68 @@ idpass_lite_verify_card_with_face(void* self,
                                   int photo_len)
 {
     if (self == nullptr || outlen == nullptr ||
-        encrypted_card == nullptr || encrypted_card_len <= 0 
-        || photo == nullptr || photo_len <= 0) 
+        encrypted_card == nullptr || encrypted_card_len <= 0
+        || photo == nullptr || photo_len <= 0)
     {
-        return nullptr; 
+        return nullptr;
     }
     Context* context = (Context*)self;
     *outlen = 0;
 
-    idpass::IDPassCards cards;
-    idpass::IDPassCard card;
-
-    if (!helper::decryptCard(encrypted_card,
+    idpass::CardDetails details;
+    if (!open_card_with_face(context,
+                             encrypted_card,
                              encrypted_card_len,
-                             context->m_keyset,
-                             card,
-                             cards)) {
+                             photo,
+                             photo_len,
+                             details)) {
         return nullptr;
     }
 
-    if (!context->verify_chain(cards)) {
-        return nullptr;
-    }
+    return new_details(context, details, outlen);
+}
 
-    idpass::CardAccess access = card.access();
-    int flen = access.face().size();
-    if (access.face().size() == 0) {
-        return nullptr;
+/**
+* Verify user's QR code ID against a matching photo, into the caller's
+* buffer.
+*
+* @param self Calling context
+* @param encrypted_card The user's QR code ID
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param photo The ID owner's photo capture
+* @param photo_len Length of bytes of photo
+* @param buf Caller buffer receiving the CardDetails, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the CardDetails, or -1 if no match
+*/
+
+MODULE_API
+int idpass_lite_verify_card_with_face_into(void* self,
+                                           unsigned char* encrypted_card,
+                                           int encrypted_card_len,
+                                           char* photo,
+                                           int photo_len,
+                                           unsigned char* buf,
+                                           int buf_len)
+{
+    if (self == nullptr || encrypted_card == nullptr
+        || encrypted_card_len <= 0 || photo == nullptr || photo_len <= 0
+        || buf_len < 0) {
+        return -1;
     }
-    double face_diff = helper::computeFaceDiff(photo, photo_len, access.face());
-    double threshold = access.face().length() == 128 * 4 ?
-                           context->facediff_full :
-                           context->facediff_half;
-    if (face_diff <= threshold) {
-        idpass::CardDetails details = card.details();
-        int n = details.ByteSizeLong();
-        unsigned char* buf = context->NewByteArray(n);
-
-        if (details.SerializeToArray(buf, n)) {
-            *outlen = n;
-            return buf;
-        }
+    Context* context = (Context*)self;
+
+    idpass::CardDetails details;
+    if (!open_card_with_face(context,
+                             encrypted_card,
+                             encrypted_card_len,
+                             photo,
+                             photo_len,
+                             details)) {
+        return -1;
     }
 
-    return nullptr;
+    return serialize_into(details, buf, buf_len);
 }
 
 /**
@@ -1082,90 +1624,76 @@ idpass_lite_verify_card_with_pin(void* self,
                                  const char* pin)
 {
     if (self == nullptr || outlen == nullptr ||
-        encrypted_card == nullptr || encrypted_card_len <= 0 
+        encrypted_card == nullptr || encrypted_card_len <= 0
         || pin == nullptr) {
-        return nullptr; 
+        return nullptr;
     }
     Context* context = (Context*)self;
     *outlen = 0;
 
-    idpass::IDPassCards cards;
-    idpass::IDPassCard card;
-
-    if (!helper::decryptCard(encrypted_card,
-                             encrypted_card_len,
-                             context->m_keyset,
-                             card,
-                             cards)) {
-        return nullptr;
-    }
-
-    if (!context->verify_chain(cards)) {
-        return nullptr;
+    idpass::CardDetails details;
+    unsigned char* buf = nullptr;
+    if (open_card_with_pin(
+            context, encrypted_card, encrypted_card_len, pin, details)) {
+        buf = new_details(context, details, outlen);
     }
 
-    idpass::CardAccess access = card.access();
-
-    if (access.pin().compare(pin) == 0) {
-        idpass::CardDetails details = card.details();
-        int n = details.ByteSizeLong();
-        unsigned char* buf = context->NewByteArray(n);
-
-        if (details.SerializeToArray(buf, n)) {
-            *outlen = n;
-            return buf;
-        }
+    if (buf == nullptr) {
+        LOGI("idpass_api_verify_card_with_pin: fail");
     }
-
-    LOGI("idpass_api_verify_card_with_pin: fail");
-    return nullptr;
+    return buf;
 }
 
 /**
-* Encrypt data with user's QR code ID.
+* Verify user's QR code ID against a matching pin, into the caller's
+* buffer.
 *
-* @param self
-* @param outlen Bytes length of encrypted data
-* @param encrypted_card User's QR code ID.
+* @param self Calling context
+* @param encrypted_card The user's QR code ID
 * @param encrypted_card_len Bytes length of encrypted_card
-* @param data The input data to be encrypted
-* @param data_len Bytes length of data
-* @return The encrypted data
+* @param pin The ID owner's secret pin code
+* @param buf Caller buffer receiving the CardDetails, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the CardDetails, or -1 if no match
 */
 
-MODULE_API unsigned char*
-idpass_lite_encrypt_with_card(void* self,
-                              int* outlen,
-                              unsigned char* encrypted_card,
-                              int encrypted_card_len,
-                              unsigned char* data,
-                              int data_len)
+MODULE_API
+int idpass_lite_verify_card_with_pin_into(void* self,
+                                          unsigned char* encrypted_card,
+                                          int encrypted_card_len,
+                                          const char* pin,
+                                          unsigned char* buf,
+                                          int buf_len)
 {
-    if (self == nullptr || outlen == nullptr ||
-        encrypted_card == nullptr || encrypted_card_len <= 0 || 
-        data == nullptr || data_len <= 0) 
-    {
-        return nullptr; 
+    if (self == nullptr || encrypted_card == nullptr
+        || encrypted_card_len <= 0 || pin == nullptr || buf_len < 0) {
+        return -1;
     }
     Context* context = (Context*)self;
-    *outlen = 0;
-
-    unsigned char* ciphertext = nullptr;
-    unsigned long long ciphertext_len = 0;
 
-    idpass::IDPassCards cards;
-    idpass::IDPassCard card;
-
-    if (!helper::decryptCard(encrypted_card,
-                             encrypted_card_len,
-                             context->m_keyset,
-                             card,
-                             cards)) {
-        return nullptr;
+    idpass::CardDetails details;
+    if (!open_card_with_pin(
+            context, encrypted_card, encrypted_card_len, pin, details)) {
+        LOGI("idpass_api_verify_card_with_pin: fail");
+        return -1;
     }
 
-    if (!context->verify_chain(cards)) {
-        return nullptr;
+    return serialize_into(details, buf, buf_len);
+}
+
+// Encrypts data with the card's key, into out as the nonce followed by
+// the ciphertext, crypto_box_NONCEBYTES + crypto_box_MACBYTES + data_len
+// bytes in all
+static bool encrypt_with_card(Context* context,
+                              unsigned char* encrypted_card,
+                              int encrypted_card_len,
+                              const unsigned char* data,
+                              int data_len,
+                              unsigned char* out)
+{
+    idpass::IDPassCard card;
+    if (!open_card(context, encrypted_card, encrypted_card_len, card)) {
+        return false;
     }
 
     // convert ed25519 to curve25519 and use curve25519 for encryption
@@ -1185,92 +1713,135 @@ idpass_lite_encrypt_with_card(void* self,
     ret = crypto_sign_ed25519_sk_to_curve25519(x25519_sk, ed25519_skpk);
 
     ///////////////////////////////////////////////////////////////////////////
-    ciphertext_len = crypto_box_MACBYTES + data_len; // 16+
-    ciphertext = new unsigned char[ciphertext_len];
-
-    unsigned char nonce[crypto_box_NONCEBYTES]; // 24
-    randombytes_buf(nonce, sizeof nonce);
+    unsigned char* nonce = out; // 24
+    randombytes_buf(nonce, crypto_box_NONCEBYTES);
 
     // Encrypt with our sk with an authentication tag of our pk
-    if (crypto_box_easy(ciphertext, data, data_len, nonce, x25519_pk, x25519_sk)
+    if (crypto_box_easy(out + crypto_box_NONCEBYTES,
+                        data,
+                        data_len,
+                        nonce,
+                        x25519_pk,
+                        x25519_sk)
         != 0) {
         LOGI("crypto_box_easy: error");
-        delete[] ciphertext;
-        return nullptr;
+        return false;
     }
     ///////////////////////////////////////////////////////////////////////////
 
-    unsigned char* nonce_plus_ciphertext
-        = context->NewByteArray(sizeof nonce + ciphertext_len);
+    return true;
+}
 
-    std::memcpy(nonce_plus_ciphertext, nonce, sizeof nonce);
+/**
+* Encrypt data with user's QR code ID.
+*
+* @param self
+* @param outlen Bytes length of encrypted data
+* @param encrypted_card User's QR code ID.
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param data The input data to be encrypted
+* @param data_len Bytes length of data
+* @return The encrypted data
+*/
 
-    std::memcpy(
-        nonce_plus_ciphertext + sizeof nonce, ciphertext, ciphertext_len);
+MODULE_API unsigned char*
+idpass_lite_encrypt_with_card(void* self,
+                              int* outlen,
+                              unsigned char* encrypted_card,
+                              int encrypted_card_len,
+                              unsigned char* data,
+                              int data_len)
+{
+    if (self == nullptr || outlen == nullptr ||
+        encrypted_card == nullptr || encrypted_card_len <= 0 ||
+        data == nullptr || data_len <= 0)
+    {
+        return nullptr;
+    }
+    Context* context = (Context*)self;
+    *outlen = 0;
 
-    delete[] ciphertext;
+    int n = crypto_box_NONCEBYTES + crypto_box_MACBYTES + data_len;
+    unsigned char* nonce_plus_ciphertext = context->NewByteArray(n);
 
-    *outlen = ciphertext_len + sizeof nonce;
+    if (!encrypt_with_card(context,
+                           encrypted_card,
+                           encrypted_card_len,
+                           data,
+                           data_len,
+                           nonce_plus_ciphertext)) {
+        context->ReleaseByteArray(nonce_plus_ciphertext);
+        return nullptr;
+    }
 
+    *outlen = n;
     return nonce_plus_ciphertext;
 }
 
 /**
-* Asymmetric decryption of a ciphertext using a provided secret key
+* Encrypt data with user's QR code ID, into the caller's buffer.
 *
-* @param self
-* @param outlen The bytes length of decrypted text
-* @param fullcard The QR code ID content
-* @param fullcard_len bytes length of fullcard
-* @param encrypted The encrypted data
-* @param encrypted_len The bytes length of encrypted
-* @return The decrypted text
+* @param self Calling context
+* @param encrypted_card User's QR code ID.
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param data The input data to be encrypted
+* @param data_len Bytes length of data
+* @param buf Caller buffer receiving the encrypted data, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the encrypted data, or -1 on failure
 */
 
 MODULE_API
-unsigned char* idpass_lite_decrypt_with_card(void* self,
-                                             int* outlen,
-                                             unsigned char* fullcard,
-                                             int fullcard_len,
-                                             unsigned char* encrypted,
-                                             int encrypted_len)
+int idpass_lite_encrypt_with_card_into(void* self,
+                                       unsigned char* encrypted_card,
+                                       int encrypted_card_len,
+                                       unsigned char* data,
+                                       int data_len,
+                                       unsigned char* buf,
+                                       int buf_len)
 {
-    if (self == nullptr || outlen == nullptr || fullcard == nullptr 
-        || fullcard_len <= 0 || encrypted == nullptr || encrypted_len <= 0) {
-        return nullptr; 
+    if (self == nullptr || encrypted_card == nullptr
+        || encrypted_card_len <= 0 || data == nullptr || data_len <= 0
+        || buf_len < 0) {
+        return -1;
     }
     Context* context = (Context*)self;
-    int len = encrypted_len - crypto_box_NONCEBYTES - crypto_box_MACBYTES;
-    *outlen = 0;
-    if (len <= 0) {
-        return nullptr;
-    }
 
-    idpass::IDPassCards cards;
-    idpass::IDPassCard card;
+    int n = crypto_box_NONCEBYTES + crypto_box_MACBYTES + data_len;
+    if (buf == nullptr || buf_len < n) {
+        return n;
+    }
 
-    if (!helper::decryptCard(fullcard,
-                             fullcard_len,
-                             context->m_keyset,
-                             card,
-                             cards)) {
-        return nullptr;
+    if (!encrypt_with_card(
+            context, encrypted_card, encrypted_card_len, data, data_len, buf)) {
+        return -1;
     }
 
-    if (!context->verify_chain(cards)) {
-        return nullptr;
+    return n;
+}
+
+// Decrypts the nonce and ciphertext in encrypted with the card's key,
+// into the encrypted_len - crypto_box_NONCEBYTES - crypto_box_MACBYTES
+// bytes of out
+static bool decrypt_with_card(Context* context,
+                              unsigned char* fullcard,
+                              int fullcard_len,
+                              const unsigned char* encrypted,
+                              int encrypted_len,
+                              unsigned char* out)
+{
+    idpass::IDPassCard card;
+    if (!open_card(context, fullcard, fullcard_len, card)) {
+        return false;
     }
+
     unsigned char card_skpk[crypto_sign_SECRETKEYBYTES];
     std::memcpy(
         card_skpk, card.encryptionkey().data(), card.encryptionkey().size());
 
-    unsigned char* plaintext = context->NewByteArray(len);
-    unsigned char nonce[crypto_box_NONCEBYTES];
-    std::memcpy(nonce, encrypted, sizeof nonce);
-
+    const unsigned char* nonce = encrypted;
+    const unsigned char* ciphertext = encrypted + crypto_box_NONCEBYTES;
     unsigned long long ciphertext_len = encrypted_len - crypto_box_NONCEBYTES;
-    unsigned char* ciphertext = new unsigned char[ciphertext_len];
-    std::memcpy(ciphertext, encrypted + crypto_box_NONCEBYTES, ciphertext_len);
 
     unsigned char pubkey[crypto_box_PUBLICKEYBYTES];
     unsigned char privkey[crypto_box_SECRETKEYBYTES];
@@ -1282,19 +1853,101 @@ unsigned char* idpass_lite_decrypt_with_card(void* self,
     crypto_sign_ed25519_sk_to_curve25519(privkey, card_skpk);
 
     // decrypt ciphertext to plaintext
-    if (crypto_box_open_easy(
-            plaintext, ciphertext, ciphertext_len, nonce, pubkey, privkey)
-        != 0) {
-        delete[] ciphertext;
+    return crypto_box_open_easy(
+               out, ciphertext, ciphertext_len, nonce, pubkey, privkey)
+           == 0;
+}
+
+/**
+* Asymmetric decryption of a ciphertext using a provided secret key
+*
+* @param self
+* @param outlen The bytes length of decrypted text
+* @param fullcard The QR code ID content
+* @param fullcard_len bytes length of fullcard
+* @param encrypted The encrypted data
+* @param encrypted_len The bytes length of encrypted
+* @return The decrypted text
+*/
+
+MODULE_API
+unsigned char* idpass_lite_decrypt_with_card(void* self,
+                                             int* outlen,
+                                             unsigned char* fullcard,
+                                             int fullcard_len,
+                                             unsigned char* encrypted,
+                                             int encrypted_len)
+{
+    if (self == nullptr || outlen == nullptr || fullcard == nullptr
+        || fullcard_len <= 0 || encrypted == nullptr || encrypted_len <= 0) {
+        return nullptr;
+    }
+    Context* context = (Context*)self;
+    int len = encrypted_len - crypto_box_NONCEBYTES - crypto_box_MACBYTES;
+    *outlen = 0;
+    if (len <= 0) {
+        return nullptr;
+    }
+
+    unsigned char* plaintext = context->NewByteArray(len);
+    if (!decrypt_with_card(context,
+                           fullcard,
+                           fullcard_len,
+                           encrypted,
+                           encrypted_len,
+                           plaintext)) {
         context->ReleaseByteArray(plaintext);
         return nullptr;
     }
 
-    delete[] ciphertext;
     *outlen = len;
     return plaintext;
 }
 
+/**
+* Asymmetric decryption of a ciphertext, into the caller's buffer.
+*
+* @param self Calling context
+* @param fullcard The QR code ID content
+* @param fullcard_len bytes length of fullcard
+* @param encrypted The encrypted data
+* @param encrypted_len The bytes length of encrypted
+* @param buf Caller buffer receiving the decrypted text, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the decrypted text, or -1 on failure
+*/
+
+MODULE_API
+int idpass_lite_decrypt_with_card_into(void* self,
+                                       unsigned char* fullcard,
+                                       int fullcard_len,
+                                       unsigned char* encrypted,
+                                       int encrypted_len,
+                                       unsigned char* buf,
+                                       int buf_len)
+{
+    if (self == nullptr || fullcard == nullptr || fullcard_len <= 0
+        || encrypted == nullptr || encrypted_len <= 0 || buf_len < 0) {
+        return -1;
+    }
+    Context* context = (Context*)self;
+
+    int len = encrypted_len - crypto_box_NONCEBYTES - crypto_box_MACBYTES;
+    if (len <= 0) {
+        return -1;
+    }
+    if (buf == nullptr || buf_len < len) {
+        return len;
+    }
+
+    if (!decrypt_with_card(
+            context, fullcard, fullcard_len, encrypted, encrypted_len, buf)) {
+        return -1;
+    }
+
+    return len;
+}
+
 /**
 * Generates an AEAD symmetric encryption key.
 *
@@ -1336,6 +1989,52 @@ int idpass_lite_generate_secret_signature_keypair(unsigned char* pk,
     return crypto_sign_keypair(pk, sk);
 }
 
+// Decrypts, then inflates if compressed, a fullcard encrypted card.
+// Returns 0 on success, 2 if decryption fails or 3 if inflating fails
+static int decrypt_card(const unsigned char* ecard_buf,
+                        int ecard_buf_len,
+                        const unsigned char* key,
+                        std::vector<unsigned char>& plaintext)
+{
+    if (ecard_buf_len < (int)(crypto_aead_chacha20poly1305_IETF_NPUBBYTES
+                              + crypto_aead_chacha20poly1305_IETF_ABYTES)) {
+        return 2;
+    }
+
+    unsigned long long decrypted_len;
+    std::vector<unsigned char> decrypted(
+        ecard_buf_len - crypto_aead_chacha20poly1305_IETF_NPUBBYTES);
+
+    unsigned char nonce[crypto_aead_chacha20poly1305_IETF_NPUBBYTES];
+    std::memcpy(nonce, ecard_buf, crypto_aead_chacha20poly1305_IETF_NPUBBYTES);
+
+    if (crypto_aead_chacha20poly1305_ietf_decrypt(
+            decrypted.data(),
+            &decrypted_len,
+            NULL, // always
+            ecard_buf + crypto_aead_chacha20poly1305_IETF_NPUBBYTES,
+            ecard_buf_len - crypto_aead_chacha20poly1305_IETF_NPUBBYTES,
+            NULL,
+            0,
+            nonce,
+            key)
+        != 0) {
+        return 2;
+    }
+    decrypted.resize(decrypted_len);
+
+    if (dictzip::is_compressed(decrypted.data(), decrypted.size())) {
+        if (!dictzip::decompress(
+                decrypted.data(), decrypted.size(), plaintext)) {
+            return 3;
+        }
+        return 0;
+    }
+
+    plaintext.swap(decrypted);
+    return 0;
+}
+
 /**
 * Symmetric decryption of the fullcard QR code ID.
 *
@@ -1344,7 +2043,9 @@ int idpass_lite_generate_secret_signature_keypair(unsigned char* pk,
 * @param ecard_buf_len Length bytes of ecard_buf
 * @param key The AEAD symmetric decryption key
 * @param key_len Length bytes of key
-* @return Returns 0 on success and decrypted content stored in ecard_buf
+* @return Returns 0 on success and decrypted content stored in ecard_buf,
+* or 3 if a compressed content does not fit into ecard_buf. Use
+* idpass_lite_card_decrypt2 for compressed cards.
 */
 
 MODULE_API
@@ -1354,8 +2055,6 @@ int idpass_lite_card_decrypt(void* self,
                              unsigned char* key,
                              int key_len)
 {
-    Context* context = (Context*)self;
-
     if (key_len != crypto_aead_chacha20poly1305_IETF_KEYBYTES
         || key == nullptr || self == nullptr || 
         ecard_buf == nullptr || ecard_buf_len == nullptr || *ecard_buf_len <= 0) 
@@ -1363,34 +2062,67 @@ int idpass_lite_card_decrypt(void* self,
         return 1;
     }
 
-    unsigned long long decrypted_len;
-    unsigned char* decrypted
-        = new unsigned char[*ecard_buf_len
-                            - crypto_aead_chacha20poly1305_IETF_NPUBBYTES];
-
-    unsigned char nonce[crypto_aead_chacha20poly1305_IETF_NPUBBYTES];
-    std::memcpy(nonce, ecard_buf, crypto_aead_chacha20poly1305_IETF_NPUBBYTES);
+    std::vector<unsigned char> plaintext;
+    int status = decrypt_card(ecard_buf, *ecard_buf_len, key, plaintext);
+    if (status != 0) {
+        return status;
+    }
 
-    if (crypto_aead_chacha20poly1305_ietf_decrypt(
-            decrypted,
-            &decrypted_len,
-            NULL, // always
-            ecard_buf + crypto_aead_chacha20poly1305_IETF_NPUBBYTES,
-            *ecard_buf_len - crypto_aead_chacha20poly1305_IETF_NPUBBYTES,
-            NULL,
-            0,
-            nonce,
-            key)
-        != 0) {
-        return 2;
+    // A compressed private region is inflated in place, provided that
+    // it fits into the caller's buffer
+    if (plaintext.size() > static_cast<std::size_t>(*ecard_buf_len)) {
+        return 3;
     }
 
-    *ecard_buf_len = (int)decrypted_len;
-    std::memcpy(ecard_buf, decrypted, decrypted_len);
-    delete[] decrypted;
+    *ecard_buf_len = (int)plaintext.size();
+    std::memcpy(ecard_buf, plaintext.data(), plaintext.size());
     return 0;
 }
 
+/**
+* Symmetric decryption of the fullcard QR code ID into a new buffer,
+* whatever size a compressed content inflates to.
+*
+* @param self
+* @param outlen Length bytes of the returned content
+* @param ecard_buf The fullcard bytes
+* @param ecard_buf_len Length bytes of ecard_buf
+* @param key The AEAD symmetric decryption key
+* @param key_len Length bytes of key
+* @return Returns the decrypted content or nullptr on error
+*/
+
+MODULE_API
+unsigned char* idpass_lite_card_decrypt2(void* self,
+                                         int* outlen,
+                                         const unsigned char* ecard_buf,
+                                         int ecard_buf_len,
+                                         const unsigned char* key,
+                                         int key_len)
+{
+    if (key_len != crypto_aead_chacha20poly1305_IETF_KEYBYTES
+        || key == nullptr || self == nullptr || outlen == nullptr
+        || ecard_buf == nullptr || ecard_buf_len <= 0) {
+        return nullptr;
+    }
+    Context* context = (Context*)self;
+    *outlen = 0;
+
+    std::vector<unsigned char> plaintext;
+    if (decrypt_card(ecard_buf, ecard_buf_len, key, plaintext) != 0
+        || plaintext.empty() || plaintext.size() > INT_MAX) {
+        return nullptr;
+    }
+
+    unsigned char* buf = context->NewByteArray(plaintext.size());
+    if (buf == nullptr) {
+        return nullptr;
+    }
+    std::memcpy(buf, plaintext.data(), plaintext.size());
+    *outlen = plaintext.size();
+    return buf;
+}
+
 /**
 * Verify the signature of msg using pubkey.
 *
@@ -1461,6 +2193,7 @@ idpass_lite_sign_with_card(void* self,
     if (!helper::decryptCard(encrypted_card,
                              encrypted_card_len,
                              context->m_keyset,
+                             context->m_verificationKeys,
                              card,
                              cards)) {
         return 2;
@@ -1485,539 +2218,1816 @@ idpass_lite_sign_with_card(void* self,
 }
 
 /**
-* Returns the QR code bitmap of data.
+* Signs many messages with user's QR code ID.
 *
-* @param self
-* @param data The input data
-* @param data_len Bytes lngth of data
-* @param *qrsize The square side dimension of QR code
-* @return The bitmap representation of data
+* @param self Calling context
+* @param outlen Bytes length of returned signatures
+* @param encrypted_card User's QR code ID
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param msgs The messages, each prefixed by its 4 bytes length
+* @param msgs_len Bytes length of msgs
+* @return Returns the 64 bytes signatures in the order of msgs
 */
 
-// Returns the QR Code encoding in bits with square dimension len
-MODULE_API unsigned char* idpass_lite_qrpixel(void* self,
-                                              const unsigned char* data,
-                                              int data_len,
-                                              int* qrsize)
+MODULE_API
+unsigned char* idpass_lite_sign_many_with_card(void* self,
+                                               int* outlen,
+                                               unsigned char* encrypted_card,
+                                               int encrypted_card_len,
+                                               unsigned char* msgs,
+                                               int msgs_len)
 {
-    if (self == nullptr || data == nullptr
-        || data_len <= 0 | qrsize == nullptr) 
-    {
-        return nullptr; 
+    if (self == nullptr || outlen == nullptr || encrypted_card == nullptr
+        || encrypted_card_len <= 0 || msgs == nullptr || msgs_len <= 0) {
+        return nullptr;
     }
+
     Context* context = (Context*)self;
-    int buf_len = 0;
+    *outlen = 0;
 
-    // if length is larger than the allowed maximum at the 
-    // choosen ECC, then data cannot be encoded into QR code
-    if (data_len > binary_encoding_max[context->qrcode_ecc]) {
+    std::vector<std::pair<const unsigned char*, int>> messages;
+    // the signatures must also fit in the returned length
+    if (!helper::unpack_blobs(msgs, msgs_len, messages)
+        || messages.empty()
+        || messages.size() > INT_MAX / crypto_sign_BYTES) {
         return nullptr;
     }
 
-    unsigned char* buf = qrcode_getpixel(
-        data, data_len, qrsize, &buf_len, context->qrcode_ecc);
+    idpass::IDPassCards cards;
+    idpass::IDPassCard card;
 
-    if (buf == nullptr) {
-        LOGI("idpass_api_qrpixel: error");
+    if (!helper::decryptCard(encrypted_card,
+                             encrypted_card_len,
+                             context->m_keyset,
+                             context->m_verificationKeys,
+                             card,
+                             cards)) {
+        return nullptr;
+    }
+
+    if (!context->verify_chain(cards)
+        || card.encryptionkey().size() != crypto_sign_SECRETKEYBYTES) {
         return nullptr;
     }
 
-    // re-allocate & copy into our manage area
-    unsigned char* pixel = context->NewByteArray(buf_len);
-    std::memcpy(pixel, buf, buf_len);
-    delete[] buf;
+    const unsigned char* skpk
+        = reinterpret_cast<const unsigned char*>(card.encryptionkey().data());
 
-    return pixel;
+    int n = messages.size();
+    unsigned char* sigs = context->NewByteArray(n * crypto_sign_BYTES);
+
+    // signing is independent per message, each worker owns its range
+    helper::parallel_for(n, 64, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            crypto_sign_detached(sigs + i * crypto_sign_BYTES,
+                                 nullptr,
+                                 messages[i].first,
+                                 messages[i].second,
+                                 skpk);
+        }
+    });
+
+    *outlen = n * crypto_sign_BYTES;
+    return sigs;
 }
 
 /**
-* Returns the QR code bitmap of data.
+* Starts an incremental Ed25519ph signing of arbitrarily large data
+* with user's QR code ID.
 *
-* @param self
-* @param *outlen The bytes length of returned data
-* @param data The input data
-* @param data_len Bytes lngth of data
-* @param *qrsize The square side dimension of QR code
-* @return The bitmap representation of data
+* @param self Calling context
+* @param encrypted_card User's QR code ID
+* @param encrypted_card_len Bytes length of encrypted_card
+* @return Returns the signing state handle or null on error
 */
 
-MODULE_API unsigned char* idpass_lite_qrpixel2(void* self,
-                                               int* outlen,
-                                               const unsigned char* data,
-                                               int data_len,
-                                               int* qrsize)
+MODULE_API
+void* idpass_lite_sign_init(void* self,
+                            unsigned char* encrypted_card,
+                            int encrypted_card_len)
 {
-    if (self == nullptr || outlen == nullptr 
-        || data == nullptr || data_len <= 0
-        || qrsize == nullptr) 
-    {
-        return nullptr; 
+    if (self == nullptr || encrypted_card == nullptr
+        || encrypted_card_len <= 0) {
+        return nullptr;
     }
+
     Context* context = (Context*)self;
-    int buf_len = 0;
-    *outlen = 0;
 
-    // if length is larger than the allowed maximum at the 
-    // choosen ECC, then data cannot be encoded into QR code
-    if (data_len > binary_encoding_max[context->qrcode_ecc]) {
+    idpass::IDPassCards cards;
+    idpass::IDPassCard card;
+
+    if (!helper::decryptCard(encrypted_card,
+                             encrypted_card_len,
+                             context->m_keyset,
+                             context->m_verificationKeys,
+                             card,
+                             cards)) {
         return nullptr;
     }
 
-    unsigned char* buf = qrcode_getpixel(
-        data, data_len, qrsize, &buf_len, context->qrcode_ecc);
-
-    if (buf == nullptr) {
-        LOGI("idpass_api_qrpixel2: error");
+    if (!context->verify_chain(cards)
+        || card.encryptionkey().size() != crypto_sign_SECRETKEYBYTES) {
         return nullptr;
     }
 
-    // re-allocate & copy into our manage area
-    unsigned char* pixel = context->NewByteArray(buf_len);
-    std::memcpy(pixel, buf, buf_len);
-    *outlen = buf_len;
-    delete[] buf;
+    SignStream* stream = reinterpret_cast<SignStream*>(
+        context->NewByteArray(sizeof(SignStream)));
 
-    return pixel;
+    std::memcpy(stream->skpk,
+                card.encryptionkey().data(),
+                crypto_sign_SECRETKEYBYTES);
+    crypto_sign_ed25519_sk_to_pk(stream->pubkey, stream->skpk);
+    stream->mode = SIGMODE_ED25519PH;
+    stream->signing = true;
+    crypto_sign_init(&stream->state);
+
+    return stream;
 }
 
 /**
-* A generic function to adjust settings of the calling context.
-* It consist of a sub-command prefix by IOCTL_* followed by
-* command-specific parameters.
+* Feeds the next chunk of data into a signing state.
 *
 * @param self Calling context
-* @param outlen The count of bytes returned
-* @param iobuf The input/output command buffer
-* @param iobuf_len The bytes length of iobuf parameter
-* @return void* Command-specific returned data buffer
+* @param state The handle returned by idpass_lite_sign_init
+* @param data The next chunk of data to be signed
+* @param data_len Bytes length of data
+* @return Returns 0 on success
 */
 
 MODULE_API
-void* idpass_lite_ioctl(void* self,
-                        int* outlen,
-                        unsigned char* iobuf,
-                        int iobuf_len)
-
+int idpass_lite_sign_update(void* self,
+                            void* state,
+                            unsigned char* data,
+                            int data_len)
 {
-    if (!iobuf || iobuf_len <= 0 || self == nullptr) {
-        return nullptr;
+    if (self == nullptr || state == nullptr || data == nullptr
+        || data_len < 0) {
+        return 1;
     }
-    Context* context = (Context*)self;
-    std::lock_guard<std::mutex> guard(context->ctxMutex);
 
-    if (outlen) {
-        *outlen = 0;
+    SignStream* stream = (SignStream*)state;
+    if (!stream->signing) {
+        return 2;
     }
 
-    unsigned char cmd = iobuf[0];
-    switch (cmd) {
-    case IOCTL_SET_FACEDIFF: { // set new facediff value
-        float facediff;
-        bin16::f4b_to_f4(iobuf + 1, iobuf_len - 1, &facediff);
-        if (context->fdimension) {
-            context->facediff_full = facediff;
-        } else {
-            context->facediff_half = facediff;
-        }
-    } break;
-
-    case IOCTL_GET_FACEDIFF: { // get current facediff value
-        if (context->fdimension) {
-            bin16::f4_to_f4b(&context->facediff_full, 1, iobuf + 1);
-        } else {
-            bin16::f4_to_f4b(&context->facediff_half, 1, iobuf + 1);
-        }
-    } break;
-
-    case IOCTL_SET_FDIM: { // set fdimension flag
-        if (iobuf[1] == 0x00) {
-            context->fdimension = false;
-        } else if (iobuf[1] == 0x01) {
-            context->fdimension = true;
-        }
-    } break;
+    return crypto_sign_update(&stream->state, data, data_len);
+}
 
-    case IOCTL_GET_FDIM: { // get fdimension flag
-        if (context->fdimension) {
-            iobuf[1] = 0x01;
-        } else {
-            iobuf[1] = 0x00;
-        }
-    } break;
+/**
+* Completes an incremental signing. The output is the SIGMODE_ED25519PH
+* tag followed by the 64 bytes Ed25519ph signature.
+*
+* @param self Calling context
+* @param state The handle returned by idpass_lite_sign_init
+* @param sig The output signature
+* @param sig_len Must be SIGNATURE_ED25519PH_LEN
+* @return Returns 0 on success
+*/
 
-    case IOCTL_SET_ECC: { // set QR Code ECC level
-        switch (iobuf[1]) {
-        case 0x00: {
-            context->qrcode_ecc = ECC_LOW;
-        } break;
-        case 0x01: {
-            context->qrcode_ecc = ECC_MEDIUM; // default
-        } break;
-        case 0x02: {
-            context->qrcode_ecc = ECC_QUARTILE;
-        } break;
-        case 0x03: {
-            context->qrcode_ecc = ECC_HIGH;
-        } break;
-        }
-    } break;
+MODULE_API
+int idpass_lite_sign_final(void* self,
+                           void* state,
+                           unsigned char* sig,
+                           int sig_len)
+{
+    if (self == nullptr || state == nullptr) {
+        return 1;
+    }
 
-    case IOCTL_SET_ACL: {
-        // TODO: Control which field goes to public or private
-        // Make it more flexible later. For now, the next byte
-        // is the ACL. The proper way, I think should follow
-        // that of popular TLV 7bit and use the 8th bit to
-        // describe the next bytes. In this way, when the
-        // number of configurable bits increases can be better
-        // managed.
-        unsigned long long vflags; 
-        unsigned char vflagsbuf[8];
-        for (int i = 0; i < 8; i++) {
-            vflagsbuf[i] = iobuf[1 + i];
-        }
-        std::memcpy(&vflags, vflagsbuf, sizeof(unsigned long long));
-        context->acl.setBits(vflags);
-    } break;
+    Context* context = (Context*)self;
+    SignStream* stream = (SignStream*)state;
+    int status = 0;
+
+    if (sig == nullptr || sig_len != SIGNATURE_ED25519PH_LEN
+        || !stream->signing) {
+        status = 2;
+    } else if (crypto_sign_final_create(
+                   &stream->state, sig + 1, nullptr, stream->skpk)
+               != 0) {
+        LOGI("crypto_sign_final_create: error");
+        status = 3;
+    } else {
+        sig[0] = stream->mode;
     }
 
-    return nullptr;
+    sodium_memzero(stream, sizeof(SignStream));
+    context->ReleaseByteArray(stream);
+    return status;
 }
 
 /**
-* Computes full facial dimension of a face.
+* Starts an incremental verification of an Ed25519ph signature
+* produced by idpass_lite_sign_final.
 *
-* @param self
-* @param photo The face photo
-* @param photo_len Bytes length of photo
-* @param facearray The float[128] array with 4 bytes per float
-* @return Returns count of detected faces in photo
+* @param self Calling context
+* @param pubkey Public key that generated the signature
+* @param pubkey_len Length of bytes of pubkey
+* @return Returns the verification state handle or null on error
 */
 
-MODULE_API int
-idpass_lite_face128d(void* self, char* photo, int photo_len, float* faceArray)
+MODULE_API
+void* idpass_lite_verify_init(void* self,
+                              unsigned char* pubkey,
+                              int pubkey_len)
 {
+    if (self == nullptr || pubkey == nullptr
+        || pubkey_len != crypto_sign_PUBLICKEYBYTES) {
+        return nullptr;
+    }
 
-    if (self == nullptr || photo == nullptr || photo_len <= 0
-        || faceArray == nullptr) 
-    {
-        return 0;
-    } 
     Context* context = (Context*)self;
-    return dlib_api::computeface128d(photo, photo_len, faceArray);
+
+    SignStream* stream = reinterpret_cast<SignStream*>(
+        context->NewByteArray(sizeof(SignStream)));
+
+    std::memcpy(stream->pubkey, pubkey, crypto_sign_PUBLICKEYBYTES);
+    stream->mode = SIGMODE_ED25519PH;
+    stream->signing = false;
+    crypto_sign_init(&stream->state);
+
+    return stream;
 }
 
 /**
-* Computes full facial dimension of a face.
+* Feeds the next chunk of data into a verification state.
 *
-* @param self
-* @param photo The face photo
-* @param photo_len Bytes length in photo
-* @param buf The facial dimension float[128] as bytes
-* @return Returns the count of faces detected in photo
+* @param self Calling context
+* @param state The handle returned by idpass_lite_verify_init
+* @param data The next chunk of signed data
+* @param data_len Bytes length of data
+* @return Returns 0 on success
 */
 
-MODULE_API int idpass_lite_face128dbuf(void* self,
-                                       char* photo,
-                                       int photo_len,
-                                       unsigned char* buf)
+MODULE_API
+int idpass_lite_verify_update(void* self,
+                              void* state,
+                              unsigned char* data,
+                              int data_len)
 {
-    if (self == nullptr || photo == nullptr || photo_len <= 0
-        || buf == nullptr) 
-    {
-        return 0;
-    } 
-    Context* context = (Context*)self;
-    float f4[128];
-    int face_count = dlib_api::computeface128d(photo, photo_len, f4);
+    if (self == nullptr || state == nullptr || data == nullptr
+        || data_len < 0) {
+        return 1;
+    }
 
-    if (face_count == 1) {
-        bin16::f4_to_f4b(f4, 128, buf);
+    SignStream* stream = (SignStream*)state;
+    if (stream->signing) {
+        return 2;
     }
 
-    return face_count;
+    return crypto_sign_update(&stream->state, data, data_len);
 }
 
 /**
-* Computes half facial dimension of a face.
+* Completes an incremental verification.
 *
-* @param self
-* @param photo The face photo.
-* @param photo_len Bytes length of photo
-* @param facearray The float[64] with 2 bytes per float
-* @return Returns the count of detected faces in photo
+* @param self Calling context
+* @param state The handle returned by idpass_lite_verify_init
+* @param sig The mode tagged signature
+* @param sig_len Must be SIGNATURE_ED25519PH_LEN
+* @return Returns 0 if the signature verifies
 */
 
 MODULE_API
-int idpass_lite_face64d(void* self,
-                        char* photo,
-                        int photo_len,
-                        float* facearray)
+int idpass_lite_verify_final(void* self,
+                             void* state,
+                             unsigned char* sig,
+                             int sig_len)
 {
-    if (self == nullptr || photo == nullptr || photo_len <= 0
-        || facearray == nullptr) 
-    {
-        return 0;
-    } 
+    if (self == nullptr || state == nullptr) {
+        return 1;
+    }
+
     Context* context = (Context*)self;
-    float fdim[128];
-    int facecount = dlib_api::computeface128d(photo, photo_len, fdim);
-    bin16::f4_to_f2(fdim, 64, facearray);
-    return facecount;
+    SignStream* stream = (SignStream*)state;
+    int status = 0;
+
+    // A pure Ed25519 signature or an unknown mode never verifies here
+    if (sig == nullptr || sig_len != SIGNATURE_ED25519PH_LEN
+        || stream->signing || sig[0] != stream->mode) {
+        status = 2;
+    } else if (crypto_sign_final_verify(
+                   &stream->state, sig + 1, stream->pubkey)
+               != 0) {
+        status = 3;
+    }
+
+    context->ReleaseByteArray(stream);
+    return status;
+}
+
+// Encodes data straight into a byte array of the context
+static unsigned char* encode_qrpixel(Context* context,
+                                     const unsigned char* data,
+                                     int data_len,
+                                     int* qrsize,
+                                     int* buf_len)
+{
+    int ecc = context->qrcode_ecc;
+    uint8_t version = qrcode_getVersion(ecc, data, data_len);
+    if (version == 0) {
+        return nullptr;
+    }
+
+    int nn = qrcode_getBufferSize(version);
+    unsigned char* pixel = context->NewByteArray(nn);
+    if (qrcode_getPixels(pixel, version, ecc, data, data_len) != 0) {
+        context->ReleaseByteArray(pixel);
+        return nullptr;
+    }
+
+    *qrsize = 4 * version + 17;
+    *buf_len = nn;
+    return pixel;
 }
 
 /**
-* Computes half facial dimension of a face.
+* Returns the QR code bitmap of data.
 *
 * @param self
-* @param photo The face photo.
-* @param photo_len Bytes length of photo
-* @param facearray The float[64] with 2 bytes per float in byte array format
-* @return Returns the count of detected faces in photo
+* @param data The input data
+* @param data_len Bytes lngth of data
+* @param *qrsize The square side dimension of QR code
+* @return The bitmap representation of data
 */
 
-MODULE_API int idpass_lite_face64dbuf(void* self,
-                                      char* photo,
-                                      int photo_len,
-                                      unsigned char* buf)
+// Returns the QR Code encoding in bits with square dimension len
+MODULE_API unsigned char* idpass_lite_qrpixel(void* self,
+                                              const unsigned char* data,
+                                              int data_len,
+                                              int* qrsize)
 {
-    if (self == nullptr || photo == nullptr || photo_len <= 0
-        || buf == nullptr) 
+    if (self == nullptr || data == nullptr
+        || data_len <= 0 | qrsize == nullptr) 
     {
-        return 0;
-    } 
-    Context* context = (Context*)self;
-    float f4[128];
-    int face_count = dlib_api::computeface128d(photo, photo_len, f4);
-
-    if (face_count == 1) {
-        bin16::f4_to_f2b(f4, 64, buf);
+        return nullptr; 
     }
-
-    return face_count;
-}
-
-MODULE_API
-int idpass_lite_compare_face_photo(void* self,
-                                   char* face1,
-                                   int face1_len,
-                                   char* face2,
-                                   int face2_len,
-                                   float* fdiff)
-{
     Context* context = (Context*)self;
+    int buf_len = 0;
 
-    if (face1 == nullptr || face2 == nullptr || face1_len <= 0
-        || face2_len <= 0 || self == nullptr || fdiff == nullptr) {
-        return 3; // invalid params
+    // if length is larger than the allowed maximum at the 
+    // choosen ECC, then data cannot be encoded into QR code
+    if (data_len > binary_encoding_max[context->qrcode_ecc]) {
+        return nullptr;
     }
 
-    float result = 10.0;
-    float face1Array[128];
-    float face2Array[128];
+    unsigned char* pixel
+        = encode_qrpixel(context, data, data_len, qrsize, &buf_len);
 
-    if (dlib_api::computeface128d((char*)face1, face1_len, face1Array) != 1) {
-        return 1; // something wrong in face1
+    if (pixel == nullptr) {
+        LOGI("idpass_api_qrpixel: error");
+        return nullptr;
     }
 
-    if (dlib_api::computeface128d((char*)face2, face2_len, face2Array) != 1) {
-        return 2; // something wrong in face2
-    }
+    return pixel;
+}
 
-    // convert vector representation based on fdim mode of calling context
+/**
+* Returns the QR code bitmap of data.
+*
+* @param self
+* @param *outlen The bytes length of returned data
+* @param data The input data
+* @param data_len Bytes lngth of data
+* @param *qrsize The square side dimension of QR code
+* @return The bitmap representation of data
+*/
+
+MODULE_API unsigned char* idpass_lite_qrpixel2(void* self,
+                                               int* outlen,
+                                               const unsigned char* data,
+                                               int data_len,
+                                               int* qrsize)
+{
+    if (self == nullptr || outlen == nullptr 
+        || data == nullptr || data_len <= 0
+        || qrsize == nullptr) 
+    {
+        return nullptr; 
+    }
+    Context* context = (Context*)self;
+    int buf_len = 0;
+    *outlen = 0;
+
+    // if length is larger than the allowed maximum at the 
+    // choosen ECC, then data cannot be encoded into QR code
+    if (data_len > binary_encoding_max[context->qrcode_ecc]) {
+        return nullptr;
+    }
+
+    unsigned char* pixel
+        = encode_qrpixel(context, data, data_len, qrsize, &buf_len);
+
+    if (pixel == nullptr) {
+        LOGI("idpass_api_qrpixel2: error");
+        return nullptr;
+    }
+
+    *outlen = buf_len;
+    return pixel;
+}
+
+/**
+* Returns the QR code bitmap of data into the caller's buffer.
+*
+* @param self Calling context
+* @param data The input data
+* @param data_len Bytes length of data
+* @param buf Caller buffer receiving the bitmap, or null
+* @param buf_len The bytes length of buf
+* @param *qrsize The square side dimension of QR code
+* @return Returns the bytes length of the bitmap, or -1 on invalid input
+*/
+
+MODULE_API int idpass_lite_qrpixel_into(void* self,
+                                        const unsigned char* data,
+                                        int data_len,
+                                        unsigned char* buf,
+                                        int buf_len,
+                                        int* qrsize)
+{
+    if (self == nullptr || data == nullptr || data_len <= 0
+        || buf_len < 0 || qrsize == nullptr) {
+        return -1;
+    }
+    Context* context = (Context*)self;
+    int ecc = context->qrcode_ecc;
+
+    if (data_len > binary_encoding_max[ecc]) {
+        return -1;
+    }
+
+    uint8_t version = qrcode_getVersion(ecc, data, data_len);
+    if (version == 0) {
+        return -1;
+    }
+
+    *qrsize = 4 * version + 17;
+    int needed = qrcode_getBufferSize(version);
+
+    if (buf == nullptr || buf_len < needed) {
+        return needed;
+    }
+
+    if (qrcode_getPixels(buf, version, ecc, data, data_len) != 0) {
+        LOGI("idpass_lite_qrpixel_into: error");
+        return -1;
+    }
+
+    return needed;
+}
+
+/**
+* Returns the QR code bitmap of data with each row padded for blitting.
+*
+* @param self Calling context
+* @param data The input data
+* @param data_len Bytes length of data
+* @param row_align Each row is padded to a multiple of this many bytes
+* @param buf Caller buffer receiving the bitmap, or null
+* @param buf_len The bytes length of buf
+* @param *qrsize The square side dimension of QR code
+* @param *row_bytes The bytes length of each row
+* @return Returns the bytes length of the bitmap, or -1 on invalid input
+*/
+
+MODULE_API int idpass_lite_qrpixel_rows(void* self,
+                                        const unsigned char* data,
+                                        int data_len,
+                                        int row_align,
+                                        unsigned char* buf,
+                                        int buf_len,
+                                        int* qrsize,
+                                        int* row_bytes)
+{
+    if (self == nullptr || data == nullptr || data_len <= 0
+        || buf_len < 0 || qrsize == nullptr || row_bytes == nullptr) {
+        return -1;
+    }
+    Context* context = (Context*)self;
+    int ecc = context->qrcode_ecc;
+
+    if (data_len > binary_encoding_max[ecc]) {
+        return -1;
+    }
+
+    uint8_t version = qrcode_getVersion(ecc, data, data_len);
+    int stride = qrcode_getRowBytes(version, row_align);
+    if (version == 0 || stride < 0) {
+        return -1;
+    }
+
+    *qrsize = 4 * version + 17;
+    *row_bytes = stride;
+    int needed = *qrsize * stride;
+
+    if (buf == nullptr || buf_len < needed) {
+        return needed;
+    }
+
+    if (qrcode_getRowPixels(buf, stride, version, ecc, data, data_len) != 0) {
+        LOGI("idpass_lite_qrpixel_rows: error");
+        return -1;
+    }
+
+    return needed;
+}
+
+/**
+* Encodes many payloads into QR codes at once, into the caller's arena.
+*
+* @param self Calling context
+* @param payloads_buf The payloads, each prefixed by its 4 bytes length
+* @param payloads_buf_len The bytes length of payloads_buf
+* @param arena Caller buffer receiving the symbols, or null
+* @param arena_len The bytes length of arena
+* @param table Receives the arena offset and side dimension per payload
+* @param table_len The count of ints in table
+* @return Returns the bytes length of all symbols, or -1 on invalid input
+* or if that length exceeds INT_MAX
+*/
+
+MODULE_API int idpass_lite_qrpixel_batch(void* self,
+                                         unsigned char* payloads_buf,
+                                         int payloads_buf_len,
+                                         unsigned char* arena,
+                                         int arena_len,
+                                         int* table,
+                                         int table_len)
+{
+    if (self == nullptr || payloads_buf == nullptr || payloads_buf_len <= 0
+        || table == nullptr) {
+        return -1;
+    }
+    Context* context = (Context*)self;
+    int ecc = context->qrcode_ecc;
+
+    std::vector<std::pair<const unsigned char*, int>> payloads;
+    if (!helper::unpack_blobs(payloads_buf, payloads_buf_len, payloads)
+        || payloads.empty() || table_len < 2 * (int)payloads.size()) {
+        return -1;
+    }
+
+    // Lay out the arena up front from each payload's version, so that
+    // every symbol is then encoded straight into its own slot
+    int n = payloads.size();
+    std::vector<uint8_t> versions(n);
+    std::int64_t needed = 0;
+    for (int i = 0; i < n; i++) {
+        int len = payloads[i].second;
+        versions[i] = len > 0 && len <= binary_encoding_max[ecc]
+                          ? qrcode_getVersion(ecc, payloads[i].first, len)
+                          : 0;
+        if (versions[i] == 0) {
+            table[2 * i] = -1;
+            table[2 * i + 1] = 0;
+            continue;
+        }
+        // offsets into the arena and the result are ints
+        if (needed + qrcode_getBufferSize(versions[i]) > INT_MAX) {
+            return -1;
+        }
+        table[2 * i] = (int)needed;
+        table[2 * i + 1] = 4 * versions[i] + 17;
+        needed += qrcode_getBufferSize(versions[i]);
+    }
+
+    if (arena == nullptr || arena_len < needed) {
+        return (int)needed;
+    }
+
+    // symbols already run in parallel, a range that is not the whole
+    // batch keeps each symbol's mask scoring on its own thread
+    helper::parallel_for(n, 4, [&](int begin, int end) {
+        bool threaded = qrcode_setMaskThreading(end - begin == n);
+        for (int i = begin; i < end; i++) {
+            if (versions[i] != 0
+                && qrcode_getPixels(arena + table[2 * i],
+                                    versions[i],
+                                    ecc,
+                                    payloads[i].first,
+                                    payloads[i].second)
+                       != 0) {
+                table[2 * i] = -1;
+                table[2 * i + 1] = 0;
+            }
+        }
+        qrcode_setMaskThreading(threaded);
+    });
+
+    return (int)needed;
+}
+
+/**
+* Splits data across up to 16 structured append QR codes.
+*
+* @param self Calling context
+* @param *outlen The bytes length of returned data
+* @param data The input data
+* @param data_len Bytes length of data
+* @param max_version The largest QR version of a symbol
+* @param *count Receives the count of symbols
+* @param *qrsize Receives the square side dimension of each symbol
+* @return The symbols back to back, or null if data does not fit
+*/
+
+MODULE_API unsigned char* idpass_lite_qrpixel_append(void* self,
+                                                     int* outlen,
+                                                     const unsigned char* data,
+                                                     int data_len,
+                                                     int max_version,
+                                                     int* count,
+                                                     int* qrsize)
+{
+    if (self == nullptr || outlen == nullptr || data == nullptr
+        || data_len <= 0 || max_version < 1 || max_version > 40
+        || count == nullptr || qrsize == nullptr) {
+        return nullptr;
+    }
+    Context* context = (Context*)self;
+    int ecc = context->qrcode_ecc;
+    *outlen = 0;
+
+    uint8_t version = 0;
+    int total = qrcode_getAppendLayout(ecc, data, data_len, max_version, &version);
+    if (total == 0) {
+        return nullptr;
+    }
+
+    unsigned char parity = 0;
+    for (int i = 0; i < data_len; i++) {
+        parity ^= data[i];
+    }
+
+    int nn = qrcode_getBufferSize(version);
+    unsigned char* pixels = context->NewByteArray(total * nn);
+    std::atomic<bool> failed(false);
+
+    helper::parallel_for(total, 1, [&](int begin, int end) {
+        bool threaded = qrcode_setMaskThreading(end - begin == total);
+        for (int i = begin; i < end; i++) {
+            int start = qrcode_getAppendOffset(data_len, total, i);
+            int stop = qrcode_getAppendOffset(data_len, total, i + 1);
+            QRAppend append = {(uint8_t)i, (uint8_t)total, parity};
+            if (qrcode_getAppendPixels(pixels + i * nn,
+                                       version,
+                                       ecc,
+                                       data + start,
+                                       stop - start,
+                                       total > 1 ? &append : nullptr)
+                != 0) {
+                failed = true;
+            }
+        }
+        qrcode_setMaskThreading(threaded);
+    });
+
+    if (failed) {
+        LOGI("idpass_lite_qrpixel_append: error");
+        context->ReleaseByteArray(pixels);
+        return nullptr;
+    }
+
+    *outlen = total * nn;
+    *count = total;
+    *qrsize = 4 * version + 17;
+    return pixels;
+}
+
+/**
+* Joins back the data of structured append symbols given in any order.
+*
+* @param self Calling context
+* @param *outlen The bytes length of returned data
+* @param symbols_buf The symbols, each prefixed by its 4 bytes length
+* @param symbols_buf_len The bytes length of symbols_buf
+* @return The joined data, or null on a missing or mismatching symbol
+*/
+
+MODULE_API unsigned char* idpass_lite_qrappend_join(void* self,
+                                                    int* outlen,
+                                                    unsigned char* symbols_buf,
+                                                    int symbols_buf_len)
+{
+    if (self == nullptr || outlen == nullptr || symbols_buf == nullptr
+        || symbols_buf_len <= 0) {
+        return nullptr;
+    }
+    Context* context = (Context*)self;
+    *outlen = 0;
+
+    std::vector<std::pair<const unsigned char*, int>> symbols;
+    if (!helper::unpack_blobs(symbols_buf, symbols_buf_len, symbols)
+        || symbols.empty() || symbols.size() > QR_APPEND_MAX) {
+        return nullptr;
+    }
+
+    // Slot each symbol by its index, all headers must agree on the
+    // count and parity
+    std::vector<std::pair<const unsigned char*, int>> parts(symbols.size());
+    unsigned char parity = 0;
+    int len = 0;
+    for (std::size_t i = 0; i < symbols.size(); i++) {
+        const unsigned char* symbol = symbols[i].first;
+        if (symbols[i].second < 2
+            || (symbol[0] & 0x0F) + 1 != (int)symbols.size()
+            || (i > 0 && symbol[1] != parity)) {
+            return nullptr;
+        }
+        parity = symbol[1];
+
+        int index = symbol[0] >> 4;
+        if (index >= (int)parts.size() || parts[index].first != nullptr) {
+            return nullptr;
+        }
+        parts[index] = {symbol + 2, symbols[i].second - 2};
+        len += symbols[i].second - 2;
+    }
+
+    if (len == 0) {
+        return nullptr;
+    }
+
+    unsigned char* data = context->NewByteArray(len);
+    unsigned char* p = data;
+    for (auto& part : parts) {
+        std::memcpy(p, part.first, part.second);
+        p += part.second;
+    }
+
+    for (int i = 0; i < len; i++) {
+        parity ^= data[i];
+    }
+    if (parity != 0) {
+        context->ReleaseByteArray(data);
+        return nullptr;
+    }
+
+    *outlen = len;
+    return data;
+}
+
+// Whether pixels_len bytes hold a bitmap of qrsize by qrsize modules
+static bool qrrender_fits(int qrsize, int pixels_len)
+{
+    return qrsize > 0
+           && pixels_len >= ((std::int64_t)qrsize * qrsize + 7) / 8;
+}
+
+/**
+* Renders a QR code bitmap into a PBM, PNG or SVG image.
+*
+* @param self Calling context
+* @param pixels The QR code bitmap
+* @param pixels_len The bytes length of pixels, at least
+*        (qrsize * qrsize + 7) / 8
+* @param qrsize The square side dimension of the QR code
+* @param format One of the QRRENDER_* formats
+* @param scale Pixels per module
+* @param quiet Modules of quiet zone on each side
+* @param buf Caller buffer receiving the image, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the image, or -1 on invalid input
+*/
+
+MODULE_API int idpass_lite_qrrender(void* self,
+                                    const unsigned char* pixels,
+                                    int pixels_len,
+                                    int qrsize,
+                                    int format,
+                                    int scale,
+                                    int quiet,
+                                    unsigned char* buf,
+                                    int buf_len)
+{
+    if (self == nullptr || pixels == nullptr || buf_len < 0
+        || !qrrender_fits(qrsize, pixels_len)) {
+        return -1;
+    }
+
+    std::size_t total = 0;
+    if (!qrraster::render(pixels,
+                          qrsize,
+                          format,
+                          scale,
+                          quiet,
+                          qrraster::buffer_sink(buf, buf_len, total))
+        || total > INT_MAX) {
+        return -1;
+    }
+
+    return total;
+}
+
+/**
+* Renders a QR code bitmap into a PBM, PNG or SVG image file.
+*
+* @param self Calling context
+* @param pixels The QR code bitmap
+* @param pixels_len The bytes length of pixels, at least
+*        (qrsize * qrsize + 7) / 8
+* @param qrsize The square side dimension of the QR code
+* @param format One of the QRRENDER_* formats
+* @param scale Pixels per module
+* @param quiet Modules of quiet zone on each side
+* @param fd The file descriptor to write into
+* @return Returns the bytes written, or -1 on invalid input or write error
+*/
+
+MODULE_API int idpass_lite_qrrender_fd(void* self,
+                                       const unsigned char* pixels,
+                                       int pixels_len,
+                                       int qrsize,
+                                       int format,
+                                       int scale,
+                                       int quiet,
+                                       int fd)
+{
+    if (self == nullptr || pixels == nullptr || fd < 0
+        || !qrrender_fits(qrsize, pixels_len)) {
+        return -1;
+    }
+
+    std::size_t total = 0;
+    if (!qrraster::render(pixels,
+                          qrsize,
+                          format,
+                          scale,
+                          quiet,
+                          qrraster::fd_sink(fd, total))
+        || total > INT_MAX) {
+        return -1;
+    }
+
+    return total;
+}
+
+/**
+* Finds and decodes a QR code in a grayscale camera frame.
+*
+* @param self Calling context
+* @param *outlen The bytes length of returned data
+* @param gray The grayscale pixels
+* @param width The frame width in pixels
+* @param height The frame height in pixels
+* @param stride The bytes between the starts of two rows
+* @param *count Receives the count of structured append symbols, or 1
+* @return The decoded data, or null if no QR code could be read
+*/
+
+MODULE_API unsigned char* idpass_lite_qrscan(void* self,
+                                             int* outlen,
+                                             const unsigned char* gray,
+                                             int width,
+                                             int height,
+                                             int stride,
+                                             int* count)
+{
+    if (self == nullptr || outlen == nullptr || gray == nullptr
+        || width <= 0 || height <= 0 || stride < width
+        || count == nullptr) {
+        return nullptr;
+    }
+    Context* context = (Context*)self;
+    *outlen = 0;
+
+    std::vector<unsigned char> data;
+    QRAppend append = {0, 0, 0};
+    if (!qrscan::decode(gray, width, height, stride, data, append)) {
+        return nullptr;
+    }
+
+    // Structured append symbols keep the header that
+    // idpass_lite_qrappend_join expects
+    int header = append.total > 1 ? 2 : 0;
+    int n = header + data.size();
+    if (n == 0) {
+        return nullptr;
+    }
+
+    unsigned char* buf = context->NewByteArray(n);
+    if (header > 0) {
+        buf[0] = (append.index << 4) | (append.total - 1);
+        buf[1] = append.parity;
+    }
+    if (!data.empty()) {
+        std::memcpy(buf + header, data.data(), data.size());
+    }
+
+    *outlen = n;
+    *count = header > 0 ? append.total : 1;
+    return buf;
+}
+
+/**
+* Decodes the QR code ID of a camera frame and verifies it against a pin.
+*
+* @param self Calling context
+* @param *outlen Bytes length of returned bytes
+* @param gray The grayscale pixels
+* @param width The frame width in pixels
+* @param height The frame height in pixels
+* @param stride The bytes between the starts of two rows
+* @param pin The ID owner's secret pin code
+* @return Returns the user's CardDetails if there is pin match.
+*/
+
+MODULE_API unsigned char*
+idpass_lite_scan_and_verify_with_pin(void* self,
+                                     int* outlen,
+                                     const unsigned char* gray,
+                                     int width,
+                                     int height,
+                                     int stride,
+                                     const char* pin)
+{
+    if (self == nullptr || outlen == nullptr || gray == nullptr
+        || width <= 0 || height <= 0 || stride < width || pin == nullptr) {
+        return nullptr;
+    }
+    *outlen = 0;
+
+    std::vector<unsigned char> card;
+    QRAppend append = {0, 0, 0};
+    if (!qrscan::decode(gray, width, height, stride, card, append)
+        || append.total > 1 || card.empty()) {
+        return nullptr;
+    }
+
+    return idpass_lite_verify_card_with_pin(
+        self, outlen, card.data(), card.size(), pin);
+}
+
+/**
+* Decodes the QR code ID of a camera frame and verifies it against a photo.
+*
+* @param self Calling context
+* @param *outlen Bytes length of returned bytes
+* @param gray The grayscale pixels
+* @param width The frame width in pixels
+* @param height The frame height in pixels
+* @param stride The bytes between the starts of two rows
+* @param photo The ID owner's photo capture
+* @param photo_len Length of bytes of photo
+* @return Returns the user's CardDetails if there is facial match.
+*/
+
+MODULE_API unsigned char*
+idpass_lite_scan_and_verify_with_face(void* self,
+                                      int* outlen,
+                                      const unsigned char* gray,
+                                      int width,
+                                      int height,
+                                      int stride,
+                                      char* photo,
+                                      int photo_len)
+{
+    if (self == nullptr || outlen == nullptr || gray == nullptr
+        || width <= 0 || height <= 0 || stride < width || photo == nullptr
+        || photo_len <= 0) {
+        return nullptr;
+    }
+    *outlen = 0;
+
+    std::vector<unsigned char> card;
+    QRAppend append = {0, 0, 0};
+    if (!qrscan::decode(gray, width, height, stride, card, append)
+        || append.total > 1 || card.empty()) {
+        return nullptr;
+    }
+
+    return idpass_lite_verify_card_with_face(
+        self, outlen, card.data(), card.size(), photo, photo_len);
+}
+
+// Bytes length of an ioctl command with its parameters
+static int ioctl_len(unsigned char cmd)
+{
+    switch (cmd) {
+    case IOCTL_SET_FACEDIFF:
+    case IOCTL_GET_FACEDIFF:
+        return 5;
+    case IOCTL_SET_FDIM:
+    case IOCTL_GET_FDIM:
+    case IOCTL_SET_ECC:
+        return 2;
+    case IOCTL_SET_ACL:
+        return 9;
+    default:
+        return 1;
+    }
+}
+
+/**
+* A generic function to adjust settings of the calling context.
+* It consist of a sub-command prefix by IOCTL_* followed by
+* command-specific parameters. A command shorter than its parameters
+* is ignored.
+*
+* @param self Calling context
+* @param outlen The count of bytes returned
+* @param iobuf The input/output command buffer
+* @param iobuf_len The bytes length of iobuf parameter
+* @return void* Command-specific returned data buffer
+*/
+
+MODULE_API
+void* idpass_lite_ioctl(void* self,
+                        int* outlen,
+                        unsigned char* iobuf,
+                        int iobuf_len)
+
+{
+    if (!iobuf || iobuf_len <= 0 || self == nullptr) {
+        return nullptr;
+    }
+    Context* context = (Context*)self;
+    std::lock_guard<std::mutex> guard(context->ctxMutex);
+
+    if (outlen) {
+        *outlen = 0;
+    }
+
+    unsigned char cmd = iobuf[0];
+    if (iobuf_len < ioctl_len(cmd)) {
+        return nullptr;
+    }
+
+    switch (cmd) {
+    case IOCTL_SET_FACEDIFF: { // set new facediff value
+        float facediff;
+        bin16::f4b_to_f4(iobuf + 1, 4, &facediff);
+        if (context->fdimension) {
+            context->facediff_full = facediff;
+        } else {
+            context->facediff_half = facediff;
+        }
+    } break;
+
+    case IOCTL_GET_FACEDIFF: { // get current facediff value
+        if (context->fdimension) {
+            bin16::f4_to_f4b(&context->facediff_full, 1, iobuf + 1);
+        } else {
+            bin16::f4_to_f4b(&context->facediff_half, 1, iobuf + 1);
+        }
+    } break;
+
+    case IOCTL_SET_FDIM: { // set fdimension flag
+        if (iobuf[1] == 0x00) {
+            context->fdimension = false;
+        } else if (iobuf[1] == 0x01) {
+            context->fdimension = true;
+        }
+    } break;
+
+    case IOCTL_GET_FDIM: { // get fdimension flag
+        if (context->fdimension) {
+            iobuf[1] = 0x01;
+        } else {
+            iobuf[1] = 0x00;
+        }
+    } break;
+
+    case IOCTL_SET_ECC: { // set QR Code ECC level
+        switch (iobuf[1]) {
+        case 0x00: {
+            context->qrcode_ecc = ECC_LOW;
+        } break;
+        case 0x01: {
+            context->qrcode_ecc = ECC_MEDIUM; // default
+        } break;
+        case 0x02: {
+            context->qrcode_ecc = ECC_QUARTILE;
+        } break;
+        case 0x03: {
+            context->qrcode_ecc = ECC_HIGH;
+        } break;
+        }
+    } break;
+
+    case IOCTL_SET_ACL: {
+        // TODO: Control which field goes to public or private
+        // Make it more flexible later. For now, the next byte
+        // is the ACL. The proper way, I think should follow
+        // that of popular TLV 7bit and use the 8th bit to
+        // describe the next bytes. In this way, when the
+        // number of configurable bits increases can be better
+        // managed.
+        unsigned long long vflags; 
+        unsigned char vflagsbuf[8];
+        for (int i = 0; i < 8; i++) {
+            vflagsbuf[i] = iobuf[1 + i];
+        }
+        std::memcpy(&vflags, vflagsbuf, sizeof(unsigned long long));
+        context->acl.setBits(vflags);
+    } break;
+
+    case IOCTL_SET_CHAINREF: { // attach known chains by reference
+        context->chain_by_reference = iobuf_len > 1 && iobuf[1] == 0x01;
+    } break;
+
+    case IOCTL_SET_COMPRESS: { // compress private region of issued cards
+        context->compress_card = iobuf_len > 1 && iobuf[1] == 0x01;
+    } break;
+    }
+
+    return nullptr;
+}
+
+/**
+* Computes full facial dimension of a face.
+*
+* @param self
+* @param photo The face photo
+* @param photo_len Bytes length of photo
+* @param facearray The float[128] array with 4 bytes per float
+* @return Returns count of detected faces in photo
+*/
+
+MODULE_API int
+idpass_lite_face128d(void* self, char* photo, int photo_len, float* faceArray)
+{
+
+    if (self == nullptr || photo == nullptr || photo_len <= 0
+        || faceArray == nullptr) 
+    {
+        return 0;
+    } 
+    Context* context = (Context*)self;
+    return dlib_api::computeface128d(photo, photo_len, faceArray);
+}
+
+/**
+* Computes full facial dimension of a face.
+*
+* @param self
+* @param photo The face photo
+* @param photo_len Bytes length in photo
+* @param buf The facial dimension float[128] as bytes
+* @return Returns the count of faces detected in photo
+*/
+
+MODULE_API int idpass_lite_face128dbuf(void* self,
+                                       char* photo,
+                                       int photo_len,
+                                       unsigned char* buf)
+{
+    if (self == nullptr || photo == nullptr || photo_len <= 0
+        || buf == nullptr) 
+    {
+        return 0;
+    } 
+    Context* context = (Context*)self;
+    float f4[128];
+    int face_count = dlib_api::computeface128d(photo, photo_len, f4);
+
+    if (face_count == 1) {
+        bin16::f4_to_f4b(f4, 128, buf);
+    }
+
+    return face_count;
+}
+
+/**
+* Computes half facial dimension of a face.
+*
+* @param self
+* @param photo The face photo.
+* @param photo_len Bytes length of photo
+* @param facearray The float[64] with 2 bytes per float
+* @return Returns the count of detected faces in photo
+*/
+
+MODULE_API
+int idpass_lite_face64d(void* self,
+                        char* photo,
+                        int photo_len,
+                        float* facearray)
+{
+    if (self == nullptr || photo == nullptr || photo_len <= 0
+        || facearray == nullptr) 
+    {
+        return 0;
+    } 
+    Context* context = (Context*)self;
+    float fdim[128];
+    int facecount = dlib_api::computeface128d(photo, photo_len, fdim);
+    bin16::f4_to_f2(fdim, 64, facearray);
+    return facecount;
+}
+
+/**
+* Computes half facial dimension of a face.
+*
+* @param self
+* @param photo The face photo.
+* @param photo_len Bytes length of photo
+* @param facearray The float[64] with 2 bytes per float in byte array format
+* @return Returns the count of detected faces in photo
+*/
+
+MODULE_API int idpass_lite_face64dbuf(void* self,
+                                      char* photo,
+                                      int photo_len,
+                                      unsigned char* buf)
+{
+    if (self == nullptr || photo == nullptr || photo_len <= 0
+        || buf == nullptr) 
+    {
+        return 0;
+    } 
+    Context* context = (Context*)self;
+    float f4[128];
+    int face_count = dlib_api::computeface128d(photo, photo_len, f4);
+
+    if (face_count == 1) {
+        bin16::f4_to_f2b(f4, 64, buf);
+    }
+
+    return face_count;
+}
+
+MODULE_API
+int idpass_lite_compare_face_photo(void* self,
+                                   char* face1,
+                                   int face1_len,
+                                   char* face2,
+                                   int face2_len,
+                                   float* fdiff)
+{
+    Context* context = (Context*)self;
+
+    if (face1 == nullptr || face2 == nullptr || face1_len <= 0
+        || face2_len <= 0 || self == nullptr || fdiff == nullptr) {
+        return 3; // invalid params
+    }
+
+    float result = 10.0;
+    float face1Array[128];
+    float face2Array[128];
+
+    if (dlib_api::computeface128d((char*)face1, face1_len, face1Array) != 1) {
+        return 1; // something wrong in face1
+    }
+
+    if (dlib_api::computeface128d((char*)face2, face2_len, face2Array) != 1) {
+        return 2; // something wrong in face2
+    }
+
+    // convert vector representation based on fdim mode of calling context
     if (context->fdimension) {
         result = helper::euclidean_diff(face1Array, face2Array, 128);
     } else {
-        float face1Array_half[64];
-        float face2Array_half[64];
-        bin16::f4_to_f2(face1Array, 64, face1Array_half);
-        bin16::f4_to_f2(face2Array, 64, face2Array_half);
-        result = helper::euclidean_diff(face1Array_half, face2Array_half, 64);
+        float face1Array_half[64];
+        float face2Array_half[64];
+        bin16::f4_to_f2(face1Array, 64, face1Array_half);
+        bin16::f4_to_f2(face2Array, 64, face2Array_half);
+        result = helper::euclidean_diff(face1Array_half, face2Array_half, 64);
+    }
+
+    if (fdiff) {
+        *fdiff = result;
+    }
+
+    return 0; // success or no error
+}
+
+/**
+* Substracts two faces face1 and face2 and stores result inot fdiff
+*
+* @param self
+* @param face1 The first face input
+* @param face1_len Length of face1
+* @param face2 The second face input
+* @param face2_len Length of face2
+* @param fdiff Where to store the computation result
+* @return Returns 0 on success subtraction
+*/
+
+MODULE_API
+int idpass_lite_compare_face_template(unsigned char* face1,
+                                      int face1_len,
+                                      unsigned char* face2,
+                                      int face2_len,
+                                      float* fdiff)
+{
+    if (face1 == nullptr || face1_len <= 0 || face2 == nullptr || 
+        face2_len <= 0 || fdiff == nullptr) 
+    {
+        return 1;
+    }
+
+    float face1Array[128];
+    float face2Array[128];
+    int len = 0;
+
+    if (face1_len == 128 * 4) {
+        bin16::f4b_to_f4(face1, face1_len, face1Array);
+        len = 128;
+    } else if (face1_len == 64 * 2) {
+        bin16::f2b_to_f4(face1, face1_len, face1Array);
+        len = 64;
+    } else {
+        return 1;
+    }
+
+    if (face2_len == 128 * 4) {
+        bin16::f4b_to_f4(face2, face2_len, face2Array);
+        len = 128;
+    } else if (face2_len == 64 * 2) {
+        bin16::f2b_to_f4(face2, face2_len, face2Array);
+        len = 64;
+    } else {
+        return 2;
     }
 
+    float result = helper::euclidean_diff(face1Array, face2Array, len);
     if (fdiff) {
         *fdiff = result;
     }
 
-    return 0; // success or no error
+    return 0;
+}
+
+// Self-signs the public key of skpk into rootCERT
+static bool make_root_certificate(const unsigned char* skpk,
+                                  idpass::Certificate& rootCERT)
+{
+    unsigned char pubkey[crypto_sign_PUBLICKEYBYTES];
+    crypto_sign_ed25519_sk_to_pk(pubkey, skpk);
+    unsigned char signature[crypto_sign_BYTES]; // 64
+
+    if (crypto_sign_detached(signature, nullptr, pubkey, sizeof pubkey, skpk)
+        != 0) {
+        return false;
+    }
+
+    //rootCERT.set_privkey(skpk, skpk_len);
+    rootCERT.set_pubkey(pubkey, crypto_sign_PUBLICKEYBYTES);
+    rootCERT.set_signature(signature, crypto_sign_BYTES);
+    rootCERT.set_issuerkey(pubkey, crypto_sign_PUBLICKEYBYTES);
+    return true;
 }
 
 /**
-* Substracts two faces face1 and face2 and stores result inot fdiff
+* Generate a self-signed certificate with the provided secretkey.
 *
 * @param self
-* @param face1 The first face input
-* @param face1_len Length of face1
-* @param face2 The second face input
-* @param face2_len Length of face2
-* @param fdiff Where to store the computation result
-* @return Returns 0 on success subtraction
+* @param skpk The certificates private key
+* @param skpk_len The bytes length of skpk
+* @param outlen The bytes length of returned self-signed certificate
+* @return Returns a self-sign certificate with the provided private key
+*/
+
+MODULE_API
+unsigned char* idpass_lite_generate_root_certificate(unsigned char* skpk,
+                                                     int skpk_len,
+                                                     int* outlen)
+{
+    if (skpk_len != crypto_sign_SECRETKEYBYTES || skpk == nullptr
+        || outlen == nullptr) {
+        return nullptr;
+    }
+
+    idpass::Certificate rootCERT;
+    if (!make_root_certificate(skpk, rootCERT)) {
+        return nullptr;
+    }
+    int n = rootCERT.ByteSizeLong();
+    *outlen = n;
+    unsigned char* buf = M::NewByteArray(n);
+    rootCERT.SerializeToArray(buf, n);
+
+    return buf;
+}
+
+/**
+* Generate a self-signed certificate into the caller's buffer.
+*
+* @param skpk The certificates private key
+* @param skpk_len The bytes length of skpk
+* @param buf Caller buffer receiving the certificate, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the certificate, or -1 on failure
+*/
+
+MODULE_API
+int idpass_lite_generate_root_certificate_into(unsigned char* skpk,
+                                               int skpk_len,
+                                               unsigned char* buf,
+                                               int buf_len)
+{
+    if (skpk_len != crypto_sign_SECRETKEYBYTES || skpk == nullptr
+        || buf_len < 0) {
+        return -1;
+    }
+
+    idpass::Certificate rootCERT;
+    if (!make_root_certificate(skpk, rootCERT)) {
+        return -1;
+    }
+
+    return serialize_into(rootCERT, buf, buf_len);
+}
+
+// Signs child_pubkey with parent_skpk into intermedCert
+static bool make_child_certificate(const unsigned char* parent_skpk,
+                                   const unsigned char* child_pubkey,
+                                   idpass::Certificate& intermedCert)
+{
+    unsigned char issuerkey[crypto_sign_PUBLICKEYBYTES];
+    unsigned char signature[crypto_sign_BYTES];
+    crypto_sign_ed25519_sk_to_pk(issuerkey, parent_skpk);
+
+    // sign the child's public key
+    if (crypto_sign_detached(signature,
+                             nullptr,
+                             child_pubkey,
+                             crypto_sign_PUBLICKEYBYTES,
+                             parent_skpk)
+        != 0) {
+        return false;
+    }
+
+    intermedCert.set_pubkey(child_pubkey, crypto_sign_PUBLICKEYBYTES);
+    intermedCert.set_signature(signature, crypto_sign_BYTES);
+    intermedCert.set_issuerkey(issuerkey, crypto_sign_PUBLICKEYBYTES);
+    return true;
+}
+
+/**
+* Generate an intermediate certificate with the provided secretkey of signer
+* and public key of the intermediate certificate.
+*
+* @param self
+* @param parent_skpk The private key of the signer
+* @param parent_skpk_len The length bytes of parent_skpk
+* @param child_pubkey The public key of to-be-signed certificate
+* @param child_pubkey_len The bytes length of child_pubkey
+* @param outlen The bytes length of returned signed intermediate certificate
+* @return Returns a signed intermediate certificate
+*/
+
+MODULE_API
+unsigned char*
+idpass_lite_generate_child_certificate(const unsigned char* parent_skpk,
+                                       int parent_skpk_len,
+                                       const unsigned char* child_pubkey,
+                                       int child_pubkey_len,
+                                       int* outlen)
+{
+    // TODO root vs intermed check???
+    if (parent_skpk_len != crypto_sign_SECRETKEYBYTES || parent_skpk == nullptr
+        || child_pubkey_len != crypto_sign_PUBLICKEYBYTES
+        || child_pubkey == nullptr || outlen == nullptr) {
+        return nullptr;
+    }
+
+    idpass::Certificate intermedCert;
+    if (!make_child_certificate(parent_skpk, child_pubkey, intermedCert)) {
+        return nullptr;
+    }
+
+    int n = intermedCert.ByteSizeLong();
+    unsigned char* buf = M::NewByteArray(n);
+    intermedCert.SerializeToArray(buf, n);
+
+    *outlen = n;
+    return buf;
+}
+
+/**
+* Generate an intermediate certificate into the caller's buffer.
+*
+* @param parent_skpk The private key of the signer
+* @param parent_skpk_len The length bytes of parent_skpk
+* @param child_pubkey The public key of to-be-signed certificate
+* @param child_pubkey_len The bytes length of child_pubkey
+* @param buf Caller buffer receiving the certificate, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the certificate, or -1 on failure
+*/
+
+MODULE_API
+int idpass_lite_generate_child_certificate_into(
+    const unsigned char* parent_skpk,
+    int parent_skpk_len,
+    const unsigned char* child_pubkey,
+    int child_pubkey_len,
+    unsigned char* buf,
+    int buf_len)
+{
+    if (parent_skpk_len != crypto_sign_SECRETKEYBYTES || parent_skpk == nullptr
+        || child_pubkey_len != crypto_sign_PUBLICKEYBYTES
+        || child_pubkey == nullptr || buf_len < 0) {
+        return -1;
+    }
+
+    idpass::Certificate intermedCert;
+    if (!make_child_certificate(parent_skpk, child_pubkey, intermedCert)) {
+        return -1;
+    }
+
+    return serialize_into(intermedCert, buf, buf_len);
+}
+
+
+/**
+* Addes the public key into revocation list.
+*
+* @param self
+* @param pubkey The public key to be revocated
+* @param pubkey_len Length bytes of pubkey
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_add_revoked_key(unsigned char* pubkey, int pubkey_len)
+{
+    if (pubkey == nullptr || pubkey_len != crypto_sign_PUBLICKEYBYTES) {
+        return 1;
+    }
+
+    return idpass_lite_add_revoked_keys(pubkey, pubkey_len);
+}
+
+/**
+* Adds a packed array of public keys into the revocation list. The
+* revocation list is copied once per call, so prefer this over
+* repeated idpass_lite_add_revoked_key calls when loading many keys.
+*
+* @param pubkeys Concatenated 32 bytes ed25519 public keys
+* @param pubkeys_len Length bytes of pubkeys, a multiple of 32
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_add_revoked_keys(unsigned char* pubkeys, int pubkeys_len)
+{
+    if (pubkeys == nullptr || pubkeys_len <= 0
+        || pubkeys_len % crypto_sign_PUBLICKEYBYTES != 0) {
+        return 1;
+    }
+
+    int n = pubkeys_len / crypto_sign_PUBLICKEYBYTES;
+
+    std::lock_guard<std::mutex> guard(g_mutex);
+
+    std::shared_ptr<const helper::KeyHashSet> current
+        = std::atomic_load(&g_revokedKeys);
+
+    std::shared_ptr<helper::KeyHashSet> next
+        = current ? std::make_shared<helper::KeyHashSet>(*current)
+                  : std::make_shared<helper::KeyHashSet>();
+
+    next->reserve(next->size() + n);
+    for (int i = 0; i < n; i++) {
+        next->insert(pubkeys + i * crypto_sign_PUBLICKEYBYTES);
+    }
+
+    std::atomic_store(&g_revokedKeys,
+                      std::shared_ptr<const helper::KeyHashSet>(next));
+    g_revocationEpoch++;
+
+    return 0;
+}
+
+/**
+* Writes a sorted, integrity-hashed revocation store file from a packed
+* array of public keys, replacing any existing file.
+*
+* @param filename The revocation store file, REVOKED_KEYS if nullptr
+* @param pubkeys Concatenated 32 bytes ed25519 public keys
+* @param pubkeys_len Length bytes of pubkeys, a multiple of 32
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_write_revoked_keys(const char* filename,
+                                   unsigned char* pubkeys,
+                                   int pubkeys_len)
+{
+    if (pubkeys == nullptr || pubkeys_len < 0
+        || pubkeys_len % crypto_sign_PUBLICKEYBYTES != 0) {
+        return 1;
+    }
+
+    if (filename == nullptr) {
+        filename = REVOKED_KEYS;
+    }
+
+    int n = pubkeys_len / crypto_sign_PUBLICKEYBYTES;
+    std::vector<std::array<unsigned char, crypto_sign_PUBLICKEYBYTES>> keys(n);
+    for (int i = 0; i < n; i++) {
+        std::memcpy(keys[i].data(),
+                    pubkeys + i * crypto_sign_PUBLICKEYBYTES,
+                    crypto_sign_PUBLICKEYBYTES);
+    }
+
+    return helper::write_revocation_store(filename, keys) ? 0 : 2;
+}
+
+/**
+* Appends public keys to the delta file of a revocation store and adds
+* them into the in-process revocation list. The delta is folded into
+* the store by idpass_lite_compact_revoked_keys.
+*
+* @param filename The revocation store file, REVOKED_KEYS if nullptr
+* @param pubkeys Concatenated 32 bytes ed25519 public keys
+* @param pubkeys_len Length bytes of pubkeys, a multiple of 32
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_append_revoked_keys(const char* filename,
+                                    unsigned char* pubkeys,
+                                    int pubkeys_len)
+{
+    if (pubkeys == nullptr || pubkeys_len <= 0
+        || pubkeys_len % crypto_sign_PUBLICKEYBYTES != 0) {
+        return 1;
+    }
+
+    if (filename == nullptr) {
+        filename = REVOKED_KEYS;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(g_mutex);
+        std::ofstream f(std::string(filename) + ".delta",
+                        std::ios::binary | std::ios::app);
+        f.write(reinterpret_cast<const char*>(pubkeys), pubkeys_len);
+        f.close();
+        if (!f) {
+            return 2;
+        }
+    }
+
+    return idpass_lite_add_revoked_keys(pubkeys, pubkeys_len);
+}
+
+/**
+* Memory-maps a revocation store file and checks its integrity hash.
+* Keys from its delta file are added into the in-process revocation
+* list. The store file is left as is, see
+* idpass_lite_compact_revoked_keys.
+*
+* @param filename The revocation store file, REVOKED_KEYS if nullptr
+* @return Returns 0 on success, 1 if neither the store nor its delta
+* exists, 2 if the store fails the integrity check
 */
 
 MODULE_API
-int idpass_lite_compare_face_template(unsigned char* face1,
-                                      int face1_len,
-                                      unsigned char* face2,
-                                      int face2_len,
-                                      float* fdiff)
+int idpass_lite_load_revoked_keys(const char* filename)
 {
-    if (face1 == nullptr || face1_len <= 0 || face2 == nullptr || 
-        face2_len <= 0 || fdiff == nullptr) 
-    {
-        return 1;
+    if (filename == nullptr) {
+        filename = REVOKED_KEYS;
     }
 
-    float face1Array[128];
-    float face2Array[128];
-    int len = 0;
+    std::ifstream exists(filename);
+    bool have_store = static_cast<bool>(exists);
+    exists.close();
 
-    if (face1_len == 128 * 4) {
-        bin16::f4b_to_f4(face1, face1_len, face1Array);
-        len = 128;
-    } else if (face1_len == 64 * 2) {
-        bin16::f2b_to_f4(face1, face1_len, face1Array);
-        len = 64;
-    } else {
+    std::shared_ptr<helper::RevocationStore> store
+        = std::make_shared<helper::RevocationStore>();
+
+    if (have_store && !store->open(filename)) {
+        return 2;
+    }
+
+    std::vector<unsigned char> delta;
+    bool have_delta = helper::read_revocation_delta(filename, delta);
+
+    if (!have_store && !have_delta) {
         return 1;
     }
 
-    if (face2_len == 128 * 4) {
-        bin16::f4b_to_f4(face2, face2_len, face2Array);
-        len = 128;
-    } else if (face2_len == 64 * 2) {
-        bin16::f2b_to_f4(face2, face2_len, face2Array);
-        len = 64;
-    } else {
-        return 2;
+    if (delta.size() > 0) {
+        idpass_lite_add_revoked_keys(delta.data(), delta.size());
     }
 
-    float result = helper::euclidean_diff(face1Array, face2Array, len);
-    if (fdiff) {
-        *fdiff = result;
+    if (have_store) {
+        std::atomic_store(&g_revokedStore,
+                          std::shared_ptr<const helper::RevocationStore>(store));
+        g_revocationEpoch++;
     }
 
     return 0;
 }
 
 /**
-* Generate a self-signed certificate with the provided secretkey.
+* Merges the delta file of a revocation store into the store file and
+* loads the result. As it sorts and rewrites the whole store, it is
+* meant for a background thread or a quiet time, so that loads stay a
+* mapping of the store plus a read of a short delta. Keys appended
+* during the merge go to a new delta.
 *
-* @param self
-* @param skpk The certificates private key
-* @param skpk_len The bytes length of skpk
-* @param outlen The bytes length of returned self-signed certificate
-* @return Returns a self-sign certificate with the provided private key
+* @param filename The revocation store file, REVOKED_KEYS if nullptr
+* @return Returns 0 on success, 1 if there is no delta to merge, 2 if
+* the merge fails
 */
 
 MODULE_API
-unsigned char* idpass_lite_generate_root_certificate(unsigned char* skpk,
-                                                     int skpk_len,
-                                                     int* outlen)
+int idpass_lite_compact_revoked_keys(const char* filename)
 {
-    if (skpk_len != crypto_sign_SECRETKEYBYTES || skpk == nullptr
-        || outlen == nullptr) {
-        return nullptr;
+    if (filename == nullptr) {
+        filename = REVOKED_KEYS;
     }
 
-    unsigned char pubkey[crypto_sign_PUBLICKEYBYTES];
-    crypto_sign_ed25519_sk_to_pk(pubkey, skpk);
-    unsigned char signature[crypto_sign_BYTES]; // 64
-
-    if (crypto_sign_detached(signature, nullptr, pubkey, sizeof pubkey, skpk)
-        != 0) {
-        return nullptr;
+    std::vector<unsigned char> delta;
+    if (!helper::read_revocation_delta(filename, delta)) {
+        return 1;
     }
 
-    idpass::Certificate rootCERT;
-    //rootCERT.set_privkey(skpk, skpk_len);
-    rootCERT.set_pubkey(pubkey, crypto_sign_PUBLICKEYBYTES);
-    rootCERT.set_signature(signature, crypto_sign_BYTES);
-    rootCERT.set_issuerkey(pubkey, crypto_sign_PUBLICKEYBYTES);
-    int n = rootCERT.ByteSizeLong();
-    *outlen = n;
-    unsigned char* buf = M::NewByteArray(n);
-    rootCERT.SerializeToArray(buf, n);
+    // a delta that fails to merge is merged again by the next call
+    if (!helper::merge_revocation_delta(filename, g_mutex)) {
+        return 2;
+    }
 
-    return buf;
+    return idpass_lite_load_revoked_keys(filename) == 0 ? 0 : 2;
 }
 
 /**
-* Generate an intermediate certificate with the provided secretkey of signer
-* and public key of the intermediate certificate.
+* Builds a serialized revocation filter blob from a packed array of
+* public keys, for distribution to readers that cannot hold the full
+* revocation list in memory.
 *
-* @param self
-* @param parent_skpk The private key of the signer
-* @param parent_skpk_len The length bytes of parent_skpk
-* @param child_pubkey The public key of to-be-signed certificate
-* @param child_pubkey_len The bytes length of child_pubkey
-* @param outlen The bytes length of returned signed intermediate certificate
-* @return Returns a signed intermediate certificate
+* @param self Calling context
+* @param outlen Length bytes of the returned blob
+* @param pubkeys Concatenated 32 bytes ed25519 public keys
+* @param pubkeys_len Length bytes of pubkeys, a multiple of 32
+* @param fpr Target false positive rate, between 0 and 1
+* @return Returns the filter blob or nullptr on error
 */
 
 MODULE_API
-unsigned char*
-idpass_lite_generate_child_certificate(const unsigned char* parent_skpk,
-                                       int parent_skpk_len,
-                                       const unsigned char* child_pubkey,
-                                       int child_pubkey_len,
-                                       int* outlen)
+unsigned char* idpass_lite_build_revocation_filter(void* self,
+                                                   int* outlen,
+                                                   unsigned char* pubkeys,
+                                                   int pubkeys_len,
+                                                   double fpr)
 {
-    // TODO root vs intermed check???
-    if (parent_skpk_len != crypto_sign_SECRETKEYBYTES || parent_skpk == nullptr
-        || child_pubkey_len != crypto_sign_PUBLICKEYBYTES
-        || child_pubkey == nullptr || outlen == nullptr) {
+    if (self == nullptr || outlen == nullptr || pubkeys == nullptr
+        || pubkeys_len <= 0 || pubkeys_len % crypto_sign_PUBLICKEYBYTES != 0) {
         return nullptr;
     }
+    Context* context = (Context*)self;
+    *outlen = 0;
 
-    unsigned char issuerkey[crypto_sign_PUBLICKEYBYTES];
-    unsigned char signature[crypto_sign_BYTES];
-    crypto_sign_ed25519_sk_to_pk(issuerkey, parent_skpk);
-
-    // sign the child's public key
-    if (crypto_sign_detached(signature,
-                             nullptr,
-                             child_pubkey,
-                             crypto_sign_PUBLICKEYBYTES,
-                             parent_skpk)
-        != 0) {
+    helper::RevocationFilter filter;
+    if (!filter.build(
+            pubkeys, pubkeys_len / crypto_sign_PUBLICKEYBYTES, fpr)) {
         return nullptr;
     }
 
-    idpass::Certificate intermedCert;
-    intermedCert.set_pubkey(child_pubkey, crypto_sign_PUBLICKEYBYTES);
-    intermedCert.set_signature(signature, crypto_sign_BYTES);
-    intermedCert.set_issuerkey(issuerkey, crypto_sign_PUBLICKEYBYTES);
-
-    int n = intermedCert.ByteSizeLong();
-    unsigned char* buf = M::NewByteArray(n);
-    intermedCert.SerializeToArray(buf, n);
+    std::vector<unsigned char> blob;
+    filter.serialize(blob);
 
-    *outlen = n;
+    unsigned char* buf = context->NewByteArray(blob.size());
+    if (buf == nullptr) {
+        return nullptr;
+    }
+    std::memcpy(buf, blob.data(), blob.size());
+    *outlen = blob.size();
     return buf;
 }
 
-
 /**
-* Addes the public key into revocation list.
+* Loads a revocation filter blob built by
+* idpass_lite_build_revocation_filter. Certificate chain checks consult
+* the filter first and confirm its hits against the revocation store
+* loaded by idpass_lite_load_revoked_keys. The filter is bypassed while
+* the loaded store holds other keys than it was built from. A nullptr
+* blob unloads the current filter.
 *
-* @param self
-* @param pubkey The public key to be revocated
-* @param pubkey_len Length bytes of pubkey
+* @param blob The filter blob
+* @param blob_len Length bytes of blob
 * @return Returns 0 on success
 */
 
 MODULE_API
-int idpass_lite_add_revoked_key(unsigned char* pubkey, int pubkey_len)
+int idpass_lite_load_revocation_filter(unsigned char* blob, int blob_len)
 {
-    if (pubkey == nullptr || pubkey_len != crypto_sign_PUBLICKEYBYTES) {
+    if (blob == nullptr) {
+        std::atomic_store(&g_revokedFilter,
+                          std::shared_ptr<const helper::RevocationFilter>());
+        g_revocationEpoch++;
+        return 0;
+    }
+
+    if (blob_len <= 0) {
         return 1;
     }
 
-    std::lock_guard<std::mutex> guard(g_mutex);
+    std::shared_ptr<helper::RevocationFilter> filter
+        = std::make_shared<helper::RevocationFilter>();
 
-    std::array<unsigned char, 32> revoked_key;
-    std::copy(pubkey, pubkey + pubkey_len, std::begin(revoked_key));
-    g_revokedKeys.push_back(revoked_key);
+    if (!filter->load(blob, blob_len)) {
+        return 2;
+    }
 
+    std::atomic_store(&g_revokedFilter,
+                      std::shared_ptr<const helper::RevocationFilter>(filter));
+    g_revocationEpoch++;
     return 0;
 }
 
@@ -2047,6 +4057,227 @@ MODULE_API int idpass_lite_saveToBitmap(void* self,
     return qrcode_saveToBitmap(data, data_len, bitmapfile, context->qrcode_ecc);
 }
 
+// Count of arguments an operation of idpass_lite_execute takes, or -1
+// if it is unknown
+static int execute_arity(api::Operation::Op op)
+{
+    switch (op) {
+    case api::Operation::NOP:
+        return 0;
+    case api::Operation::IOCTL:
+    case api::Operation::CREATE_CARD:
+    case api::Operation::QRPIXEL:
+        return 1;
+    case api::Operation::VERIFY_CARD_WITH_PIN:
+    case api::Operation::VERIFY_CARD_WITH_FACE:
+    case api::Operation::SIGN_WITH_CARD:
+    case api::Operation::ENCRYPT_WITH_CARD:
+    case api::Operation::DECRYPT_WITH_CARD:
+        return 2;
+    case api::Operation::VERIFY_WITH_CARD:
+        return 3;
+    default:
+        return -1;
+    }
+}
+
+// Runs one operation of idpass_lite_execute, whose output, if any, is a
+// byte array of the context
+static int execute_op(Context* context,
+                      const api::Operation& op,
+                      std::vector<std::pair<unsigned char*, int>>& args,
+                      unsigned char*& out,
+                      int& outlen,
+                      int& qrsize)
+{
+    if ((int)args.size() != execute_arity(op.op())) {
+        return EXECUTE_BADARGS;
+    }
+
+    switch (op.op()) {
+    case api::Operation::NOP:
+        return EXECUTE_OK;
+
+    case api::Operation::IOCTL:
+        // Gets are answered in place, so into a copy
+        if (args[0].second <= 0
+            || args[0].second < ioctl_len(args[0].first[0])) {
+            return EXECUTE_BADARGS;
+        }
+        out = context->NewByteArray(args[0].second);
+        std::memcpy(out, args[0].first, args[0].second);
+        outlen = args[0].second;
+        idpass_lite_ioctl(context, nullptr, out, outlen);
+        return EXECUTE_OK;
+
+    case api::Operation::CREATE_CARD:
+        out = idpass_lite_create_card_with_face(
+            context, &outlen, args[0].first, args[0].second);
+        break;
+
+    case api::Operation::VERIFY_CARD_WITH_PIN: {
+        std::string pin((const char*)args[1].first, args[1].second);
+        out = idpass_lite_verify_card_with_pin(
+            context, &outlen, args[0].first, args[0].second, pin.c_str());
+    } break;
+
+    case api::Operation::VERIFY_CARD_WITH_FACE:
+        out = idpass_lite_verify_card_with_face(context,
+                                                &outlen,
+                                                args[0].first,
+                                                args[0].second,
+                                                (char*)args[1].first,
+                                                args[1].second);
+        break;
+
+    case api::Operation::QRPIXEL:
+        out = idpass_lite_qrpixel2(
+            context, &outlen, args[0].first, args[0].second, &qrsize);
+        break;
+
+    case api::Operation::SIGN_WITH_CARD:
+        out = context->NewByteArray(crypto_sign_BYTES);
+        outlen = crypto_sign_BYTES;
+        if (idpass_lite_sign_with_card(context,
+                                       out,
+                                       outlen,
+                                       args[0].first,
+                                       args[0].second,
+                                       args[1].first,
+                                       args[1].second)
+            != 0) {
+            context->ReleaseByteArray(out);
+            out = nullptr;
+        }
+        break;
+
+    case api::Operation::ENCRYPT_WITH_CARD:
+        out = idpass_lite_encrypt_with_card(context,
+                                            &outlen,
+                                            args[0].first,
+                                            args[0].second,
+                                            args[1].first,
+                                            args[1].second);
+        break;
+
+    case api::Operation::DECRYPT_WITH_CARD:
+        out = idpass_lite_decrypt_with_card(context,
+                                            &outlen,
+                                            args[0].first,
+                                            args[0].second,
+                                            args[1].first,
+                                            args[1].second);
+        break;
+
+    case api::Operation::VERIFY_WITH_CARD:
+        return idpass_lite_verify_with_card(context,
+                                            args[0].first,
+                                            args[0].second,
+                                            args[1].first,
+                                            args[1].second,
+                                            args[2].first,
+                                            args[2].second)
+                       == 0
+                   ? EXECUTE_OK
+                   : EXECUTE_FAILED;
+
+    default:
+        return EXECUTE_BADARGS;
+    }
+
+    if (out == nullptr) {
+        outlen = 0;
+        return EXECUTE_FAILED;
+    }
+    return EXECUTE_OK;
+}
+
+/**
+* Runs a batch of operations, each able to use an earlier one's output.
+*
+* @param self Calling context
+* @param *outlen The bytes length of returned data
+* @param ops_buf The serialized api::Operations
+* @param ops_buf_len The bytes length of ops_buf
+* @return The serialized api::Results, or null if ops_buf cannot be parsed
+*/
+
+MODULE_API unsigned char* idpass_lite_execute(void* self,
+                                              int* outlen,
+                                              unsigned char* ops_buf,
+                                              int ops_buf_len)
+{
+    if (self == nullptr || outlen == nullptr || ops_buf == nullptr
+        || ops_buf_len <= 0) {
+        return nullptr;
+    }
+    Context* context = (Context*)self;
+    *outlen = 0;
+
+    api::Operations ops;
+    if (!ops.ParseFromArray(ops_buf, ops_buf_len)) {
+        return nullptr;
+    }
+
+    // Outputs stay in the context byte arrays until the batch is done
+    struct Output {
+        unsigned char* buf;
+        int len;
+        int status;
+    };
+    std::vector<Output> outputs;
+    outputs.reserve(ops.ops_size());
+    api::Results results;
+
+    for (int i = 0; i < ops.ops_size(); i++) {
+        const api::Operation& op = ops.ops(i);
+        Output output = {nullptr, 0, EXECUTE_OK};
+        int qrsize = 0;
+
+        std::vector<std::pair<unsigned char*, int>> args;
+        for (const api::Operation::Arg& arg : op.args()) {
+            if (arg.value_case() == api::Operation::Arg::kRef) {
+                int ref = arg.ref();
+                if (ref < 0 || ref >= i || outputs[ref].status != EXECUTE_OK) {
+                    output.status = EXECUTE_BADARGS;
+                    break;
+                }
+                args.emplace_back(outputs[ref].buf, outputs[ref].len);
+            } else {
+                args.emplace_back((unsigned char*)arg.data().data(),
+                                  arg.data().size());
+            }
+        }
+
+        if (output.status == EXECUTE_OK) {
+            output.status
+                = execute_op(context, op, args, output.buf, output.len, qrsize);
+        }
+        outputs.push_back(output);
+
+        api::Result* result = results.add_results();
+        result->set_status(output.status);
+        result->set_qrsize(qrsize);
+        if (!op.discard() && output.buf != nullptr) {
+            result->set_data(output.buf, output.len);
+        }
+    }
+
+    for (Output& output : outputs) {
+        context->ReleaseByteArray(output.buf);
+    }
+
+    int n = results.ByteSizeLong();
+    unsigned char* buf = context->NewByteArray(n > 0 ? n : 1);
+    if (!results.SerializeToArray(buf, n)) {
+        context->ReleaseByteArray(buf);
+        return nullptr;
+    }
+
+    *outlen = n;
+    return buf;
+}
+
 /**
 * Experimential test of length-prefixed returned blob
 *
@@ -2091,34 +4322,18 @@ int idpass_lite_compute_hash(unsigned char* data,
     return crypto_generichash(hash, hash_len, data, data_len, NULL, 0);
 }
 
-/**
- * Merges two CardDetails into one.
- *
- * Workable in protobuf Java, but Android uses protobuf-lite which does not have
- * reflection. Without reflection, a long series of if-check in Java would
- * clutter the code. Like checking if a string has zero length, int32 is 0, if
- * sub-message is present.
- */
-
-MODULE_API
-unsigned char* idpass_lite_merge_CardDetails(unsigned char* d1buf,
-                                             int d1buf_len,
-                                             unsigned char* d2buf,
-                                             int d2buf_len,
-                                             int* outlen)
+// Parses d2buf into merged, overridden by the fields set in d1buf
+static bool merge_details(const unsigned char* d1buf,
+                          int d1buf_len,
+                          const unsigned char* d2buf,
+                          int d2buf_len,
+                          idpass::CardDetails& merged)
 {
-    if (d1buf == nullptr || d2buf == nullptr || 
-        (d1buf_len == 0 && d2buf_len == 0) || d1buf_len < 0 || d2buf_len < 0 
-        || outlen == nullptr) {
-        return nullptr;
-    }
-
     idpass::CardDetails d1;
-    idpass::CardDetails merged;
 
     if (!d1.ParseFromArray(d1buf, d1buf_len)
         || !merged.ParseFromArray(d2buf, d2buf_len)) {
-        return nullptr;
+        return false;
     }
     
     const google::protobuf::Descriptor* pDesc = d1.descriptor();
@@ -2173,6 +4388,36 @@ unsigned char* idpass_lite_merge_CardDetails(unsigned char* d1buf,
         }
     }
 
+    return true;
+}
+
+/**
+ * Merges two CardDetails into one.
+ *
+ * Workable in protobuf Java, but Android uses protobuf-lite which does not have
+ * reflection. Without reflection, a long series of if-check in Java would
+ * clutter the code. Like checking if a string has zero length, int32 is 0, if
+ * sub-message is present.
+ */
+
+MODULE_API
+unsigned char* idpass_lite_merge_CardDetails(unsigned char* d1buf,
+                                             int d1buf_len,
+                                             unsigned char* d2buf,
+                                             int d2buf_len,
+                                             int* outlen)
+{
+    if (d1buf == nullptr || d2buf == nullptr || 
+        (d1buf_len == 0 && d2buf_len == 0) || d1buf_len < 0 || d2buf_len < 0 
+        || outlen == nullptr) {
+        return nullptr;
+    }
+
+    idpass::CardDetails merged;
+    if (!merge_details(d1buf, d1buf_len, d2buf, d2buf_len, merged)) {
+        return nullptr;
+    }
+
     int buf_len = merged.ByteSizeLong();
     unsigned char* buf = M::NewByteArray(buf_len);
     *outlen = buf_len;
@@ -2185,6 +4430,41 @@ unsigned char* idpass_lite_merge_CardDetails(unsigned char* d1buf,
     return buf;
 }
 
+/**
+ * Merges two CardDetails into one, into the caller's buffer.
+ *
+ * @param d1buf The CardDetails whose set fields win
+ * @param d1buf_len The bytes length of d1buf
+ * @param d2buf The CardDetails to merge into
+ * @param d2buf_len The bytes length of d2buf
+ * @param buf Caller buffer receiving the merged CardDetails, or null
+ * @param buf_len The bytes length of buf
+ * @return Returns the bytes length of the merged CardDetails, or -1 on
+ * invalid input
+ */
+
+MODULE_API
+int idpass_lite_merge_CardDetails_into(unsigned char* d1buf,
+                                       int d1buf_len,
+                                       unsigned char* d2buf,
+                                       int d2buf_len,
+                                       unsigned char* buf,
+                                       int buf_len)
+{
+    if (d1buf == nullptr || d2buf == nullptr
+        || (d1buf_len == 0 && d2buf_len == 0) || d1buf_len < 0
+        || d2buf_len < 0 || buf_len < 0) {
+        return -1;
+    }
+
+    idpass::CardDetails merged;
+    if (!merge_details(d1buf, d1buf_len, d2buf, d2buf_len, merged)) {
+        return -1;
+    }
+
+    return serialize_into(merged, buf, buf_len);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -82,10 +82,41 @@
 #define IOCTL_GET_FDIM 0x03
 #define IOCTL_SET_ECC 0x04
 #define IOCTL_SET_ACL 0x05
+#define IOCTL_SET_CHAINREF 0x06
+#define IOCTL_SET_COMPRESS 0x07
+
+/**
+* Image formats of idpass_lite_qrrender. QRRENDER_PNG is deflated and
+* QRRENDER_PNG_STORED is not compressed, both are 1 bit grayscale.
+*/
+
+#define QRRENDER_PBM 0x00
+#define QRRENDER_PNG 0x01
+#define QRRENDER_PNG_STORED 0x02
+#define QRRENDER_SVG 0x03
 
 #define ROOTCA_LEN 160
 #define INTERMEDCA_LEN 128
 
+/**
+* Signature mode tags. Signatures produced by the streaming sign
+* functions are prefixed with a one byte mode tag, so that a prehashed
+* Ed25519ph signature is never confused with a pure Ed25519 signature.
+*/
+
+#define SIGMODE_ED25519PH 0x01
+#define SIGNATURE_ED25519PH_LEN 65
+
+/**
+* Status of each operation run by idpass_lite_execute. EXECUTE_BADARGS
+* is also given to an operation whose argument refers to a later or
+* failed operation.
+*/
+
+#define EXECUTE_OK 0
+#define EXECUTE_FAILED 1
+#define EXECUTE_BADARGS 2
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -107,6 +138,40 @@ int idpass_lite_add_certificates(void* self,
                                  unsigned char* certs_buf,
                                  int certs_buf_len);
 
+/**
+* Preloads a certificate chain so that cards carrying it by reference
+* can be verified. An issuing context with IOCTL_SET_CHAINREF set
+* attaches its chain by reference only if the chain was preloaded here,
+* otherwise the full chain is embedded in the card.
+*
+* @param self Calling context
+* @param certs_buf The serialized api::Certificates chain
+* @param certs_buf_len Length bytes of certs_buf
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_add_known_chain(void* self,
+                                unsigned char* certs_buf,
+                                int certs_buf_len);
+
+/**
+* Sets a preset dictionary, trained on representative CardDetails, for
+* compressing the private region of cards issued with IOCTL_SET_COMPRESS.
+* The dictionary is also registered for decoding, so readers of such
+* cards must set the same dictionary. The private region is not
+* compressed until a dictionary is set.
+*
+* @param self Calling context
+* @param dict The dictionary bytes
+* @param dict_len Length bytes of dict
+* @return Returns 0 on success, or 2 if the dictionary id collides with
+* a different dictionary already set
+*/
+
+MODULE_API
+int idpass_lite_set_dictionary(void* self, unsigned char* dict, int dict_len);
+
 /**
 * Verifies the fullcard's attached certificate against the root
 * certificate configured in the context. Returns 0 if the
@@ -130,10 +195,31 @@ int idpass_lite_verify_card_signature(void* self,
                                       unsigned char* fullcard,
                                       int fullcard_len, int skipcheckcert);
 
+/**
+* Verifies the signature of many fullcards at once. The cards are
+* spread across a pool of threads and each one gets the same check
+* as idpass_lite_verify_card_signature.
+*
+* @param self Calling context
+* @param outlen The count of cards, which is the bytes length of the result
+* @param cards_buf The fullcards, each prefixed by its 4 bytes length
+* @param cards_buf_len The bytes length of cards_buf
+* @param skipcheckcert Same as in idpass_lite_verify_card_signature
+* @return Returns one status byte per card, 0 if the card verifies
+*/
+
+MODULE_API
+unsigned char* idpass_lite_verify_card_signatures_batch(void* self,
+                                                        int* outlen,
+                                                        unsigned char* cards_buf,
+                                                        int cards_buf_len,
+                                                        int skipcheckcert);
+
 /**
 * A generic function to adjust settings of the calling context.
 * It consist of a sub-command prefix by IOCTL_* followed by 
-* command-specific parameters. 
+* command-specific parameters. A command shorter than its parameters
+* is ignored.
 *
 * @param self Calling context
 * @param outlen The count of bytes returned
@@ -190,6 +276,31 @@ unsigned char* idpass_lite_create_card_with_face(void* self,
                                                  unsigned char* ident_buf,
                                                  int ident_buf_len);
 
+/**
+* Issues a QR code ID as does idpass_lite_create_card_with_face, but
+* serializes it into the caller's buffer rather than one to be freed
+* with idpass_lite_freemem. Nothing is written unless buf holds the
+* returned length. Every call issues a new card, with its own key and
+* time of creation, whose length can differ by a few bytes from that of
+* an earlier call, so a buffer sized by a first call with a null buf
+* may still come up short: pass a generous buffer and retry with the
+* returned length when it does not fit.
+*
+* @param self Calling context
+* @param ident_buf The personal details of the registered identity
+* @param ident_buf_len Bytes length of ident_buf
+* @param buf Caller buffer receiving the QR code ID, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the QR code ID, or -1 on failure
+*/
+
+MODULE_API
+int idpass_lite_create_card_with_face_into(void* self,
+                                           unsigned char* ident_buf,
+                                           int ident_buf_len,
+                                           unsigned char* buf,
+                                           int buf_len);
+
 /**
 * Verify user's QR code ID against a matching photo template.
 *
@@ -210,6 +321,32 @@ idpass_lite_verify_card_with_face_template(void* self,
                                   int encrypted_card_len,
                                   unsigned char* photo,
                                   int photo_len);
+
+/**
+* Same as idpass_lite_verify_card_with_face_template, with the
+* CardDetails written into the caller's buffer if it holds the returned
+* length. A call with a buffer too small, or null, still goes through
+* the whole verification, so size buf for the largest expected details.
+*
+* @param self Calling context
+* @param encrypted_card The user's QR code ID
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param photo The ID owner's photo capture template
+* @param photo_len Length of bytes of photo template
+* @param buf Caller buffer receiving the CardDetails, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the CardDetails, or -1 if there is
+* no facial match
+*/
+
+MODULE_API
+int idpass_lite_verify_card_with_face_template_into(void* self,
+                                                    unsigned char* encrypted_card,
+                                                    int encrypted_card_len,
+                                                    unsigned char* photo,
+                                                    int photo_len,
+                                                    unsigned char* buf,
+                                                    int buf_len);
                                   
 /**
 * Verify user's QR code ID against a matching photo.
@@ -230,6 +367,32 @@ unsigned char* idpass_lite_verify_card_with_face(void* self,
                                                  int encrypted_card_len,
                                                  char* photo,
                                                  int photo_len);
+
+/**
+* Same as idpass_lite_verify_card_with_face, with the CardDetails
+* written into the caller's buffer if it holds the returned length.
+* As the face is computed again on every call, a first call with a null
+* buf to learn the length doubles the cost of a verification.
+*
+* @param self Calling context
+* @param encrypted_card The user's QR code ID
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param photo The ID owner's photo capture
+* @param photo_len Length of bytes of photo
+* @param buf Caller buffer receiving the CardDetails, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the CardDetails, or -1 if there is
+* no facial match
+*/
+
+MODULE_API
+int idpass_lite_verify_card_with_face_into(void* self,
+                                           unsigned char* encrypted_card,
+                                           int encrypted_card_len,
+                                           char* photo,
+                                           int photo_len,
+                                           unsigned char* buf,
+                                           int buf_len);
 /**
 * Verify user's QR code ID against a matching pin.
 *
@@ -247,6 +410,28 @@ unsigned char* idpass_lite_verify_card_with_pin(void* self,
                                                 unsigned char* encrypted_card,
                                                 int encrypted_card_len,
                                                 const char* pin);
+
+/**
+* Same as idpass_lite_verify_card_with_pin, with the CardDetails
+* written into the caller's buffer if it holds the returned length.
+*
+* @param self Calling context
+* @param encrypted_card The user's QR code ID
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param pin The ID owner's secret pin code
+* @param buf Caller buffer receiving the CardDetails, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the CardDetails, or -1 if there is
+* no pin match
+*/
+
+MODULE_API
+int idpass_lite_verify_card_with_pin_into(void* self,
+                                          unsigned char* encrypted_card,
+                                          int encrypted_card_len,
+                                          const char* pin,
+                                          unsigned char* buf,
+                                          int buf_len);
 /**
 * Signs data with user's QR code ID. 
 *
@@ -267,6 +452,128 @@ int idpass_lite_sign_with_card(void* self,
                                int encrypted_card_len,
                                unsigned char* data,
                                int data_len);
+
+/**
+* Signs many messages with user's QR code ID. The card is decrypted
+* and verified only once for the whole batch, and large batches are
+* signed across threads.
+*
+* @param self Calling context
+* @param outlen Bytes length of returned signatures
+* @param encrypted_card User's QR code ID
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param msgs The messages, each prefixed by its 4 bytes length
+* @param msgs_len Bytes length of msgs
+* @return Returns the 64 bytes signatures in the order of msgs
+*/
+
+MODULE_API
+unsigned char* idpass_lite_sign_many_with_card(void* self,
+                                               int* outlen,
+                                               unsigned char* encrypted_card,
+                                               int encrypted_card_len,
+                                               unsigned char* msgs,
+                                               int msgs_len);
+
+/**
+* Starts an incremental Ed25519ph signing of arbitrarily large data
+* with user's QR code ID. The card is decrypted and verified once
+* here. Feed the data with idpass_lite_sign_update and obtain the
+* signature with idpass_lite_sign_final.
+*
+* @param self Calling context
+* @param encrypted_card User's QR code ID
+* @param encrypted_card_len Bytes length of encrypted_card
+* @return Returns the signing state handle or null on error
+*/
+
+MODULE_API
+void* idpass_lite_sign_init(void* self,
+                            unsigned char* encrypted_card,
+                            int encrypted_card_len);
+
+/**
+* Feeds the next chunk of data into a signing state.
+*
+* @param self Calling context
+* @param state The handle returned by idpass_lite_sign_init
+* @param data The next chunk of data to be signed
+* @param data_len Bytes length of data
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_sign_update(void* self,
+                            void* state,
+                            unsigned char* data,
+                            int data_len);
+
+/**
+* Completes an incremental signing. The signature is the one byte
+* SIGMODE_ED25519PH tag followed by the 64 bytes Ed25519ph signature.
+* The state handle is released whether or not this succeeds.
+*
+* @param self Calling context
+* @param state The handle returned by idpass_lite_sign_init
+* @param sig The output signature
+* @param sig_len Must be SIGNATURE_ED25519PH_LEN
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_sign_final(void* self,
+                           void* state,
+                           unsigned char* sig,
+                           int sig_len);
+
+/**
+* Starts an incremental verification of an Ed25519ph signature
+* produced by idpass_lite_sign_final.
+*
+* @param self Calling context
+* @param pubkey Public key that generated the signature
+* @param pubkey_len Length of bytes of pubkey
+* @return Returns the verification state handle or null on error
+*/
+
+MODULE_API
+void* idpass_lite_verify_init(void* self,
+                              unsigned char* pubkey,
+                              int pubkey_len);
+
+/**
+* Feeds the next chunk of data into a verification state.
+*
+* @param self Calling context
+* @param state The handle returned by idpass_lite_verify_init
+* @param data The next chunk of signed data
+* @param data_len Bytes length of data
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_verify_update(void* self,
+                              void* state,
+                              unsigned char* data,
+                              int data_len);
+
+/**
+* Completes an incremental verification. The state handle is released
+* whether or not the signature verifies.
+*
+* @param self Calling context
+* @param state The handle returned by idpass_lite_verify_init
+* @param sig The mode tagged signature
+* @param sig_len Must be SIGNATURE_ED25519PH_LEN
+* @return Returns 0 if the signature verifies
+*/
+
+MODULE_API
+int idpass_lite_verify_final(void* self,
+                             void* state,
+                             unsigned char* sig,
+                             int sig_len);
+
 /**
 * Encrypt data with user's QR code ID.
 *
@@ -287,6 +594,31 @@ unsigned char* idpass_lite_encrypt_with_card(void* self,
                                              unsigned char* data,
                                              int data_len);
 
+/**
+* Encrypt data with user's QR code ID into the caller's buffer. The
+* encrypted data is always 40 bytes longer than data, so a call with a
+* buffer too small, or null, returns that length without opening the
+* card.
+*
+* @param self Calling context
+* @param encrypted_card User's QR code ID.
+* @param encrypted_card_len Bytes length of encrypted_card
+* @param data The input data to be encrypted
+* @param data_len Bytes length of data
+* @param buf Caller buffer receiving the encrypted data, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the encrypted data, or -1 on failure
+*/
+
+MODULE_API
+int idpass_lite_encrypt_with_card_into(void* self,
+                                       unsigned char* encrypted_card,
+                                       int encrypted_card_len,
+                                       unsigned char* data,
+                                       int data_len,
+                                       unsigned char* buf,
+                                       int buf_len);
+
 /**
 * Returns the QR code bitmap of data.
 *
@@ -320,6 +652,264 @@ unsigned char* idpass_lite_qrpixel2(void* self,
                                     int data_len,
                                     int* qrsize);
 
+/**
+* Returns the QR code bitmap of data, packed as by idpass_lite_qrpixel,
+* into the caller's buffer. The bitmap is only written if buf holds the
+* returned length, which depends only on the QR code version, so a
+* first call with a null buf cheaply returns the size to allocate.
+*
+* @param self Calling context
+* @param data The input data
+* @param data_len Bytes length of data
+* @param buf Caller buffer receiving the bitmap, or null
+* @param buf_len The bytes length of buf
+* @param *qrsize Receives the square side dimension of QR code
+* @return Returns the bytes length of the bitmap, or -1 on invalid input
+*/
+
+MODULE_API
+int idpass_lite_qrpixel_into(void* self,
+                             const unsigned char* data,
+                             int data_len,
+                             unsigned char* buf,
+                             int buf_len,
+                             int* qrsize);
+
+/**
+* Returns the QR code bitmap of data, as does idpass_lite_qrpixel, but
+* with every row of modules starting on its own multiple of row_align
+* bytes and zero padded, ready to blit. Read as little endian words of
+* row_align bytes, module x of a row is bit x. The bitmap is only
+* written if buf holds the returned length, so a first call with a null
+* buf returns the size to allocate.
+*
+* @param self Calling context
+* @param data The input data
+* @param data_len Bytes length of data
+* @param row_align Row alignment in bytes, a power of two from 1 to 64
+* @param buf Caller buffer receiving the bitmap, or null
+* @param buf_len The bytes length of buf
+* @param *qrsize Receives the square side dimension of QR code
+* @param *row_bytes Receives the bytes length of each row
+* @return Returns the bytes length of the bitmap, or -1 on invalid input
+*/
+
+MODULE_API
+int idpass_lite_qrpixel_rows(void* self,
+                             const unsigned char* data,
+                             int data_len,
+                             int row_align,
+                             unsigned char* buf,
+                             int buf_len,
+                             int* qrsize,
+                             int* row_bytes);
+
+/**
+* Encodes many payloads into QR codes at once. The symbols are
+* spread across a pool of threads and written back to back into the
+* caller's arena, each packed as by idpass_lite_qrpixel. Nothing is
+* written into the arena unless it holds all symbols, so a first call
+* with a null arena returns the size to allocate.
+*
+* @param self Calling context
+* @param payloads_buf The payloads, each prefixed by its 4 bytes length
+* @param payloads_buf_len The bytes length of payloads_buf
+* @param arena Caller buffer receiving the symbols, or null
+* @param arena_len The bytes length of arena
+* @param table Caller array receiving two ints per payload: the arena
+*        offset and the square side dimension of its symbol, or -1 and 0
+*        if the payload cannot be encoded
+* @param table_len The count of ints in table
+* @return Returns the bytes length of all symbols, or -1 on invalid input
+* or if that length exceeds INT_MAX
+*/
+
+MODULE_API
+int idpass_lite_qrpixel_batch(void* self,
+                              unsigned char* payloads_buf,
+                              int payloads_buf_len,
+                              unsigned char* arena,
+                              int arena_len,
+                              int* table,
+                              int table_len);
+
+/**
+* Splits data too large for one QR code across up to 16 symbols linked
+* by structured append, none of them larger than max_version. All
+* symbols share one version and are returned back to back, each packed
+* as by idpass_lite_qrpixel. Data that fits in one symbol is returned
+* as a single plain QR code.
+*
+* @param self Calling context
+* @param *outlen The bytes length of returned data
+* @param data The input data
+* @param data_len Bytes length of data
+* @param max_version The largest QR version of a symbol, from 1 to 40
+* @param *count Receives the count of symbols
+* @param *qrsize Receives the square side dimension of each symbol
+* @return The symbols, or null if data does not fit in 16 symbols
+*/
+
+MODULE_API
+unsigned char* idpass_lite_qrpixel_append(void* self,
+                                          int* outlen,
+                                          const unsigned char* data,
+                                          int data_len,
+                                          int max_version,
+                                          int* count,
+                                          int* qrsize);
+
+/**
+* Joins back the data of structured append symbols, which can be given
+* in any order. Each symbol is its decoded content prefixed by two
+* header bytes: the symbol index in the high nibble and the count of
+* symbols minus one in the low nibble, then the parity byte.
+*
+* @param self Calling context
+* @param *outlen The bytes length of returned data
+* @param symbols_buf The symbols, each prefixed by its 4 bytes length
+* @param symbols_buf_len The bytes length of symbols_buf
+* @return The joined data, or null if a symbol is missing, repeated or
+*         does not match the parity
+*/
+
+MODULE_API
+unsigned char* idpass_lite_qrappend_join(void* self,
+                                         int* outlen,
+                                         unsigned char* symbols_buf,
+                                         int symbols_buf_len);
+
+/**
+* Renders a QR code bitmap, as returned by idpass_lite_qrpixel, into
+* a PBM, PNG or SVG image. Each module is drawn as a square of scale
+* pixels, inside a quiet zone of quiet modules. The image is only
+* complete if the returned length is at most buf_len, so a first call
+* with a null buf returns the size to allocate.
+*
+* @param self Calling context
+* @param pixels The QR code bitmap
+* @param pixels_len The bytes length of pixels, at least
+*        (qrsize * qrsize + 7) / 8
+* @param qrsize The square side dimension of the QR code
+* @param format One of the QRRENDER_* formats
+* @param scale Pixels per module, from 1 to 64
+* @param quiet Modules of quiet zone on each side, from 0 to 16
+* @param buf Caller buffer receiving the image, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the image, or -1 on invalid input
+*/
+
+MODULE_API
+int idpass_lite_qrrender(void* self,
+                         const unsigned char* pixels,
+                         int pixels_len,
+                         int qrsize,
+                         int format,
+                         int scale,
+                         int quiet,
+                         unsigned char* buf,
+                         int buf_len);
+
+/**
+* Same as idpass_lite_qrrender, but streams the image into an open
+* file descriptor.
+*
+* @param self Calling context
+* @param pixels The QR code bitmap
+* @param pixels_len The bytes length of pixels, at least
+*        (qrsize * qrsize + 7) / 8
+* @param qrsize The square side dimension of the QR code
+* @param format One of the QRRENDER_* formats
+* @param scale Pixels per module, from 1 to 64
+* @param quiet Modules of quiet zone on each side, from 0 to 16
+* @param fd The file descriptor to write into
+* @return Returns the bytes written, or -1 on invalid input or write error
+*/
+
+MODULE_API
+int idpass_lite_qrrender_fd(void* self,
+                            const unsigned char* pixels,
+                            int pixels_len,
+                            int qrsize,
+                            int format,
+                            int scale,
+                            int quiet,
+                            int fd);
+
+/**
+* Finds and decodes a QR code in a camera frame of 8 bit grayscale
+* pixels, such as the Y plane of a YUV preview. The symbol may be
+* rotated or seen in perspective, but not mirrored or inverted. A
+* structured append symbol is returned prefixed by its two header
+* bytes, as taken by idpass_lite_qrappend_join.
+*
+* @param self Calling context
+* @param *outlen The bytes length of returned data
+* @param gray The grayscale pixels, one byte each
+* @param width The frame width in pixels
+* @param height The frame height in pixels
+* @param stride The bytes between the starts of two rows
+* @param *count Receives the count of structured append symbols, or 1
+* @return The decoded data, or null if no QR code could be read
+*/
+
+MODULE_API
+unsigned char* idpass_lite_qrscan(void* self,
+                                  int* outlen,
+                                  const unsigned char* gray,
+                                  int width,
+                                  int height,
+                                  int stride,
+                                  int* count);
+
+/**
+* Decodes the QR code ID found in a camera frame, as does
+* idpass_lite_qrscan, and verifies it against a matching pin.
+*
+* @param self Calling context
+* @param *outlen Bytes length of returned bytes
+* @param gray The grayscale pixels, one byte each
+* @param width The frame width in pixels
+* @param height The frame height in pixels
+* @param stride The bytes between the starts of two rows
+* @param pin The ID owner's secret pin code
+* @return Returns the user's CardDetails if there is pin match.
+*/
+
+MODULE_API
+unsigned char* idpass_lite_scan_and_verify_with_pin(void* self,
+                                                    int* outlen,
+                                                    const unsigned char* gray,
+                                                    int width,
+                                                    int height,
+                                                    int stride,
+                                                    const char* pin);
+
+/**
+* Decodes the QR code ID found in a camera frame, as does
+* idpass_lite_qrscan, and verifies it against a matching photo.
+*
+* @param self Calling context
+* @param *outlen Bytes length of returned bytes
+* @param gray The grayscale pixels, one byte each
+* @param width The frame width in pixels
+* @param height The frame height in pixels
+* @param stride The bytes between the starts of two rows
+* @param photo The ID owner's photo capture
+* @param photo_len Length of bytes of photo
+* @return Returns the user's CardDetails if there is facial match.
+*/
+
+MODULE_API
+unsigned char* idpass_lite_scan_and_verify_with_face(void* self,
+                                                     int* outlen,
+                                                     const unsigned char* gray,
+                                                     int width,
+                                                     int height,
+                                                     int stride,
+                                                     char* photo,
+                                                     int photo_len);
+
 /**
 * Computes full facial dimension of a face.
 *
@@ -404,6 +994,32 @@ unsigned char* idpass_lite_decrypt_with_card(void* self,
                                              unsigned char* encrypted,
                                              int encrypted_len);
 
+/**
+* Asymmetric decryption of a ciphertext into the caller's buffer. The
+* decrypted text is 40 bytes shorter than encrypted, and a call with a
+* buffer too small, or null, returns that length without opening the
+* card. Nothing is written into buf if the ciphertext does not
+* authenticate.
+*
+* @param self Calling context
+* @param fullcard The QR code ID content
+* @param fullcard_len bytes length of fullcard
+* @param encrypted The encrypted data
+* @param encrypted_len The bytes length of encrypted
+* @param buf Caller buffer receiving the decrypted text, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the decrypted text, or -1 on failure
+*/
+
+MODULE_API
+int idpass_lite_decrypt_with_card_into(void* self,
+                                       unsigned char* fullcard,
+                                       int fullcard_len,
+                                       unsigned char* encrypted,
+                                       int encrypted_len,
+                                       unsigned char* buf,
+                                       int buf_len);
+
 /**
 * Generates an AEAD symmetric encryption key.
 *
@@ -444,6 +1060,23 @@ unsigned char* idpass_lite_generate_root_certificate(unsigned char* skpk,
                                                      int skpk_len,
                                                      int* outlen);
 
+/**
+* Generate a self-signed certificate with the provided secretkey into
+* the caller's buffer, if it holds the returned length.
+*
+* @param skpk The certificates private key
+* @param skpk_len The bytes length of skpk
+* @param buf Caller buffer receiving the certificate, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the certificate, or -1 on failure
+*/
+
+MODULE_API
+int idpass_lite_generate_root_certificate_into(unsigned char* skpk,
+                                               int skpk_len,
+                                               unsigned char* buf,
+                                               int buf_len);
+
 /**
 * Addes the public key into revocation list.
 *
@@ -456,6 +1089,115 @@ unsigned char* idpass_lite_generate_root_certificate(unsigned char* skpk,
 MODULE_API
 int idpass_lite_add_revoked_key(unsigned char* pubkey, int pubkey_len);
 
+/**
+* Adds a packed array of public keys into the revocation list. The
+* revocation list is copied once per call, so prefer this over
+* repeated idpass_lite_add_revoked_key calls when loading many keys.
+*
+* @param pubkeys Concatenated 32 bytes ed25519 public keys
+* @param pubkeys_len Length bytes of pubkeys, a multiple of 32
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_add_revoked_keys(unsigned char* pubkeys, int pubkeys_len);
+
+/**
+* Writes a sorted, integrity-hashed revocation store file from a packed
+* array of public keys, replacing any existing file.
+*
+* @param filename The revocation store file, REVOKED_KEYS if nullptr
+* @param pubkeys Concatenated 32 bytes ed25519 public keys
+* @param pubkeys_len Length bytes of pubkeys, a multiple of 32
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_write_revoked_keys(const char* filename,
+                                   unsigned char* pubkeys,
+                                   int pubkeys_len);
+
+/**
+* Appends public keys to the delta file of a revocation store and adds
+* them into the in-process revocation list. The delta is folded into
+* the store by idpass_lite_compact_revoked_keys.
+*
+* @param filename The revocation store file, REVOKED_KEYS if nullptr
+* @param pubkeys Concatenated 32 bytes ed25519 public keys
+* @param pubkeys_len Length bytes of pubkeys, a multiple of 32
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_append_revoked_keys(const char* filename,
+                                    unsigned char* pubkeys,
+                                    int pubkeys_len);
+
+/**
+* Memory-maps a revocation store file and checks its integrity hash.
+* Keys from its delta file are added into the in-process revocation
+* list. The store file is left as is, see
+* idpass_lite_compact_revoked_keys.
+*
+* @param filename The revocation store file, REVOKED_KEYS if nullptr
+* @return Returns 0 on success, 1 if neither the store nor its delta
+* exists, 2 if the store fails the integrity check
+*/
+
+MODULE_API
+int idpass_lite_load_revoked_keys(const char* filename);
+
+/**
+* Merges the delta file of a revocation store into the store file and
+* loads the result. As it sorts and rewrites the whole store, it is
+* meant for a background thread or a quiet time, so that loads stay a
+* mapping of the store plus a read of a short delta. Keys appended
+* during the merge go to a new delta.
+*
+* @param filename The revocation store file, REVOKED_KEYS if nullptr
+* @return Returns 0 on success, 1 if there is no delta to merge, 2 if
+* the merge fails
+*/
+
+MODULE_API
+int idpass_lite_compact_revoked_keys(const char* filename);
+
+/**
+* Builds a serialized revocation filter blob from a packed array of
+* public keys, for distribution to readers that cannot hold the full
+* revocation list in memory.
+*
+* @param self Calling context
+* @param outlen Length bytes of the returned blob
+* @param pubkeys Concatenated 32 bytes ed25519 public keys
+* @param pubkeys_len Length bytes of pubkeys, a multiple of 32
+* @param fpr Target false positive rate, between 0 and 1
+* @return Returns the filter blob or nullptr on error
+*/
+
+MODULE_API
+unsigned char* idpass_lite_build_revocation_filter(void* self,
+                                                   int* outlen,
+                                                   unsigned char* pubkeys,
+                                                   int pubkeys_len,
+                                                   double fpr);
+
+/**
+* Loads a revocation filter blob built by
+* idpass_lite_build_revocation_filter. Certificate chain checks consult
+* the filter first and confirm its hits against the revocation store
+* loaded by idpass_lite_load_revoked_keys. The filter is bypassed while
+* the loaded store holds other keys than it was built from. A nullptr
+* blob unloads the current filter.
+*
+* @param blob The filter blob
+* @param blob_len Length bytes of blob
+* @return Returns 0 on success
+*/
+
+MODULE_API
+int idpass_lite_load_revocation_filter(unsigned char* blob, int blob_len);
+
 /**
 * Generate an intermediate certificate with the provided secretkey of signer
 * and public key of the intermediate certificate.
@@ -477,6 +1219,28 @@ idpass_lite_generate_child_certificate(const unsigned char* parent_skpk,
                                        int child_pubkey_len,
                                        int* outlen);
 
+/**
+* Generate an intermediate certificate into the caller's buffer, if it
+* holds the returned length.
+*
+* @param parent_skpk The private key of the signer
+* @param parent_skpk_len The length bytes of parent_skpk
+* @param child_pubkey The public key of to-be-signed certificate
+* @param child_pubkey_len The bytes length of child_pubkey
+* @param buf Caller buffer receiving the certificate, or null
+* @param buf_len The bytes length of buf
+* @return Returns the bytes length of the certificate, or -1 on failure
+*/
+
+MODULE_API
+int idpass_lite_generate_child_certificate_into(
+    const unsigned char* parent_skpk,
+    int parent_skpk_len,
+    const unsigned char* child_pubkey,
+    int child_pubkey_len,
+    unsigned char* buf,
+    int buf_len);
+
 /**
 * Symmetric decryption of the fullcard QR code ID.
 *
@@ -485,7 +1249,9 @@ idpass_lite_generate_child_certificate(const unsigned char* parent_skpk,
 * @param ecard_buf_len Length bytes of ecard_buf
 * @param key The AEAD symmetric decryption key
 * @param key_len Length bytes of key
-* @return Returns 0 on success and decrypted content stored in ecard_buf
+* @return Returns 0 on success and decrypted content stored in ecard_buf,
+* or 3 if a compressed content does not fit into ecard_buf. Use
+* idpass_lite_card_decrypt2 for compressed cards.
 */
 
 MODULE_API
@@ -495,6 +1261,27 @@ int idpass_lite_card_decrypt(void* self,
                              unsigned char* key,
                              int key_len);
 
+/**
+* Symmetric decryption of the fullcard QR code ID into a new buffer,
+* whatever size a compressed content inflates to.
+*
+* @param self
+* @param outlen Length bytes of the returned content
+* @param ecard_buf The fullcard bytes
+* @param ecard_buf_len Length bytes of ecard_buf
+* @param key The AEAD symmetric decryption key
+* @param key_len Length bytes of key
+* @return Returns the decrypted content or nullptr on error
+*/
+
+MODULE_API
+unsigned char* idpass_lite_card_decrypt2(void* self,
+                                         int* outlen,
+                                         const unsigned char* ecard_buf,
+                                         int ecard_buf_len,
+                                         const unsigned char* key,
+                                         int key_len);
+
 /**
 * Verify the signature of msg using pubkey.
 *
@@ -567,6 +1354,28 @@ int idpass_lite_saveToBitmap(void* self,
                              int data_len,
                              const char* bitmapfile);
 
+/**
+* Runs a batch of operations in one call, such as creating a card, then
+* rendering its QR code and signing with it. The batch is a serialized
+* api::Operations, whose arguments are given inline or refer by index
+* to the output of an earlier operation, which then stays native. The
+* operations run in order, each one regardless of the failure of
+* another that it does not refer to.
+*
+* @param self Calling context
+* @param *outlen The bytes length of returned data
+* @param ops_buf The serialized api::Operations
+* @param ops_buf_len The bytes length of ops_buf
+* @return The serialized api::Results, one per operation, or null if
+*         ops_buf cannot be parsed
+*/
+
+MODULE_API
+unsigned char* idpass_lite_execute(void* self,
+                                   int* outlen,
+                                   unsigned char* ops_buf,
+                                   int ops_buf_len);
+
 /**
 * Experimential test of length-prefixed returned blob
 *
@@ -598,6 +1407,19 @@ unsigned char* idpass_lite_merge_CardDetails(unsigned char* d1buf,
                                              int d2buf_len,
                                              int* outlen);
 
+/**
+* Merges two CardDetails into the caller's buffer, if it holds the
+* returned length. The fields set in d1buf override those of d2buf.
+*/
+
+MODULE_API
+int idpass_lite_merge_CardDetails_into(unsigned char* d1buf,
+                                       int d1buf_len,
+                                       unsigned char* d2buf,
+                                       int d2buf_len,
+                                       unsigned char* buf,
+                                       int buf_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -16,6 +16,8 @@
 
 #include "../idpass.h"
 
+#include <climits>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <jni.h>
@@ -36,27 +38,153 @@
 #define LOGI(...)
 #endif
 
+// Looked up once from JNI_OnLoad by idpass_jni_init
+static jclass g_BitSet = nullptr;
+static jmethodID g_BitSet_valueOf = nullptr;
+
+// Short inputs are pinned rather than copied, for calls brief enough
+// to hold off the garbage collector
+const jsize CRITICAL_MAX = 16 * 1024;
+
+// Read-only view of a byte[] argument, released with JNI_ABORT as
+// nothing is written back. For a brief call, an array of up to
+// CRITICAL_MAX bytes is pinned by GetPrimitiveArrayCritical on the first
+// data(), after which no other JNI call may be made until release(), so
+// all the views of a call are constructed before the first data().
+// Other arrays, such as photos, go through GetByteArrayElements.
+class JniBytes
+{
+public:
+    JniBytes(JNIEnv *env, jbyteArray array, bool brief)
+        : m_env(env),
+          m_array(array),
+          m_size(array != nullptr ? env->GetArrayLength(array) : 0),
+          m_critical(brief && m_size <= CRITICAL_MAX),
+          m_data(nullptr)
+    {
+        if (m_array != nullptr && !m_critical)
+        {
+            m_data = env->GetByteArrayElements(array, nullptr);
+        }
+    }
+
+    ~JniBytes()
+    {
+        release();
+    }
+
+    JniBytes(const JniBytes &) = delete;
+    JniBytes &operator=(const JniBytes &) = delete;
+
+    unsigned char *data()
+    {
+        if (m_array != nullptr && m_critical && m_data == nullptr)
+        {
+            m_data = m_env->GetPrimitiveArrayCritical(m_array, nullptr);
+        }
+        return static_cast<unsigned char *>(m_data);
+    }
+
+    jsize size() const
+    {
+        return m_size;
+    }
+
+    void release()
+    {
+        if (m_data == nullptr)
+        {
+            return;
+        }
+        if (m_critical)
+        {
+            m_env->ReleasePrimitiveArrayCritical(m_array, m_data, JNI_ABORT);
+        }
+        else
+        {
+            m_env->ReleaseByteArrayElements(
+                m_array, static_cast<jbyte *>(m_data), JNI_ABORT);
+        }
+        m_data = nullptr;
+    }
+
+private:
+    JNIEnv *m_env;
+    jbyteArray m_array;
+    jsize m_size;
+    bool m_critical;
+    void *m_data;
+};
+
+// Copies a library result into a new byte[], empty if there is none,
+// and frees it
+static jbyteArray
+to_byte_array(JNIEnv *env, void *ctx, unsigned char *buf, int len)
+{
+    if (buf == nullptr)
+    {
+        return env->NewByteArray(0);
+    }
+
+    jbyteArray ret = env->NewByteArray(len);
+    env->SetByteArrayRegion(ret, 0, len, (const jbyte *)buf);
+    idpass_lite_freemem(ctx, buf);
+    return ret;
+}
+
+// Address of a direct ByteBuffer of at least len bytes, or null
+static unsigned char *direct_address(JNIEnv *env, jobject buffer, jint len)
+{
+    if (buffer == nullptr || len < 0)
+    {
+        return nullptr;
+    }
+
+    void *addr = env->GetDirectBufferAddress(buffer);
+    if (addr == nullptr || env->GetDirectBufferCapacity(buffer) < len)
+    {
+        return nullptr;
+    }
+    return static_cast<unsigned char *>(addr);
+}
+
+// Address and capacity of a direct ByteBuffer receiving a result, or
+// null and 0 if out is not one
+static unsigned char *direct_out(JNIEnv *env, jobject out, int *capacity)
+{
+    *capacity = 0;
+    if (out == nullptr)
+    {
+        return nullptr;
+    }
+
+    void *addr = env->GetDirectBufferAddress(out);
+    jlong cap = env->GetDirectBufferCapacity(out);
+    if (addr == nullptr || cap < 0)
+    {
+        return nullptr;
+    }
+
+    *capacity = cap > INT_MAX ? INT_MAX : static_cast<int>(cap);
+    return static_cast<unsigned char *>(addr);
+}
+
+
 jlong idpass_init(JNIEnv *env,
                   jclass clazz,
                   jbyteArray cryptokeys,
                   jbyteArray rootcerts)
 {
-    jbyte *cryptokeys_buf = env->GetByteArrayElements(cryptokeys, 0);
-    jsize cryptokeys_buf_len = env->GetArrayLength(cryptokeys);
+    JniBytes cryptokeys_buf(env, cryptokeys, true);
+    JniBytes rootcerts_buf(env, rootcerts, true);
 
-    jbyte *rootcerts_buf = rootcerts != nullptr ? env->GetByteArrayElements(rootcerts, 0) : nullptr;
-    jsize rootcerts_buf_len = rootcerts != nullptr ? env->GetArrayLength(rootcerts) : 0;
+    void *ctx = idpass_lite_init(cryptokeys_buf.data(),
+                                 cryptokeys_buf.size(),
+                                 rootcerts_buf.data(),
+                                 rootcerts_buf.size());
 
-    void *ctx = idpass_lite_init(reinterpret_cast<unsigned char *>(cryptokeys_buf),
-                                 cryptokeys_buf_len,
-                                 reinterpret_cast<unsigned char *>(rootcerts_buf),
-                                 rootcerts_buf_len);
-
-    env->ReleaseByteArrayElements(cryptokeys, cryptokeys_buf, 0);
-    if (rootcerts)
-    {
-        env->ReleaseByteArrayElements(rootcerts, rootcerts_buf, 0);
-    }
+    cryptokeys_buf.release();
+    rootcerts_buf.release();
 
     if (ctx)
     {
@@ -107,27 +235,16 @@ jfloat compare_face_template(JNIEnv *env,
                              jbyteArray face1,
                              jbyteArray face2)
 {
-    jbyte *face1_buf = env->GetByteArrayElements(face1, 0);
-    jsize face1_buf_len = env->GetArrayLength(face1);
-    jbyte *face2_buf = env->GetByteArrayElements(face2, 0);
-    jsize face2_buf_len = env->GetArrayLength(face2);
+    JniBytes face1_buf(env, face1, true);
+    JniBytes face2_buf(env, face2, true);
 
     float result = -10.0;
 
-    int status = idpass_lite_compare_face_template(
-        reinterpret_cast<unsigned char *>(face1_buf),
-        face1_buf_len,
-        reinterpret_cast<unsigned char *>(face2_buf),
-        face2_buf_len,
-        &result);
-
-    if (status == 0)
-    {
-        return result;
-    }
-
-    env->ReleaseByteArrayElements(face1, face1_buf, 0);
-    env->ReleaseByteArrayElements(face2, face2_buf, 0);
+    idpass_lite_compare_face_template(face1_buf.data(),
+                                      face1_buf.size(),
+                                      face2_buf.data(),
+                                      face2_buf.size(),
+                                      &result);
 
     return result;
 }
@@ -135,25 +252,14 @@ jfloat compare_face_template(JNIEnv *env,
 jbyteArray
 generate_root_certificate(JNIEnv *env, jclass clazz, jbyteArray secretKey)
 {
-    jbyte *secretKey_buf = env->GetByteArrayElements(secretKey, 0);
-    jsize secretKey_buf_len = env->GetArrayLength(secretKey);
-
-    jbyteArray rootCertificate = env->NewByteArray(0);
+    JniBytes secretKey_buf(env, secretKey, true);
 
     int outlen = 0;
     unsigned char *rootcert = idpass_lite_generate_root_certificate(
-        reinterpret_cast<unsigned char *>(secretKey_buf),
-        secretKey_buf_len,
-        &outlen);
-    if (rootcert)
-    {
-        rootCertificate = env->NewByteArray(outlen);
-        env->SetByteArrayRegion(
-            rootCertificate, 0, outlen, (const jbyte *)rootcert);
-    }
+        secretKey_buf.data(), secretKey_buf.size(), &outlen);
 
-    env->ReleaseByteArrayElements(secretKey, secretKey_buf, 0);
-    return rootCertificate;
+    secretKey_buf.release();
+    return to_byte_array(env, nullptr, rootcert, outlen);
 }
 
 jbyteArray generate_child_certificate(JNIEnv *env,
@@ -161,40 +267,26 @@ jbyteArray generate_child_certificate(JNIEnv *env,
                                       jbyteArray parentSecretKey,
                                       jbyteArray childSecretKey)
 {
-    jbyte *parentSecretKey_buf = env->GetByteArrayElements(parentSecretKey, 0);
-    jsize parentSecretKey_buf_len = env->GetArrayLength(parentSecretKey);
-    jbyte *childSecretKey_buf = env->GetByteArrayElements(childSecretKey, 0);
-    jsize childSecretKey_buf_len = env->GetArrayLength(childSecretKey);
-
-    jbyteArray childCertificate = env->NewByteArray(0);
+    JniBytes parentSecretKey_buf(env, parentSecretKey, true);
+    JniBytes childSecretKey_buf(env, childSecretKey, true);
 
     int outlen = 0;
     unsigned char *childcert = idpass_lite_generate_child_certificate(
-        reinterpret_cast<unsigned char *>(parentSecretKey_buf),
-        parentSecretKey_buf_len,
-        reinterpret_cast<unsigned char *>(childSecretKey_buf),
-        childSecretKey_buf_len,
+        parentSecretKey_buf.data(),
+        parentSecretKey_buf.size(),
+        childSecretKey_buf.data(),
+        childSecretKey_buf.size(),
         &outlen);
 
-    if (childcert)
-    {
-        childCertificate = env->NewByteArray(outlen);
-        env->SetByteArrayRegion(
-            childCertificate, 0, outlen, (const jbyte *)childcert);
-    }
-
-    env->ReleaseByteArrayElements(parentSecretKey, parentSecretKey_buf, 0);
-    env->ReleaseByteArrayElements(childSecretKey, childSecretKey_buf, 0);
-    return childCertificate;
+    parentSecretKey_buf.release();
+    childSecretKey_buf.release();
+    return to_byte_array(env, nullptr, childcert, outlen);
 }
 
 void add_revoked_key(JNIEnv *env, jclass clazz, jbyteArray pubkey)
 {
-    jbyte *pubkey_buf = env->GetByteArrayElements(pubkey, 0);
-    jsize pubkey_buf_len = env->GetArrayLength(pubkey);
-    idpass_lite_add_revoked_key(reinterpret_cast<unsigned char *>(pubkey_buf),
-                                pubkey_buf_len);
-    env->ReleaseByteArrayElements(pubkey, pubkey_buf, 0);
+    JniBytes pubkey_buf(env, pubkey, true);
+    idpass_lite_add_revoked_key(pubkey_buf.data(), pubkey_buf.size());
 }
 
 jbyteArray ioctl(JNIEnv *env, jobject thiz, jlong context, jbyteArray iobuf)
@@ -206,18 +298,30 @@ jbyteArray ioctl(JNIEnv *env, jobject thiz, jlong context, jbyteArray iobuf)
         return env->NewByteArray(0);
     }
 
-    jbyte *buf = env->GetByteArrayElements(iobuf, 0);
+    // The ACL is byte swapped here, so it is worked on in a copy rather
+    // than in the Java array, into which the gets are copied back
     jsize buf_len = env->GetArrayLength(iobuf);
+    if (buf_len <= 0)
+    {
+        return env->NewByteArray(0);
+    }
+    std::vector<unsigned char> buf(buf_len);
+    env->GetByteArrayRegion(
+        iobuf, 0, buf_len, reinterpret_cast<jbyte *>(buf.data()));
 
-    if (buf[0] == IOCTL_SET_ACL)
+    if (buf_len >= 9 && buf[0] == IOCTL_SET_ACL)
     {
-        std::reverse(buf + 1, buf + 9);
+        std::reverse(buf.begin() + 1, buf.begin() + 9);
     }
 
-    idpass_lite_ioctl(
-        ctx, nullptr, reinterpret_cast<unsigned char *>(buf), buf_len);
+    idpass_lite_ioctl(ctx, nullptr, buf.data(), buf_len);
+
+    if (buf[0] != IOCTL_SET_ACL)
+    {
+        env->SetByteArrayRegion(
+            iobuf, 0, buf_len, reinterpret_cast<const jbyte *>(buf.data()));
+    }
 
-    env->ReleaseByteArrayElements(iobuf, buf, 0);
     return env->NewByteArray(0);
 }
 
@@ -233,34 +337,16 @@ jbyteArray create_card_with_face(JNIEnv *env,
         return env->NewByteArray(0);
     }
 
-    jbyteArray ecard = nullptr;
-
-    jbyte *ident_buf = env->GetByteArrayElements(ident, 0);
-    jsize ident_buf_len = env->GetArrayLength(ident);
+    JniBytes ident_buf(env, ident, false);
 
-    int outlen;
+    int outlen = 0;
     unsigned char *eSignedIDPassCard = idpass_lite_create_card_with_face(
-        ctx,
-        &outlen,
-        reinterpret_cast<unsigned char *>(ident_buf),
-        ident_buf_len);
+        ctx, &outlen, ident_buf.data(), ident_buf.size());
 
-    if (eSignedIDPassCard != nullptr)
-    {
-        ecard = env->NewByteArray(outlen);
-        env->SetByteArrayRegion(
-            ecard, 0, outlen, (const jbyte *)eSignedIDPassCard);
-        idpass_lite_freemem(ctx, eSignedIDPassCard);
-    }
-    else
-    {
-        ecard = env->NewByteArray(0);
-    }
-
-    if (ident_buf)
-        env->ReleaseByteArrayElements(ident, ident_buf, 0);
+    ident_buf.release();
 
-    return ecard; // encrypted SignedIDPassCard proto object
+    // encrypted SignedIDPassCard proto object
+    return to_byte_array(env, ctx, eSignedIDPassCard, outlen);
 }
 
 jbyteArray verify_card_with_face_template(JNIEnv *env,
@@ -276,37 +362,21 @@ jbyteArray verify_card_with_face_template(JNIEnv *env,
         return env->NewByteArray(0);
     }
 
-    jbyteArray ret = nullptr;
-    jbyte *buf = env->GetByteArrayElements(photo_template, 0);
-    jsize buf_len = env->GetArrayLength(photo_template);
-
-    jbyte *eSignedIDPassCard = env->GetByteArrayElements(e_signed_card, 0);
-    jsize eSignedIDPassCard_len = env->GetArrayLength(e_signed_card);
+    JniBytes buf(env, photo_template, true);
+    JniBytes eSignedIDPassCard(env, e_signed_card, true);
 
     int details_len = 0;
     unsigned char *details = idpass_lite_verify_card_with_face_template(
         ctx,
         &details_len,
-        reinterpret_cast<unsigned char *>(eSignedIDPassCard),
-        eSignedIDPassCard_len,
-        reinterpret_cast<unsigned char *>(buf),
-        buf_len);
-
-    if (details != nullptr)
-    {
-        ret = env->NewByteArray(details_len);
-        env->SetByteArrayRegion(ret, 0, details_len, (const jbyte *)details);
-        idpass_lite_freemem(ctx, details);
-    }
-    else
-    {
-        ret = env->NewByteArray(0);
-    }
-
-    env->ReleaseByteArrayElements(photo_template, buf, 0);
-    env->ReleaseByteArrayElements(e_signed_card, eSignedIDPassCard, 0);
-
-    return ret;
+        eSignedIDPassCard.data(),
+        eSignedIDPassCard.size(),
+        buf.data(),
+        buf.size());
+
+    buf.release();
+    eSignedIDPassCard.release();
+    return to_byte_array(env, ctx, details, details_len);
 }
 
 jbyteArray verify_card_with_face(JNIEnv *env,
@@ -322,37 +392,22 @@ jbyteArray verify_card_with_face(JNIEnv *env,
         return env->NewByteArray(0);
     }
 
-    jbyteArray ret = nullptr;
-    jbyte *buf = env->GetByteArrayElements(photo, 0);
-    jsize buf_len = env->GetArrayLength(photo);
-
-    jbyte *eSignedIDPassCard = env->GetByteArrayElements(e_signed_card, 0);
-    jsize eSignedIDPassCard_len = env->GetArrayLength(e_signed_card);
+    // Face matching is too long a call to hold arrays critical
+    JniBytes buf(env, photo, false);
+    JniBytes eSignedIDPassCard(env, e_signed_card, false);
 
     int details_len = 0;
     unsigned char *details = idpass_lite_verify_card_with_face(
         ctx,
         &details_len,
-        reinterpret_cast<unsigned char *>(eSignedIDPassCard),
-        eSignedIDPassCard_len,
-        reinterpret_cast<char *>(buf),
-        buf_len);
-
-    if (details != nullptr)
-    {
-        ret = env->NewByteArray(details_len);
-        env->SetByteArrayRegion(ret, 0, details_len, (const jbyte *)details);
-        idpass_lite_freemem(ctx, details);
-    }
-    else
-    {
-        ret = env->NewByteArray(0);
-    }
-
-    env->ReleaseByteArrayElements(photo, buf, 0);
-    env->ReleaseByteArrayElements(e_signed_card, eSignedIDPassCard, 0);
-
-    return ret;
+        eSignedIDPassCard.data(),
+        eSignedIDPassCard.size(),
+        reinterpret_cast<char *>(buf.data()),
+        buf.size());
+
+    buf.release();
+    eSignedIDPassCard.release();
+    return to_byte_array(env, ctx, details, details_len);
 }
 
 jbyteArray verify_card_with_pin(JNIEnv *env,
@@ -369,34 +424,19 @@ jbyteArray verify_card_with_pin(JNIEnv *env,
     }
 
     const char *strPin = env->GetStringUTFChars(pin, 0);
-    jbyteArray ret = nullptr;
-
-    jbyte *eSignedIDPassCard = env->GetByteArrayElements(e_signed_card, 0);
-    jsize eSignedIDPassCard_len = env->GetArrayLength(e_signed_card);
+    JniBytes eSignedIDPassCard(env, e_signed_card, true);
 
     int details_len = 0;
     unsigned char *details = idpass_lite_verify_card_with_pin(
         ctx,
         &details_len,
-        reinterpret_cast<unsigned char *>(eSignedIDPassCard),
-        eSignedIDPassCard_len,
+        eSignedIDPassCard.data(),
+        eSignedIDPassCard.size(),
         strPin);
 
-    if (details != nullptr)
-    {
-        ret = env->NewByteArray(details_len);
-        env->SetByteArrayRegion(ret, 0, details_len, (const jbyte *)details);
-        idpass_lite_freemem(ctx, details);
-    }
-    else
-    {
-        ret = env->NewByteArray(0);
-    }
-
+    eSignedIDPassCard.release();
     env->ReleaseStringUTFChars(pin, strPin);
-    env->ReleaseByteArrayElements(e_signed_card, eSignedIDPassCard, 0);
-
-    return ret;
+    return to_byte_array(env, ctx, details, details_len);
 }
 
 jbyteArray encrypt_with_card(JNIEnv *env,
@@ -411,29 +451,21 @@ jbyteArray encrypt_with_card(JNIEnv *env,
         LOGI("null ctx");
         return env->NewByteArray(0);
     }
-    jbyte *eSignedIDPassCard = env->GetByteArrayElements(e_signed_card, 0);
-    jsize eSignedIDPassCard_len = env->GetArrayLength(e_signed_card);
+    JniBytes eSignedIDPassCard(env, e_signed_card, true);
+    JniBytes bufData(env, data, true);
 
-    jbyte *bufData = env->GetByteArrayElements(data, 0);
-    jsize bufData_len = env->GetArrayLength(data);
-    ///////////////
-    int encrypted_len;
+    int encrypted_len = 0;
     unsigned char *encrypted = idpass_lite_encrypt_with_card(
         ctx,
         &encrypted_len,
-        reinterpret_cast<unsigned char *>(eSignedIDPassCard),
-        eSignedIDPassCard_len,
-        reinterpret_cast<unsigned char *>(bufData),
-        bufData_len);
-
-    jbyteArray ret = env->NewByteArray(encrypted_len);
-    env->SetByteArrayRegion(ret, 0, encrypted_len, (const jbyte *)encrypted);
-    idpass_lite_freemem(ctx, encrypted);
-    ///////////////
-    env->ReleaseByteArrayElements(e_signed_card, eSignedIDPassCard, 0);
-    env->ReleaseByteArrayElements(data, bufData, 0);
-
-    return ret;
+        eSignedIDPassCard.data(),
+        eSignedIDPassCard.size(),
+        bufData.data(),
+        bufData.size());
+
+    eSignedIDPassCard.release();
+    bufData.release();
+    return to_byte_array(env, ctx, encrypted, encrypted_len);
 }
 
 jbyteArray sign_with_card(JNIEnv *env,
@@ -448,33 +480,29 @@ jbyteArray sign_with_card(JNIEnv *env,
         LOGI("null ctx");
         return env->NewByteArray(0);
     }
-    jbyte *eSignedIDPassCard = env->GetByteArrayElements(e_signed_card, 0);
-    jsize eSignedIDPassCard_len = env->GetArrayLength(e_signed_card);
+    JniBytes eSignedIDPassCard(env, e_signed_card, true);
+    JniBytes bufData(env, data, true);
 
-    jbyte *bufData = env->GetByteArrayElements(data, 0);
-    jsize bufData_len = env->GetArrayLength(data);
-    ////////////////////////
     unsigned char sig[64];
     int sig_len = 64;
-    if (0 != idpass_lite_sign_with_card(
-                 ctx, sig, 64,
-                 reinterpret_cast<unsigned char *>(eSignedIDPassCard),
-                 eSignedIDPassCard_len,
-                 reinterpret_cast<unsigned char *>(bufData),
-                 bufData_len))
-    {
-        env->ReleaseByteArrayElements(e_signed_card, eSignedIDPassCard, 0);
-        env->ReleaseByteArrayElements(data, bufData, 0);
+    int status = idpass_lite_sign_with_card(ctx,
+                                            sig,
+                                            sig_len,
+                                            eSignedIDPassCard.data(),
+                                            eSignedIDPassCard.size(),
+                                            bufData.data(),
+                                            bufData.size());
+
+    eSignedIDPassCard.release();
+    bufData.release();
+
+    if (status != 0)
+    {
         return env->NewByteArray(0);
     }
 
     jbyteArray ret = env->NewByteArray(sig_len);
     env->SetByteArrayRegion(ret, 0, sig_len, (const jbyte *)sig);
-    // idpass_lite_freemem(ctx, sig);
-    ////////////////////////
-    env->ReleaseByteArrayElements(e_signed_card, eSignedIDPassCard, 0);
-    env->ReleaseByteArrayElements(data, bufData, 0);
-
     return ret;
 }
 
@@ -489,38 +517,39 @@ jobject generate_qrcode_pixels(JNIEnv *env,
         LOGI("null ctx");
         return env->NewByteArray(0);
     }
-    auto TestBit = [](unsigned char A[], int k) { // helper function
-        return ((A[k / 8] & (1 << (k % 8))) != 0);
-    };
-
-    jbyte *buf = env->GetByteArrayElements(data, 0);
-    jsize buf_len = env->GetArrayLength(data);
-
-    jclass jcls = env->FindClass("java/util/BitSet"); // careful with BitSet(n)
-    jmethodID constructor = env->GetMethodID(jcls, "<init>", "(I)V");
+    JniBytes buf(env, data, true);
 
     int square_side_len = 0;
+    int pixels_len = 0;
 
-    unsigned char *pixels = idpass_lite_qrpixel(
-        ctx, reinterpret_cast<unsigned char *>(buf), buf_len, &square_side_len);
+    unsigned char *pixels = idpass_lite_qrpixel2(
+        ctx, &pixels_len, buf.data(), buf.size(), &square_side_len);
 
-    int pixels_count = square_side_len * square_side_len;
+    buf.release();
 
-    jobject obj = env->NewObject(jcls, constructor, pixels_count + 1); // BitSet(n + 1)
-    jmethodID setBit = env->GetMethodID(jcls, "set", "(I)V");
-    env->CallVoidMethod(obj, setBit, pixels_count);
+    int pixels_count = square_side_len * square_side_len;
 
-    // Copy the QR Code pixels into the BitSet object
-    for (int i = 0; i < pixels_count; i++)
+    // The bitmap is least significant bit first, so its bytes assemble
+    // into the little endian words of BitSet.valueOf. One more bit past
+    // the modules, as BitSet(n + 1).set(n), lets the caller recover n.
+    std::vector<jlong> words(pixels_count / 64 + 1, 0);
+    for (int i = 0; i < pixels_len; i++)
     {
-        if (TestBit(pixels, i))
-        {
-            env->CallVoidMethod(obj, setBit, i);
-        }
+        words[i / 8] = static_cast<jlong>(
+            static_cast<uint64_t>(words[i / 8])
+            | static_cast<uint64_t>(pixels[i]) << (8 * (i % 8)));
     }
+    words[pixels_count / 64] = static_cast<jlong>(
+        static_cast<uint64_t>(words[pixels_count / 64])
+        | uint64_t(1) << (pixels_count % 64));
 
     idpass_lite_freemem(ctx, pixels);
-    env->ReleaseByteArrayElements(data, buf, 0);
+
+    jlongArray array = env->NewLongArray(words.size());
+    env->SetLongArrayRegion(array, 0, words.size(), words.data());
+    jobject obj = env->CallStaticObjectMethod(g_BitSet, g_BitSet_valueOf, array);
+    env->DeleteLocalRef(array);
+
     return obj;
 }
 
@@ -534,28 +563,24 @@ compute_face_128d(JNIEnv *env, jobject thiz, jlong context, jbyteArray photo)
         return env->NewByteArray(0);
     }
 
-    jbyteArray face128d = nullptr;
-    jbyte *buf = env->GetByteArrayElements(photo, 0);
-    jsize buf_len = env->GetArrayLength(photo);
+    JniBytes buf(env, photo, false);
 
     unsigned char facearray[128 * 4];
 
     int face_count = idpass_lite_face128dbuf(
-        ctx, reinterpret_cast<char *>(buf), buf_len, facearray);
+        ctx, reinterpret_cast<char *>(buf.data()), buf.size(), facearray);
+
+    buf.release();
 
     // this method only returns workable data if it finds exactly 1 face
     if (face_count == 1)
     {
-        face128d = env->NewByteArray(128 * 4);
+        jbyteArray face128d = env->NewByteArray(128 * 4);
         env->SetByteArrayRegion(face128d, 0, 128 * 4, (const jbyte *)facearray);
-    }
-    else
-    {
-        face128d = env->NewByteArray(0);
+        return face128d;
     }
 
-    env->ReleaseByteArrayElements(photo, buf, 0);
-    return face128d;
+    return env->NewByteArray(0);
 }
 
 jbyteArray
@@ -568,28 +593,24 @@ compute_face_64d(JNIEnv *env, jobject thiz, jlong context, jbyteArray photo)
         return env->NewByteArray(0);
     }
 
-    jbyteArray face64d = nullptr;
-    jbyte *buf = env->GetByteArrayElements(photo, 0);
-    jsize buf_len = env->GetArrayLength(photo);
+    JniBytes buf(env, photo, false);
 
     unsigned char facearray[64 * 2];
 
     int face_count = idpass_lite_face64dbuf(
-        ctx, reinterpret_cast<char *>(buf), buf_len, facearray);
+        ctx, reinterpret_cast<char *>(buf.data()), buf.size(), facearray);
+
+    buf.release();
 
     // this method only returns workable data if it finds exactly 1 face
     if (face_count == 1)
     {
-        face64d = env->NewByteArray(64 * 2);
+        jbyteArray face64d = env->NewByteArray(64 * 2);
         env->SetByteArrayRegion(face64d, 0, 64 * 2, (const jbyte *)facearray);
-    }
-    else
-    {
-        face64d = env->NewByteArray(0);
+        return face64d;
     }
 
-    env->ReleaseByteArrayElements(photo, buf, 0);
-    return face64d;
+    return env->NewByteArray(0);
 }
 
 jbyteArray decrypt_with_card(JNIEnv *env,
@@ -605,36 +626,21 @@ jbyteArray decrypt_with_card(JNIEnv *env,
         return env->NewByteArray(0);
     }
 
-    jbyte *fullcard_buf = env->GetByteArrayElements(fullcard, 0);
-    jsize fullcard_buf_len = env->GetArrayLength(fullcard);
-    jbyte *encrypted_buf = env->GetByteArrayElements(encrypted, 0);
-    jsize encrypted_buf_len = env->GetArrayLength(encrypted);
+    JniBytes fullcard_buf(env, fullcard, true);
+    JniBytes encrypted_buf(env, encrypted, true);
 
     int decrypted_len = 0;
     unsigned char *decrypted = idpass_lite_decrypt_with_card(
         ctx,
         &decrypted_len,
-        reinterpret_cast<unsigned char *>(fullcard_buf),
-        fullcard_buf_len,
-        reinterpret_cast<unsigned char *>(encrypted_buf),
-        encrypted_buf_len);
-
-    if (!decrypted)
-    {
-        env->ReleaseByteArrayElements(fullcard, fullcard_buf, 0);
-        env->ReleaseByteArrayElements(encrypted, encrypted_buf, 0);
-        return env->NewByteArray(0);
-    }
-
-    jbyteArray plaintext = env->NewByteArray(decrypted_len);
-    env->SetByteArrayRegion(
-        plaintext, 0, decrypted_len, (const jbyte *)decrypted);
-    idpass_lite_freemem(ctx, decrypted);
-
-    env->ReleaseByteArrayElements(fullcard, fullcard_buf, 0);
-    env->ReleaseByteArrayElements(encrypted, encrypted_buf, 0);
-
-    return plaintext;
+        fullcard_buf.data(),
+        fullcard_buf.size(),
+        encrypted_buf.data(),
+        encrypted_buf.size());
+
+    fullcard_buf.release();
+    encrypted_buf.release();
+    return to_byte_array(env, ctx, decrypted, decrypted_len);
 }
 
 jbyteArray card_decrypt(JNIEnv *env,
@@ -650,31 +656,20 @@ jbyteArray card_decrypt(JNIEnv *env,
         return env->NewByteArray(0);
     }
 
-    jbyte *ecard_buf = env->GetByteArrayElements(ecard, 0);
-    jsize ecard_buf_len = env->GetArrayLength(ecard);
-    jbyte *key_buf = env->GetByteArrayElements(key, 0);
-    jsize key_buf_len = env->GetArrayLength(key);
-
-    int len = ecard_buf_len;
-
-    if (idpass_lite_card_decrypt(ctx,
-                                 reinterpret_cast<unsigned char *>(ecard_buf),
-                                 &len,
-                                 reinterpret_cast<unsigned char *>(key_buf),
-                                 key_buf_len) != 0)
-    {
-        env->ReleaseByteArrayElements(ecard, ecard_buf, 0);
-        env->ReleaseByteArrayElements(key, key_buf, 0);
-        return env->NewByteArray(0);
-    }
-
-    jbyteArray plaintext = env->NewByteArray(len);
-    env->SetByteArrayRegion(plaintext, 0, len, ecard_buf);
+    JniBytes ecard_buf(env, ecard, true);
+    JniBytes key_buf(env, key, true);
 
-    env->ReleaseByteArrayElements(ecard, ecard_buf, 0);
-    env->ReleaseByteArrayElements(key, key_buf, 0);
+    int len = 0;
+    unsigned char *plaintext = idpass_lite_card_decrypt2(ctx,
+                                                         &len,
+                                                         ecard_buf.data(),
+                                                         ecard_buf.size(),
+                                                         key_buf.data(),
+                                                         key_buf.size());
 
-    return plaintext;
+    ecard_buf.release();
+    key_buf.release();
+    return to_byte_array(env, ctx, plaintext, len);
 }
 
 jboolean verify_with_card(JNIEnv *env,
@@ -693,31 +688,21 @@ jboolean verify_with_card(JNIEnv *env,
         return flag;
     }
 
-    jbyte *msg_buf = env->GetByteArrayElements(msg, 0);
-    jsize msg_buf_len = env->GetArrayLength(msg);
-
-    jbyte *signature_buf = env->GetByteArrayElements(signature, 0);
-    jsize signature_buf_len = env->GetArrayLength(signature);
-
-    jbyte *pubkey_buf = env->GetByteArrayElements(pubkey, 0);
-    jsize pubkey_buf_len = env->GetArrayLength(pubkey);
-
-    if (idpass_lite_verify_with_card(
-            ctx,
-            reinterpret_cast<unsigned char *>(msg_buf),
-            msg_buf_len,
-            reinterpret_cast<unsigned char *>(signature_buf),
-            signature_buf_len,
-            reinterpret_cast<unsigned char *>(pubkey_buf),
-            pubkey_buf_len) == 0)
+    JniBytes msg_buf(env, msg, true);
+    JniBytes signature_buf(env, signature, true);
+    JniBytes pubkey_buf(env, pubkey, true);
+
+    if (idpass_lite_verify_with_card(ctx,
+                                     msg_buf.data(),
+                                     msg_buf.size(),
+                                     signature_buf.data(),
+                                     signature_buf.size(),
+                                     pubkey_buf.data(),
+                                     pubkey_buf.size()) == 0)
     {
         flag = JNI_TRUE;
     }
 
-    env->ReleaseByteArrayElements(msg, msg_buf, 0);
-    env->ReleaseByteArrayElements(signature, signature_buf, 0);
-    env->ReleaseByteArrayElements(pubkey, pubkey_buf, 0);
-
     return flag;
 }
 
@@ -733,19 +718,14 @@ jboolean add_certificates(JNIEnv *env,
     }
 
     jboolean flag = false;
-    jbyte *certificates_buf = env->GetByteArrayElements(certificates, 0);
-    jsize certificates_buf_len = env->GetArrayLength(certificates);
+    JniBytes certificates_buf(env, certificates, true);
 
     if (0 == idpass_lite_add_certificates(
-                 ctx,
-                 reinterpret_cast<unsigned char *>(certificates_buf),
-                 certificates_buf_len))
+                 ctx, certificates_buf.data(), certificates_buf.size()))
     {
         flag = true;
     }
 
-    env->ReleaseByteArrayElements(certificates, certificates_buf, 0);
-
     return flag;
 }
 
@@ -760,15 +740,10 @@ jint verify_card_certificate(JNIEnv *env,
         return -1;
     }
 
-    jbyte *fullcard_buf = env->GetByteArrayElements(fullcard, 0);
-    jsize fullcard_buf_len = env->GetArrayLength(fullcard);
-
-    int status = idpass_lite_verify_certificate(
-        ctx, reinterpret_cast<unsigned char *>(fullcard_buf), fullcard_buf_len);
+    JniBytes fullcard_buf(env, fullcard, true);
 
-    env->ReleaseByteArrayElements(fullcard, fullcard_buf, 0);
-
-    return status;
+    return idpass_lite_verify_certificate(
+        ctx, fullcard_buf.data(), fullcard_buf.size());
 }
 
 jbyteArray uio(JNIEnv *env, jobject thiz, jlong context, jint typ)
@@ -812,32 +787,29 @@ jboolean verify_card_signature(JNIEnv *env,
         return JNI_FALSE;
     }
 
-    jbyte *fullcard_buf = env->GetByteArrayElements(fullcard, 0);
-    jsize fullcard_buf_len = env->GetArrayLength(fullcard);
+    JniBytes fullcard_buf(env, fullcard, true);
 
     if (0 != idpass_lite_verify_card_signature(
-                 ctx, (unsigned char *)fullcard_buf, fullcard_buf_len, 1))
+                 ctx, fullcard_buf.data(), fullcard_buf.size(), 1))
     {
         return JNI_FALSE;
     }
 
-    env->ReleaseByteArrayElements(fullcard, fullcard_buf, 0);
     return JNI_TRUE;
 }
 
 jboolean
 compute_hash(JNIEnv *env, jclass clazz, jbyteArray data, jbyteArray hash)
 {
-    jbyte *data_buf = env->GetByteArrayElements(data, 0);
-    jsize data_buf_len = env->GetArrayLength(data);
+    JniBytes data_buf(env, data, false);
     jbyte *hash_buf = env->GetByteArrayElements(hash, 0);
     jsize hash_buf_len = env->GetArrayLength(hash);
 
     int status = idpass_lite_compute_hash(
-        (unsigned char *)data_buf, data_buf_len,
+        data_buf.data(), data_buf.size(),
         (unsigned char *)hash_buf, hash_buf_len);
 
-    env->ReleaseByteArrayElements(data, data_buf, 0);
+    data_buf.release();
     env->ReleaseByteArrayElements(hash, hash_buf, 0);
 
     return status == 0 ? JNI_TRUE : JNI_FALSE;
@@ -857,32 +829,20 @@ jbyteArray merge_CardDetails(JNIEnv *env,
                              jbyteArray details1,
                              jbyteArray details2)
 {
-    jbyte *details1_buf = env->GetByteArrayElements(details1, 0);
-    jsize details1_buf_len = env->GetArrayLength(details1);
-    jbyte *details2_buf = env->GetByteArrayElements(details2, 0);
-    jsize details2_buf_len = env->GetArrayLength(details2);
-
-    jbyteArray merged = env->NewByteArray(0);
+    JniBytes details1_buf(env, details1, true);
+    JniBytes details2_buf(env, details2, true);
 
     int buf_len = 0;
 
-    unsigned char *buf = idpass_lite_merge_CardDetails(reinterpret_cast<unsigned char *>(details1_buf),
-                                                       details1_buf_len,
-                                                       reinterpret_cast<unsigned char *>(details2_buf),
-                                                       details2_buf_len,
+    unsigned char *buf = idpass_lite_merge_CardDetails(details1_buf.data(),
+                                                       details1_buf.size(),
+                                                       details2_buf.data(),
+                                                       details2_buf.size(),
                                                        &buf_len);
 
-    if (buf != nullptr)
-    {
-        merged = env->NewByteArray(buf_len);
-        env->SetByteArrayRegion(merged, 0, buf_len, (const jbyte *)buf);
-        idpass_lite_freemem(nullptr, buf);
-    }
-
-    env->ReleaseByteArrayElements(details1, details1_buf, 0);
-    env->ReleaseByteArrayElements(details2, details2_buf, 0);
-
-    return merged;
+    details1_buf.release();
+    details2_buf.release();
+    return to_byte_array(env, nullptr, buf, buf_len);
 }
 
 /**
@@ -919,6 +879,134 @@ jstring getenviron(JNIEnv *env,
     return env->NewStringUTF(valuesz);
 }
 
+// Runs a serialized api::Operations batch with idpass_lite_execute
+jbyteArray execute(JNIEnv *env, jobject thiz, jlong context, jbyteArray ops)
+{
+    void *ctx = reinterpret_cast<void *>(context);
+    if (!ctx)
+    {
+        LOGI("null ctx");
+        return env->NewByteArray(0);
+    }
+
+    // A batch may match faces, too long a call to hold it critical
+    JniBytes ops_buf(env, ops, false);
+
+    int outlen = 0;
+    unsigned char *results
+        = idpass_lite_execute(ctx, &outlen, ops_buf.data(), ops_buf.size());
+
+    ops_buf.release();
+    return to_byte_array(env, ctx, results, outlen);
+}
+
+/**
+ * Direct ByteBuffer variants, for callers that keep cards and photos
+ * off the Java heap. Inputs are read in place from the first len bytes
+ * of their buffer. The result is written into out when it has the
+ * capacity, and its length returned either way, or -1 on failure.
+ */
+
+jint create_card_with_face_direct(JNIEnv *env,
+                                  jobject thiz,
+                                  jlong context,
+                                  jobject ident,
+                                  jint ident_len,
+                                  jobject out)
+{
+    void *ctx = reinterpret_cast<void *>(context);
+    unsigned char *ident_buf = direct_address(env, ident, ident_len);
+    if (!ctx || !ident_buf)
+    {
+        return -1;
+    }
+
+    int capacity = 0;
+    unsigned char *dst = direct_out(env, out, &capacity);
+
+    return idpass_lite_create_card_with_face_into(
+        ctx, ident_buf, ident_len, dst, capacity);
+}
+
+jint verify_card_with_face_direct(JNIEnv *env,
+                                  jobject thiz,
+                                  jlong context,
+                                  jobject photo,
+                                  jint photo_len,
+                                  jobject e_signed_card,
+                                  jint e_signed_card_len,
+                                  jobject out)
+{
+    void *ctx = reinterpret_cast<void *>(context);
+    unsigned char *buf = direct_address(env, photo, photo_len);
+    unsigned char *eSignedIDPassCard
+        = direct_address(env, e_signed_card, e_signed_card_len);
+    if (!ctx || !buf || !eSignedIDPassCard)
+    {
+        return -1;
+    }
+
+    int capacity = 0;
+    unsigned char *dst = direct_out(env, out, &capacity);
+
+    return idpass_lite_verify_card_with_face_into(
+        ctx,
+        eSignedIDPassCard,
+        e_signed_card_len,
+        reinterpret_cast<char *>(buf),
+        photo_len,
+        dst,
+        capacity);
+}
+
+jint verify_card_with_pin_direct(JNIEnv *env,
+                                 jobject thiz,
+                                 jlong context,
+                                 jstring pin,
+                                 jobject e_signed_card,
+                                 jint e_signed_card_len,
+                                 jobject out)
+{
+    void *ctx = reinterpret_cast<void *>(context);
+    unsigned char *eSignedIDPassCard
+        = direct_address(env, e_signed_card, e_signed_card_len);
+    if (!ctx || !eSignedIDPassCard || !pin)
+    {
+        return -1;
+    }
+
+    const char *strPin = env->GetStringUTFChars(pin, 0);
+
+    int capacity = 0;
+    unsigned char *dst = direct_out(env, out, &capacity);
+    int details_len = idpass_lite_verify_card_with_pin_into(
+        ctx, eSignedIDPassCard, e_signed_card_len, strPin, dst, capacity);
+
+    env->ReleaseStringUTFChars(pin, strPin);
+    return details_len;
+}
+
+// Writes the 128 floats of the face into out, if it has 512 bytes and
+// exactly one face is found. Returns the count of faces.
+jint compute_face_128d_direct(JNIEnv *env,
+                              jobject thiz,
+                              jlong context,
+                              jobject photo,
+                              jint photo_len,
+                              jobject out)
+{
+    void *ctx = reinterpret_cast<void *>(context);
+    unsigned char *buf = direct_address(env, photo, photo_len);
+    unsigned char *facearray = direct_address(env, out, 128 * 4);
+    if (!ctx || !buf || !facearray)
+    {
+        return -1;
+    }
+
+    return idpass_lite_face128dbuf(
+        ctx, reinterpret_cast<char *>(buf), photo_len, facearray);
+}
+
 JNINativeMethod IDPASS_JNI[] = {
     {(char *)"ioctl", (char *)"(J[B)[B", (void *)ioctl},
 
@@ -1014,3 +1102,59 @@ JNINativeMethod IDPASS_JNI[] = {
 };
 
 int IDPASS_JNI_TLEN = sizeof IDPASS_JNI / sizeof IDPASS_JNI[0];
+
+// Bound one by one, and only where the Java class declares them
+static JNINativeMethod IDPASS_JNI_OPTIONAL[] = {
+    {(char *)"create_card_with_face_direct",
+     (char *)"(JLjava/nio/ByteBuffer;ILjava/nio/ByteBuffer;)I",
+     (void *)create_card_with_face_direct},
+
+    {(char *)"verify_card_with_face_direct",
+     (char *)"(JLjava/nio/ByteBuffer;ILjava/nio/ByteBuffer;ILjava/nio/ByteBuffer;)I",
+     (void *)verify_card_with_face_direct},
+
+    {(char *)"verify_card_with_pin_direct",
+     (char *)"(JLjava/lang/String;Ljava/nio/ByteBuffer;ILjava/nio/ByteBuffer;)I",
+     (void *)verify_card_with_pin_direct},
+
+    {(char *)"compute_face_128d_direct",
+     (char *)"(JLjava/nio/ByteBuffer;ILjava/nio/ByteBuffer;)I",
+     (void *)compute_face_128d_direct},
+
+    {(char *)"execute", (char *)"(J[B)[B", (void *)execute},
+};
+
+bool idpass_jni_init(JNIEnv *env)
+{
+    jclass clazz = env->FindClass("java/util/BitSet");
+    if (clazz == nullptr)
+    {
+        return false;
+    }
+    g_BitSet = reinterpret_cast<jclass>(env->NewGlobalRef(clazz));
+    env->DeleteLocalRef(clazz);
+
+    g_BitSet_valueOf = env->GetStaticMethodID(
+        g_BitSet, "valueOf", "([J)Ljava/util/BitSet;");
+    if (g_BitSet_valueOf == nullptr)
+    {
+        return false;
+    }
+
+    clazz = env->FindClass("org/idpass/lite/IDPassReader");
+    if (clazz == nullptr)
+    {
+        env->ExceptionClear();
+        return true;
+    }
+    for (auto &method : IDPASS_JNI_OPTIONAL)
+    {
+        if (env->RegisterNatives(clazz, &method, 1) != 0)
+        {
+            env->ExceptionClear();
+        }
+    }
+    env->DeleteLocalRef(clazz);
+
+    return true;
+}
@@ -31,10 +31,15 @@
 
 #include "qrcode.h"
 
+#include <algorithm>
+#include <bitset>
 #include <cstring>
+#include <memory>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
 #include <vector>
 
 #pragma mark - Error Correction Lookup tables
@@ -196,27 +201,6 @@ static int8_t getAlphanumeric(char c)
     return -1;
 }
 
-static bool isAlphanumeric(const char *text, uint16_t length)
-{
-    while (length != 0) {
-        if (getAlphanumeric(text[--length]) == -1) {
-            return false;
-        }
-    }
-    return true;
-}
-
-static bool isNumeric(const char *text, uint16_t length)
-{
-    while (length != 0) {
-        char c = text[--length];
-        if (c < '0' || c > '9') {
-            return false;
-        }
-    }
-    return true;
-}
-
 #pragma mark - Counting
 
 // We store the following tightly packed (less 8) in modeInfo
@@ -251,6 +235,134 @@ static char getModeBits(uint8_t version, uint8_t mode)
     return result;
 }
 
+#pragma mark - Segmentation
+
+typedef struct QrSegment {
+    uint8_t mode;
+    uint16_t start;
+    uint16_t length;
+} QrSegment;
+
+// Returns the bits of a segment's data, without its mode and count header
+static uint32_t getSegmentDataBits(uint8_t mode, uint16_t length)
+{
+    switch (mode) {
+    case MODE_NUMERIC:
+        return 10 * (length / 3) + (length % 3 ? (length % 3) * 3 + 1 : 0);
+    case MODE_ALPHANUMERIC:
+        return 11 * (length / 2) + 6 * (length % 2);
+    default:
+        return 8 * length;
+    }
+}
+
+// Returns the total bits of the segments at the given version, or 0 if a
+// segment has more characters than its count field holds
+static uint32_t getSegmentsBits(const std::vector<QrSegment> &segments,
+                                uint8_t version)
+{
+    uint32_t bits = 0;
+    for (const QrSegment &segment : segments) {
+        uint8_t countBits = getModeBits(version, segment.mode);
+        if (segment.length >= (1UL << countBits)) {
+            return 0;
+        }
+        bits += 4 + countBits
+                + getSegmentDataBits(segment.mode, segment.length);
+    }
+    return bits;
+}
+
+// Splits text into the numeric, alphanumeric and byte segments of least
+// total bit length at the given version. This is the dynamic programming of
+// Nayuki's generator: for every character and every mode, it keeps the
+// cheapest encoding so far that ends in that mode, and then walks back from
+// the cheapest end. Costs are in sixths of a bit, so that numeric (10/3
+// bits) and alphanumeric (11/2 bits) characters have whole costs.
+static void getOptimalSegments(const uint8_t *text,
+                               uint16_t length,
+                               uint8_t version,
+                               std::vector<QrSegment> &segments)
+{
+    segments.clear();
+    // An empty text is one empty numeric segment, as it always was
+    if (length == 0) {
+        QrSegment empty = {MODE_NUMERIC, 0, 0};
+        segments.push_back(empty);
+        return;
+    }
+
+    static const uint32_t CHAR_COSTS[3] = {20, 33, 48};
+
+    uint32_t headCosts[3];
+    for (uint8_t m = 0; m < 3; m++) {
+        headCosts[m] = (4 + getModeBits(version, m)) * 6;
+    }
+
+    // charModes[i * 3 + m] is the mode of character i on the cheapest path
+    // that leaves it in mode m, or -1 if there is none
+    std::vector<int8_t> charModes(length * 3);
+    uint32_t prevCosts[3] = {headCosts[0], headCosts[1], headCosts[2]};
+
+    for (uint16_t i = 0; i < length; i++) {
+        int8_t *modes = &charModes[i * 3];
+        uint32_t curCosts[3] = {0, 0, 0};
+
+        modes[MODE_NUMERIC] = -1;
+        modes[MODE_ALPHANUMERIC] = -1;
+        modes[MODE_BYTE] = MODE_BYTE;
+        curCosts[MODE_BYTE] = prevCosts[MODE_BYTE] + CHAR_COSTS[MODE_BYTE];
+
+        if (getAlphanumeric(text[i]) != -1) {
+            modes[MODE_ALPHANUMERIC] = MODE_ALPHANUMERIC;
+            curCosts[MODE_ALPHANUMERIC] = prevCosts[MODE_ALPHANUMERIC]
+                                          + CHAR_COSTS[MODE_ALPHANUMERIC];
+        }
+        if (text[i] >= '0' && text[i] <= '9') {
+            modes[MODE_NUMERIC] = MODE_NUMERIC;
+            curCosts[MODE_NUMERIC]
+                = prevCosts[MODE_NUMERIC] + CHAR_COSTS[MODE_NUMERIC];
+        }
+
+        // Switching modes after this character closes its segment, rounded
+        // up to whole bits, and opens a new one
+        for (uint8_t to = 0; to < 3; to++) {
+            for (uint8_t from = 0; from < 3; from++) {
+                if (modes[from] == -1) {
+                    continue;
+                }
+                uint32_t cost = (curCosts[from] + 5) / 6 * 6 + headCosts[to];
+                if (modes[to] == -1 || cost < curCosts[to]) {
+                    curCosts[to] = cost;
+                    modes[to] = from;
+                }
+            }
+        }
+
+        memcpy(prevCosts, curCosts, sizeof(prevCosts));
+    }
+
+    uint8_t mode = 0;
+    for (uint8_t m = 1; m < 3; m++) {
+        if (prevCosts[m] < prevCosts[mode]) {
+            mode = m;
+        }
+    }
+
+    // Walk back, merging characters of the same mode into segments
+    for (int i = length - 1; i >= 0; i--) {
+        mode = charModes[i * 3 + mode];
+        if (segments.empty() || segments.back().mode != mode) {
+            QrSegment segment = {mode, (uint16_t)i, 0};
+            segments.push_back(segment);
+        }
+        segments.back().start = i;
+        segments.back().length++;
+    }
+
+    std::reverse(segments.begin(), segments.end());
+}
+
 #pragma mark - BitBucket
 
 typedef struct BitBucket {
@@ -325,74 +437,188 @@ static void bb_setBit(BitBucket *bitGrid, uint8_t x, uint8_t y, bool on)
     }
 }
 
-static void bb_invertBit(BitBucket *bitGrid, uint8_t x, uint8_t y, bool invert)
+static bool bb_getBit(BitBucket *bitGrid, uint8_t x, uint8_t y)
 {
     uint32_t offset = y * bitGrid->bitOffsetOrWidth + x;
-    uint8_t mask = 1 << (7 - (offset & 0x07));
-    bool on
-        = ((bitGrid->data[offset >> 3] & (1 << (7 - (offset & 0x07)))) != 0);
-    if (on ^ invert) {
-        bitGrid->data[offset >> 3] |= mask;
-    } else {
-        bitGrid->data[offset >> 3] &= ~mask;
+    return (bitGrid->data[offset >> 3] & (1 << (7 - (offset & 0x07)))) != 0;
+}
+
+#pragma mark - Packed Grid
+
+// The widest symbol (version 40) is 177 modules, three 64 bits words per row
+#define QR_MAX_SIZE 177
+#define QR_ROW_WORDS 3
+
+// From this version on, the mask candidates are scored on two threads
+#define QR_PARALLEL_MASK_VERSION 30
+
+// Cleared on threads whose caller already encodes symbols in parallel
+static thread_local bool maskThreading = true;
+
+// Grid of modules with every row packed into its own words, most significant
+// bit first, so that masking and scoring work on whole words. Bits past the
+// symbol size are always zero.
+typedef struct PackedGrid {
+    uint8_t size;
+    uint64_t rows[QR_MAX_SIZE][QR_ROW_WORDS];
+} PackedGrid;
+
+static void pg_pack(PackedGrid *grid, const BitBucket *bitGrid)
+{
+    uint8_t size = bitGrid->bitOffsetOrWidth;
+    const uint8_t *data = bitGrid->data;
+
+    grid->size = size;
+    memset(grid->rows, 0, sizeof(grid->rows));
+
+    // Eight modules at a time, out of the 16 bits window they straddle
+    for (uint8_t y = 0; y < size; y++) {
+        for (uint8_t x = 0; x < size; x += 8) {
+            uint32_t offset = y * size + x;
+            uint16_t b = offset >> 3;
+            uint16_t window = data[b] << 8;
+            if (b + 1 < bitGrid->capacityBytes) {
+                window |= data[b + 1];
+            }
+            uint8_t chunk = (window << (offset & 7)) >> 8;
+            if (size - x < 8) {
+                chunk &= 0xFF << (8 - (size - x));
+            }
+            grid->rows[y][x >> 6] |= (uint64_t)chunk << (56 - (x & 63));
+        }
     }
 }
 
-static bool bb_getBit(BitBucket *bitGrid, uint8_t x, uint8_t y)
+static void pg_unpack(BitBucket *bitGrid, const PackedGrid *grid)
 {
-    uint32_t offset = y * bitGrid->bitOffsetOrWidth + x;
-    return (bitGrid->data[offset >> 3] & (1 << (7 - (offset & 0x07)))) != 0;
+    uint8_t size = grid->size;
+    uint8_t *data = bitGrid->data;
+
+    memset(data, 0, bitGrid->capacityBytes);
+
+    for (uint8_t y = 0; y < size; y++) {
+        for (uint8_t x = 0; x < size; x += 8) {
+            uint8_t chunk = grid->rows[y][x >> 6] >> (56 - (x & 63));
+            uint32_t offset = y * size + x;
+            uint8_t shift = offset & 7;
+            data[offset >> 3] |= chunk >> shift;
+            uint8_t rest = chunk << (8 - shift);
+            if (shift != 0 && rest != 0) {
+                data[(offset >> 3) + 1] |= rest;
+            }
+        }
+    }
+}
+
+// Sets the bits of the modules from <= x < to
+static void pg_range(uint8_t from, uint8_t to, uint64_t *out)
+{
+    for (uint8_t w = 0; w < QR_ROW_WORDS; w++) {
+        int lo = max(from - w * 64, 0);
+        int hi = to - w * 64;
+        if (hi > 64) {
+            hi = 64;
+        }
+        out[w] = 0;
+        if (lo < hi) {
+            uint64_t bits = hi - lo == 64 ? ~0ULL : ((1ULL << (hi - lo)) - 1);
+            out[w] = bits << (64 - hi);
+        }
+    }
+}
+
+// Moves every module k (1 to 63) places right, so that bit x of out holds
+// module x - k of row. Modules shifted in from the left are zero.
+static void pg_shift(const uint64_t *row, uint8_t k, uint64_t *out)
+{
+    out[0] = row[0] >> k;
+    for (uint8_t w = 1; w < QR_ROW_WORDS; w++) {
+        out[w] = (row[w] >> k) | (row[w - 1] << (64 - k));
+    }
+}
+
+static uint32_t pg_count(const uint64_t *row)
+{
+    uint32_t count = 0;
+    for (uint8_t w = 0; w < QR_ROW_WORDS; w++) {
+        count += std::bitset<64>(row[w]).count();
+    }
+    return count;
 }
 
 #pragma mark - Drawing Patterns
 
+static bool getMaskBit(uint8_t mask, uint8_t x, uint8_t y)
+{
+    switch (mask) {
+    case 0:
+        return (x + y) % 2 == 0;
+    case 1:
+        return y % 2 == 0;
+    case 2:
+        return x % 3 == 0;
+    case 3:
+        return (x + y) % 3 == 0;
+    case 4:
+        return (x / 3 + y / 2) % 2 == 0;
+    case 5:
+        return x * y % 2 + x * y % 3 == 0;
+    case 6:
+        return (x * y % 2 + x * y % 3) % 2 == 0;
+    case 7:
+        return ((x + y) % 2 + x * y % 3) % 2 == 0;
+    }
+    return false;
+}
+
+// The eight mask patterns over the largest symbol, packed like PackedGrid
+typedef struct MaskPlanes {
+    uint64_t rows[8][QR_MAX_SIZE][QR_ROW_WORDS];
+
+    MaskPlanes()
+    {
+        memset(rows, 0, sizeof(rows));
+        for (uint8_t mask = 0; mask < 8; mask++) {
+            for (uint8_t y = 0; y < QR_MAX_SIZE; y++) {
+                for (uint8_t x = 0; x < QR_MAX_SIZE; x++) {
+                    if (getMaskBit(mask, x, y)) {
+                        rows[mask][y][x >> 6] |= 1ULL << (63 - (x & 63));
+                    }
+                }
+            }
+        }
+    }
+} MaskPlanes;
+
+static const MaskPlanes &maskPlanes()
+{
+    static const MaskPlanes planes;
+    return planes;
+}
+
 // XORs the data modules in this QR Code with the given mask pattern. Due to
 // XOR's mathematical properties, calling applyMask(m) twice with the same value
 // is equivalent to no change at all. This means it is possible to apply a mask,
 // undo it, and try another mask. Note that a final well-formed QR Code symbol
 // needs exactly one mask applied (not zero, not two, etc.).
-static void applyMask(BitBucket *modules, BitBucket *isFunction, uint8_t mask)
+static void
+applyMask(PackedGrid *modules, const PackedGrid *isFunction, uint8_t mask)
 {
-    uint8_t size = modules->bitOffsetOrWidth;
+    const uint64_t(*plane)[QR_ROW_WORDS] = maskPlanes().rows[mask];
+    uint8_t size = modules->size;
 
-    for (uint8_t y = 0; y < size; y++) {
-        for (uint8_t x = 0; x < size; x++) {
-            if (bb_getBit(isFunction, x, y)) {
-                continue;
-            }
+    uint64_t inside[QR_ROW_WORDS];
+    pg_range(0, size, inside);
 
-            bool invert = 0;
-            switch (mask) {
-            case 0:
-                invert = (x + y) % 2 == 0;
-                break;
-            case 1:
-                invert = y % 2 == 0;
-                break;
-            case 2:
-                invert = x % 3 == 0;
-                break;
-            case 3:
-                invert = (x + y) % 3 == 0;
-                break;
-            case 4:
-                invert = (x / 3 + y / 2) % 2 == 0;
-                break;
-            case 5:
-                invert = x * y % 2 + x * y % 3 == 0;
-                break;
-            case 6:
-                invert = (x * y % 2 + x * y % 3) % 2 == 0;
-                break;
-            case 7:
-                invert = ((x + y) % 2 + x * y % 3) % 2 == 0;
-                break;
-            }
-            bb_invertBit(modules, x, y, invert);
+    for (uint8_t y = 0; y < size; y++) {
+        for (uint8_t w = 0; w < QR_ROW_WORDS; w++) {
+            modules->rows[y][w]
+                ^= plane[y][w] & ~isFunction->rows[y][w] & inside[w];
         }
     }
 }
 
+// Sets a module and marks it as a function module, unless isFunction is null
 static void setFunctionModule(BitBucket *modules,
                               BitBucket *isFunction,
                               uint8_t x,
@@ -400,7 +626,9 @@ static void setFunctionModule(BitBucket *modules,
                               bool on)
 {
     bb_setBit(modules, x, y, on);
-    bb_setBit(isFunction, x, y, true);
+    if (isFunction != nullptr) {
+        bb_setBit(isFunction, x, y, true);
+    }
 }
 
 // Draws a 9*9 finder pattern including the border separator, with the center
@@ -438,6 +666,31 @@ static void drawAlignmentPattern(BitBucket *modules,
     }
 }
 
+// Returns the 15 bit format word of the error correction level and mask,
+// with its error correction code
+static uint16_t getFormatWord(uint8_t ecc, uint8_t mask)
+{
+    uint32_t data = ecc << 3 | mask; // errCorrLvl is uint2, mask is uint3
+    uint32_t rem = data;
+    for (int i = 0; i < 10; i++) {
+        rem = (rem << 1) ^ ((rem >> 9) * 0x537);
+    }
+
+    data = data << 10 | rem;
+    return data ^ 0x5412; // uint15
+}
+
+// Returns the 18 bit version word, with its error correction code
+static uint32_t getVersionWord(uint8_t version)
+{
+    uint32_t rem = version; // version is uint6, in the range [7, 40]
+    for (uint8_t i = 0; i < 12; i++) {
+        rem = (rem << 1) ^ ((rem >> 11) * 0x1F25);
+    }
+
+    return version << 12 | rem; // uint18
+}
+
 // Draws two copies of the format bits (with its own error correction code)
 // based on the given mask and this object's error correction level field.
 static void drawFormatBits(BitBucket *modules,
@@ -447,15 +700,7 @@ static void drawFormatBits(BitBucket *modules,
 {
     uint8_t size = modules->bitOffsetOrWidth;
 
-    // Calculate error correction code and pack bits
-    uint32_t data = ecc << 3 | mask; // errCorrLvl is uint2, mask is uint3
-    uint32_t rem = data;
-    for (int i = 0; i < 10; i++) {
-        rem = (rem << 1) ^ ((rem >> 9) * 0x537);
-    }
-
-    data = data << 10 | rem;
-    data ^= 0x5412; // uint15
+    uint32_t data = getFormatWord(ecc, mask);
 
     // Draw first copy
     for (uint8_t i = 0; i <= 5; i++) {
@@ -501,13 +746,7 @@ drawVersion(BitBucket *modules, BitBucket *isFunction, uint8_t version)
         return;
     }
 
-    // Calculate error correction code and pack bits
-    uint32_t rem = version; // version is uint6, in the range [7, 40]
-    for (uint8_t i = 0; i < 12; i++) {
-        rem = (rem << 1) ^ ((rem >> 11) * 0x1F25);
-    }
-
-    uint32_t data = version << 12 | rem; // uint18
+    uint32_t data = getVersionWord(version);
 
     // Draw two copies
     for (uint8_t i = 0; i < 18; i++) {
@@ -589,19 +828,15 @@ static void drawFunctionPatterns(BitBucket *modules,
     drawVersion(modules, isFunction, version);
 }
 
-// Draws the given sequence of 8-bit codewords (data and error correction) onto
-// the entire data area of this QR Code symbol. Function modules need to be
-// marked off before this is called.
-static void
-drawCodewords(BitBucket *modules, BitBucket *isFunction, BitBucket *codewords)
+// Lists the data modules of a grid, as offsets into it, in the order the
+// codewords are placed. Function modules need to be marked off before this is
+// called.
+static void getPlacementOrder(BitBucket *isFunction,
+                              std::vector<uint16_t> &placement)
 {
-    uint32_t bitLength = codewords->bitOffsetOrWidth;
-    uint8_t *data = codewords->data;
-
-    uint8_t size = modules->bitOffsetOrWidth;
+    uint8_t size = isFunction->bitOffsetOrWidth;
 
-    // Bit index into the data
-    uint32_t i = 0;
+    placement.clear();
 
     // Do the funny zigzag scan
     for (int16_t right = size - 1; right >= 1;
@@ -616,20 +851,75 @@ drawCodewords(BitBucket *modules, BitBucket *isFunction, BitBucket *codewords)
                 bool upwards = ((right & 2) == 0) ^ (x < 6);
                 uint8_t y
                     = upwards ? size - 1 - vert : vert; // Actual y coordinate
-                if (!bb_getBit(isFunction, x, y) && i < bitLength) {
-                    bb_setBit(modules,
-                              x,
-                              y,
-                              ((data[i >> 3] >> (7 - (i & 7))) & 1) != 0);
-                    i++;
+                if (!bb_getBit(isFunction, x, y)) {
+                    placement.push_back(y * size + x);
                 }
-                // If there are any remainder bits (0 to 7), they are already
-                // set to 0/false/white when the grid of modules was initialized
             }
         }
     }
 }
 
+// Draws the given sequence of 8-bit codewords (data and error correction) onto
+// the data modules, in placement order. If there are any remainder bits (0 to
+// 7), they are left 0/false/white as drawn by the template.
+static void drawCodewords(BitBucket *modules,
+                          const std::vector<uint16_t> &placement,
+                          BitBucket *codewords)
+{
+    uint32_t bitLength = codewords->bitOffsetOrWidth;
+    if (bitLength > placement.size()) {
+        bitLength = placement.size();
+    }
+    const uint8_t *data = codewords->data;
+
+    for (uint32_t i = 0; i < bitLength; i++) {
+        if ((data[i >> 3] >> (7 - (i & 7))) & 1) {
+            uint16_t offset = placement[i];
+            modules->data[offset >> 3] |= 1 << (7 - (offset & 7));
+        }
+    }
+}
+
+#pragma mark - Templates
+
+// Function patterns of one version, drawn once and copied into every symbol
+// of that version. The format bits carry the dummy mask 0, so there is one
+// grid per error correction level.
+typedef struct QrTemplate {
+    std::vector<uint8_t> modules[4];
+    PackedGrid isFunction;
+    std::vector<uint16_t> placement;
+} QrTemplate;
+
+// Returns the template of the given version, built on first use
+static const QrTemplate *getTemplate(uint8_t version)
+{
+    static std::once_flag once[40];
+    static std::unique_ptr<QrTemplate> templates[40];
+
+    std::call_once(once[version - 1], [version]() {
+        uint8_t size = version * 4 + 17;
+
+        std::unique_ptr<QrTemplate> t(new QrTemplate);
+        std::vector<uint8_t> isFunctionBytes(bb_getGridSizeBytes(size));
+        BitBucket isFunction;
+
+        for (uint8_t ecc = 0; ecc < 4; ecc++) {
+            BitBucket modules;
+            t->modules[ecc].resize(bb_getGridSizeBytes(size));
+            bb_initGrid(&modules, t->modules[ecc].data(), size);
+            bb_initGrid(&isFunction, isFunctionBytes.data(), size);
+            drawFunctionPatterns(&modules, &isFunction, version, ecc);
+        }
+
+        pg_pack(&t->isFunction, &isFunction);
+        getPlacementOrder(&isFunction, t->placement);
+        templates[version - 1] = std::move(t);
+    });
+
+    return templates[version - 1].get();
+}
+
 #pragma mark - Penalty Calculation
 
 #define PENALTY_N1 3
@@ -637,90 +927,116 @@ drawCodewords(BitBucket *modules, BitBucket *isFunction, BitBucket *codewords)
 #define PENALTY_N3 40
 #define PENALTY_N4 10
 
+// The two 11 modules finder-like sequences, oldest module in bit 10
+static const uint16_t FINDER_LIKE[2] = {0x05D, 0x5D0};
+
+// Counts the positions where the 11 modules ending there, given by window[j]
+// holding the module j places back, match pattern
+static uint32_t countFinderLike(const uint64_t (*window)[QR_ROW_WORDS],
+                                uint16_t pattern,
+                                const uint64_t *positions)
+{
+    uint64_t match[QR_ROW_WORDS];
+    memcpy(match, positions, sizeof(match));
+    for (uint8_t j = 0; j < 11; j++) {
+        bool on = (pattern >> j) & 1;
+        for (uint8_t w = 0; w < QR_ROW_WORDS; w++) {
+            match[w] &= on ? window[j][w] : ~window[j][w];
+        }
+    }
+    return pg_count(match);
+}
+
 // Calculates and returns the penalty score based on state of this QR Code's
 // current modules. This is used by the automatic mask choice algorithm to find
 // the mask pattern that yields the lowest score.
-// @TODO: This can be optimized by working with the bytes instead of bits.
-static uint32_t getPenaltyScore(BitBucket *modules)
+//
+// Rows are scored with shifted copies of themselves and columns a row at a
+// time across all columns at once, so every rule is a few word operations per
+// row. A run of length n >= 5 scores PENALTY_N1 + (n - 5), which is one per
+// position that ends four equal neighbours plus PENALTY_N1 - 1 per run.
+static uint32_t getPenaltyScore(const PackedGrid *modules)
 {
     uint32_t result = 0;
 
-    uint8_t size = modules->bitOffsetOrWidth;
+    uint8_t size = modules->size;
 
-    // Adjacent modules in row having same color
-    for (uint8_t y = 0; y < size; y++) {
-        bool colorX = bb_getBit(modules, 0, y);
-        for (uint8_t x = 1, runX = 1; x < size; x++) {
-            bool cx = bb_getBit(modules, x, y);
-            if (cx != colorX) {
-                colorX = cx;
-                runX = 1;
-
-            } else {
-                runX++;
-                if (runX == 5) {
-                    result += PENALTY_N1;
-                } else if (runX > 5) {
-                    result++;
-                }
-            }
-        }
-    }
+    uint64_t inside[QR_ROW_WORDS], fromX1[QR_ROW_WORDS],
+        fromX10[QR_ROW_WORDS];
+    pg_range(0, size, inside);
+    pg_range(1, size, fromX1);
+    pg_range(10, size, fromX10);
 
-    // Adjacent modules in column having same color
-    for (uint8_t x = 0; x < size; x++) {
-        bool colorY = bb_getBit(modules, x, 0);
-        for (uint8_t y = 1, runY = 1; y < size; y++) {
-            bool cy = bb_getBit(modules, x, y);
-            if (cy != colorY) {
-                colorY = cy;
-                runY = 1;
-            } else {
-                runY++;
-                if (runY == 5) {
-                    result += PENALTY_N1;
-                } else if (runY > 5) {
-                    result++;
-                }
-            }
-        }
-    }
+    // Column state: same color as the module above over the last four rows,
+    // the resulting run marks of the previous row, and the last 11 rows
+    uint64_t sameUp[4][QR_ROW_WORDS] = {};
+    uint64_t runUp[QR_ROW_WORDS] = {};
+    uint64_t sameLeftUp[QR_ROW_WORDS] = {};
+    uint64_t column[11][QR_ROW_WORDS] = {};
 
     uint16_t black = 0;
     for (uint8_t y = 0; y < size; y++) {
-        uint16_t bitsRow = 0, bitsCol = 0;
-        for (uint8_t x = 0; x < size; x++) {
-            bool color = bb_getBit(modules, x, y);
-
-            // 2*2 blocks of modules having same color
-            if (x > 0 && y > 0) {
-                bool colorUL = bb_getBit(modules, x - 1, y - 1);
-                bool colorUR = bb_getBit(modules, x, y - 1);
-                bool colorL = bb_getBit(modules, x - 1, y);
-                if (color == colorUL && color == colorUR && color == colorL) {
-                    result += PENALTY_N2;
-                }
-            }
+        const uint64_t *row = modules->rows[y];
 
-            // Finder-like pattern in rows and columns
-            bitsRow = ((bitsRow << 1) & 0x7FF) | color;
-            bitsCol = ((bitsCol << 1) & 0x7FF) | bb_getBit(modules, y, x);
+        // window[j] holds module x - j of this row at bit x
+        uint64_t window[11][QR_ROW_WORDS];
+        memcpy(window[0], row, sizeof(window[0]));
+        for (uint8_t j = 1; j < 11; j++) {
+            pg_shift(row, j, window[j]);
+        }
 
-            // Needs 11 bits accumulated
-            if (x >= 10) {
-                if (bitsRow == 0x05D || bitsRow == 0x5D0) {
-                    result += PENALTY_N3;
-                }
-                if (bitsCol == 0x05D || bitsCol == 0x5D0) {
-                    result += PENALTY_N3;
-                }
+        // Adjacent modules in row having same color
+        uint64_t sameLeft[QR_ROW_WORDS], run[QR_ROW_WORDS], tmp[QR_ROW_WORDS];
+        for (uint8_t w = 0; w < QR_ROW_WORDS; w++) {
+            sameLeft[w] = ~(row[w] ^ window[1][w]) & fromX1[w];
+        }
+        memcpy(run, sameLeft, sizeof(run));
+        for (uint8_t k = 1; k < 4; k++) {
+            pg_shift(sameLeft, k, tmp);
+            for (uint8_t w = 0; w < QR_ROW_WORDS; w++) {
+                run[w] &= tmp[w];
             }
+        }
+        pg_shift(run, 1, tmp);
+        for (uint8_t w = 0; w < QR_ROW_WORDS; w++) {
+            tmp[w] = run[w] & ~tmp[w];
+        }
+        result += pg_count(run) + pg_count(tmp) * (PENALTY_N1 - 1);
+
+        // Adjacent modules in column having same color
+        memmove(sameUp[1], sameUp[0], sizeof(sameUp[0]) * 3);
+        for (uint8_t w = 0; w < QR_ROW_WORDS; w++) {
+            sameUp[0][w] = y > 0 ? ~(row[w] ^ column[0][w]) & inside[w] : 0;
+        }
+        for (uint8_t w = 0; w < QR_ROW_WORDS; w++) {
+            uint64_t r = sameUp[0][w] & sameUp[1][w] & sameUp[2][w]
+                         & sameUp[3][w];
+            tmp[w] = r & ~runUp[w];
+            runUp[w] = r;
+        }
+        result += pg_count(runUp) + pg_count(tmp) * (PENALTY_N1 - 1);
 
-            // Balance of black and white modules
-            if (color) {
-                black++;
+        // 2*2 blocks of modules having same color
+        for (uint8_t w = 0; w < QR_ROW_WORDS; w++) {
+            tmp[w] = sameLeft[w] & sameLeftUp[w] & sameUp[0][w];
+        }
+        result += pg_count(tmp) * PENALTY_N2;
+        memcpy(sameLeftUp, sameLeft, sizeof(sameLeftUp));
+
+        // Finder-like pattern in rows and columns
+        memmove(column[1], column[0], sizeof(column[0]) * 10);
+        memcpy(column[0], row, sizeof(column[0]));
+        for (uint8_t p = 0; p < 2; p++) {
+            result += countFinderLike(window, FINDER_LIKE[p], fromX10)
+                      * PENALTY_N3;
+            if (y >= 10) {
+                result += countFinderLike(column, FINDER_LIKE[p], inside)
+                          * PENALTY_N3;
             }
         }
+
+        // Balance of black and white modules
+        black += pg_count(row);
     }
 
     // Find smallest k such that (45-5k)% <= dark/total <= (55+5k)%
@@ -736,140 +1052,310 @@ static uint32_t getPenaltyScore(BitBucket *modules)
 
 #pragma mark - Reed-Solomon Generator
 
+#define RS_MAX_DEGREE 30
+#define RS_ROW 32
+
+// Exp and log tables of GF(2^8/0x11D), with generator element 0x02. The
+// exp table is doubled so that the sum of two logs needs no reduction.
+typedef struct RsTables {
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    RsTables()
+    {
+        uint16_t x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = x;
+            exp[i + 255] = x;
+            log[x] = i;
+            x = (x << 1) ^ ((x >> 7) * 0x11D);
+        }
+        exp[510] = exp[0];
+        exp[511] = exp[1];
+        log[0] = 0;
+    }
+} RsTables;
+
+static const RsTables &rs_tables()
+{
+    static const RsTables tables;
+    return tables;
+}
+
 static uint8_t rs_multiply(uint8_t x, uint8_t y)
 {
-    // Russian peasant multiplication
-    // See: https://en.wikipedia.org/wiki/Ancient_Egyptian_multiplication
-    uint16_t z = 0;
-    for (int8_t i = 7; i >= 0; i--) {
-        z = (z << 1) ^ ((z >> 7) * 0x11D);
-        z ^= ((y >> i) & 1) * x;
+    if (x == 0 || y == 0) {
+        return 0;
     }
-    return z;
+    const RsTables &t = rs_tables();
+    return t.exp[t.log[x] + t.log[y]];
 }
 
-static void rs_init(uint8_t degree, uint8_t *coeff)
+// Generator polynomial of one degree, kept as its product with every
+// possible factor. Rows are zero padded to RS_ROW bytes so the remainder
+// update is a fixed-width XOR.
+typedef struct RsGenerator {
+    uint8_t degree;
+    uint8_t mul[256][RS_ROW];
+} RsGenerator;
+
+// Returns the generator of the given degree, built once on first use
+static const RsGenerator *rs_init(uint8_t degree)
 {
-    memset(coeff, 0, degree);
-    coeff[degree - 1] = 1;
+    static std::once_flag once[RS_MAX_DEGREE + 1];
+    static std::unique_ptr<RsGenerator> generators[RS_MAX_DEGREE + 1];
+
+    std::call_once(once[degree], [degree]() {
+        uint8_t coeff[RS_MAX_DEGREE];
+        memset(coeff, 0, degree);
+        coeff[degree - 1] = 1;
+
+        // Compute the product polynomial (x - r^0) * (x - r^1) * (x - r^2)
+        // * ... * (x - r^{degree-1}), drop the highest term, and store the
+        // rest of the coefficients in order of descending powers. Note that
+        // r = 0x02, which is a generator element of this field
+        // GF(2^8/0x11D).
+        uint8_t root = 1;
+        for (uint8_t i = 0; i < degree; i++) {
+            // Multiply the current product by (x - r^i)
+            for (uint8_t j = 0; j < degree; j++) {
+                coeff[j] = rs_multiply(coeff[j], root);
+                if (j + 1 < degree) {
+                    coeff[j] ^= coeff[j + 1];
+                }
+            }
+            root = rs_multiply(root, 0x02);
+        }
 
-    // Compute the product polynomial (x - r^0) * (x - r^1) * (x - r^2) * ... *
-    // (x - r^{degree-1}), drop the highest term, and store the rest of the
-    // coefficients in order of descending powers. Note that r = 0x02, which is
-    // a generator element of this field GF(2^8/0x11D).
-    uint16_t root = 1;
-    for (uint8_t i = 0; i < degree; i++) {
-        // Multiply the current product by (x - r^i)
-        for (uint8_t j = 0; j < degree; j++) {
-            coeff[j] = rs_multiply(coeff[j], root);
-            if (j + 1 < degree) {
-                coeff[j] ^= coeff[j + 1];
+        std::unique_ptr<RsGenerator> gen(new RsGenerator);
+        memset(gen.get(), 0, sizeof(RsGenerator));
+        gen->degree = degree;
+        for (int f = 0; f < 256; f++) {
+            for (uint8_t j = 0; j < degree; j++) {
+                gen->mul[f][j] = rs_multiply(coeff[j], f);
             }
         }
-        root = (root << 1)
-               ^ ((root >> 7) * 0x11D); // Multiply by 0x02 mod GF(2^8/0x11D)
-    }
+        generators[degree] = std::move(gen);
+    });
+
+    return generators[degree].get();
 }
 
-static void rs_getRemainder(uint8_t degree,
-                            uint8_t *coeff,
-                            uint8_t *data,
+static void rs_getRemainder(const RsGenerator *gen,
+                            const uint8_t *data,
                             uint8_t length,
                             uint8_t *result,
                             uint8_t stride)
 {
-    // Compute the remainder by performing polynomial division
-
-    // for (uint8_t i = 0; i < degree; i++) { result[] = 0; }
-    // memset(result, 0, degree);
+    // Compute the remainder by performing polynomial division. Rather
+    // than shifting the remainder each step, the remainder is a window
+    // sliding over a zeroed work buffer: before step i it is
+    // work[i .. i+degree-1].
+    uint8_t work[255 + RS_ROW];
+    memset(work, 0, length + RS_ROW);
 
     for (uint8_t i = 0; i < length; i++) {
-        uint8_t factor = data[i] ^ result[0];
-        for (uint8_t j = 1; j < degree; j++) {
-            result[(j - 1) * stride] = result[j * stride];
+        const uint8_t *row = gen->mul[data[i] ^ work[i]];
+        uint8_t *w = work + i + 1;
+        for (int k = 0; k < RS_ROW; k += 8) {
+            uint64_t a, b;
+            memcpy(&a, w + k, 8);
+            memcpy(&b, row + k, 8);
+            a ^= b;
+            memcpy(w + k, &a, 8);
         }
-        result[(degree - 1) * stride] = 0;
+    }
 
-        for (uint8_t j = 0; j < degree; j++) {
-            result[j * stride] ^= rs_multiply(coeff[j], factor);
-        }
+    for (uint8_t j = 0; j < gen->degree; j++) {
+        result[j * stride] = work[length + j];
     }
 }
 
-#pragma mark - QrCode
-
-static int8_t encodeDataCodewords(BitBucket *dataCodewords,
-                                  const uint8_t *text,
-                                  uint16_t length,
-                                  uint8_t version)
+// Corrects in place up to degree / 2 wrong codewords of a block, whose last
+// degree codewords are its error correction. Returns false if the block has
+// more errors than that.
+static bool rs_correct(uint8_t *block, uint8_t length, uint8_t degree)
 {
-    int8_t mode = MODE_BYTE;
-
-    if (isNumeric((char *)text, length)) {
-        mode = MODE_NUMERIC;
-        bb_appendBits(dataCodewords, 1 << MODE_NUMERIC, 4);
-        bb_appendBits(
-            dataCodewords, length, getModeBits(version, MODE_NUMERIC));
-
-        uint16_t accumData = 0;
-        uint8_t accumCount = 0;
-        for (uint16_t i = 0; i < length; i++) {
-            accumData = accumData * 10 + ((char)(text[i]) - '0');
-            accumCount++;
-            if (accumCount == 3) {
-                bb_appendBits(dataCodewords, accumData, 10);
-                accumData = 0;
-                accumCount = 0;
-            }
+    const RsTables &t = rs_tables();
+
+    // The syndromes are the block evaluated at the roots of the generator,
+    // all zero when there is no error
+    uint8_t syndromes[RS_MAX_DEGREE];
+    bool clean = true;
+    for (uint8_t j = 0; j < degree; j++) {
+        uint8_t s = 0;
+        for (uint8_t i = 0; i < length; i++) {
+            s = rs_multiply(s, t.exp[j]) ^ block[i];
         }
+        syndromes[j] = s;
+        clean = clean && s == 0;
+    }
+    if (clean) {
+        return true;
+    }
 
-        // 1 or 2 digits remaining
-        if (accumCount > 0) {
-            bb_appendBits(dataCodewords, accumData, accumCount * 3 + 1);
+    // Berlekamp-Massey, for the error locator polynomial
+    uint8_t locator[RS_MAX_DEGREE + 1] = {1};
+    uint8_t previous[RS_MAX_DEGREE + 1] = {1};
+    uint8_t saved[RS_MAX_DEGREE + 1];
+    uint8_t errors = 0, shift = 1, lastDiscrepancy = 1;
+    for (uint8_t k = 0; k < degree; k++) {
+        uint8_t d = syndromes[k];
+        for (uint8_t i = 1; i <= errors; i++) {
+            d ^= rs_multiply(locator[i], syndromes[k - i]);
+        }
+        if (d == 0) {
+            shift++;
+            continue;
         }
 
-    } else if (isAlphanumeric((char *)text, length)) {
-        mode = MODE_ALPHANUMERIC;
-        bb_appendBits(dataCodewords, 1 << MODE_ALPHANUMERIC, 4);
-        bb_appendBits(
-            dataCodewords, length, getModeBits(version, MODE_ALPHANUMERIC));
-
-        uint16_t accumData = 0;
-        uint8_t accumCount = 0;
-        for (uint16_t i = 0; i < length; i++) {
-            accumData = accumData * 45 + getAlphanumeric((char)(text[i]));
-            accumCount++;
-            if (accumCount == 2) {
-                bb_appendBits(dataCodewords, accumData, 11);
-                accumData = 0;
-                accumCount = 0;
-            }
+        uint8_t coef = t.exp[t.log[d] + 255 - t.log[lastDiscrepancy]];
+        memcpy(saved, locator, sizeof(saved));
+        for (uint8_t i = 0; i + shift <= degree; i++) {
+            locator[i + shift] ^= rs_multiply(coef, previous[i]);
         }
 
-        // 1 character remaining
-        if (accumCount > 0) {
-            bb_appendBits(dataCodewords, accumData, 6);
+        if (2 * errors <= k) {
+            errors = k + 1 - errors;
+            memcpy(previous, saved, sizeof(previous));
+            lastDiscrepancy = d;
+            shift = 1;
+        } else {
+            shift++;
         }
+    }
+    if (2 * errors > degree) {
+        return false;
+    }
 
-    } else {
-        bb_appendBits(dataCodewords, 1 << MODE_BYTE, 4);
-        bb_appendBits(dataCodewords, length, getModeBits(version, MODE_BYTE));
-        for (uint16_t i = 0; i < length; i++) {
-            bb_appendBits(dataCodewords, (char)(text[i]), 8);
+    // Error evaluator, the syndromes times the locator modulo x^degree
+    uint8_t evaluator[RS_MAX_DEGREE];
+    for (uint8_t j = 0; j < degree; j++) {
+        evaluator[j] = 0;
+        for (uint8_t i = 0; i <= j && i <= errors; i++) {
+            evaluator[j] ^= rs_multiply(locator[i], syndromes[j - i]);
         }
     }
 
-    // bb_setBits(dataCodewords, length, 4, getModeBits(version, mode));
+    // Chien search for the error positions, then Forney for the values. The
+    // codeword at i is the coefficient of x^(length - 1 - i).
+    uint8_t found = 0;
+    for (uint8_t i = 0; i < length; i++) {
+        uint8_t power = length - 1 - i;
+        uint8_t inverse = t.exp[255 - power];
 
-    return mode;
-}
+        uint8_t value = 0, x = 1;
+        for (uint8_t k = 0; k <= errors; k++) {
+            value ^= rs_multiply(locator[k], x);
+            x = rs_multiply(x, inverse);
+        }
+        if (value != 0) {
+            continue;
+        }
 
-static void
-performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data)
-{
-    // See: http://www.thonky.com/qr-code-tutorial/structure-final-message
+        uint8_t numerator = 0, denominator = 0;
+        x = 1;
+        for (uint8_t k = 0; k < degree; k++) {
+            numerator ^= rs_multiply(evaluator[k], x);
+            if (k % 2 == 0 && k + 1 <= errors) {
+                denominator ^= rs_multiply(locator[k + 1], x);
+            }
+            x = rs_multiply(x, inverse);
+        }
+        if (denominator == 0) {
+            return false;
+        }
 
-#if LOCK_VERSION == 0
+        if (numerator != 0) {
+            block[i] ^= rs_multiply(
+                t.exp[power],
+                t.exp[t.log[numerator] + 255 - t.log[denominator]]);
+        }
+        found++;
+    }
+
+    return found == errors;
+}
+
+#pragma mark - QrCode
+
+// NUM_RAW_DATA_MODULES of version 40, in bytes
+#define QR_MAX_CODEWORD_BYTES 3706
+
+// Mode indicator, symbol index, symbol count and parity
+#define QR_APPEND_HEADER_BITS 20
+
+static void encodeDataCodewords(BitBucket *dataCodewords,
+                                const uint8_t *data,
+                                const std::vector<QrSegment> &segments,
+                                uint8_t version,
+                                const QRAppend *append)
+{
+    if (append != nullptr) {
+        bb_appendBits(dataCodewords, 0x3, 4);
+        bb_appendBits(dataCodewords, append->index, 4);
+        bb_appendBits(dataCodewords, append->total - 1, 4);
+        bb_appendBits(dataCodewords, append->parity, 8);
+    }
+
+    for (const QrSegment &segment : segments) {
+        const uint8_t *text = data + segment.start;
+        uint16_t length = segment.length;
+
+        bb_appendBits(dataCodewords, 1 << segment.mode, 4);
+        bb_appendBits(
+            dataCodewords, length, getModeBits(version, segment.mode));
+
+        if (segment.mode == MODE_NUMERIC) {
+            uint16_t accumData = 0;
+            uint8_t accumCount = 0;
+            for (uint16_t i = 0; i < length; i++) {
+                accumData = accumData * 10 + ((char)(text[i]) - '0');
+                accumCount++;
+                if (accumCount == 3) {
+                    bb_appendBits(dataCodewords, accumData, 10);
+                    accumData = 0;
+                    accumCount = 0;
+                }
+            }
+
+            // 1 or 2 digits remaining
+            if (accumCount > 0) {
+                bb_appendBits(dataCodewords, accumData, accumCount * 3 + 1);
+            }
+
+        } else if (segment.mode == MODE_ALPHANUMERIC) {
+            uint16_t accumData = 0;
+            uint8_t accumCount = 0;
+            for (uint16_t i = 0; i < length; i++) {
+                accumData = accumData * 45 + getAlphanumeric((char)(text[i]));
+                accumCount++;
+                if (accumCount == 2) {
+                    bb_appendBits(dataCodewords, accumData, 11);
+                    accumData = 0;
+                    accumCount = 0;
+                }
+            }
+
+            // 1 character remaining
+            if (accumCount > 0) {
+                bb_appendBits(dataCodewords, accumData, 6);
+            }
+
+        } else {
+            for (uint16_t i = 0; i < length; i++) {
+                bb_appendBits(dataCodewords, (char)(text[i]), 8);
+            }
+        }
+    }
+}
+
+static void
+performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data)
+{
+    // See: http://www.thonky.com/qr-code-tutorial/structure-final-message
+
+#if LOCK_VERSION == 0
     uint8_t numBlocks = NUM_ERROR_CORRECTION_BLOCKS[ecc][version - 1];
     uint16_t totalEcc = NUM_ERROR_CORRECTION_CODEWORDS[ecc][version - 1];
     uint16_t moduleCount = NUM_RAW_DATA_MODULES[version - 1];
@@ -885,11 +1371,10 @@ performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data)
 
     uint8_t shortDataBlockLen = shortBlockLen - blockEccLen;
 
-    std::vector<uint8_t> result(data->capacityBytes);
-    memset(result.data(), 0, result.size());
+    uint8_t result[QR_MAX_CODEWORD_BYTES];
+    memset(result, 0, data->capacityBytes);
 
-    std::vector<uint8_t> coeff(blockEccLen);
-    rs_init(blockEccLen, coeff.data());
+    const RsGenerator *generator = rs_init(blockEccLen);
 
     uint16_t offset = 0;
     uint8_t *dataBytes = data->data;
@@ -936,8 +1421,7 @@ performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data)
             blockSize++;
         }
 #endif
-        rs_getRemainder(blockEccLen,
-                        coeff.data(),
+        rs_getRemainder(generator,
                         dataBytes,
                         blockSize,
                         &result[offset + blockNum],
@@ -945,7 +1429,7 @@ performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data)
         dataBytes += blockSize;
     }
 
-    memcpy(data->data, result.data(), data->capacityBytes);
+    memcpy(data->data, result, data->capacityBytes);
     data->bitOffsetOrWidth = moduleCount;
 }
 
@@ -955,6 +1439,209 @@ performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data)
 static const uint8_t ECC_FORMAT_BITS
     = (0x02 << 6) | (0x03 << 4) | (0x00 << 2) | (0x01 << 0);
 
+#pragma mark - Decoding
+
+static const char ALPHANUMERIC_CHARS[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+
+// Reads the bits of a codeword stream, most significant first
+typedef struct BitReader {
+    const uint8_t *data;
+    uint32_t length;
+    uint32_t offset;
+} BitReader;
+
+static bool br_read(BitReader *reader, uint8_t count, uint32_t *value)
+{
+    if (reader->length - reader->offset < count) {
+        return false;
+    }
+
+    *value = 0;
+    for (uint8_t i = 0; i < count; i++, reader->offset++) {
+        uint8_t bit = reader->data[reader->offset >> 3]
+                      >> (7 - (reader->offset & 7));
+        *value = *value << 1 | (bit & 1);
+    }
+    return true;
+}
+
+static uint8_t hammingDistance(uint32_t a, uint32_t b)
+{
+    return std::bitset<32>(a ^ b).count();
+}
+
+// Parses the segments of the corrected data codewords into data, without
+// writing past data_len. ECI designators are skipped and their data is
+// passed through unchanged. Returns the decoded length, or -1.
+static int parseSegments(const uint8_t *codewords,
+                         uint16_t length,
+                         uint8_t version,
+                         uint8_t *data,
+                         int data_len,
+                         QRAppend *append)
+{
+    BitReader reader = {codewords, length * 8U, 0};
+    int count = 0;
+    auto put = [&](uint8_t c) {
+        if (count < data_len) {
+            data[count] = c;
+        }
+        count++;
+    };
+
+    if (append != nullptr) {
+        append->index = 0;
+        append->total = 1;
+        append->parity = 0;
+    }
+
+    uint32_t mode = 0, value = 0;
+    while (br_read(&reader, 4, &mode) && mode != 0) {
+        if (mode == 0x3) {
+            uint32_t index, total, parity;
+            if (!br_read(&reader, 4, &index) || !br_read(&reader, 4, &total)
+                || !br_read(&reader, 8, &parity)) {
+                return -1;
+            }
+            if (append != nullptr) {
+                append->index = index;
+                append->total = total + 1;
+                append->parity = parity;
+            }
+            continue;
+        }
+
+        if (mode == 0x7) {
+            if (!br_read(&reader, 8, &value)) {
+                return -1;
+            }
+            uint8_t more = (value & 0x80) == 0    ? 0
+                           : (value & 0xC0) == 0x80 ? 8
+                           : (value & 0xE0) == 0xC0 ? 16
+                                                    : 0xFF;
+            if (more == 0xFF || !br_read(&reader, more, &value)) {
+                return -1;
+            }
+            continue;
+        }
+
+        uint8_t segmentMode;
+        if (mode == 0x1) {
+            segmentMode = MODE_NUMERIC;
+        } else if (mode == 0x2) {
+            segmentMode = MODE_ALPHANUMERIC;
+        } else if (mode == 0x4) {
+            segmentMode = MODE_BYTE;
+        } else {
+            return -1;
+        }
+
+        uint32_t n;
+        if (!br_read(&reader, getModeBits(version, segmentMode), &n)) {
+            return -1;
+        }
+
+        if (segmentMode == MODE_NUMERIC) {
+            for (; n >= 3; n -= 3) {
+                if (!br_read(&reader, 10, &value) || value > 999) {
+                    return -1;
+                }
+                put('0' + value / 100);
+                put('0' + value / 10 % 10);
+                put('0' + value % 10);
+            }
+            if (n > 0) {
+                if (!br_read(&reader, n * 3 + 1, &value)
+                    || value >= (n == 2 ? 100U : 10U)) {
+                    return -1;
+                }
+                if (n == 2) {
+                    put('0' + value / 10);
+                }
+                put('0' + value % 10);
+            }
+
+        } else if (segmentMode == MODE_ALPHANUMERIC) {
+            for (; n >= 2; n -= 2) {
+                if (!br_read(&reader, 11, &value) || value >= 45 * 45) {
+                    return -1;
+                }
+                put(ALPHANUMERIC_CHARS[value / 45]);
+                put(ALPHANUMERIC_CHARS[value % 45]);
+            }
+            if (n > 0) {
+                if (!br_read(&reader, 6, &value) || value >= 45) {
+                    return -1;
+                }
+                put(ALPHANUMERIC_CHARS[value]);
+            }
+
+        } else {
+            for (; n > 0; n--) {
+                if (!br_read(&reader, 8, &value)) {
+                    return -1;
+                }
+                put(value);
+            }
+        }
+    }
+
+    return count;
+}
+
+#pragma mark - Export
+
+// Each byte with its bits in reverse order
+typedef struct BitReverseTable {
+    uint8_t reversed[256];
+
+    BitReverseTable()
+    {
+        for (int i = 0; i < 256; i++) {
+            uint8_t b = i;
+            b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+            b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+            b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+            reversed[i] = b;
+        }
+    }
+} BitReverseTable;
+
+static const BitReverseTable &bitReverse()
+{
+    static const BitReverseTable table;
+    return table;
+}
+
+// Copies the most significant bit first grid of size modules into rows of
+// row_bytes bytes, least significant bit first, 8 modules at a time
+static void exportRows(const uint8_t *grid,
+                       uint8_t size,
+                       uint8_t *pixels,
+                       int row_bytes)
+{
+    const uint8_t *reversed = bitReverse().reversed;
+    uint16_t nn = bb_getGridSizeBytes(size);
+    int bytes = (size + 7) / 8;
+    uint8_t last = 0xFF << (8 * bytes - size);
+
+    for (int y = 0; y < size; y++) {
+        uint8_t *row = pixels + y * row_bytes;
+        uint32_t bit = y * size;
+        for (int k = 0; k < bytes; k++, bit += 8) {
+            uint32_t i = bit >> 3;
+            uint16_t window = grid[i] << 8;
+            if (i + 1 < nn) {
+                window |= grid[i + 1];
+            }
+            uint8_t b = window >> (8 - (bit & 7));
+            row[k] = reversed[k + 1 < bytes ? b : b & last];
+        }
+        memset(row + bytes, 0, row_bytes - bytes);
+    }
+}
+
 #pragma mark - Public QRCode functions
 
 uint16_t qrcode_getBufferSize(uint8_t version)
@@ -962,13 +1649,130 @@ uint16_t qrcode_getBufferSize(uint8_t version)
     return bb_getGridSizeBytes(4 * version + 17);
 }
 
-// @TODO: Return error if data is too big.
-int8_t qrcode_initBytes(QRCode *qrcode,
-                        uint8_t *modules,
-                        uint8_t version,
-                        uint8_t ecc,
-                        uint8_t *data,
-                        uint16_t length)
+// Smallest version whose data capacity is at least the given count of
+// codewords, per error correction level, or 0 past version 40
+typedef struct VersionTable {
+    uint8_t version[4][QR_MAX_CODEWORD_BYTES + 1];
+
+    VersionTable()
+    {
+        memset(version, 0, sizeof(version));
+        for (uint8_t ecc = 0; ecc < 4; ecc++) {
+            uint16_t needed = 0;
+            for (uint8_t v = 1; v <= 40; v++) {
+                uint16_t dataCapacity
+                    = NUM_RAW_DATA_MODULES[v - 1] / 8
+                      - NUM_ERROR_CORRECTION_CODEWORDS[ecc][v - 1];
+                for (; needed <= dataCapacity; needed++) {
+                    version[ecc][needed] = v;
+                }
+            }
+        }
+    }
+} VersionTable;
+
+// Smallest version that holds data after headerBits of header
+static uint8_t getVersion(uint8_t ecc,
+                          const unsigned char *data,
+                          int data_len,
+                          uint32_t headerBits)
+{
+    static const VersionTable table;
+
+    // The count fields, and so the best segments, only change between
+    // these groups of versions
+    static const uint8_t GROUPS[3][2] = {{1, 9}, {10, 26}, {27, 40}};
+
+    if ((data == nullptr && data_len != 0) || data_len < 0
+        || data_len > UINT16_MAX) {
+        return 0;
+    }
+
+    uint8_t eccFormatBits = (ECC_FORMAT_BITS >> (2 * ecc)) & 0x03;
+
+    std::vector<QrSegment> segments;
+    for (uint8_t g = 0; g < 3; g++) {
+        getOptimalSegments(data, data_len, GROUPS[g][1], segments);
+        uint32_t bits = getSegmentsBits(segments, GROUPS[g][1]);
+        if (bits == 0) {
+            continue;
+        }
+        bits += headerBits;
+        uint32_t needed = (bits + 7) / 8;
+        if (needed > QR_MAX_CODEWORD_BYTES) {
+            continue;
+        }
+
+        uint8_t version = table.version[eccFormatBits][needed];
+        if (version != 0 && version <= GROUPS[g][1]) {
+            return version < GROUPS[g][0] ? GROUPS[g][0] : version;
+        }
+    }
+
+    return 0;
+}
+
+uint8_t qrcode_getVersion(uint8_t ecc,
+                          const unsigned char *data,
+                          int data_len)
+{
+    return getVersion(ecc, data, data_len, 0);
+}
+
+int qrcode_getAppendOffset(int data_len, int total, int index)
+{
+    return (int)((int64_t)data_len * index / total);
+}
+
+uint8_t qrcode_getAppendLayout(uint8_t ecc,
+                               const unsigned char *data,
+                               int data_len,
+                               uint8_t max_version,
+                               uint8_t *version)
+{
+    if (data == nullptr || data_len <= 0 || version == nullptr) {
+        return 0;
+    }
+
+    uint8_t single = getVersion(ecc, data, data_len, 0);
+    if (single != 0 && single <= max_version) {
+        *version = single;
+        return 1;
+    }
+
+    // Parts are even byte ranges, all printed at the version of the
+    // largest so that the symbols share one size
+    for (int total = 2; total <= QR_APPEND_MAX && total <= data_len;
+         total++) {
+        uint8_t largest = 0;
+        for (int i = 0; i < total; i++) {
+            int start = qrcode_getAppendOffset(data_len, total, i);
+            int end = qrcode_getAppendOffset(data_len, total, i + 1);
+            uint8_t v = getVersion(
+                ecc, data + start, end - start, QR_APPEND_HEADER_BITS);
+            if (v == 0 || v > max_version) {
+                largest = 0;
+                break;
+            }
+            largest = v > largest ? v : largest;
+        }
+
+        if (largest != 0) {
+            *version = largest;
+            return total;
+        }
+    }
+
+    return 0;
+}
+
+static int8_t initSymbol(QRCode *qrcode,
+                         uint8_t *modules,
+                         uint8_t version,
+                         uint8_t ecc,
+                         const uint8_t *data,
+                         uint16_t length,
+                         const QRAppend *append)
 {
     uint8_t size = version * 4 + 17;
     qrcode->version = version;
@@ -991,17 +1795,25 @@ int8_t qrcode_initBytes(QRCode *qrcode,
 #endif
 
     struct BitBucket codewords;
-    std::vector<uint8_t> codewordBytes(bb_getBufferSizeBytes(moduleCount));
+    uint8_t codewordBytes[QR_MAX_CODEWORD_BYTES];
     bb_initBuffer(
-        &codewords, codewordBytes.data(), (int32_t)codewordBytes.size());
-
-    // Place the data code words into the buffer
-    int8_t mode = encodeDataCodewords(&codewords, data, length, version);
+        &codewords, codewordBytes, bb_getBufferSizeBytes(moduleCount));
 
-    if (mode < 0) {
+    // Place the data code words into the buffer, failing if they do not fit
+    std::vector<QrSegment> segments;
+    getOptimalSegments(data, length, version, segments);
+    uint32_t bits = getSegmentsBits(segments, version);
+    if (bits == 0) {
+        return -1;
+    }
+    if (append != nullptr) {
+        bits += QR_APPEND_HEADER_BITS;
+    }
+    if (bits > dataCapacity * 8U) {
         return -1;
     }
-    qrcode->mode = mode;
+    encodeDataCodewords(&codewords, data, segments, version, append);
+    qrcode->mode = segments[0].mode;
 
     // Add terminator and pad up to a byte if applicable
     uint32_t padding = (dataCapacity * 8) - codewords.bitOffsetOrWidth;
@@ -1018,86 +1830,180 @@ int8_t qrcode_initBytes(QRCode *qrcode,
         bb_appendBits(&codewords, padByte, 8);
     }
 
+    const QrTemplate *tmpl = getTemplate(version);
+
+    // Copy the function patterns, draw all codewords, do masking
     BitBucket modulesGrid;
     bb_initGrid(&modulesGrid, modules, size);
+    memcpy(modules,
+           tmpl->modules[eccFormatBits].data(),
+           modulesGrid.capacityBytes);
 
-    BitBucket isFunctionGrid;
-    std::vector<uint8_t> isFunctionGridBytes(bb_getGridSizeBytes(size));
-    bb_initGrid(&isFunctionGrid, isFunctionGridBytes.data(), size);
-
-    // Draw function patterns, draw all codewords, do masking
-    drawFunctionPatterns(&modulesGrid, &isFunctionGrid, version, eccFormatBits);
     performErrorCorrection(version, eccFormatBits, &codewords);
-    drawCodewords(&modulesGrid, &isFunctionGrid, &codewords);
+    drawCodewords(&modulesGrid, tmpl->placement, &codewords);
+
+    // Candidates only differ in their format bits and mask, so each gets
+    // its own packed copy and the eight are scored independently
+    std::vector<PackedGrid> candidates(8);
+    for (uint8_t i = 0; i < 8; i++) {
+        drawFormatBits(&modulesGrid, nullptr, eccFormatBits, i);
+        pg_pack(&candidates[i], &modulesGrid);
+    }
+
+    uint32_t penalties[8];
+    auto score = [&](uint8_t first, uint8_t last) {
+        for (uint8_t i = first; i < last; i++) {
+            applyMask(&candidates[i], &tmpl->isFunction, i);
+            penalties[i] = getPenaltyScore(&candidates[i]);
+        }
+    };
+
+    if (version >= QR_PARALLEL_MASK_VERSION && maskThreading
+        && std::thread::hardware_concurrency() > 1) {
+        std::thread worker(score, 4, 8);
+        score(0, 4);
+        worker.join();
+    } else {
+        score(0, 8);
+    }
 
     // Find the best (lowest penalty) mask
     uint8_t mask = 0;
-    int32_t minPenalty = INT32_MAX;
-    for (uint8_t i = 0; i < 8; i++) {
-        drawFormatBits(&modulesGrid, &isFunctionGrid, eccFormatBits, i);
-        applyMask(&modulesGrid, &isFunctionGrid, i);
-        int penalty = getPenaltyScore(&modulesGrid);
-        if (penalty < minPenalty) {
+    for (uint8_t i = 1; i < 8; i++) {
+        if (penalties[i] < penalties[mask]) {
             mask = i;
-            minPenalty = penalty;
         }
-        applyMask(
-            &modulesGrid, &isFunctionGrid, i); // Undoes the mask due to XOR
     }
 
     qrcode->mask = mask;
 
-    // Overwrite old format bits
-    drawFormatBits(&modulesGrid, &isFunctionGrid, eccFormatBits, mask);
+    // The winning candidate already has its format bits and mask applied
+    pg_unpack(&modulesGrid, &candidates[mask]);
+
+    return 0;
+}
+
+int8_t qrcode_initBytes(QRCode *qrcode,
+                        uint8_t *modules,
+                        uint8_t version,
+                        uint8_t ecc,
+                        uint8_t *data,
+                        uint16_t length)
+{
+    return initSymbol(qrcode, modules, version, ecc, data, length, nullptr);
+}
+
+int8_t qrcode_getAppendPixels(uint8_t *pixels,
+                              uint8_t version,
+                              uint8_t ecc,
+                              const unsigned char *data,
+                              int data_len,
+                              const QRAppend *append)
+{
+    if (append != nullptr
+        && (append->total < 2 || append->total > QR_APPEND_MAX
+            || append->index >= append->total)) {
+        return -1;
+    }
+    if (data_len < 0 || data_len > UINT16_MAX) {
+        return -1;
+    }
+
+    QRCode qrcode;
+    int8_t status = initSymbol(
+        &qrcode, pixels, version, ecc, data, data_len, append);
+    if (status != 0) {
+        return status;
+    }
 
-    // Apply the final choice of mask
-    applyMask(&modulesGrid, &isFunctionGrid, mask);
+    // Same bit order as the grid, except least significant bit first
+    const uint8_t *reversed = bitReverse().reversed;
+    uint16_t nn = qrcode_getBufferSize(version);
+    for (uint16_t i = 0; i < nn; i++) {
+        pixels[i] = reversed[pixels[i]];
+    }
 
     return 0;
 }
 
+bool qrcode_setMaskThreading(bool enabled)
+{
+    bool previous = maskThreading;
+    maskThreading = enabled;
+    return previous;
+}
+
+int qrcode_getRowBytes(uint8_t version, int row_align)
+{
+    if (version < 1 || version > 40 || row_align < 1 || row_align > 64
+        || (row_align & (row_align - 1)) != 0) {
+        return -1;
+    }
+
+    int size = 4 * version + 17;
+    return ((size + 7) / 8 + row_align - 1) & ~(row_align - 1);
+}
+
+int8_t qrcode_getRowPixels(uint8_t *pixels,
+                           int row_bytes,
+                           uint8_t version,
+                           uint8_t ecc,
+                           const unsigned char *data,
+                           int data_len)
+{
+    if (version < 1 || version > 40 || data_len < 0 || data_len > UINT16_MAX
+        || row_bytes < (4 * version + 17 + 7) / 8) {
+        return -1;
+    }
+
+    // Rows are moved out of a per-thread grid, as padded rows can
+    // overlap the packed ones
+    thread_local std::vector<uint8_t> grid;
+    grid.resize(qrcode_getBufferSize(version));
+
+    QRCode qrcode;
+    int8_t status = initSymbol(
+        &qrcode, grid.data(), version, ecc, data, data_len, nullptr);
+    if (status != 0) {
+        return status;
+    }
+
+    exportRows(grid.data(), qrcode.size, pixels, row_bytes);
+    return 0;
+}
+
+int8_t qrcode_getPixels(uint8_t *pixels,
+                        uint8_t version,
+                        uint8_t ecc,
+                        const unsigned char *data,
+                        int data_len)
+{
+    return qrcode_getAppendPixels(
+        pixels, version, ecc, data, data_len, nullptr);
+}
+
 uint8_t *qrcode_getpixel(const unsigned char *data,
                          int data_len,
                          int *len,
                          int *buf_len,
                          int ecc)
 {
-    // Create the QR code
-    QRCode qrcode;
-    int version = 1; // start with version 1
-
-    int status = qrcode_initText(&qrcode,
-                                 nullptr,
-                                 version,
-                                 ecc,
-                                 reinterpret_cast<const char *>(data),
-                                 data_len);
-
-    if (status != 0)
+    uint8_t version = qrcode_getVersion(ecc, data, data_len);
+    if (version == 0) {
         return NULL;
+    }
 
-    auto SetBit = [](unsigned char A[], int k) {
-        // Set the bit at the k-th position in A[i]
-        A[k / 8] |= 1 << (k % 8);
-    };
-
-    int n = qrcode.size;
-    *len = n;
-    const int nn = (n * n + 7) / 8;
+    const int nn = qrcode_getBufferSize(version);
     unsigned char *pixels = new unsigned char[nn];
-    *buf_len = nn; // so that idpass.cpp can re-allocate
-    std::memset(pixels, 0x00, nn);
 
-    for (uint8_t y = 0; y < n; y++) {
-        // Each horizontal module
-        for (uint8_t x = 0; x < n; x++) {
-            int p = (y * n + x);
-            if (qrcode_getModule(&qrcode, x, y)) {
-                SetBit(pixels, p);
-            }
-        }
+    if (qrcode_getPixels(pixels, version, ecc, data, data_len) != 0) {
+        delete[] pixels;
+        return NULL;
     }
 
+    *len = 4 * version + 17;
+    *buf_len = nn; // so that idpass.cpp can re-allocate
+
     return pixels;
 }
 
@@ -1123,46 +2029,168 @@ int8_t qrcode_saveToBitmap(const unsigned char *data,
     int width = qrcode.size;
     int height = qrcode.size;
 
+    // Header fields are little endian and wider than a byte
+    auto put32 = [](char *p, uint32_t v) {
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+        p[3] = v >> 24;
+    };
+
     int size = width * height * 4;
     char header[54] = {0};
-    strcpy(header, "BM");
-    memset(&header[2], (int)(54 + size), 1);
-    memset(&header[10], (int)54, 1); // always 54
-    memset(&header[14], (int)40, 1); // always 40
-    memset(&header[18], (int)width, 1);
-    memset(&header[22], (int)height, 1);
-    memset(&header[26], (short)1, 1);
-    memset(&header[28], (short)32, 1); // 32bit
-    memset(&header[34], (int)size, 1); // pixel size
-
-    unsigned char *pixels = new unsigned char[width * height * 4];
-
-    for (uint8_t y = 0; y < width; y++) {
-        // Each horizontal module
-        for (uint8_t x = 0; x < height; x++) {
-            int p = (y * height + x) * 4;
-
-            if (qrcode_getModule(&qrcode, x, y)) {
-                pixels[p + 0] = 0;
-                pixels[p + 1] = 0;
-                pixels[p + 2] = 0;
-            } else {
-                pixels[p + 0] = 255;
-                pixels[p + 1] = 255;
-                pixels[p + 2] = 255;
-            }
-        }
-    }
+    header[0] = 'B';
+    header[1] = 'M';
+    put32(&header[2], 54 + size);
+    put32(&header[10], 54); // always 54
+    put32(&header[14], 40); // always 40
+    put32(&header[18], width);
+    put32(&header[22], height);
+    header[26] = 1; // planes
+    header[28] = 32; // 32bit
+    put32(&header[34], size); // pixel size
 
     FILE *fout = fopen(bitmapfile, "wb");
+    if (fout == NULL) {
+        return -1;
+    }
     fwrite(header, 1, 54, fout);
-    fwrite(pixels, 1, size, fout);
-    delete[] pixels;
+
+    // One row at a time
+    std::vector<unsigned char> row(width * 4);
+    for (uint8_t y = 0; y < height; y++) {
+        // Each horizontal module
+        for (uint8_t x = 0; x < width; x++) {
+            unsigned char c = qrcode_getModule(&qrcode, x, y) ? 0 : 255;
+            row[x * 4 + 0] = c;
+            row[x * 4 + 1] = c;
+            row[x * 4 + 2] = c;
+            row[x * 4 + 3] = 0;
+        }
+        fwrite(row.data(), 1, row.size(), fout);
+    }
     fclose(fout);
 
     return 0;
 }
 
+uint8_t qrcode_decodeVersionWord(uint32_t word)
+{
+    // Version words are at least 8 bits apart
+    for (uint8_t version = 7; version <= 40; version++) {
+        if (hammingDistance(getVersionWord(version), word) <= 3) {
+            return version;
+        }
+    }
+
+    return 0;
+}
+
+int qrcode_decodeModules(const uint8_t *pixels,
+                         uint8_t size,
+                         uint8_t *data,
+                         int data_len,
+                         QRAppend *append)
+{
+#if LOCK_VERSION == 0
+    if (pixels == nullptr || size < 21 || size > QR_MAX_SIZE
+        || (size - 17) % 4 != 0 || data_len < 0
+        || (data == nullptr && data_len > 0)) {
+        return -1;
+    }
+    uint8_t version = (size - 17) / 4;
+
+    auto module = [&](uint8_t x, uint8_t y) -> uint32_t {
+        uint16_t offset = y * size + x;
+        return (pixels[offset >> 3] >> (offset & 7)) & 1;
+    };
+
+    // Both copies of the format word, read back as drawFormatBits draws
+    // them, and the format nearest to either
+    uint32_t first = 0, second = 0;
+    for (uint8_t i = 0; i <= 5; i++) {
+        first |= module(8, i) << i;
+    }
+    first |= module(8, 7) << 6 | module(8, 8) << 7 | module(7, 8) << 8;
+    for (uint8_t i = 9; i < 15; i++) {
+        first |= module(14 - i, 8) << i;
+    }
+    for (uint8_t i = 0; i <= 7; i++) {
+        second |= module(size - 1 - i, 8) << i;
+    }
+    for (uint8_t i = 8; i < 15; i++) {
+        second |= module(8, size - 15 + i) << i;
+    }
+
+    int format = -1;
+    uint8_t nearest = 4;
+    for (uint8_t f = 0; f < 32; f++) {
+        uint16_t word = getFormatWord(f >> 3, f & 7);
+        uint8_t d = std::min(hammingDistance(word, first),
+                             hammingDistance(word, second));
+        if (d < nearest) {
+            nearest = d;
+            format = f;
+        }
+    }
+    if (format < 0) {
+        return -1;
+    }
+    uint8_t eccFormatBits = format >> 3;
+    uint8_t mask = format & 7;
+
+    // Unmask the data modules back into codewords
+    const QrTemplate *tmpl = getTemplate(version);
+    uint16_t totalCodewords = NUM_RAW_DATA_MODULES[version - 1] / 8;
+    uint8_t codewords[QR_MAX_CODEWORD_BYTES];
+    memset(codewords, 0, totalCodewords);
+    for (uint16_t i = 0; i < totalCodewords * 8; i++) {
+        uint16_t offset = tmpl->placement[i];
+        uint8_t x = offset % size, y = offset / size;
+        if (module(x, y) ^ getMaskBit(mask, x, y)) {
+            codewords[i >> 3] |= 0x80 >> (i & 7);
+        }
+    }
+
+    // Undo the interleaving of performErrorCorrection, correcting each
+    // block on the way
+    uint8_t numBlocks = NUM_ERROR_CORRECTION_BLOCKS[eccFormatBits][version - 1];
+    uint16_t totalEcc
+        = NUM_ERROR_CORRECTION_CODEWORDS[eccFormatBits][version - 1];
+    uint8_t blockEccLen = totalEcc / numBlocks;
+    uint8_t numShortBlocks = numBlocks - totalCodewords % numBlocks;
+    uint8_t shortDataBlockLen = totalCodewords / numBlocks - blockEccLen;
+    uint16_t totalData = totalCodewords - totalEcc;
+
+    uint8_t result[QR_MAX_CODEWORD_BYTES];
+    uint16_t resultLength = 0;
+    uint8_t block[255];
+    for (uint8_t b = 0; b < numBlocks; b++) {
+        uint8_t dataLen = shortDataBlockLen + (b >= numShortBlocks ? 1 : 0);
+        for (uint8_t i = 0; i < shortDataBlockLen; i++) {
+            block[i] = codewords[i * numBlocks + b];
+        }
+        if (b >= numShortBlocks) {
+            block[shortDataBlockLen] = codewords[shortDataBlockLen * numBlocks
+                                                 + b - numShortBlocks];
+        }
+        for (uint8_t j = 0; j < blockEccLen; j++) {
+            block[dataLen + j] = codewords[totalData + j * numBlocks + b];
+        }
+
+        if (!rs_correct(block, dataLen + blockEccLen, blockEccLen)) {
+            return -1;
+        }
+        memcpy(result + resultLength, block, dataLen);
+        resultLength += dataLen;
+    }
+
+    return parseSegments(result, resultLength, version, data, data_len, append);
+#else
+    return -1;
+#endif
+}
+
 int8_t qrcode_initText(QRCode *qrcode,
                        uint8_t *modules,
                        uint8_t version,
@@ -1170,31 +2198,18 @@ int8_t qrcode_initText(QRCode *qrcode,
                        const char *data,
                        int data_len)
 {
-    static std::vector<uint8_t> qrcodeData;
-
-    uint16_t moduleCount;
-    uint16_t dataCapacity;
+    // Without a caller buffer, the symbol is kept in a per-thread buffer that
+    // stays valid until the next such call on the same thread
+    thread_local std::vector<uint8_t> qrcodeData;
 
     if (modules == nullptr) {
-        uint8_t eccFormatBits = (ECC_FORMAT_BITS >> (2 * ecc)) & 0x03;
-
-        moduleCount = NUM_RAW_DATA_MODULES[version - 1];
-        dataCapacity
-            = moduleCount / 8
-              - NUM_ERROR_CORRECTION_CODEWORDS[eccFormatBits][version - 1];
-
-        int theoritical_limit = data_len + 2;
-
-        while (dataCapacity < theoritical_limit) {
-            version++;
-            moduleCount = NUM_RAW_DATA_MODULES[version - 1];
-            dataCapacity
-                = moduleCount / 8
-                  - NUM_ERROR_CORRECTION_CODEWORDS[eccFormatBits][version - 1];
+        uint8_t minVersion
+            = qrcode_getVersion(ecc, (const unsigned char *)data, data_len);
+        if (minVersion == 0) {
+            return 41;
         }
-
-        if (version > 40) {
-            return version; 
+        if (version < minVersion) {
+            version = minVersion;
         }
 
         qrcodeData.resize(qrcode_getBufferSize(version));
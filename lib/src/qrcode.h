@@ -66,12 +66,42 @@ typedef struct QRCode {
     uint8_t *modules;
 } QRCode;
 
+// Structured append header, placing a symbol at index among total
+// symbols whose data, once joined, has parity as the XOR of all bytes
+#define QR_APPEND_MAX 16
+
+typedef struct QRAppend {
+    uint8_t index;
+    uint8_t total;
+    uint8_t parity;
+} QRAppend;
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
 uint16_t qrcode_getBufferSize(uint8_t version);
 
+// Returns the smallest version that holds data, split into its best mix of
+// numeric, alphanumeric and byte segments, or 0 if none does
+uint8_t qrcode_getVersion(uint8_t ecc,
+                          const unsigned char *data,
+                          int data_len);
+
+// Returns the smallest count of symbols, up to QR_APPEND_MAX, that hold
+// data split into even parts with no symbol over max_version, and sets
+// version to the one all symbols share. A count of 1 is a plain symbol
+// without structured append header, 0 means data does not fit.
+uint8_t qrcode_getAppendLayout(uint8_t ecc,
+                               const unsigned char *data,
+                               int data_len,
+                               uint8_t max_version,
+                               uint8_t *version);
+
+// Start offset of the part at index, when data_len bytes are split
+// into total symbols
+int qrcode_getAppendOffset(int data_len, int total, int index);
+
 int8_t qrcode_initText(QRCode *qrcode,
                        uint8_t *modules,
                        uint8_t version,
@@ -91,6 +121,55 @@ int8_t qrcode_saveToBitmap(const unsigned char *data,
                            int data_len,
                            const char *bitmapfile,
                            int ecc);
+// Encodes data at the given version into pixels, which must hold
+// qrcode_getBufferSize(version) bytes, packed as by qrcode_getpixel
+int8_t qrcode_getPixels(uint8_t *pixels,
+                        uint8_t version,
+                        uint8_t ecc,
+                        const unsigned char *data,
+                        int data_len);
+// Same as qrcode_getPixels, with a structured append header when
+// append is not null
+int8_t qrcode_getAppendPixels(uint8_t *pixels,
+                              uint8_t version,
+                              uint8_t ecc,
+                              const unsigned char *data,
+                              int data_len,
+                              const QRAppend *append);
+// Bytes per row of a symbol of the given version, once each row is
+// padded to a multiple of row_align bytes, a power of two up to 64,
+// or -1 if out of range
+int qrcode_getRowBytes(uint8_t version, int row_align);
+// Same as qrcode_getPixels, but every row of modules starts on its own
+// row_bytes boundary, least significant bit first, and is zero padded.
+// pixels must hold size * row_bytes bytes.
+int8_t qrcode_getRowPixels(uint8_t *pixels,
+                           int row_bytes,
+                           uint8_t version,
+                           uint8_t ecc,
+                           const unsigned char *data,
+                           int data_len);
+// Whether symbols encoded on the calling thread may score their mask
+// candidates on a second thread, as they do by default from version 30
+// on. Callers already spreading symbols across every core turn it off.
+// Returns the previous setting.
+bool qrcode_setMaskThreading(bool enabled);
+
+// Returns the version of an 18 bit version word read from a symbol,
+// allowing for up to 3 wrong bits, or 0 if it is not one
+uint8_t qrcode_decodeVersionWord(uint32_t word);
+
+// Decodes a symbol of size modules, packed as by qrcode_getpixel, into data
+// without writing past data_len, correcting errors from its error
+// correction codewords. The structured append header, if any, goes into
+// append, otherwise it is set to a single symbol. Returns the decoded
+// length, which can be larger than data_len, or -1 if unreadable.
+int qrcode_decodeModules(const uint8_t *pixels,
+                         uint8_t size,
+                         uint8_t *data,
+                         int data_len,
+                         QRAppend *append);
+
 uint8_t *qrcode_getpixel(const unsigned char *data,
                          int data_len,
                          int *len,
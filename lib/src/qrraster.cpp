@@ -0,0 +1,545 @@
+/*
+ * Copyright (C) 2020 Newlogic Pte. Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "qrraster.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace
+{
+const int MAX_SCALE = 64;
+const int MAX_QUIET = 16;
+const std::size_t IDAT_CHUNK_LEN = 8192;
+const std::size_t STORED_BLOCK_LEN = 65535;
+const int MIN_MATCH = 3;
+const int MAX_MATCH = 258;
+
+const unsigned char PNG_SIGNATURE[]
+    = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+// Deflate length and distance codes (RFC 1951, 3.2.5)
+const std::uint16_t LENGTH_BASE[29]
+    = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+       31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const std::uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                       1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                       4, 4, 4, 4, 5, 5, 5, 5, 0};
+const std::uint16_t DIST_BASE[30]
+    = {1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+       33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+       1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const std::uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                     4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                     9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+struct Crc32Table {
+    std::uint32_t t[256];
+
+    Crc32Table()
+    {
+        for (std::uint32_t n = 0; n < 256; n++) {
+            std::uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            t[n] = c;
+        }
+    }
+};
+
+std::uint32_t crc32(std::uint32_t crc, const unsigned char* p, std::size_t n)
+{
+    static const Crc32Table table;
+    crc = ~crc;
+    for (std::size_t i = 0; i < n; i++) {
+        crc = table.t[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void put_be32(unsigned char* p, std::uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+bool is_dark(const unsigned char* pixels, int qrsize, int x, int y)
+{
+    int k = y * qrsize + x;
+    return (pixels[k / 8] >> (k % 8)) & 1;
+}
+
+// Packs image row y, most significant bit first with 1 for a dark pixel
+void pack_row(const unsigned char* pixels,
+              int qrsize,
+              int scale,
+              int quiet,
+              int y,
+              std::vector<unsigned char>& row)
+{
+    std::fill(row.begin(), row.end(), 0);
+
+    int my = y / scale - quiet;
+    if (my < 0 || my >= qrsize) {
+        return;
+    }
+
+    for (int mx = 0; mx < qrsize; mx++) {
+        if (!is_dark(pixels, qrsize, mx, my)) {
+            continue;
+        }
+        int x0 = (mx + quiet) * scale;
+        for (int x = x0; x < x0 + scale; x++) {
+            row[x >> 3] |= 0x80 >> (x & 7);
+        }
+    }
+}
+
+// Writes the chunks of a 1 bit grayscale PNG, with its zlib stream cut
+// into IDAT chunks as it fills up
+class PngWriter
+{
+public:
+    PngWriter(const qrraster::Sink& sink, bool deflate)
+        : m_sink(sink)
+        , m_deflate(deflate)
+        , m_bitbuf(0)
+        , m_bitcount(0)
+        , m_adler_a(1)
+        , m_adler_b(0)
+    {
+    }
+
+    bool begin(std::uint32_t width, std::uint32_t height)
+    {
+        unsigned char ihdr[13];
+        put_be32(ihdr, width);
+        put_be32(ihdr + 4, height);
+        ihdr[8] = 1; // bit depth
+        ihdr[9] = 0; // grayscale
+        ihdr[10] = 0; // deflate
+        ihdr[11] = 0; // adaptive filtering, unused
+        ihdr[12] = 0; // no interlace
+
+        if (!m_sink(PNG_SIGNATURE, sizeof PNG_SIGNATURE)
+            || !chunk("IHDR", ihdr, sizeof ihdr)) {
+            return false;
+        }
+
+        // zlib header: deflate with a 32K window, no preset dictionary
+        m_idat.push_back(0x78);
+        m_idat.push_back(0x01);
+
+        if (m_deflate) {
+            put_bits(1, 1); // final block
+            put_bits(1, 2); // fixed Huffman codes
+        }
+        return true;
+    }
+
+    // Adds one scanline, filter type byte included
+    bool row(const std::vector<unsigned char>& line)
+    {
+        adler(line);
+
+        if (!m_deflate) {
+            m_block.insert(m_block.end(), line.begin(), line.end());
+            while (m_block.size() > STORED_BLOCK_LEN) {
+                stored_block(false, STORED_BLOCK_LEN);
+            }
+        } else if (line == m_prev) {
+            copy(line.size(), line.size());
+        } else {
+            // Runs of the same byte become copies at distance 1
+            std::size_t i = 0;
+            while (i < line.size()) {
+                std::size_t run = 1;
+                while (i + run < line.size() && line[i + run] == line[i]) {
+                    run++;
+                }
+                literal(line[i]);
+                if (run - 1 >= MIN_MATCH) {
+                    copy(run - 1, 1);
+                } else {
+                    for (std::size_t k = 1; k < run; k++) {
+                        literal(line[i]);
+                    }
+                }
+                i += run;
+            }
+            m_prev = line;
+        }
+
+        return flush_idat(false);
+    }
+
+    bool end()
+    {
+        if (m_deflate) {
+            symbol(256);
+            if (m_bitcount > 0) {
+                put_bits(0, 8 - m_bitcount);
+            }
+        } else {
+            stored_block(true, m_block.size());
+        }
+
+        unsigned char adler32[4];
+        put_be32(adler32, (m_adler_b << 16) | m_adler_a);
+        m_idat.insert(m_idat.end(), adler32, adler32 + 4);
+
+        return flush_idat(true) && chunk("IEND", nullptr, 0);
+    }
+
+private:
+    bool chunk(const char* type, const unsigned char* data, std::size_t len)
+    {
+        unsigned char head[8];
+        put_be32(head, len);
+        std::memcpy(head + 4, type, 4);
+
+        unsigned char tail[4];
+        std::uint32_t crc = crc32(0, head + 4, 4);
+        if (len > 0) {
+            crc = crc32(crc, data, len);
+        }
+        put_be32(tail, crc);
+
+        return m_sink(head, sizeof head) && (len == 0 || m_sink(data, len))
+               && m_sink(tail, sizeof tail);
+    }
+
+    bool flush_idat(bool all)
+    {
+        std::size_t pos = 0;
+        while (m_idat.size() - pos >= IDAT_CHUNK_LEN
+               || (all && m_idat.size() > pos)) {
+            std::size_t n = std::min(IDAT_CHUNK_LEN, m_idat.size() - pos);
+            if (!chunk("IDAT", m_idat.data() + pos, n)) {
+                return false;
+            }
+            pos += n;
+        }
+        m_idat.erase(m_idat.begin(), m_idat.begin() + pos);
+        return true;
+    }
+
+    void adler(const std::vector<unsigned char>& line)
+    {
+        for (unsigned char c : line) {
+            m_adler_a = (m_adler_a + c) % 65521;
+            m_adler_b = (m_adler_b + m_adler_a) % 65521;
+        }
+    }
+
+    void stored_block(bool final, std::size_t n)
+    {
+        m_idat.push_back(final ? 0x01 : 0x00);
+        m_idat.push_back(n & 0xff);
+        m_idat.push_back(n >> 8);
+        m_idat.push_back(~n & 0xff);
+        m_idat.push_back((~n >> 8) & 0xff);
+        m_idat.insert(m_idat.end(), m_block.begin(), m_block.begin() + n);
+        m_block.erase(m_block.begin(), m_block.begin() + n);
+    }
+
+    void put_bits(std::uint32_t value, int n)
+    {
+        m_bitbuf |= value << m_bitcount;
+        m_bitcount += n;
+        while (m_bitcount >= 8) {
+            m_idat.push_back(m_bitbuf & 0xff);
+            m_bitbuf >>= 8;
+            m_bitcount -= 8;
+        }
+    }
+
+    // Huffman codes are packed starting from their most significant bit
+    void put_code(std::uint32_t code, int n)
+    {
+        std::uint32_t reversed = 0;
+        for (int i = 0; i < n; i++) {
+            reversed = (reversed << 1) | ((code >> i) & 1);
+        }
+        put_bits(reversed, n);
+    }
+
+    // Fixed literal/length code (RFC 1951, 3.2.6)
+    void symbol(int v)
+    {
+        if (v < 144) {
+            put_code(0x30 + v, 8);
+        } else if (v < 256) {
+            put_code(0x190 + v - 144, 9);
+        } else if (v < 280) {
+            put_code(v - 256, 7);
+        } else {
+            put_code(0xc0 + v - 280, 8);
+        }
+    }
+
+    void literal(unsigned char c)
+    {
+        symbol(c);
+    }
+
+    void match(int length, int distance)
+    {
+        int i = 28;
+        while (LENGTH_BASE[i] > length) {
+            i--;
+        }
+        symbol(257 + i);
+        put_bits(length - LENGTH_BASE[i], LENGTH_EXTRA[i]);
+
+        int j = 29;
+        while (DIST_BASE[j] > distance) {
+            j--;
+        }
+        put_code(j, 5);
+        put_bits(distance - DIST_BASE[j], DIST_EXTRA[j]);
+    }
+
+    // Emits a copy of n >= MIN_MATCH bytes as matches of at most MAX_MATCH
+    void copy(std::size_t n, int distance)
+    {
+        while (n > 0) {
+            std::size_t len = std::min<std::size_t>(n, MAX_MATCH);
+            if (n - len > 0 && n - len < MIN_MATCH) {
+                len = n - MIN_MATCH;
+            }
+            match(len, distance);
+            n -= len;
+        }
+    }
+
+    const qrraster::Sink& m_sink;
+    bool m_deflate;
+    std::vector<unsigned char> m_idat;
+    std::vector<unsigned char> m_block;
+    std::vector<unsigned char> m_prev;
+    std::uint32_t m_bitbuf;
+    int m_bitcount;
+    std::uint32_t m_adler_a;
+    std::uint32_t m_adler_b;
+};
+
+bool render_pbm(const unsigned char* pixels,
+                int qrsize,
+                int scale,
+                int quiet,
+                const qrraster::Sink& sink)
+{
+    int width = (qrsize + 2 * quiet) * scale;
+
+    char header[32];
+    int n = std::snprintf(header, sizeof header, "P4\n%d %d\n", width, width);
+    if (!sink(reinterpret_cast<unsigned char*>(header), n)) {
+        return false;
+    }
+
+    std::vector<unsigned char> row((width + 7) / 8);
+    for (int y = 0; y < width; y++) {
+        if (y % scale == 0) {
+            pack_row(pixels, qrsize, scale, quiet, y, row);
+        }
+        if (!sink(row.data(), row.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool render_png(const unsigned char* pixels,
+                int qrsize,
+                int scale,
+                int quiet,
+                bool deflate,
+                const qrraster::Sink& sink)
+{
+    int width = (qrsize + 2 * quiet) * scale;
+    int row_len = (width + 7) / 8;
+
+    PngWriter png(sink, deflate);
+    if (!png.begin(width, width)) {
+        return false;
+    }
+
+    // Filter type 0 byte, then the row with 0 for a dark pixel
+    std::vector<unsigned char> row(row_len);
+    std::vector<unsigned char> line(1 + row_len);
+    for (int y = 0; y < width; y++) {
+        if (y % scale == 0) {
+            pack_row(pixels, qrsize, scale, quiet, y, row);
+            for (int i = 0; i < row_len; i++) {
+                line[1 + i] = ~row[i];
+            }
+            if (width % 8 != 0) {
+                line[row_len] &= 0xff << (8 - width % 8);
+            }
+        }
+        if (!png.row(line)) {
+            return false;
+        }
+    }
+
+    return png.end();
+}
+
+bool render_svg(const unsigned char* pixels,
+                int qrsize,
+                int scale,
+                int quiet,
+                const qrraster::Sink& sink)
+{
+    int dim = qrsize + 2 * quiet;
+    int width = dim * scale;
+
+    auto put = [&](const std::string& s) {
+        return sink(reinterpret_cast<const unsigned char*>(s.data()),
+                    s.size());
+    };
+
+    char head[320];
+    std::snprintf(head,
+                  sizeof head,
+                  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                  "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" "
+                  "width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\" "
+                  "shape-rendering=\"crispEdges\">\n"
+                  "<rect width=\"%d\" height=\"%d\" fill=\"#FFFFFF\"/>\n"
+                  "<path fill=\"#000000\" d=\"",
+                  width,
+                  width,
+                  dim,
+                  dim,
+                  dim,
+                  dim);
+    if (!put(head)) {
+        return false;
+    }
+
+    // One rectangle per horizontal run of dark modules
+    std::string path;
+    for (int y = 0; y < qrsize; y++) {
+        path.clear();
+        for (int x = 0; x < qrsize;) {
+            if (!is_dark(pixels, qrsize, x, y)) {
+                x++;
+                continue;
+            }
+            int run = 1;
+            while (x + run < qrsize && is_dark(pixels, qrsize, x + run, y)) {
+                run++;
+            }
+            char rect[48];
+            std::snprintf(rect,
+                          sizeof rect,
+                          "M%d %dh%dv1h-%dz",
+                          x + quiet,
+                          y + quiet,
+                          run,
+                          run);
+            path += rect;
+            x += run;
+        }
+        if (!path.empty() && !put(path)) {
+            return false;
+        }
+    }
+
+    return put("\"/>\n</svg>\n");
+}
+} // namespace
+
+bool qrraster::render(const unsigned char* pixels,
+                      int qrsize,
+                      int format,
+                      int scale,
+                      int quiet,
+                      const Sink& sink)
+{
+    if (pixels == nullptr || qrsize < 21 || qrsize > 177
+        || (qrsize - 17) % 4 != 0 || scale < 1 || scale > MAX_SCALE
+        || quiet < 0 || quiet > MAX_QUIET) {
+        return false;
+    }
+
+    switch (format) {
+    case PBM:
+        return render_pbm(pixels, qrsize, scale, quiet, sink);
+    case PNG:
+        return render_png(pixels, qrsize, scale, quiet, true, sink);
+    case PNG_STORED:
+        return render_png(pixels, qrsize, scale, quiet, false, sink);
+    case SVG:
+        return render_svg(pixels, qrsize, scale, quiet, sink);
+    }
+    return false;
+}
+
+qrraster::Sink qrraster::buffer_sink(unsigned char* buf,
+                                     std::size_t buf_len,
+                                     std::size_t& total)
+{
+    total = 0;
+    return [buf, buf_len, &total](const unsigned char* p, std::size_t n) {
+        if (buf != nullptr && total + n <= buf_len) {
+            std::memcpy(buf + total, p, n);
+        }
+        total += n;
+        return true;
+    };
+}
+
+qrraster::Sink qrraster::fd_sink(int fd, std::size_t& total)
+{
+    total = 0;
+    return [fd, &total](const unsigned char* p, std::size_t n) {
+        while (n > 0) {
+#ifdef _WIN32
+            int w = _write(fd, p, static_cast<unsigned int>(n));
+#else
+            ssize_t w = write(fd, p, n);
+#endif
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                return false;
+            }
+            p += w;
+            n -= w;
+            total += w;
+        }
+        return true;
+    };
+}
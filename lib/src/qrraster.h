@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2020 Newlogic Pte. Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+/**
+* Renders a packed QR module grid, as returned by qrcode_getpixel, into
+* PBM, 1 bit grayscale PNG or SVG. Each module becomes a square of
+* scale pixels, and the symbol is surrounded by a quiet zone of quiet
+* modules.
+*
+* Images are produced a row at a time and handed to a sink, so the
+* full raster is never held in memory. PNG image data is either stored
+* or deflated with the fixed Huffman codes, where the repeated rows of
+* a scaled module are back-references to the row above.
+*/
+
+class qrraster
+{
+public:
+    enum Format { PBM = 0, PNG = 1, PNG_STORED = 2, SVG = 3 };
+
+    // Receives the consecutive pieces of an image, false aborts rendering
+    typedef std::function<bool(const unsigned char*, std::size_t)> Sink;
+
+    static bool render(const unsigned char* pixels,
+                       int qrsize,
+                       int format,
+                       int scale,
+                       int quiet,
+                       const Sink& sink);
+
+    // Copies into buf as long as the image fits, while total counts the
+    // bytes length of the whole image
+    static Sink buffer_sink(unsigned char* buf,
+                            std::size_t buf_len,
+                            std::size_t& total);
+
+    // Writes into an open file descriptor, total counts the bytes written
+    static Sink fd_sink(int fd, std::size_t& total);
+};
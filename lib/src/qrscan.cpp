@@ -0,0 +1,818 @@
+/*
+ * Copyright (C) 2020 Newlogic Pte. Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "qrscan.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace
+{
+const int BLOCK = 8;
+const int FLAT_DEVIATION = 12;
+const int MAX_FINDERS = 12;
+const int ROW_SKIP_DIVISOR = 360;
+const int MAX_TRIPLES = 8;
+const int MIN_SIZE = 21;
+const int MAX_SIZE = 177;
+const int MAX_DATA_LEN = 8192;
+const int MIN_ALIGNMENT_SCORE = 21;
+const std::size_t MAX_ALIGNMENTS = 4;
+
+// One byte per pixel, 1 for dark
+struct BitImage {
+    int width;
+    int height;
+    std::vector<std::uint8_t> dark;
+
+    bool get(int x, int y) const
+    {
+        return dark[y * width + x] != 0;
+    }
+
+    bool inside(int x, int y) const
+    {
+        return x >= 0 && y >= 0 && x < width && y < height;
+    }
+};
+
+struct Point {
+    double x;
+    double y;
+};
+
+struct Finder {
+    double x;
+    double y;
+    double module;
+    int count;
+};
+
+double distance(const Point& a, const Point& b)
+{
+    return std::hypot(a.x - b.x, a.y - b.y);
+}
+
+// Thresholds each 8x8 block at the mean level of the 5x5 blocks around
+// it. A block without contrast is taken as background, unless its
+// neighbours say it lies inside a darker area. Contrast is measured by
+// the deviation rather than the range of the block, which sensor noise
+// alone widens.
+void binarize(const unsigned char* gray,
+              int width,
+              int height,
+              int stride,
+              BitImage& image)
+{
+    image.width = width;
+    image.height = height;
+    image.dark.assign(width * height, 0);
+
+    int bw = (width + BLOCK - 1) / BLOCK;
+    int bh = (height + BLOCK - 1) / BLOCK;
+    std::vector<int> level(bw * bh);
+
+    for (int by = 0; by < bh; by++) {
+        int y0 = by * BLOCK, y1 = std::min(height, y0 + BLOCK);
+        for (int bx = 0; bx < bw; bx++) {
+            int x0 = bx * BLOCK, x1 = std::min(width, x0 + BLOCK);
+            int lo = 255, sum = 0, squares = 0;
+            for (int y = y0; y < y1; y++) {
+                const unsigned char* row = gray + y * stride;
+                for (int x = x0; x < x1; x++) {
+                    int v = row[x];
+                    lo = v < lo ? v : lo;
+                    sum += v;
+                    squares += v * v;
+                }
+            }
+
+            int count = (y1 - y0) * (x1 - x0);
+            int average = sum / count;
+            if (count * squares - sum * sum
+                <= FLAT_DEVIATION * FLAT_DEVIATION * count * count) {
+                average = lo / 2;
+                if (bx > 0 && by > 0) {
+                    int neighbours = (level[(by - 1) * bw + bx]
+                                      + 2 * level[by * bw + bx - 1]
+                                      + level[(by - 1) * bw + bx - 1])
+                                     / 4;
+                    if (lo < neighbours) {
+                        average = neighbours;
+                    }
+                }
+            }
+            level[by * bw + bx] = average;
+        }
+    }
+
+    for (int by = 0; by < bh; by++) {
+        int y0 = by * BLOCK, y1 = std::min(height, y0 + BLOCK);
+        for (int bx = 0; bx < bw; bx++) {
+            int x0 = bx * BLOCK, x1 = std::min(width, x0 + BLOCK);
+            int sum = 0, count = 0;
+            for (int ny = std::max(0, by - 2); ny <= std::min(bh - 1, by + 2);
+                 ny++) {
+                for (int nx = std::max(0, bx - 2);
+                     nx <= std::min(bw - 1, bx + 2);
+                     nx++) {
+                    sum += level[ny * bw + nx];
+                    count++;
+                }
+            }
+            int threshold = sum / count;
+
+            for (int y = y0; y < y1; y++) {
+                const unsigned char* row = gray + y * stride;
+                std::uint8_t* out = &image.dark[y * width];
+                for (int x = x0; x < x1; x++) {
+                    out[x] = row[x] <= threshold;
+                }
+            }
+        }
+    }
+}
+
+bool is_finder_ratio(const int* runs)
+{
+    int total = 0;
+    for (int i = 0; i < 5; i++) {
+        if (runs[i] == 0) {
+            return false;
+        }
+        total += runs[i];
+    }
+    if (total < 7) {
+        return false;
+    }
+
+    double module = total / 7.0;
+    double variance = module / 2;
+    return std::fabs(module - runs[0]) < variance
+           && std::fabs(module - runs[1]) < variance
+           && std::fabs(3 * module - runs[2]) < 3 * variance
+           && std::fabs(module - runs[3]) < variance
+           && std::fabs(module - runs[4]) < variance;
+}
+
+// Measures the finder runs through (x, y) along (dx, dy), starting from
+// inside the centre run. Returns the offset of the centre from (x, y) in
+// steps, or NAN if the runs are not those of a finder pattern.
+double cross_check(const BitImage& image,
+                   int x,
+                   int y,
+                   int dx,
+                   int dy,
+                   int max_run,
+                   int& total)
+{
+    int runs[5] = {0, 0, 0, 0, 0};
+    auto inside = [&](int k) { return image.inside(x + k * dx, y + k * dy); };
+    auto dark = [&](int k) { return image.get(x + k * dx, y + k * dy); };
+
+    if (!inside(0) || !dark(0)) {
+        return NAN;
+    }
+
+    int k = 0;
+    for (; inside(k) && dark(k); k--) {
+        runs[2]++;
+    }
+    for (; inside(k) && !dark(k) && runs[1] <= max_run; k--) {
+        runs[1]++;
+    }
+    for (; inside(k) && dark(k) && runs[0] <= max_run; k--) {
+        runs[0]++;
+    }
+
+    for (k = 1; inside(k) && dark(k); k++) {
+        runs[2]++;
+    }
+    for (; inside(k) && !dark(k) && runs[3] <= max_run; k++) {
+        runs[3]++;
+    }
+    for (; inside(k) && dark(k) && runs[4] <= max_run; k++) {
+        runs[4]++;
+    }
+
+    if (runs[1] > max_run || runs[3] > max_run || runs[0] > max_run
+        || runs[4] > max_run || !is_finder_ratio(runs)) {
+        return NAN;
+    }
+
+    total = runs[0] + runs[1] + runs[2] + runs[3] + runs[4];
+    return k - runs[4] - runs[3] - runs[2] / 2.0;
+}
+
+// Confirms a row match across the other directions, then merges it into
+// the finder it repeats or adds it
+void add_finder(const BitImage& image,
+                double cx,
+                int y,
+                const int* runs,
+                std::vector<Finder>& finders)
+{
+    int total = runs[0] + runs[1] + runs[2] + runs[3] + runs[4];
+
+    int vertical = 0;
+    double oy = cross_check(image, (int)cx, y, 0, 1, total, vertical);
+    // Perspective stretches a finder along one axis, by half in a strong
+    // keystone
+    if (std::isnan(oy) || 2 * std::abs(vertical - total) >= total) {
+        return;
+    }
+    double cy = y + oy;
+
+    int horizontal = 0;
+    double ox = cross_check(image, (int)cx, (int)cy, 1, 0, total, horizontal);
+    if (std::isnan(ox)) {
+        return;
+    }
+    cx = (int)cx + ox;
+
+    int diagonal = 0;
+    if (std::isnan(cross_check(
+            image, (int)cx, (int)cy, 1, 1, total, diagonal))) {
+        return;
+    }
+
+    double module = (horizontal + vertical) / 14.0;
+    for (Finder& f : finders) {
+        if (std::fabs(f.x - cx) <= f.module && std::fabs(f.y - cy) <= f.module
+            && std::fabs(f.module - module) <= std::max(1.0, f.module)) {
+            f.x = (f.x * f.count + cx) / (f.count + 1);
+            f.y = (f.y * f.count + cy) / (f.count + 1);
+            f.module = (f.module * f.count + module) / (f.count + 1);
+            f.count++;
+            return;
+        }
+    }
+    finders.push_back({cx, cy, module, 1});
+}
+
+// Scans every few rows for finder runs, still crossing a finder of the
+// smallest readable modules several times
+void find_finders(const BitImage& image, std::vector<Finder>& finders)
+{
+    int skip = std::max(1, std::min(image.width, image.height) / ROW_SKIP_DIVISOR);
+    for (int y = 0; y < image.height; y += skip) {
+        const std::uint8_t* row = &image.dark[y * image.width];
+        int runs[5] = {0, 0, 0, 0, 0};
+        int state = 0;
+
+        for (int x = 0; x <= image.width; x++) {
+            bool dark = x < image.width && row[x];
+            if (dark) {
+                if (state & 1) {
+                    state++;
+                }
+                runs[state]++;
+                continue;
+            }
+
+            if (state == 0 && runs[0] == 0) {
+                continue;
+            }
+            if (state & 1) {
+                runs[state]++;
+                continue;
+            }
+            if (state < 4) {
+                runs[++state]++;
+                continue;
+            }
+
+            if (is_finder_ratio(runs)) {
+                add_finder(image, x - runs[4] - runs[3] - runs[2] / 2.0, y,
+                           runs, finders);
+            }
+            runs[0] = runs[2];
+            runs[1] = runs[3];
+            runs[2] = runs[4];
+            runs[3] = 1;
+            runs[4] = 0;
+            state = 3;
+        }
+    }
+}
+
+// Length of the finder at from along the line to to, which holds 7
+// modules: from the centre, 3.5 modules lie before the third change of
+// colour on either side. Returns NAN if a side runs out of the frame.
+double finder_span(const BitImage& image, const Point& from, const Point& to)
+{
+    double length = distance(from, to);
+    double dx = (to.x - from.x) / length, dy = (to.y - from.y) / length;
+
+    double span = 0;
+    for (int sign : {1, -1}) {
+        bool dark = true;
+        int changes = 0;
+        double t = 0;
+        for (; changes < 3; t++) {
+            int x = (int)(from.x + sign * t * dx);
+            int y = (int)(from.y + sign * t * dy);
+            if (!image.inside(x, y) || t > length) {
+                return NAN;
+            }
+            if (image.get(x, y) != dark) {
+                dark = !dark;
+                changes++;
+            }
+        }
+        span += t - 1;
+    }
+    return span;
+}
+
+// Module size along the axis between two finders, measured on both
+// finders, or fallback when neither can be measured
+double axis_module(const BitImage& image,
+                   const Point& a,
+                   const Point& b,
+                   double fallback)
+{
+    double sa = finder_span(image, a, b), sb = finder_span(image, b, a);
+    if (std::isnan(sa) && std::isnan(sb)) {
+        return fallback;
+    }
+    if (std::isnan(sa) || std::isnan(sb)) {
+        return (std::isnan(sa) ? sb : sa) / 7;
+    }
+    return (sa + sb) / 14;
+}
+
+// Homogeneous 3x3 transform, row major
+struct Transform {
+    double m[9];
+
+    Point map(double x, double y) const
+    {
+        double w = m[6] * x + m[7] * y + m[8];
+        return {(m[0] * x + m[1] * y + m[2]) / w,
+                (m[3] * x + m[4] * y + m[5]) / w};
+    }
+
+    // Maps the unit square (0,0), (1,0), (1,1), (0,1) onto p
+    static Transform from_square(const Point* p)
+    {
+        double dx3 = p[0].x - p[1].x + p[2].x - p[3].x;
+        double dy3 = p[0].y - p[1].y + p[2].y - p[3].y;
+        double dx1 = p[1].x - p[2].x, dx2 = p[3].x - p[2].x;
+        double dy1 = p[1].y - p[2].y, dy2 = p[3].y - p[2].y;
+        double den = dx1 * dy2 - dx2 * dy1;
+        double g = (dx3 * dy2 - dx2 * dy3) / den;
+        double h = (dx1 * dy3 - dx3 * dy1) / den;
+
+        return {{p[1].x - p[0].x + g * p[1].x,
+                 p[3].x - p[0].x + h * p[3].x,
+                 p[0].x,
+                 p[1].y - p[0].y + g * p[1].y,
+                 p[3].y - p[0].y + h * p[3].y,
+                 p[0].y,
+                 g,
+                 h,
+                 1}};
+    }
+
+    // The inverse, up to scale
+    Transform adjoint() const
+    {
+        return {{m[4] * m[8] - m[5] * m[7],
+                 m[2] * m[7] - m[1] * m[8],
+                 m[1] * m[5] - m[2] * m[4],
+                 m[5] * m[6] - m[3] * m[8],
+                 m[0] * m[8] - m[2] * m[6],
+                 m[2] * m[3] - m[0] * m[5],
+                 m[3] * m[7] - m[4] * m[6],
+                 m[1] * m[6] - m[0] * m[7],
+                 m[0] * m[4] - m[1] * m[3]}};
+    }
+
+    Transform times(const Transform& o) const
+    {
+        Transform r;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                r.m[3 * i + j] = m[3 * i] * o.m[j] + m[3 * i + 1] * o.m[3 + j]
+                                 + m[3 * i + 2] * o.m[6 + j];
+            }
+        }
+        return r;
+    }
+
+    static Transform between(const Point* from, const Point* to)
+    {
+        return from_square(to).times(from_square(from).adjoint());
+    }
+};
+
+// Lists the likely centres of the alignment pattern within radius pixels
+// of estimate, best first. Each pixel is scored by how many of the 25
+// module centres around it match the pattern, with ex and ey the module
+// steps of the symbol, and each candidate is the centre of the best
+// scoring pixels around a local best.
+void find_alignments(const BitImage& image,
+                     const Point& estimate,
+                     const Point& ex,
+                     const Point& ey,
+                     int radius,
+                     std::vector<Point>& found)
+{
+    found.clear();
+    int x0 = std::max(0, (int)estimate.x - radius);
+    int x1 = std::min(image.width - 1, (int)estimate.x + radius);
+    int y0 = std::max(0, (int)estimate.y - radius);
+    int y1 = std::min(image.height - 1, (int)estimate.y + radius);
+    // Large modules leave the score flat over a third of a module
+    double module = std::hypot(ex.x, ex.y);
+    int step = std::max(1, (int)(module / 3));
+    int w = (x1 - x0) / step + 1, h = (y1 - y0) / step + 1;
+    if (x1 < x0 || y1 < y0) {
+        return;
+    }
+
+    int offsets[25][2];
+    for (int j = -2, n = 0; j <= 2; j++) {
+        for (int i = -2; i <= 2; i++, n++) {
+            offsets[n][0] = (int)std::lround(i * ex.x + j * ey.x);
+            offsets[n][1] = (int)std::lround(i * ex.y + j * ey.y);
+        }
+    }
+
+    std::vector<std::uint8_t> scores(w * h);
+    std::vector<int> order;
+    for (int y = y0; y <= y1; y += step) {
+        for (int x = x0; x <= x1; x += step) {
+            int score = 0;
+            for (int n = 0; n < 25; n++) {
+                int px = x + offsets[n][0], py = y + offsets[n][1];
+                int ring = std::max(std::abs(n % 5 - 2), std::abs(n / 5 - 2));
+                bool dark = image.inside(px, py) && image.get(px, py);
+                score += dark == (ring != 1);
+            }
+            int i = (y - y0) / step * w + (x - x0) / step;
+            scores[i] = score;
+            if (score >= MIN_ALIGNMENT_SCORE) {
+                order.push_back(i);
+            }
+        }
+    }
+
+    auto at = [&](int i) {
+        return Point{(double)(x0 + i % w * step), (double)(y0 + i / w * step)};
+    };
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        if (scores[a] != scores[b]) {
+            return scores[a] > scores[b];
+        }
+        return distance(at(a), estimate) < distance(at(b), estimate);
+    });
+
+    for (int i : order) {
+        Point seed = at(i);
+        bool seen = false;
+        for (const Point& p : found) {
+            seen = seen || distance(p, seed) <= 2 * module;
+        }
+        if (seen) {
+            continue;
+        }
+
+        double sx = 0, sy = 0, count = 0;
+        for (int k : order) {
+            if (scores[k] == scores[i] && distance(at(k), seed) <= module) {
+                sx += at(k).x;
+                sy += at(k).y;
+                count++;
+            }
+        }
+        found.push_back({sx / count + 0.5, sy / count + 0.5});
+        if (found.size() == MAX_ALIGNMENTS) {
+            break;
+        }
+    }
+}
+
+// Samples the module centres of a symbol of the given size into a grid
+// packed as by qrcode_getpixel
+bool sample(const BitImage& image,
+            const Transform& transform,
+            int size,
+            std::vector<std::uint8_t>& grid)
+{
+    grid.assign((size * size + 7) / 8, 0);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            Point p = transform.map(x + 0.5, y + 0.5);
+            if (!(p.x > -2 && p.y > -2 && p.x < image.width + 2
+                  && p.y < image.height + 2)) {
+                return false;
+            }
+            int px = std::min(std::max((int)p.x, 0), image.width - 1);
+            int py = std::min(std::max((int)p.y, 0), image.height - 1);
+            if (image.get(px, py)) {
+                int offset = y * size + x;
+                grid[offset >> 3] |= 1 << (offset & 7);
+            }
+        }
+    }
+    return true;
+}
+
+// Reads the version word beside a finder, whose module steps are measured
+// on the finder itself along the unit axes ux and uy of the symbol, the
+// word being transposed beside the bottom left finder. Returns 0 if the
+// word does not read.
+std::uint8_t read_version(const BitImage& image,
+                          const Point& finder,
+                          const Point& ux,
+                          const Point& uy,
+                          bool transposed)
+{
+    Point far_x = {finder.x - ux.x * image.width, finder.y - ux.y * image.width};
+    Point far_y = {finder.x - uy.x * image.width, finder.y - uy.y * image.width};
+    double mx = finder_span(image, finder, far_x) / 7;
+    double my = finder_span(image, finder, far_y) / 7;
+    if (std::isnan(mx) || std::isnan(my)) {
+        return 0;
+    }
+
+    std::uint32_t word = 0;
+    for (int i = 0; i < 18; i++) {
+        // Module offsets from the finder centre, as drawn by drawVersion
+        double along = i % 3 - 7, across = i / 3 - 3;
+        double dx = transposed ? across : along;
+        double dy = transposed ? along : across;
+        int x = (int)(finder.x + ux.x * mx * dx + uy.x * my * dy);
+        int y = (int)(finder.y + ux.y * mx * dx + uy.y * my * dy);
+        if (!image.inside(x, y)) {
+            return 0;
+        }
+        word |= (std::uint32_t)image.get(x, y) << i;
+    }
+
+    return qrcode_decodeVersionWord(word);
+}
+
+// Samples the symbol of the given size through transform and decodes it
+bool decode_grid(const BitImage& image,
+                 const Transform& transform,
+                 int size,
+                 std::vector<unsigned char>& data,
+                 QRAppend& append)
+{
+    std::vector<std::uint8_t> grid;
+    if (!sample(image, transform, size, grid)) {
+        return false;
+    }
+
+    data.resize(MAX_DATA_LEN);
+    int len = qrcode_decodeModules(
+        grid.data(), size, data.data(), data.size(), &append);
+    if (len > (int)data.size()) {
+        data.resize(len);
+        len = qrcode_decodeModules(
+            grid.data(), size, data.data(), data.size(), &append);
+    }
+    if (len < 0) {
+        return false;
+    }
+    data.resize(len);
+    return true;
+}
+
+// Decodes the symbol of the given size laid out by its three finders.
+// The fourth corner is anchored on each alignment pattern candidate in
+// turn, the error correction telling the right one, and last on the
+// parallelogram of the finders.
+bool decode_at(const BitImage& image,
+               const Point& tl,
+               const Point& tr,
+               const Point& bl,
+               int size,
+               std::vector<unsigned char>& data,
+               QRAppend& append)
+{
+    double d = size - 7;
+    Point from[4] = {{3.5, 3.5}, {size - 3.5, 3.5}, {size - 3.5, size - 3.5},
+                     {3.5, size - 3.5}};
+    Point to[4] = {tl, tr, {tr.x + bl.x - tl.x, tr.y + bl.y - tl.y}, bl};
+
+    // The bottom right alignment pattern sits 3 modules in from the
+    // corner finder that a symbol does not have
+    if (size > MIN_SIZE) {
+        Point ex = {(tr.x - tl.x) / d, (tr.y - tl.y) / d};
+        Point ey = {(bl.x - tl.x) / d, (bl.y - tl.y) / d};
+        Point estimate = {to[2].x - 3 * (ex.x + ey.x),
+                          to[2].y - 3 * (ex.y + ey.y)};
+        double module = std::hypot(ex.x, ex.y);
+        Point anchored[4]
+            = {from[0], from[1], {size - 6.5, size - 6.5}, from[3]};
+
+        // Strong perspective moves the pattern far from the estimate and
+        // scales its modules away from those between the finders, so the
+        // search widens and then rescales when no candidate decodes
+        std::vector<Point> candidates, tried;
+        for (int allowance : {8, 16}) {
+            for (double scale : {1.0, 0.85, 1.2}) {
+                find_alignments(image,
+                                estimate,
+                                {ex.x * scale, ex.y * scale},
+                                {ey.x * scale, ey.y * scale},
+                                (int)std::ceil(allowance * module),
+                                candidates);
+                for (const Point& candidate : candidates) {
+                    bool seen = false;
+                    for (const Point& p : tried) {
+                        seen = seen || distance(p, candidate) <= module;
+                    }
+                    if (seen) {
+                        continue;
+                    }
+                    tried.push_back(candidate);
+
+                    Point corners[4] = {tl, tr, candidate, bl};
+                    if (decode_grid(image,
+                                    Transform::between(anchored, corners),
+                                    size,
+                                    data,
+                                    append)) {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+
+    return decode_grid(image, Transform::between(from, to), size, data, append);
+}
+
+// Tries the symbol sizes that the spacing of the finders allows, the
+// version word of a sampled grid taking precedence
+bool decode_triple(const BitImage& image,
+                   const Finder* a,
+                   const Finder* b,
+                   const Finder* c,
+                   std::vector<unsigned char>& data,
+                   QRAppend& append)
+{
+    Point pa = {a->x, a->y}, pb = {b->x, b->y}, pc = {c->x, c->y};
+    double ab = distance(pa, pb), bc = distance(pb, pc), ca = distance(pc, pa);
+
+    // The top left finder faces the longest side
+    Point tl = pc, tr = pa, bl = pb;
+    if (bc >= ab && bc >= ca) {
+        tl = pa;
+        tr = pb;
+        bl = pc;
+    } else if (ca >= ab && ca >= bc) {
+        tl = pb;
+        tr = pc;
+        bl = pa;
+    }
+    if ((tr.x - tl.x) * (bl.y - tl.y) - (tr.y - tl.y) * (bl.x - tl.x) < 0) {
+        std::swap(tr, bl);
+    }
+
+    // Finder runs along the frame rows are stretched on a rotated
+    // symbol, so the module size is measured along each axis instead
+    double module = (a->module + b->module + c->module) / 3;
+    double span = (distance(tl, tr) / axis_module(image, tl, tr, module)
+                   + distance(tl, bl) / axis_module(image, tl, bl, module))
+                      / 2
+                  + 7;
+    int size = ((int)std::lround(span) - 17 + 2) / 4 * 4 + 17;
+
+    // From version 7 on, the version words beside the top right and
+    // bottom left finders come first, then the sizes around the estimate
+    std::vector<int> sizes;
+    if (size >= 41) {
+        double lx = distance(tl, tr), ly = distance(tl, bl);
+        Point ux = {(tr.x - tl.x) / lx, (tr.y - tl.y) / lx};
+        Point uy = {(bl.x - tl.x) / ly, (bl.y - tl.y) / ly};
+        int version = read_version(image, tr, ux, uy, false);
+        if (version == 0) {
+            version = read_version(image, bl, ux, uy, true);
+        }
+        if (version != 0) {
+            sizes.push_back(4 * version + 17);
+        }
+    }
+    for (int s : {size, size + 4, size - 4, size + 8, size - 8}) {
+        if (std::find(sizes.begin(), sizes.end(), s) == sizes.end()) {
+            sizes.push_back(s);
+        }
+    }
+
+    for (int s : sizes) {
+        if (s >= MIN_SIZE && s <= MAX_SIZE
+            && decode_at(image, tl, tr, bl, s, data, append)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+} // namespace
+
+bool qrscan::decode(const unsigned char* gray,
+                    int width,
+                    int height,
+                    int stride,
+                    std::vector<unsigned char>& data,
+                    QRAppend& append)
+{
+    if (gray == nullptr || width < MIN_SIZE || height < MIN_SIZE
+        || stride < width) {
+        return false;
+    }
+
+    BitImage image;
+    binarize(gray, width, height, stride, image);
+
+    std::vector<Finder> finders;
+    find_finders(image, finders);
+
+    // A finder is seen on many rows, so stray matches are dropped when
+    // there are enough confirmed ones
+    std::stable_sort(
+        finders.begin(), finders.end(), [](const Finder& a, const Finder& b) {
+            return a.count > b.count;
+        });
+    if (finders.size() > 3 && finders[2].count > 1) {
+        finders.erase(std::remove_if(finders.begin(),
+                                     finders.end(),
+                                     [](const Finder& f) { return f.count < 2; }),
+                      finders.end());
+    }
+    if (finders.size() > MAX_FINDERS) {
+        finders.resize(MAX_FINDERS);
+    }
+
+    // Rank the triples by how close they are to an isosceles right
+    // triangle of finders with matching module sizes
+    struct Triple {
+        double score;
+        int a, b, c;
+    };
+    std::vector<Triple> triples;
+    int n = finders.size();
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            for (int k = j + 1; k < n; k++) {
+                const Finder* f[3] = {&finders[i], &finders[j], &finders[k]};
+                double lo = std::min({f[0]->module, f[1]->module, f[2]->module});
+                double hi = std::max({f[0]->module, f[1]->module, f[2]->module});
+                if (hi > 2 * lo) {
+                    continue;
+                }
+
+                double s[3] = {distance({f[0]->x, f[0]->y}, {f[1]->x, f[1]->y}),
+                               distance({f[1]->x, f[1]->y}, {f[2]->x, f[2]->y}),
+                               distance({f[2]->x, f[2]->y}, {f[0]->x, f[0]->y})};
+                std::sort(s, s + 3);
+                if (s[0] < 7 * lo) {
+                    continue;
+                }
+                double score
+                    = std::fabs(s[2] * s[2] - s[0] * s[0] - s[1] * s[1])
+                          / (s[2] * s[2])
+                      + (s[1] - s[0]) / s[1] + (hi - lo) / hi;
+                triples.push_back({score, i, j, k});
+            }
+        }
+    }
+    std::sort(triples.begin(),
+              triples.end(),
+              [](const Triple& a, const Triple& b) { return a.score < b.score; });
+
+    for (std::size_t t = 0; t < triples.size() && t < MAX_TRIPLES; t++) {
+        if (decode_triple(image,
+                          &finders[triples[t].a],
+                          &finders[triples[t].b],
+                          &finders[triples[t].c],
+                          data,
+                          append)) {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2020 Newlogic Pte. Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "qrcode.h"
+
+#include <vector>
+
+/**
+* Finds and decodes a QR code in an 8 bit grayscale camera frame.
+*
+* The frame is thresholded per 8x8 block against its neighbourhood, the
+* three finder patterns are located from their 1:1:3:1:1 runs, and the
+* bottom right alignment pattern, when the version has one, anchors a
+* perspective transform from which every module is sampled. The module
+* grid is then decoded by qrcode_decodeModules, with its Reed-Solomon
+* error correction.
+*/
+
+class qrscan
+{
+public:
+    // Decodes the QR code of a frame of width by height pixels, whose rows
+    // are stride bytes apart. The structured append header of the symbol,
+    // if any, goes into append.
+    static bool decode(const unsigned char* gray,
+                       int width,
+                       int height,
+                       int stride,
+                       std::vector<unsigned char>& data,
+                       QRAppend& append);
+};
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2020 Newlogic Pte. Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Timings of the library's hot paths. These only report numbers and are
+// not run by ctest, the behavior they exercise is covered by idpasstests.
+
+#include "idpass.h"
+#include "CCertificate.h"
+#include "qrframe.h"
+#include "proto/api/api.pb.h"
+#include "proto/idpasslite/idpasslite.pb.h"
+#include "sodium.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+// Returns an issuing context signing with sig, that trusts ver and
+// nkeys - 1 other random verification keys
+void* makeContext(const unsigned char* enc,
+                  const unsigned char* sig,
+                  const unsigned char* ver,
+                  int nkeys,
+                  const std::vector<unsigned char>& rootcerts)
+{
+    api::KeySet cryptoKeys;
+    cryptoKeys.set_encryptionkey(enc, 32);
+    cryptoKeys.set_signaturekey(sig, 64);
+
+    for (int i = 0; i < nkeys - 1; i++) {
+        unsigned char pk[32];
+        unsigned char sk[64];
+        crypto_sign_keypair(pk, sk);
+        api::byteArray* verkey = cryptoKeys.add_verificationkeys();
+        verkey->set_typ(api::byteArray_Typ_ED25519PUBKEY);
+        verkey->set_val(pk, 32);
+    }
+
+    api::byteArray* verkey = cryptoKeys.add_verificationkeys();
+    verkey->set_typ(api::byteArray_Typ_ED25519PUBKEY);
+    verkey->set_val(ver, 32);
+
+    std::vector<unsigned char> keysetbuf(cryptoKeys.ByteSizeLong());
+    cryptoKeys.SerializeToArray(keysetbuf.data(), keysetbuf.size());
+
+    return idpass_lite_init(keysetbuf.data(),
+                            keysetbuf.size(),
+                            rootcerts.empty() ? nullptr : (unsigned char*)rootcerts.data(),
+                            rootcerts.size());
+}
+
+std::vector<unsigned char> makeIdent()
+{
+    api::Ident ident;
+    ident.set_surname("Pacquiao");
+    ident.set_givenname("Manny");
+    ident.set_placeofbirth("Kibawe, Bukidnon");
+    ident.set_pin("12345");
+    ident.mutable_dateofbirth()->set_year(1978);
+    ident.mutable_dateofbirth()->set_month(12);
+    ident.mutable_dateofbirth()->set_day(17);
+
+    std::vector<unsigned char> buf(ident.ByteSizeLong());
+    ident.SerializeToArray(buf.data(), buf.size());
+    return buf;
+}
+
+// Card signature verification against a growing set of trusted keys,
+// with the signer's key trusted last
+void benchVerificationKeys()
+{
+    std::vector<unsigned char> ident = makeIdent();
+
+    for (int nkeys : {1, 100, 10000}) {
+        unsigned char enc[32];
+        unsigned char sig[64];
+        unsigned char ver[32];
+        idpass_lite_generate_secret_signature_keypair(ver, 32, sig, 64);
+        idpass_lite_generate_encryption_key(enc, 32);
+
+        void* ctx = makeContext(enc, sig, ver, nkeys, {});
+        if (ctx == nullptr) {
+            std::cout << "init failed" << std::endl;
+            return;
+        }
+
+        int card_len = 0;
+        unsigned char* card = idpass_lite_create_card_with_face(
+            ctx, &card_len, ident.data(), ident.size());
+
+        const int rounds = 1000;
+        int failed = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; i++) {
+            failed += idpass_lite_verify_card_signature(ctx, card, card_len, 1) != 0;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+
+        std::cout << nkeys << " trusted keys: " << elapsed.count() / rounds
+                  << " us/verify" << (failed ? " (failures)" : "") << std::endl;
+
+        idpass_lite_freemem(ctx, card);
+        idpass_lite_freemem(ctx, ctx);
+    }
+}
+
+// QR encoding of a card embedding its certificate chain, and of the same
+// card carrying the chain by reference
+void benchChainByReference()
+{
+    unsigned char enc[32];
+    unsigned char sig[64];
+    unsigned char ver[32];
+    idpass_lite_generate_secret_signature_keypair(ver, 32, sig, 64);
+    idpass_lite_generate_encryption_key(enc, 32);
+
+    CCertificate rootCert;
+    api::Certificates rootCertificates;
+    rootCertificates.add_cert()->CopyFrom(rootCert.getValue());
+    std::vector<unsigned char> rootcerts(rootCertificates.ByteSizeLong());
+    rootCertificates.SerializeToArray(rootcerts.data(), rootcerts.size());
+
+    void* ctx = makeContext(enc, sig, ver, 1, rootcerts);
+    if (ctx == nullptr) {
+        std::cout << "init failed" << std::endl;
+        return;
+    }
+
+    CCertificate child0;
+    CCertificate child1(sig, 64);
+    rootCert.Sign(child0);
+    child0.Sign(child1);
+
+    api::Certificates intermediateCertificates;
+    intermediateCertificates.add_cert()->CopyFrom(child0.getValue());
+    intermediateCertificates.add_cert()->CopyFrom(child1.getValue());
+    std::vector<unsigned char> chain(intermediateCertificates.ByteSizeLong());
+    intermediateCertificates.SerializeToArray(chain.data(), chain.size());
+    idpass_lite_add_certificates(ctx, chain.data(), chain.size());
+
+    std::vector<unsigned char> ident = makeIdent();
+
+    int embedded_len = 0;
+    unsigned char* embedded = idpass_lite_create_card_with_face(
+        ctx, &embedded_len, ident.data(), ident.size());
+
+    unsigned char ioctlcmd[] = {IOCTL_SET_CHAINREF, 0x01};
+    idpass_lite_ioctl(ctx, nullptr, ioctlcmd, sizeof ioctlcmd);
+    idpass_lite_add_known_chain(ctx, chain.data(), chain.size());
+
+    int byref_len = 0;
+    unsigned char* byref = idpass_lite_create_card_with_face(
+        ctx, &byref_len, ident.data(), ident.size());
+
+    for (auto c : {std::make_pair(embedded, embedded_len),
+                   std::make_pair(byref, byref_len)}) {
+        const int rounds = 100;
+        int qrsize = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; i++) {
+            idpass_lite_freemem(ctx, idpass_lite_qrpixel(ctx, c.first, c.second, &qrsize));
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+
+        std::cout << (c.first == byref ? "by reference: " : "embedded: ")
+                  << c.second << " bytes, QR version " << (qrsize - 17) / 4
+                  << ", " << elapsed.count() / rounds << " us/encode" << std::endl;
+    }
+
+    idpass_lite_freemem(ctx, embedded);
+    idpass_lite_freemem(ctx, byref);
+    idpass_lite_freemem(ctx, ctx);
+}
+
+// Decoding of a card's QR code from a tilted 1280x720 camera frame
+void benchQrscan()
+{
+    unsigned char enc[32];
+    unsigned char sig[64];
+    unsigned char ver[32];
+    idpass_lite_generate_secret_signature_keypair(ver, 32, sig, 64);
+    idpass_lite_generate_encryption_key(enc, 32);
+
+    void* ctx = makeContext(enc, sig, ver, 1, {});
+    if (ctx == nullptr) {
+        std::cout << "init failed" << std::endl;
+        return;
+    }
+
+    std::vector<unsigned char> ident = makeIdent();
+    int card_len = 0;
+    unsigned char* card = idpass_lite_create_card_with_face(
+        ctx, &card_len, ident.data(), ident.size());
+
+    int pixels_len = 0, qrsize = 0;
+    unsigned char* pixels
+        = idpass_lite_qrpixel2(ctx, &pixels_len, card, card_len, &qrsize);
+
+    const int width = 1280, height = 720;
+    const double quad[8] = {420, 110, 890, 150, 860, 650, 380, 600};
+    std::vector<unsigned char> frame;
+    qrframe_render(pixels, qrsize, quad, 20, width, height, frame);
+
+    const int rounds = 100;
+    int failed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        int data_len = 0, count = 0;
+        unsigned char* data = idpass_lite_qrscan(
+            ctx, &data_len, frame.data(), width, height, width, &count);
+        failed += data == nullptr;
+        idpass_lite_freemem(ctx, data);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    std::cout << "QR version " << (qrsize - 17) / 4 << " scan: "
+              << elapsed.count() / rounds << " us/frame"
+              << (failed ? " (failures)" : "") << std::endl;
+
+    idpass_lite_freemem(ctx, pixels);
+    idpass_lite_freemem(ctx, card);
+    idpass_lite_freemem(ctx, ctx);
+}
+} // namespace
+
+int main()
+{
+    if (sodium_init() < 0) {
+        return 1;
+    }
+
+    benchVerificationKeys();
+    benchChainByReference();
+    benchQrscan();
+    return 0;
+}
@@ -17,18 +17,24 @@
 #include "idpass.h"
 #include "bin16.h"
 #include "CCertificate.h"
+#include "qrcode.h"
+#include "qrframe.h"
 #include "proto/api/api.pb.h"
 #include "proto/idpasslite/idpasslite.pb.h"
 #include "sodium.h"
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <ctime>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <map>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -124,6 +130,23 @@ protected:
         delete m_rootCert1;
         idpass_lite_freemem(ctx, ctx);
     }
+
+    // Signs child0 with m_rootCert1 and a child1 of m_sig with child0, and
+    // returns both as serialized intermediate certificates
+    std::vector<unsigned char> makeChain(CCertificate& child0)
+    {
+        CCertificate child1(m_sig, 64);
+        m_rootCert1->Sign(child0);
+        child0.Sign(child1);
+
+        api::Certificates intermediateCertificates;
+        intermediateCertificates.add_cert()->CopyFrom(child0.getValue());
+        intermediateCertificates.add_cert()->CopyFrom(child1.getValue());
+
+        std::vector<unsigned char> chain(intermediateCertificates.ByteSizeLong());
+        intermediateCertificates.SerializeToArray(chain.data(), chain.size());
+        return chain;
+    }
 };
 
 TEST_F(TestCases, card_integrity_test)
@@ -1814,6 +1837,1572 @@ TEST_F(TestCases, test_verify_card_with_face_template_with_different_photo)
     ASSERT_EQ(details, nullptr);
 }
 
+TEST_F(TestCases, sign_streaming_test)
+{
+    std::vector<unsigned char> _ident(m_ident.ByteSizeLong());
+    m_ident.SerializeToArray(_ident.data(), _ident.size());
+
+    int card_len = 0;
+    unsigned char* card = idpass_lite_create_card_with_face(ctx,
+        &card_len, _ident.data(), _ident.size());
+
+    ASSERT_TRUE(card != nullptr);
+
+    std::vector<unsigned char> document(100000);
+    randombytes_buf(document.data(), document.size());
+
+    // sign the document in uneven chunks as if streamed from disk
+    void* signer = idpass_lite_sign_init(ctx, card, card_len);
+    ASSERT_TRUE(signer != nullptr);
+
+    std::size_t offset = 0;
+    for (int chunk = 1; offset < document.size(); chunk *= 3) {
+        int n = std::min<std::size_t>(chunk, document.size() - offset);
+        ASSERT_EQ(0, idpass_lite_sign_update(ctx, signer, &document[offset], n));
+        offset += n;
+    }
+
+    unsigned char signature[SIGNATURE_ED25519PH_LEN];
+    ASSERT_EQ(0, idpass_lite_sign_final(ctx, signer, signature, sizeof signature));
+    ASSERT_EQ(signature[0], SIGMODE_ED25519PH);
+
+    ///////////// get user's unique ed25519 public key ////////////
+    idpass::IDPassCards idpassCards;
+    ASSERT_TRUE(idpassCards.ParseFromArray(card, card_len));
+    int decrypted_card_len = idpassCards.encryptedcard().size();
+    std::vector<unsigned char> decrypted_card(
+        idpassCards.encryptedcard().begin(), idpassCards.encryptedcard().end());
+    ASSERT_EQ(0, idpass_lite_card_decrypt(
+        ctx, decrypted_card.data(), &decrypted_card_len, m_enc, 32));
+    idpass::SignedIDPassCard signedidpasscard;
+    ASSERT_TRUE(signedidpasscard.ParseFromArray(decrypted_card.data(), decrypted_card_len));
+    unsigned char pubkey[32];
+    std::memcpy(pubkey, signedidpasscard.card().encryptionkey().data() + 32, 32);
+
+    // verify in a single chunk
+    void* verifier = idpass_lite_verify_init(ctx, pubkey, sizeof pubkey);
+    ASSERT_TRUE(verifier != nullptr);
+    ASSERT_EQ(0, idpass_lite_verify_update(ctx, verifier, document.data(), document.size()));
+    ASSERT_EQ(0, idpass_lite_verify_final(ctx, verifier, signature, sizeof signature));
+
+    // the prehashed signature is not a pure ed25519 signature
+    ASSERT_NE(0, idpass_lite_verify_with_card(ctx, document.data(),
+        document.size(), signature + 1, 64, pubkey, sizeof pubkey));
+
+    // tampered data does not verify
+    document[document.size() / 2] ^= 0x01;
+    verifier = idpass_lite_verify_init(ctx, pubkey, sizeof pubkey);
+    ASSERT_EQ(0, idpass_lite_verify_update(ctx, verifier, document.data(), document.size()));
+    ASSERT_NE(0, idpass_lite_verify_final(ctx, verifier, signature, sizeof signature));
+    document[document.size() / 2] ^= 0x01;
+
+    // a wrong mode tag does not verify
+    signature[0] = 0x00;
+    verifier = idpass_lite_verify_init(ctx, pubkey, sizeof pubkey);
+    ASSERT_EQ(0, idpass_lite_verify_update(ctx, verifier, document.data(), document.size()));
+    ASSERT_NE(0, idpass_lite_verify_final(ctx, verifier, signature, sizeof signature));
+}
+
+TEST_F(TestCases, sign_many_with_card_test)
+{
+    std::vector<unsigned char> _ident(m_ident.ByteSizeLong());
+    m_ident.SerializeToArray(_ident.data(), _ident.size());
+
+    int card_len = 0;
+    unsigned char* card = idpass_lite_create_card_with_face(ctx,
+        &card_len, _ident.data(), _ident.size());
+
+    ASSERT_TRUE(card != nullptr);
+
+    // build a batch large enough to be signed across threads
+    const int N = 300;
+    std::vector<std::string> records;
+    std::vector<unsigned char> msgs;
+
+    for (int i = 0; i < N; i++) {
+        std::string record = "audit record #" + std::to_string(i);
+        int len = record.size();
+        msgs.insert(msgs.end(), (unsigned char*)&len, (unsigned char*)&len + sizeof len);
+        msgs.insert(msgs.end(), record.begin(), record.end());
+        records.push_back(record);
+    }
+
+    int sigs_len = 0;
+    unsigned char* sigs = idpass_lite_sign_many_with_card(ctx,
+        &sigs_len, card, card_len, msgs.data(), msgs.size());
+
+    ASSERT_TRUE(sigs != nullptr);
+    ASSERT_EQ(sigs_len, N * 64);
+
+    // ed25519 is deterministic, so each batch signature must match
+    // the one signed individually
+    for (int i = 0; i < N; i += 37) {
+        unsigned char signature[64];
+        ASSERT_EQ(0, idpass_lite_sign_with_card(ctx, signature, 64, card,
+            card_len, (unsigned char*)records[i].data(), records[i].size()));
+        ASSERT_EQ(0, std::memcmp(signature, sigs + i * 64, 64));
+    }
+
+    idpass_lite_freemem(ctx, sigs);
+
+    // truncated length prefix
+    ASSERT_TRUE(nullptr == idpass_lite_sign_many_with_card(ctx,
+        &sigs_len, card, card_len, msgs.data(), msgs.size() - 1));
+}
+
+TEST_F(TestCases, verify_card_signatures_batch_test)
+{
+    m_ident.clear_photo();
+    std::vector<unsigned char> _ident(m_ident.ByteSizeLong());
+    m_ident.SerializeToArray(_ident.data(), _ident.size());
+
+    const int N = 40;
+    const int tampered = 17;
+    std::vector<unsigned char> cards_buf;
+
+    for (int i = 0; i < N; i++) {
+        int card_len = 0;
+        unsigned char* card = idpass_lite_create_card_with_face(ctx,
+            &card_len, _ident.data(), _ident.size());
+        ASSERT_TRUE(card != nullptr);
+
+        std::vector<unsigned char> c(card, card + card_len);
+        if (i == tampered) {
+            c[c.size() / 2] ^= 0x01;
+        }
+        cards_buf.insert(cards_buf.end(), (unsigned char*)&card_len, (unsigned char*)&card_len + sizeof card_len);
+        cards_buf.insert(cards_buf.end(), c.begin(), c.end());
+        idpass_lite_freemem(ctx, card);
+    }
+
+    int n = 0;
+    unsigned char* status = idpass_lite_verify_card_signatures_batch(
+        ctx, &n, cards_buf.data(), cards_buf.size(), 1);
+
+    ASSERT_TRUE(status != nullptr);
+    ASSERT_EQ(n, N);
+
+    for (int i = 0; i < N; i++) {
+        if (i == tampered) {
+            ASSERT_NE(status[i], 0);
+        } else {
+            ASSERT_EQ(status[i], 0);
+        }
+    }
+
+    idpass_lite_freemem(ctx, status);
+}
+
+TEST_F(TestCases, verification_key_index_test)
+{
+    m_ident.clear_photo();
+    std::vector<unsigned char> _ident(m_ident.ByteSizeLong());
+    m_ident.SerializeToArray(_ident.data(), _ident.size());
+
+    // A card from a signer the reader contexts below do not trust
+    int foreign_len = 0;
+    unsigned char* foreign = idpass_lite_create_card_with_face(
+        ctx, &foreign_len, _ident.data(), _ident.size());
+    ASSERT_TRUE(foreign != nullptr);
+
+    for (int nkeys : {1, 100, 10000}) {
+        unsigned char enc[32];
+        unsigned char sig[64];
+        unsigned char ver[32];
+        idpass_lite_generate_secret_signature_keypair(ver, 32, sig, 64);
+        idpass_lite_generate_encryption_key(enc, 32);
+
+        api::KeySet cryptoKeys;
+        cryptoKeys.set_encryptionkey(enc, 32);
+        cryptoKeys.set_signaturekey(sig, 64);
+
+        for (int i = 0; i < nkeys - 1; i++) {
+            unsigned char pk[32];
+            unsigned char sk[64];
+            crypto_sign_keypair(pk, sk);
+            api::byteArray* verkey = cryptoKeys.add_verificationkeys();
+            verkey->set_typ(api::byteArray_Typ_ED25519PUBKEY);
+            verkey->set_val(pk, 32);
+        }
+
+        // The card signer's key is the last one trusted
+        api::byteArray* verkey = cryptoKeys.add_verificationkeys();
+        verkey->set_typ(api::byteArray_Typ_ED25519PUBKEY);
+        verkey->set_val(ver, 32);
+
+        std::vector<unsigned char> keysetbuf(cryptoKeys.ByteSizeLong());
+        cryptoKeys.SerializeToArray(keysetbuf.data(), keysetbuf.size());
+
+        void* reader = idpass_lite_init(
+            keysetbuf.data(), keysetbuf.size(), nullptr, 0);
+        ASSERT_TRUE(reader != nullptr);
+
+        int card_len = 0;
+        unsigned char* card = idpass_lite_create_card_with_face(
+            reader, &card_len, _ident.data(), _ident.size());
+        ASSERT_TRUE(card != nullptr);
+
+        ASSERT_EQ(idpass_lite_verify_card_signature(reader, card, card_len, 1), 0);
+
+        ASSERT_EQ(idpass_lite_verify_card_signature(
+                      reader, foreign, foreign_len, 1), 4);
+
+        idpass_lite_freemem(reader, card);
+        idpass_lite_freemem(reader, reader);
+    }
+
+    idpass_lite_freemem(ctx, foreign);
+}
+
+TEST_F(TestCases, certificate_bulk_revoke_test)
+{
+    CCertificate child0;
+    std::vector<unsigned char> intermedcerts_buf = makeChain(child0);
+
+    const int N = 100000;
+    std::vector<unsigned char> pubkeys(N * 32);
+    randombytes_buf(pubkeys.data(), pubkeys.size());
+    std::memcpy(&pubkeys[(N / 2) * 32], child0.m_pk.data(), 32);
+
+    ASSERT_NE(idpass_lite_add_revoked_keys(pubkeys.data(), 31), 0);
+    ASSERT_EQ(idpass_lite_add_revoked_keys(pubkeys.data(), pubkeys.size()), 0);
+
+    int n = idpass_lite_add_certificates(
+        ctx, intermedcerts_buf.data(), intermedcerts_buf.size());
+
+    ASSERT_TRUE(n != 0); // child0 is in the bulk revoked list
+}
+
+TEST_F(TestCases, revocation_store_test)
+{
+    const char* storefile = "test_revoked.keys";
+    std::string deltafile = std::string(storefile) + ".delta";
+    std::remove(storefile);
+    std::remove(deltafile.c_str());
+
+    CCertificate storeRevoked, deltaRevoked, notRevoked;
+    std::vector<unsigned char> chain1 = makeChain(storeRevoked);
+    std::vector<unsigned char> chain2 = makeChain(deltaRevoked);
+    std::vector<unsigned char> chain3 = makeChain(notRevoked);
+
+    const int N = 100000;
+    std::vector<unsigned char> pubkeys(N * 32);
+    randombytes_buf(pubkeys.data(), pubkeys.size());
+    std::memcpy(&pubkeys[1234 * 32], storeRevoked.m_pk.data(), 32);
+
+    ASSERT_EQ(idpass_lite_load_revoked_keys(storefile), 1);
+    ASSERT_EQ(idpass_lite_write_revoked_keys(storefile, pubkeys.data(), pubkeys.size()), 0);
+    ASSERT_EQ(idpass_lite_append_revoked_keys(
+                  storefile, (unsigned char*)deltaRevoked.m_pk.data(), 32), 0);
+    ASSERT_EQ(idpass_lite_load_revoked_keys(storefile), 0);
+
+    ASSERT_NE(idpass_lite_add_certificates(ctx, chain1.data(), chain1.size()), 0);
+    ASSERT_NE(idpass_lite_add_certificates(ctx, chain2.data(), chain2.size()), 0);
+    ASSERT_EQ(idpass_lite_add_certificates(ctx, chain3.data(), chain3.size()), 0);
+
+    // Loading leaves the delta alone, compacting merges it into the store
+    ASSERT_TRUE(std::ifstream(deltafile));
+    ASSERT_EQ(idpass_lite_compact_revoked_keys(storefile), 0);
+    ASSERT_FALSE(std::ifstream(deltafile));
+    ASSERT_FALSE(std::ifstream(deltafile + ".merging"));
+    ASSERT_EQ(idpass_lite_compact_revoked_keys(storefile), 1);
+    ASSERT_EQ(idpass_lite_load_revoked_keys(storefile), 0);
+
+    // Keys appended while the delta is merged all end up in the store
+    const int M = 200;
+    std::vector<unsigned char> appended(M * 32);
+    randombytes_buf(appended.data(), appended.size());
+    std::thread appender([&]() {
+        for (int i = 0; i < M; i++) {
+            idpass_lite_append_revoked_keys(storefile, &appended[i * 32], 32);
+        }
+    });
+    for (int i = 0; i < 20; i++) {
+        ASSERT_NE(idpass_lite_compact_revoked_keys(storefile), 2);
+    }
+    appender.join();
+    ASSERT_NE(idpass_lite_compact_revoked_keys(storefile), 2);
+    ASSERT_FALSE(std::ifstream(deltafile));
+
+    std::uint64_t count = 0;
+    {
+        std::ifstream f(storefile, std::ios::binary);
+        f.seekg(8);
+        f.read(reinterpret_cast<char*>(&count), sizeof count);
+    }
+    ASSERT_EQ(count, (std::uint64_t)N + 1 + M);
+
+    // A corrupted store fails the integrity check
+    {
+        std::fstream f(storefile, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(100);
+        f.put('X');
+    }
+    ASSERT_EQ(idpass_lite_load_revoked_keys(storefile), 2);
+
+    std::remove(storefile);
+}
+
+TEST_F(TestCases, revocation_filter_test)
+{
+    const char* storefile = "test_filter_revoked.keys";
+
+    CCertificate revoked, notRevoked, lateRevoked;
+    std::vector<unsigned char> chain1 = makeChain(revoked);
+    std::vector<unsigned char> chain2 = makeChain(notRevoked);
+    std::vector<unsigned char> chain3 = makeChain(lateRevoked);
+
+    const int N = 200000;
+    std::vector<unsigned char> pubkeys(N * 32);
+    randombytes_buf(pubkeys.data(), pubkeys.size());
+    std::memcpy(&pubkeys[777 * 32], revoked.m_pk.data(), 32);
+
+    ASSERT_EQ(idpass_lite_write_revoked_keys(storefile, pubkeys.data(), pubkeys.size()), 0);
+    ASSERT_EQ(idpass_lite_load_revoked_keys(storefile), 0);
+
+    int blob_len = 0;
+    unsigned char* blob = idpass_lite_build_revocation_filter(
+        ctx, &blob_len, pubkeys.data(), pubkeys.size(), 0.05);
+    ASSERT_TRUE(blob != nullptr);
+    // 1 byte fingerprints suffice for a 5% false positive rate
+    ASSERT_LT(blob_len, N * 2);
+
+    int blob2_len = 0;
+    unsigned char* blob2 = idpass_lite_build_revocation_filter(
+        ctx, &blob2_len, pubkeys.data(), pubkeys.size(), 0.000001);
+    ASSERT_TRUE(blob2 != nullptr);
+    ASSERT_GT(blob2_len, blob_len);
+
+    ASSERT_NE(idpass_lite_load_revocation_filter(blob, blob_len - 1), 0);
+    ASSERT_EQ(idpass_lite_load_revocation_filter(blob, blob_len), 0);
+
+    ASSERT_NE(idpass_lite_add_certificates(ctx, chain1.data(), chain1.size()), 0);
+    ASSERT_EQ(idpass_lite_add_certificates(ctx, chain2.data(), chain2.size()), 0);
+
+    // A key revoked after the filter was built is not missed
+    pubkeys.insert(pubkeys.end(), lateRevoked.m_pk.begin(), lateRevoked.m_pk.end());
+    ASSERT_EQ(idpass_lite_write_revoked_keys(storefile, pubkeys.data(), pubkeys.size()), 0);
+    ASSERT_EQ(idpass_lite_load_revoked_keys(storefile), 0);
+    ASSERT_NE(idpass_lite_add_certificates(ctx, chain3.data(), chain3.size()), 0);
+    ASSERT_NE(idpass_lite_add_certificates(ctx, chain1.data(), chain1.size()), 0);
+    ASSERT_EQ(idpass_lite_add_certificates(ctx, chain2.data(), chain2.size()), 0);
+
+    ASSERT_EQ(idpass_lite_load_revocation_filter(nullptr, 0), 0);
+    idpass_lite_freemem(ctx, blob);
+    idpass_lite_freemem(ctx, blob2);
+    std::remove(storefile);
+}
+
+TEST_F(TestCases, chain_cache_revocation_test)
+{
+    CCertificate child0;
+    std::vector<unsigned char> intermedcerts_buf = makeChain(child0);
+
+    ASSERT_EQ(idpass_lite_add_certificates(
+                  ctx, intermedcerts_buf.data(), intermedcerts_buf.size()), 0);
+
+    m_ident.clear_photo();
+    std::vector<unsigned char> _ident(m_ident.ByteSizeLong());
+    m_ident.SerializeToArray(_ident.data(), _ident.size());
+
+    int card_len = 0;
+    unsigned char* card = idpass_lite_create_card_with_face(
+        ctx, &card_len, _ident.data(), _ident.size());
+    ASSERT_TRUE(card != nullptr);
+
+    // Repeat verifications of the same chain hit the cache
+    for (int i = 0; i < 100; i++) {
+        ASSERT_EQ(idpass_lite_verify_card_signature(ctx, card, card_len, 0), 0);
+    }
+
+    // Revoking a certificate of the cached chain invalidates it
+    idpass_lite_add_revoked_key((unsigned char*)child0.m_pk.data(), 32);
+    ASSERT_NE(idpass_lite_verify_card_signature(ctx, card, card_len, 0), 0);
+    ASSERT_NE(idpass_lite_add_certificates(
+                  ctx, intermedcerts_buf.data(), intermedcerts_buf.size()), 0);
+
+    idpass_lite_freemem(ctx, card);
+}
+
+TEST_F(TestCases, chain_by_reference_test)
+{
+    CCertificate child0;
+    std::vector<unsigned char> chain = makeChain(child0);
+
+    ASSERT_EQ(idpass_lite_add_certificates(ctx, chain.data(), chain.size()), 0);
+
+    m_ident.clear_photo();
+    std::vector<unsigned char> _ident(m_ident.ByteSizeLong());
+    m_ident.SerializeToArray(_ident.data(), _ident.size());
+
+    int embedded_len = 0;
+    unsigned char* embedded = idpass_lite_create_card_with_face(
+        ctx, &embedded_len, _ident.data(), _ident.size());
+    ASSERT_TRUE(embedded != nullptr);
+
+    // Opting in has no effect until the chain is known
+    unsigned char ioctlcmd[] = {IOCTL_SET_CHAINREF, 0x01};
+    idpass_lite_ioctl(ctx, nullptr, ioctlcmd, sizeof ioctlcmd);
+
+    int card_len = 0;
+    unsigned char* card = idpass_lite_create_card_with_face(
+        ctx, &card_len, _ident.data(), _ident.size());
+    ASSERT_TRUE(card != nullptr);
+    ASSERT_EQ(card_len, embedded_len);
+    idpass_lite_freemem(ctx, card);
+
+    ASSERT_EQ(idpass_lite_add_known_chain(ctx, chain.data(), chain.size()), 0);
+
+    int byref_len = 0;
+    unsigned char* byref = idpass_lite_create_card_with_face(
+        ctx, &byref_len, _ident.data(), _ident.size());
+    ASSERT_TRUE(byref != nullptr);
+    ASSERT_LT(byref_len + 200, embedded_len);
+
+    ASSERT_EQ(idpass_lite_verify_certificate(ctx, embedded, embedded_len), 2);
+    ASSERT_EQ(idpass_lite_verify_certificate(ctx, byref, byref_len), 2);
+    ASSERT_EQ(idpass_lite_verify_card_signature(ctx, byref, byref_len, 0), 0);
+
+    // The smaller card never needs a larger QR code
+    int embedded_qrsize = 0;
+    unsigned char* pixels
+        = idpass_lite_qrpixel(ctx, embedded, embedded_len, &embedded_qrsize);
+    ASSERT_TRUE(pixels != nullptr);
+    idpass_lite_freemem(ctx, pixels);
+
+    int byref_qrsize = 0;
+    pixels = idpass_lite_qrpixel(ctx, byref, byref_len, &byref_qrsize);
+    ASSERT_TRUE(pixels != nullptr);
+    idpass_lite_freemem(ctx, pixels);
+    ASSERT_LE(byref_qrsize, embedded_qrsize);
+
+    // A reader that has not preloaded the chain rejects the card
+    api::KeySet cryptoKeys;
+    cryptoKeys.set_encryptionkey(m_enc, 32);
+    cryptoKeys.set_signaturekey(m_sig, 64);
+    std::vector<unsigned char> keysetbuf(cryptoKeys.ByteSizeLong());
+    cryptoKeys.SerializeToArray(keysetbuf.data(), keysetbuf.size());
+
+    api::Certificates rootCertificates;
+    rootCertificates.add_cert()->CopyFrom(m_rootCert1->getValue());
+    std::vector<unsigned char> rootcertsbuf(rootCertificates.ByteSizeLong());
+    rootCertificates.SerializeToArray(rootcertsbuf.data(), rootcertsbuf.size());
+
+    void* reader = idpass_lite_init(keysetbuf.data(), keysetbuf.size(),
+                                    rootcertsbuf.data(), rootcertsbuf.size());
+    ASSERT_TRUE(reader != nullptr);
+
+    ASSERT_LT(idpass_lite_verify_certificate(reader, byref, byref_len), 0);
+    ASSERT_EQ(idpass_lite_verify_certificate(reader, embedded, embedded_len), 2);
+    ASSERT_EQ(idpass_lite_add_known_chain(reader, chain.data(), chain.size()), 0);
+    ASSERT_EQ(idpass_lite_verify_certificate(reader, byref, byref_len), 2);
+
+    idpass_lite_freemem(reader, reader);
+    idpass_lite_freemem(ctx, embedded);
+    idpass_lite_freemem(ctx, byref);
+}
+
+TEST_F(TestCases, compressed_private_region_test)
+{
+    m_ident.clear_photo();
+    m_ident.mutable_postaladdress()->set_region_code("PH");
+    m_ident.mutable_postaladdress()->set_locality("Municipality of Kibawe");
+    m_ident.mutable_postaladdress()->set_administrative_area("Province of Bukidnon");
+    m_ident.mutable_postaladdress()->add_address_lines("Purok 5, Barangay Poblacion");
+    idpass::Pair* kv = m_ident.add_privextra();
+    kv->set_key("Nationality");
+    kv->set_value("Filipino Citizen");
+    kv = m_ident.add_privextra();
+    kv->set_key("Marital Status");
+    kv->set_value("Married");
+
+    std::vector<unsigned char> _ident(m_ident.ByteSizeLong());
+    m_ident.SerializeToArray(_ident.data(), _ident.size());
+
+    int plain_len = 0;
+    unsigned char* plain = idpass_lite_create_card_with_face(
+        ctx, &plain_len, _ident.data(), _ident.size());
+    ASSERT_TRUE(plain != nullptr);
+
+    unsigned char ioctlcmd[] = {IOCTL_SET_COMPRESS, 0x01};
+    idpass_lite_ioctl(ctx, nullptr, ioctlcmd, sizeof ioctlcmd);
+
+    // Without a dictionary the private region is left uncompressed and
+    // decrypts in place
+    int card_len = 0;
+    unsigned char* card = idpass_lite_create_card_with_face(
+        ctx, &card_len, _ident.data(), _ident.size());
+    ASSERT_TRUE(card != nullptr);
+    idpass::IDPassCards noDictCard;
+    ASSERT_TRUE(noDictCard.ParseFromArray(card, card_len));
+    std::vector<unsigned char> nodict(noDictCard.encryptedcard().begin(),
+                                      noDictCard.encryptedcard().end());
+    int nodict_len = nodict.size();
+    ASSERT_EQ(idpass_lite_card_decrypt(ctx, nodict.data(), &nodict_len, m_enc, 32), 0);
+
+    // A trained dictionary holding this population's common values
+    std::string dict = "Province of Bukidnon, Municipality of Kibawe, "
+                       "Barangay Poblacion, Filipino Citizen, Manny Pacquiao";
+    ASSERT_EQ(idpass_lite_set_dictionary(
+                  ctx, (unsigned char*)dict.data(), dict.size()), 0);
+
+    int trained_len = 0;
+    unsigned char* trained = idpass_lite_create_card_with_face(
+        ctx, &trained_len, _ident.data(), _ident.size());
+    ASSERT_TRUE(trained != nullptr);
+    ASSERT_LT(trained_len, plain_len);
+
+    // Old uncompressed and new compressed cards both decode
+    for (auto c : {std::make_pair(plain, plain_len),
+                   std::make_pair(card, card_len),
+                   std::make_pair(trained, trained_len)}) {
+        int details_len = 0;
+        unsigned char* details = idpass_lite_verify_card_with_pin(
+            ctx, &details_len, c.first, c.second, "12345");
+        ASSERT_TRUE(details != nullptr);
+
+        idpass::CardDetails cardDetails;
+        ASSERT_TRUE(cardDetails.ParseFromArray(details, details_len));
+        ASSERT_EQ(cardDetails.surname(), "Pacquiao");
+        ASSERT_EQ(cardDetails.postaladdress().locality(), "Municipality of Kibawe");
+        ASSERT_EQ(cardDetails.extra_size(), 2);
+        idpass_lite_freemem(ctx, details);
+    }
+
+    // The private region inflates past the encrypted length, so it does
+    // not decrypt in place but does into a new buffer
+    idpass::IDPassCards fullCard;
+    ASSERT_TRUE(fullCard.ParseFromArray(trained, trained_len));
+    std::vector<unsigned char> ecard(fullCard.encryptedcard().begin(),
+                                     fullCard.encryptedcard().end());
+    int ecard_len = ecard.size();
+    ASSERT_EQ(idpass_lite_card_decrypt(ctx, ecard.data(), &ecard_len, m_enc, 32), 3);
+    ASSERT_EQ(ecard_len, (int)ecard.size());
+
+    int decrypted_len = 0;
+    unsigned char* decrypted = idpass_lite_card_decrypt2(
+        ctx, &decrypted_len, ecard.data(), ecard.size(), m_enc, 32);
+    ASSERT_TRUE(decrypted != nullptr);
+    ASSERT_GT(decrypted_len, (int)ecard.size());
+    idpass::SignedIDPassCard signedCard;
+    ASSERT_TRUE(signedCard.ParseFromArray(decrypted, decrypted_len));
+    ASSERT_EQ(signedCard.card().details().surname(), "Pacquiao");
+    idpass_lite_freemem(ctx, decrypted);
+
+    ecard[ecard.size() - 1] ^= 1;
+    ASSERT_TRUE(idpass_lite_card_decrypt2(
+                    ctx, &decrypted_len, ecard.data(), ecard.size(), m_enc, 32)
+                == nullptr);
+
+    idpass_lite_freemem(ctx, plain);
+    idpass_lite_freemem(ctx, card);
+    idpass_lite_freemem(ctx, trained);
+}
+
+TEST_F(TestCases, dictionary_collision_test)
+{
+    // Both dictionaries hash to the same 32-bit id
+    std::string dict1 = "dict-52059";
+    std::string dict2 = "dict-63416";
+
+    ASSERT_EQ(idpass_lite_set_dictionary(
+                  ctx, (unsigned char*)dict1.data(), dict1.size()), 0);
+    ASSERT_EQ(idpass_lite_set_dictionary(
+                  ctx, (unsigned char*)dict2.data(), dict2.size()), 2);
+    ASSERT_EQ(idpass_lite_set_dictionary(
+                  ctx, (unsigned char*)dict1.data(), dict1.size()), 0);
+
+    // Cards compressed with the first dictionary still decode
+    unsigned char ioctlcmd[] = {IOCTL_SET_COMPRESS, 0x01};
+    idpass_lite_ioctl(ctx, nullptr, ioctlcmd, sizeof ioctlcmd);
+
+    std::vector<unsigned char> _ident(m_ident.ByteSizeLong());
+    m_ident.SerializeToArray(_ident.data(), _ident.size());
+
+    int card_len = 0;
+    unsigned char* card = idpass_lite_create_card_with_face(
+        ctx, &card_len, _ident.data(), _ident.size());
+    ASSERT_TRUE(card != nullptr);
+
+    int details_len = 0;
+    unsigned char* details = idpass_lite_verify_card_with_pin(
+        ctx, &details_len, card, card_len, "12345");
+    ASSERT_TRUE(details != nullptr);
+    idpass_lite_freemem(ctx, details);
+    idpass_lite_freemem(ctx, card);
+}
+
+TEST_F(TestCases, qrcode_golden_test)
+{
+    // Digest of the version, mask and modules of every symbol encoded
+    // from a fixed set of payloads
+    std::set<int> masks;
+    auto digest = [&masks](int ecc,
+                           const std::vector<std::vector<uint8_t>>& payloads) {
+        crypto_generichash_state state;
+        crypto_generichash_init(&state, nullptr, 0, 16);
+        for (auto& data : payloads) {
+            uint8_t version = qrcode_getVersion(ecc, data.data(), data.size());
+            if (version == 0) {
+                continue;
+            }
+            std::vector<uint8_t> modules(qrcode_getBufferSize(version));
+            QRCode qrcode;
+            EXPECT_EQ(qrcode_initBytes(&qrcode,
+                                       modules.data(),
+                                       version,
+                                       ecc,
+                                       (uint8_t*)data.data(),
+                                       data.size()),
+                      0);
+            masks.insert(qrcode.mask);
+            uint8_t header[2] = {version, qrcode.mask};
+            crypto_generichash_update(&state, header, sizeof header);
+            crypto_generichash_update(&state, modules.data(), modules.size());
+        }
+        unsigned char hash[16];
+        char hex[sizeof hash * 2 + 1];
+        crypto_generichash_final(&state, hash, sizeof hash);
+        return std::string(sodium_bin2hex(hex, sizeof hex, hash, sizeof hash));
+    };
+
+    // Byte mode payloads from version 1 to 40. These symbols are the
+    // same as those of the single byte segment encoder.
+    const char* binary[4] = {"823506d1840132c717f45cd1f26438db",
+                             "5eb8bb32b12cd0f907c5aa703dcb3755",
+                             "5582a744f5b101eaf7c6ee7b33d801ee",
+                             "d9a4bcaff73c84833e2205ba4375a4e2"};
+    std::vector<int> lengths;
+    for (int n = 0; n <= 40; n++) {
+        lengths.push_back(n);
+    }
+    for (int n : {60, 100, 150, 220, 300, 450, 600, 850, 1100, 1400, 1800,
+                  2300, 2900}) {
+        lengths.push_back(n);
+    }
+    for (int ecc = ECC_LOW; ecc <= ECC_HIGH; ecc++) {
+        std::vector<std::vector<uint8_t>> payloads;
+        for (int n : lengths) {
+            std::vector<uint8_t> data(n);
+            for (int i = 0; i < n; i++) {
+                data[i] = 0x80 | (i * 37 + n * 11 + ecc * 5);
+            }
+            payloads.push_back(data);
+        }
+        ASSERT_EQ(digest(ecc, payloads), binary[ecc]) << "ecc " << ecc;
+    }
+    ASSERT_EQ(masks.size(), 8u);
+
+    // Numeric, alphanumeric and mixed segments
+    const char* text[4] = {"3aa638a3af7b5f49a8a4cd595a29ae18",
+                           "2134a57d04d2135f338b83ebd3876023",
+                           "a5d5f3fd206560d23b430ba69bd0989c",
+                           "23c610f7487debaebebddf65c8a835ca"};
+    std::string digits, alnum = "IDPASS LITE $%*+-./:";
+    for (int i = 0; i < 900; i++) {
+        digits.push_back('0' + (i * 7) % 10);
+    }
+    for (int ecc = ECC_LOW; ecc <= ECC_HIGH; ecc++) {
+        std::vector<std::vector<uint8_t>> payloads;
+        std::string mixed = alnum + digits.substr(0, 40) + "\x01\xfe" + alnum;
+        for (std::string t : {digits.substr(0, 7), digits, alnum, mixed}) {
+            payloads.push_back(std::vector<uint8_t>(t.begin(), t.end()));
+        }
+        ASSERT_EQ(digest(ecc, payloads), text[ecc]) << "ecc " << ecc;
+    }
+}
+
+TEST_F(TestCases, qrcode_concurrent_encode_test)
+{
+    std::vector<std::vector<unsigned char>> payloads;
+    for (int n : {1, 20, 100, 300, 700, 1200, 2000}) {
+        std::vector<unsigned char> payload(n);
+        randombytes_buf(payload.data(), payload.size());
+        payloads.push_back(payload);
+    }
+
+    // Single-threaded reference symbols
+    std::vector<std::vector<unsigned char>> expected;
+    for (auto& payload : payloads) {
+        int buf_len = 0, qrsize = 0;
+        unsigned char* buf = idpass_lite_qrpixel2(
+            ctx, &buf_len, payload.data(), payload.size(), &qrsize);
+        ASSERT_TRUE(buf != nullptr);
+        expected.emplace_back(buf, buf + buf_len);
+        idpass_lite_freemem(ctx, buf);
+    }
+
+    const int N = 8;
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < N; t++) {
+        workers.emplace_back([&, t]() {
+            for (int round = 0; round < 5; round++) {
+                for (std::size_t i = 0; i < payloads.size(); i++) {
+                    std::size_t k = (i + t) % payloads.size();
+                    int buf_len = 0, qrsize = 0;
+                    unsigned char* buf = idpass_lite_qrpixel2(ctx,
+                                                              &buf_len,
+                                                              payloads[k].data(),
+                                                              payloads[k].size(),
+                                                              &qrsize);
+                    if (buf == nullptr
+                        || std::vector<unsigned char>(buf, buf + buf_len)
+                               != expected[k]) {
+                        mismatches++;
+                    }
+                    idpass_lite_freemem(ctx, buf);
+                }
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    ASSERT_EQ(mismatches.load(), 0);
+}
+
+TEST_F(TestCases, qrcode_batch_test)
+{
+    std::vector<std::vector<unsigned char>> payloads;
+    for (int n : {10, 300, 2400, 64, 1000}) {
+        std::vector<unsigned char> payload(n);
+        randombytes_buf(payload.data(), payload.size());
+        payloads.push_back(payload);
+    }
+
+    std::vector<unsigned char> payloads_buf;
+    for (auto& payload : payloads) {
+        int len = payload.size();
+        payloads_buf.insert(payloads_buf.end(), (unsigned char*)&len, (unsigned char*)&len + sizeof len);
+        payloads_buf.insert(payloads_buf.end(), payload.begin(), payload.end());
+    }
+
+    // Sizing call, then the actual encode
+    std::vector<int> table(2 * payloads.size());
+    int needed = idpass_lite_qrpixel_batch(ctx, payloads_buf.data(),
+        payloads_buf.size(), nullptr, 0, table.data(), table.size());
+    ASSERT_GT(needed, 0);
+
+    std::vector<unsigned char> arena(needed);
+    ASSERT_EQ(idpass_lite_qrpixel_batch(ctx, payloads_buf.data(),
+        payloads_buf.size(), arena.data(), arena.size(), table.data(),
+        table.size()), needed);
+
+    for (std::size_t i = 0; i < payloads.size(); i++) {
+        int buf_len = 0, qrsize = 0;
+        unsigned char* buf = idpass_lite_qrpixel2(
+            ctx, &buf_len, payloads[i].data(), payloads[i].size(), &qrsize);
+
+        if (buf == nullptr) {
+            // 2400 bytes is over the default ECC_MEDIUM capacity
+            ASSERT_EQ(table[2 * i], -1);
+            ASSERT_EQ(table[2 * i + 1], 0);
+            continue;
+        }
+
+        ASSERT_EQ(table[2 * i + 1], qrsize);
+        ASSERT_LE(table[2 * i] + buf_len, needed);
+        ASSERT_TRUE(std::equal(buf, buf + buf_len, arena.begin() + table[2 * i]));
+        idpass_lite_freemem(ctx, buf);
+    }
+
+    // A table too short for the payloads
+    ASSERT_EQ(idpass_lite_qrpixel_batch(ctx, payloads_buf.data(),
+        payloads_buf.size(), arena.data(), arena.size(), table.data(), 2), -1);
+}
+
+TEST_F(TestCases, qrrender_test)
+{
+    std::vector<unsigned char> payload(300);
+    randombytes_buf(payload.data(), payload.size());
+
+    int buf_len = 0, qrsize = 0;
+    unsigned char* pixels = idpass_lite_qrpixel2(
+        ctx, &buf_len, payload.data(), payload.size(), &qrsize);
+    ASSERT_TRUE(pixels != nullptr);
+
+    auto render = [&](int format, int scale, int quiet) {
+        int n = idpass_lite_qrrender(
+            ctx, pixels, buf_len, qrsize, format, scale, quiet, nullptr, 0);
+        std::vector<unsigned char> image(n > 0 ? n : 0);
+        int m = idpass_lite_qrrender(ctx, pixels, buf_len, qrsize, format,
+            scale, quiet, image.data(), image.size());
+        EXPECT_EQ(n, m);
+        return image;
+    };
+
+    // PBM rows map straight to the modules, 1 for dark
+    const int scale = 3, quiet = 4;
+    int width = (qrsize + 2 * quiet) * scale;
+    std::vector<unsigned char> pbm = render(QRRENDER_PBM, scale, quiet);
+    std::string header = "P4\n" + std::to_string(width) + " "
+                         + std::to_string(width) + "\n";
+    int row_len = (width + 7) / 8;
+    ASSERT_EQ(pbm.size(), header.size() + row_len * width);
+    ASSERT_TRUE(std::equal(header.begin(), header.end(), pbm.begin()));
+
+    for (int y = 0; y < width; y++) {
+        for (int x = 0; x < width; x++) {
+            int mx = x / scale - quiet, my = y / scale - quiet;
+            bool dark = false;
+            if (mx >= 0 && mx < qrsize && my >= 0 && my < qrsize) {
+                int k = my * qrsize + mx;
+                dark = (pixels[k / 8] >> (k % 8)) & 1;
+            }
+            unsigned char b = pbm[header.size() + y * row_len + x / 8];
+            ASSERT_EQ(dark, ((b >> (7 - x % 8)) & 1) == 1);
+        }
+    }
+
+    const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    std::vector<unsigned char> stored = render(QRRENDER_PNG_STORED, 8, quiet);
+    std::vector<unsigned char> png = render(QRRENDER_PNG, 8, quiet);
+    ASSERT_TRUE(std::equal(signature, signature + 8, stored.begin()));
+    ASSERT_TRUE(std::equal(signature, signature + 8, png.begin()));
+    ASSERT_LT(png.size() * 4, stored.size());
+
+    std::vector<unsigned char> svg = render(QRRENDER_SVG, 8, quiet);
+    ASSERT_EQ(std::string(svg.begin(), svg.begin() + 5), "<?xml");
+
+    // Streaming into a file gives the same bytes
+    FILE* f = tmpfile();
+    ASSERT_TRUE(f != nullptr);
+    ASSERT_EQ(idpass_lite_qrrender_fd(ctx, pixels, buf_len, qrsize,
+        QRRENDER_PNG, 8, quiet, fileno(f)), (int)png.size());
+    std::vector<unsigned char> written(png.size());
+    rewind(f);
+    ASSERT_EQ(fread(written.data(), 1, written.size(), f), written.size());
+    fclose(f);
+    ASSERT_TRUE(written == png);
+
+    ASSERT_EQ(idpass_lite_qrrender(ctx, pixels, buf_len, qrsize, QRRENDER_PNG,
+        0, quiet, nullptr, 0), -1);
+
+    // A bitmap shorter than its qrsize claims is not read past its end
+    int short_len = (qrsize * qrsize + 7) / 8 - 1;
+    ASSERT_EQ(idpass_lite_qrrender(ctx, pixels, short_len, qrsize, QRRENDER_PBM,
+        scale, quiet, nullptr, 0), -1);
+    ASSERT_EQ(idpass_lite_qrrender(ctx, pixels, buf_len, qrsize + 4,
+        QRRENDER_PBM, scale, quiet, nullptr, 0), -1);
+    ASSERT_EQ(idpass_lite_qrrender_fd(ctx, pixels, short_len, qrsize,
+        QRRENDER_PNG, 8, quiet, 1), -1);
+
+    idpass_lite_freemem(ctx, pixels);
+}
+
+TEST_F(TestCases, qrcode_mixed_segments_test)
+{
+    // A long digit run, such as a UIN, is packed in numeric mode
+    // between byte segments instead of spending 8 bits per digit
+    std::string digits(600, '0');
+    for (std::size_t i = 0; i < digits.size(); i++) {
+        digits[i] = '0' + (i * 7) % 10;
+    }
+
+    std::vector<unsigned char> mixed(40);
+    randombytes_buf(mixed.data(), mixed.size());
+    mixed.insert(mixed.end(), digits.begin(), digits.end());
+    std::vector<unsigned char> binary(mixed.size());
+    randombytes_buf(binary.data(), binary.size());
+
+    int mixed_len = 0, mixed_size = 0, binary_len = 0, binary_size = 0;
+    unsigned char* mixed_buf = idpass_lite_qrpixel2(
+        ctx, &mixed_len, mixed.data(), mixed.size(), &mixed_size);
+    unsigned char* binary_buf = idpass_lite_qrpixel2(
+        ctx, &binary_len, binary.data(), binary.size(), &binary_size);
+    ASSERT_TRUE(mixed_buf != nullptr);
+    ASSERT_TRUE(binary_buf != nullptr);
+    ASSERT_LT(mixed_size, binary_size);
+
+    // An empty payload still makes a version 1 symbol
+    ASSERT_EQ(qrcode_getVersion(ECC_LOW, nullptr, 0), 1);
+    std::vector<uint8_t> empty(qrcode_getBufferSize(1));
+    ASSERT_EQ(qrcode_getPixels(empty.data(), 1, ECC_LOW, nullptr, 0), 0);
+
+    idpass_lite_freemem(ctx, mixed_buf);
+    idpass_lite_freemem(ctx, binary_buf);
+}
+
+TEST_F(TestCases, qrcode_structured_append_test)
+{
+    // Over binary_encoding_max, so too large for a single QR code
+    std::vector<unsigned char> data(6000);
+    randombytes_buf(data.data(), data.size());
+
+    int buf_len = 0, count = 0, qrsize = 0;
+    unsigned char* buf = idpass_lite_qrpixel_append(
+        ctx, &buf_len, data.data(), data.size(), 20, &count, &qrsize);
+    ASSERT_TRUE(buf != nullptr);
+    ASSERT_GT(count, 1);
+    ASSERT_LE(count, 16);
+    ASSERT_LE(qrsize, 4 * 20 + 17);
+    ASSERT_EQ(buf_len % count, 0);
+
+    // Every emitted symbol decodes, in reverse order, and the symbols
+    // join back into the payload
+    std::vector<unsigned char> emitted;
+    for (int k = count - 1; k >= 0; k--) {
+        std::vector<unsigned char> part(data.size());
+        QRAppend append;
+        int len = qrcode_decodeModules(buf + k * (buf_len / count), qrsize,
+                                       part.data(), part.size(), &append);
+        ASSERT_GT(len, 0);
+        ASSERT_LE(len, (int)part.size());
+        ASSERT_EQ(append.index, k);
+        ASSERT_EQ(append.total, count);
+
+        int symbol_len = len + 2;
+        emitted.insert(emitted.end(), (unsigned char*)&symbol_len,
+                       (unsigned char*)&symbol_len + sizeof symbol_len);
+        emitted.push_back(append.index << 4 | (append.total - 1));
+        emitted.push_back(append.parity);
+        emitted.insert(emitted.end(), part.begin(), part.begin() + len);
+    }
+    int emitted_len = 0;
+    unsigned char* rejoined = idpass_lite_qrappend_join(
+        ctx, &emitted_len, emitted.data(), emitted.size());
+    ASSERT_TRUE(rejoined != nullptr);
+    ASSERT_EQ(emitted_len, (int)data.size());
+    ASSERT_TRUE(std::equal(data.begin(), data.end(), rejoined));
+    idpass_lite_freemem(ctx, rejoined);
+    idpass_lite_freemem(ctx, buf);
+
+    // What fits in one symbol stays a plain QR code
+    int plain_len = 0, plain_size = 0;
+    unsigned char* plain = idpass_lite_qrpixel2(
+        ctx, &plain_len, data.data(), 100, &plain_size);
+    buf = idpass_lite_qrpixel_append(
+        ctx, &buf_len, data.data(), 100, 40, &count, &qrsize);
+    ASSERT_EQ(count, 1);
+    ASSERT_EQ(qrsize, plain_size);
+    ASSERT_TRUE(std::equal(plain, plain + plain_len, buf));
+    idpass_lite_freemem(ctx, buf);
+    idpass_lite_freemem(ctx, plain);
+
+    ASSERT_TRUE(idpass_lite_qrpixel_append(
+        ctx, &buf_len, data.data(), data.size(), 2, &count, &qrsize) == nullptr);
+
+    // Rebuild the decoded symbols of a 5 way split, in reverse order
+    unsigned char parity = 0;
+    for (unsigned char c : data) {
+        parity ^= c;
+    }
+    auto pack = [&](std::vector<int> order, int total) {
+        std::vector<unsigned char> symbols;
+        for (int i : order) {
+            int start = data.size() * i / total;
+            int end = data.size() * (i + 1) / total;
+            int len = end - start + 2;
+            symbols.insert(symbols.end(), (unsigned char*)&len, (unsigned char*)&len + sizeof len);
+            symbols.push_back(i << 4 | (total - 1));
+            symbols.push_back(parity);
+            symbols.insert(symbols.end(), data.begin() + start, data.begin() + end);
+        }
+        return symbols;
+    };
+
+    std::vector<unsigned char> symbols = pack({4, 3, 2, 1, 0}, 5);
+    int joined_len = 0;
+    unsigned char* joined = idpass_lite_qrappend_join(
+        ctx, &joined_len, symbols.data(), symbols.size());
+    ASSERT_TRUE(joined != nullptr);
+    ASSERT_EQ(joined_len, (int)data.size());
+    ASSERT_TRUE(std::equal(data.begin(), data.end(), joined));
+    idpass_lite_freemem(ctx, joined);
+
+    // A missing, a repeated and a corrupted symbol
+    symbols = pack({0, 1, 2, 3}, 5);
+    ASSERT_TRUE(idpass_lite_qrappend_join(
+        ctx, &joined_len, symbols.data(), symbols.size()) == nullptr);
+    symbols = pack({0, 1, 2, 3, 3}, 5);
+    ASSERT_TRUE(idpass_lite_qrappend_join(
+        ctx, &joined_len, symbols.data(), symbols.size()) == nullptr);
+    symbols = pack({0, 1, 2, 3, 4}, 5);
+    symbols.back() ^= 0x01;
+    ASSERT_TRUE(idpass_lite_qrappend_join(
+        ctx, &joined_len, symbols.data(), symbols.size()) == nullptr);
+}
+
+TEST_F(TestCases, qrpixel_rows_test)
+{
+    std::vector<unsigned char> data(1500);
+    randombytes_buf(data.data(), data.size());
+
+    for (int len : {1, 40, 300, 1500}) {
+        int packed_len = 0, qrsize = 0;
+        unsigned char* packed = idpass_lite_qrpixel2(
+            ctx, &packed_len, data.data(), len, &qrsize);
+        ASSERT_TRUE(packed != nullptr);
+
+        for (int align : {1, 4, 8}) {
+            int size = 0, row_bytes = 0;
+            int needed = idpass_lite_qrpixel_rows(
+                ctx, data.data(), len, align, nullptr, 0, &size, &row_bytes);
+            ASSERT_EQ(size, qrsize);
+            ASSERT_EQ(row_bytes % align, 0);
+            ASSERT_GE(row_bytes * 8, size);
+            ASSERT_EQ(needed, size * row_bytes);
+
+            std::vector<unsigned char> rows(needed, 0xAA);
+            ASSERT_EQ(idpass_lite_qrpixel_rows(ctx,
+                                               data.data(),
+                                               len,
+                                               align,
+                                               rows.data(),
+                                               rows.size(),
+                                               &size,
+                                               &row_bytes),
+                      needed);
+
+            // Same modules as the packed bitmap, and zero padding
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < row_bytes * 8; x++) {
+                    bool bit = (rows[y * row_bytes + x / 8] >> (x % 8)) & 1;
+                    int k = y * size + x;
+                    bool module = x < size && ((packed[k / 8] >> (k % 8)) & 1);
+                    ASSERT_EQ(bit, module);
+                }
+            }
+        }
+        idpass_lite_freemem(ctx, packed);
+    }
+
+    int size = 0, row_bytes = 0;
+    ASSERT_EQ(idpass_lite_qrpixel_rows(
+                  ctx, data.data(), 10, 3, nullptr, 0, &size, &row_bytes),
+              -1);
+}
+
+TEST_F(TestCases, qrpixel_bitset_layout_test)
+{
+    // The JNI bridge hands the bitmap to BitSet.valueOf as the little
+    // endian words of its bytes, with a marker bit past the modules. So
+    // module i must be bit i % 8 of byte i / 8, the padding bits clear,
+    // and the bytes must fit into n * n / 64 + 1 words.
+    for (int version = 1; version <= 40; version++) {
+        int n = 4 * version + 17;
+        int buf_len = qrcode_getBufferSize(version);
+        ASSERT_GE(buf_len * 8, n * n);
+        ASSERT_LE(buf_len, (n * n / 64 + 1) * 8);
+    }
+
+    for (int len : {10, 300, 2000}) {
+        std::vector<unsigned char> data(len);
+        randombytes_buf(data.data(), data.size());
+
+        int pixels_len = 0, qrsize = 0;
+        unsigned char* pixels = idpass_lite_qrpixel2(
+            ctx, &pixels_len, data.data(), data.size(), &qrsize);
+        ASSERT_TRUE(pixels != nullptr);
+
+        uint8_t version = (qrsize - 17) / 4;
+        std::vector<uint8_t> modules(qrcode_getBufferSize(version));
+        QRCode qrcode;
+        ASSERT_EQ(qrcode_initBytes(&qrcode,
+                                   modules.data(),
+                                   version,
+                                   ECC_MEDIUM,
+                                   data.data(),
+                                   data.size()),
+                  0);
+
+        for (int i = 0; i < pixels_len * 8; i++) {
+            bool bit = (pixels[i / 8] >> (i % 8)) & 1;
+            bool module = i < qrsize * qrsize
+                          && qrcode_getModule(&qrcode, i % qrsize, i / qrsize);
+            ASSERT_EQ(bit, module) << "bit " << i;
+        }
+        idpass_lite_freemem(ctx, pixels);
+    }
+}
+
+TEST_F(TestCases, qrscan_test)
+{
+    api::Ident ident;
+    ident.set_surname("Pacquiao");
+    ident.set_givenname("Manny");
+    ident.set_placeofbirth("Kibawe, Bukidnon");
+    ident.set_pin("12345");
+
+    std::vector<unsigned char> identbuf(ident.ByteSizeLong());
+    ident.SerializeToArray(identbuf.data(), identbuf.size());
+
+    int cards_len = 0;
+    unsigned char* cards = idpass_lite_create_card_with_face(
+        ctx, &cards_len, identbuf.data(), identbuf.size());
+    ASSERT_TRUE(cards != nullptr);
+
+    int pixels_len = 0, qrsize = 0;
+    unsigned char* pixels
+        = idpass_lite_qrpixel2(ctx, &pixels_len, cards, cards_len, &qrsize);
+    ASSERT_TRUE(pixels != nullptr);
+
+    const int width = 1280, height = 720;
+    std::vector<unsigned char> frame;
+    int data_len = 0, count = 0;
+
+    // Rotated, perspective-warped and noisy symbols that must decode
+    struct Shot {
+        double quad[8];
+        int noise;
+    };
+    std::vector<Shot> readable = {
+        {{420, 110, 890, 150, 860, 650, 380, 600}, 20}, // tilted
+        {{488, 130, 792, 130, 850, 600, 430, 600}, 20}, // keystone
+        {{400, 191, 860, 140, 860, 580, 400, 529}, 20}, // side keystone
+        {{400, 140, 860, 190, 840, 600, 420, 650}, 20}, // oblique
+        {{0}, 20}, // turned by 30 degrees
+        {{0}, 20}, // upside down
+        {{0}, 20}, // turned by 250 degrees
+        {{0}, 50}, // heavy sensor noise
+    };
+    qrframe_square(640, 360, 460, 30, readable[4].quad);
+    qrframe_square(640, 360, 460, 180, readable[5].quad);
+    qrframe_square(640, 360, 460, 250, readable[6].quad);
+    qrframe_square(640, 360, 560, 0, readable[7].quad);
+
+    for (auto& shot : readable) {
+        SCOPED_TRACE(&shot - readable.data());
+        qrframe_render(pixels, qrsize, shot.quad, shot.noise, width, height, frame);
+        unsigned char* data = idpass_lite_qrscan(
+            ctx, &data_len, frame.data(), width, height, width, &count);
+        ASSERT_TRUE(data != nullptr);
+        ASSERT_EQ(count, 1);
+        ASSERT_EQ(data_len, cards_len);
+        ASSERT_TRUE(std::equal(cards, cards + cards_len, data));
+        idpass_lite_freemem(ctx, data);
+    }
+
+    // Symbols half out of the frame or too small to resolve must not
+    std::vector<Shot> unreadable = {
+        {{940, 100, 1540, 100, 1540, 700, 940, 700}, 20},
+        {{0}, 20},
+    };
+    qrframe_square(640, 360, 60, 0, unreadable[1].quad);
+    for (auto& shot : unreadable) {
+        SCOPED_TRACE(&shot - unreadable.data());
+        qrframe_render(pixels, qrsize, shot.quad, shot.noise, width, height, frame);
+        ASSERT_TRUE(idpass_lite_qrscan(
+            ctx, &data_len, frame.data(), width, height, width, &count) == nullptr);
+    }
+
+    qrframe_render(pixels, qrsize, readable[0].quad, 20, width, height, frame);
+
+    int details_len = 0;
+    unsigned char* details = idpass_lite_scan_and_verify_with_pin(
+        ctx, &details_len, frame.data(), width, height, width, "12345");
+    ASSERT_TRUE(details != nullptr);
+    idpass::CardDetails cardDetails;
+    ASSERT_TRUE(cardDetails.ParseFromArray(details, details_len));
+    ASSERT_EQ(cardDetails.surname(), "Pacquiao");
+    idpass_lite_freemem(ctx, details);
+
+    ASSERT_TRUE(idpass_lite_scan_and_verify_with_pin(
+        ctx, &details_len, frame.data(), width, height, width, "54321") == nullptr);
+
+    // A frame without a QR code
+    std::fill(frame.begin(), frame.end(), 128);
+    ASSERT_TRUE(idpass_lite_qrscan(
+        ctx, &data_len, frame.data(), width, height, width, &count) == nullptr);
+
+    idpass_lite_freemem(ctx, pixels);
+    idpass_lite_freemem(ctx, cards);
+}
+
+TEST_F(TestCases, execute_batch_test)
+{
+    api::Ident ident;
+    ident.set_surname("Pacquiao");
+    ident.set_givenname("Manny");
+    ident.set_pin("12345");
+    std::string identbuf = ident.SerializeAsString();
+    std::string message = "this is a test message";
+
+    auto inline_arg = [](api::Operation* op, const std::string& data) {
+        op->add_args()->set_data(data);
+    };
+    auto ref_arg = [](api::Operation* op, int ref) {
+        op->add_args()->set_ref(ref);
+    };
+
+    // Issue a card, then open, render and sign with it, all in one call
+    api::Operations ops;
+    api::Operation* create = ops.add_ops();
+    create->set_op(api::Operation::CREATE_CARD);
+    inline_arg(create, identbuf);
+    create->set_discard(true);
+
+    api::Operation* verify = ops.add_ops();
+    verify->set_op(api::Operation::VERIFY_CARD_WITH_PIN);
+    ref_arg(verify, 0);
+    inline_arg(verify, "12345");
+
+    api::Operation* qrpixel = ops.add_ops();
+    qrpixel->set_op(api::Operation::QRPIXEL);
+    ref_arg(qrpixel, 0);
+
+    api::Operation* sign = ops.add_ops();
+    sign->set_op(api::Operation::SIGN_WITH_CARD);
+    ref_arg(sign, 0);
+    inline_arg(sign, message);
+
+    // A wrong pin, an operation depending on it, and references to
+    // later operations or with missing arguments
+    api::Operation* wrong = ops.add_ops();
+    wrong->set_op(api::Operation::VERIFY_CARD_WITH_PIN);
+    ref_arg(wrong, 0);
+    inline_arg(wrong, "54321");
+
+    api::Operation* dependent = ops.add_ops();
+    dependent->set_op(api::Operation::QRPIXEL);
+    ref_arg(dependent, 4);
+
+    api::Operation* forward = ops.add_ops();
+    forward->set_op(api::Operation::QRPIXEL);
+    ref_arg(forward, 7);
+
+    api::Operation* missing = ops.add_ops();
+    missing->set_op(api::Operation::SIGN_WITH_CARD);
+    ref_arg(missing, 0);
+
+    // Ioctl commands shorter than their parameters, then a whole one
+    api::Operation* shortget = ops.add_ops();
+    shortget->set_op(api::Operation::IOCTL);
+    inline_arg(shortget, std::string(1, IOCTL_GET_FACEDIFF));
+
+    api::Operation* shortacl = ops.add_ops();
+    shortacl->set_op(api::Operation::IOCTL);
+    inline_arg(shortacl, std::string(4, IOCTL_SET_ACL));
+
+    api::Operation* get = ops.add_ops();
+    get->set_op(api::Operation::IOCTL);
+    inline_arg(get, std::string(5, IOCTL_GET_FACEDIFF));
+
+    std::string opsbuf = ops.SerializeAsString();
+    int results_len = 0;
+    unsigned char* results_buf = idpass_lite_execute(
+        ctx, &results_len, (unsigned char*)opsbuf.data(), opsbuf.size());
+    ASSERT_TRUE(results_buf != nullptr);
+
+    api::Results results;
+    ASSERT_TRUE(results.ParseFromArray(results_buf, results_len));
+    idpass_lite_freemem(ctx, results_buf);
+    ASSERT_EQ(results.results_size(), ops.ops_size());
+
+    ASSERT_EQ(results.results(0).status(), EXECUTE_OK);
+    ASSERT_TRUE(results.results(0).data().empty());
+
+    ASSERT_EQ(results.results(1).status(), EXECUTE_OK);
+    idpass::CardDetails details;
+    ASSERT_TRUE(details.ParseFromString(results.results(1).data()));
+    ASSERT_EQ(details.surname(), "Pacquiao");
+
+    ASSERT_EQ(results.results(2).status(), EXECUTE_OK);
+    int qrsize = results.results(2).qrsize();
+    ASSERT_GT(qrsize, 0);
+    ASSERT_EQ((int)results.results(2).data().size(),
+              (qrsize * qrsize + 7) / 8);
+
+    ASSERT_EQ(results.results(3).status(), EXECUTE_OK);
+    ASSERT_EQ(results.results(3).data().size(), 64);
+
+    ASSERT_EQ(results.results(4).status(), EXECUTE_FAILED);
+    ASSERT_EQ(results.results(5).status(), EXECUTE_BADARGS);
+    ASSERT_EQ(results.results(6).status(), EXECUTE_BADARGS);
+    ASSERT_EQ(results.results(7).status(), EXECUTE_BADARGS);
+    ASSERT_EQ(results.results(8).status(), EXECUTE_BADARGS);
+    ASSERT_EQ(results.results(9).status(), EXECUTE_BADARGS);
+    ASSERT_EQ(results.results(10).status(), EXECUTE_OK);
+    ASSERT_EQ(results.results(10).data().size(), 5);
+
+    // A short command is ignored rather than answered past its end
+    unsigned char shortcmd[] = {IOCTL_GET_FDIM, 0xA5};
+    idpass_lite_ioctl(ctx, nullptr, shortcmd, 1);
+    ASSERT_EQ(shortcmd[1], 0xA5);
+
+    unsigned char garbage[] = {0xFF, 0xFF, 0xFF};
+    ASSERT_TRUE(idpass_lite_execute(ctx, &results_len, garbage, sizeof garbage)
+                == nullptr);
+}
+
+TEST_F(TestCases, freemem_many_buffers_test)
+{
+    const unsigned char data[] = "freemem";
+    const int count = 4000;
+    std::vector<unsigned char*> bufs;
+    std::vector<std::vector<unsigned char>> copies;
+
+    for (int i = 0; i < count; i++) {
+        int buf_len = 0;
+        int qrsize = 0;
+        unsigned char* buf = idpass_lite_qrpixel2(
+            ctx, &buf_len, data, sizeof data - 1, &qrsize);
+        ASSERT_TRUE(buf != nullptr);
+        bufs.push_back(buf);
+        copies.emplace_back(buf, buf + buf_len);
+    }
+
+    // Buffers of the context are left alone by another context, and
+    // memory the library did not hand out is not touched
+    idpass_lite_freemem(nullptr, bufs[0]);
+    ASSERT_TRUE(std::equal(copies[0].begin(), copies[0].end(), bufs[0]));
+    unsigned char local[64] = {0};
+    idpass_lite_freemem(ctx, local + 32);
+    idpass_lite_freemem(ctx, bufs[0]);
+
+    // Newest first, the order that scanned every buffer held
+    for (int i = count - 1; i > 0; i--) {
+        ASSERT_TRUE(std::equal(copies[i].begin(), copies[i].end(), bufs[i]));
+        idpass_lite_freemem(ctx, bufs[i]);
+    }
+}
+
+TEST_F(TestCases, into_buffers_test)
+{
+    api::Ident ident;
+    ident.set_surname("Pacquiao");
+    ident.set_givenname("Manny");
+    ident.set_pin("12345");
+    std::string identbuf = ident.SerializeAsString();
+
+    // A first call with no buffer returns the length to allocate
+    int card_len = idpass_lite_create_card_with_face_into(
+        ctx, (unsigned char*)identbuf.data(), identbuf.size(), nullptr, 0);
+    ASSERT_GT(card_len, 0);
+
+    std::vector<unsigned char> card(card_len + 64);
+    card_len = idpass_lite_create_card_with_face_into(
+        ctx,
+        (unsigned char*)identbuf.data(),
+        identbuf.size(),
+        card.data(),
+        card.size());
+    ASSERT_GT(card_len, 0);
+    ASSERT_LE(card_len, (int)card.size());
+    card.resize(card_len);
+
+    // Same details as the allocating variant, untouched buffer when short
+    int details_len = 0;
+    unsigned char* details = idpass_lite_verify_card_with_pin(
+        ctx, &details_len, card.data(), card.size(), "12345");
+    ASSERT_TRUE(details != nullptr);
+
+    std::vector<unsigned char> small(details_len - 1, 0xA5);
+    ASSERT_EQ(idpass_lite_verify_card_with_pin_into(
+                  ctx, card.data(), card.size(), "12345", small.data(), small.size()),
+              details_len);
+    ASSERT_TRUE(std::all_of(small.begin(), small.end(), [](unsigned char c) {
+        return c == 0xA5;
+    }));
+
+    std::vector<unsigned char> into(details_len);
+    ASSERT_EQ(idpass_lite_verify_card_with_pin_into(
+                  ctx, card.data(), card.size(), "12345", into.data(), into.size()),
+              details_len);
+    ASSERT_TRUE(std::equal(into.begin(), into.end(), details));
+    idpass_lite_freemem(ctx, details);
+
+    ASSERT_EQ(idpass_lite_verify_card_with_pin_into(
+                  ctx, card.data(), card.size(), "54321", into.data(), into.size()),
+              -1);
+
+    // Encrypt and decrypt round trip, sized without opening the card
+    std::string msg = "this is a test message";
+    int encrypted_len = idpass_lite_encrypt_with_card_into(
+        ctx, card.data(), card.size(), (unsigned char*)msg.data(), msg.size(), nullptr, 0);
+    ASSERT_EQ(encrypted_len, (int)msg.size() + 40);
+
+    std::vector<unsigned char> encrypted(encrypted_len);
+    ASSERT_EQ(idpass_lite_encrypt_with_card_into(ctx,
+                                                 card.data(),
+                                                 card.size(),
+                                                 (unsigned char*)msg.data(),
+                                                 msg.size(),
+                                                 encrypted.data(),
+                                                 encrypted.size()),
+              encrypted_len);
+
+    std::vector<unsigned char> decrypted(msg.size());
+    ASSERT_EQ(idpass_lite_decrypt_with_card_into(ctx,
+                                                 card.data(),
+                                                 card.size(),
+                                                 encrypted.data(),
+                                                 encrypted.size(),
+                                                 decrypted.data(),
+                                                 decrypted.size()),
+              (int)msg.size());
+    ASSERT_TRUE(std::equal(decrypted.begin(), decrypted.end(), msg.begin()));
+
+    encrypted.back() ^= 1;
+    ASSERT_EQ(idpass_lite_decrypt_with_card_into(ctx,
+                                                 card.data(),
+                                                 card.size(),
+                                                 encrypted.data(),
+                                                 encrypted.size(),
+                                                 decrypted.data(),
+                                                 decrypted.size()),
+              -1);
+
+    // QR code bitmap
+    int qrsize = 0;
+    int qrbuf_len = 0;
+    unsigned char* qrbuf = idpass_lite_qrpixel2(
+        ctx, &qrbuf_len, card.data(), card.size(), &qrsize);
+    ASSERT_TRUE(qrbuf != nullptr);
+
+    int into_qrsize = 0;
+    std::vector<unsigned char> qrinto(idpass_lite_qrpixel_into(
+        ctx, card.data(), card.size(), nullptr, 0, &into_qrsize));
+    ASSERT_EQ((int)qrinto.size(), qrbuf_len);
+    ASSERT_EQ(idpass_lite_qrpixel_into(
+                  ctx, card.data(), card.size(), qrinto.data(), qrinto.size(), &into_qrsize),
+              qrbuf_len);
+    ASSERT_EQ(into_qrsize, qrsize);
+    ASSERT_TRUE(std::equal(qrinto.begin(), qrinto.end(), qrbuf));
+    idpass_lite_freemem(ctx, qrbuf);
+
+    // Certificates
+    unsigned char pk[crypto_sign_PUBLICKEYBYTES];
+    unsigned char sk[crypto_sign_SECRETKEYBYTES];
+    idpass_lite_generate_secret_signature_keypair(pk, sizeof pk, sk, sizeof sk);
+    unsigned char childpk[crypto_sign_PUBLICKEYBYTES];
+    unsigned char childsk[crypto_sign_SECRETKEYBYTES];
+    idpass_lite_generate_secret_signature_keypair(
+        childpk, sizeof childpk, childsk, sizeof childsk);
+
+    int root_len = 0;
+    unsigned char* root
+        = idpass_lite_generate_root_certificate(sk, sizeof sk, &root_len);
+    ASSERT_TRUE(root != nullptr);
+    std::vector<unsigned char> rootinto(
+        idpass_lite_generate_root_certificate_into(sk, sizeof sk, nullptr, 0));
+    ASSERT_EQ((int)rootinto.size(), root_len);
+    ASSERT_EQ(idpass_lite_generate_root_certificate_into(
+                  sk, sizeof sk, rootinto.data(), rootinto.size()),
+              root_len);
+    ASSERT_TRUE(std::equal(rootinto.begin(), rootinto.end(), root));
+    idpass_lite_freemem(nullptr, root);
+
+    int child_len = 0;
+    unsigned char* child = idpass_lite_generate_child_certificate(
+        sk, sizeof sk, childpk, sizeof childpk, &child_len);
+    ASSERT_TRUE(child != nullptr);
+    std::vector<unsigned char> childinto(child_len);
+    ASSERT_EQ(idpass_lite_generate_child_certificate_into(sk,
+                                                          sizeof sk,
+                                                          childpk,
+                                                          sizeof childpk,
+                                                          childinto.data(),
+                                                          childinto.size()),
+              child_len);
+    ASSERT_TRUE(std::equal(childinto.begin(), childinto.end(), child));
+    idpass_lite_freemem(nullptr, child);
+
+    // Merged CardDetails
+    idpass::CardDetails d1;
+    d1.set_uin("14443");
+    idpass::CardDetails d2;
+    d2.set_surname("Doe");
+    std::string d1buf = d1.SerializeAsString();
+    std::string d2buf = d2.SerializeAsString();
+
+    int merged_len = idpass_lite_merge_CardDetails_into(
+        (unsigned char*)d1buf.data(), d1buf.size(),
+        (unsigned char*)d2buf.data(), d2buf.size(), nullptr, 0);
+    ASSERT_GT(merged_len, 0);
+    std::vector<unsigned char> mergedbuf(merged_len);
+    ASSERT_EQ(idpass_lite_merge_CardDetails_into((unsigned char*)d1buf.data(),
+                                                 d1buf.size(),
+                                                 (unsigned char*)d2buf.data(),
+                                                 d2buf.size(),
+                                                 mergedbuf.data(),
+                                                 mergedbuf.size()),
+              merged_len);
+
+    idpass::CardDetails merged;
+    ASSERT_TRUE(merged.ParseFromArray(mergedbuf.data(), mergedbuf.size()));
+    ASSERT_EQ(merged.uin(), "14443");
+    ASSERT_EQ(merged.surname(), "Doe");
+}
+
+TEST_F(TestCases, face_into_buffers_test)
+{
+    std::vector<unsigned char> _ident(m_ident.ByteSizeLong());
+    m_ident.SerializeToArray(_ident.data(), _ident.size());
+    std::vector<char> photo(m_ident.photo().begin(), m_ident.photo().end());
+
+    int card_len = idpass_lite_create_card_with_face_into(
+        ctx, _ident.data(), _ident.size(), nullptr, 0);
+    ASSERT_GT(card_len, 0);
+    std::vector<unsigned char> card(card_len);
+    ASSERT_EQ(idpass_lite_create_card_with_face_into(
+                  ctx, _ident.data(), _ident.size(), card.data(), card.size()),
+              card_len);
+
+    // Same details as the allocating variant, untouched buffer when short
+    int details_len = 0;
+    unsigned char* details = idpass_lite_verify_card_with_face(
+        ctx, &details_len, card.data(), card.size(), photo.data(), photo.size());
+    ASSERT_TRUE(details != nullptr);
+
+    std::vector<unsigned char> small(details_len - 1, 0xA5);
+    ASSERT_EQ(idpass_lite_verify_card_with_face_into(ctx,
+                                                     card.data(),
+                                                     card.size(),
+                                                     photo.data(),
+                                                     photo.size(),
+                                                     small.data(),
+                                                     small.size()),
+              details_len);
+    ASSERT_TRUE(std::all_of(small.begin(), small.end(), [](unsigned char c) {
+        return c == 0xA5;
+    }));
+
+    std::vector<unsigned char> into(details_len);
+    ASSERT_EQ(idpass_lite_verify_card_with_face_into(ctx,
+                                                     card.data(),
+                                                     card.size(),
+                                                     photo.data(),
+                                                     photo.size(),
+                                                     into.data(),
+                                                     into.size()),
+              details_len);
+    ASSERT_TRUE(std::equal(into.begin(), into.end(), details));
+    idpass_lite_freemem(ctx, details);
+
+    idpass::CardDetails cardDetails;
+    ASSERT_TRUE(cardDetails.ParseFromArray(into.data(), into.size()));
+    ASSERT_EQ(cardDetails.surname(), "Pacquiao");
+
+    // The face dimensions are written into a caller's 512 bytes
+    float face[128];
+    std::vector<unsigned char> facebuf(sizeof face);
+    ASSERT_EQ(idpass_lite_face128d(ctx, photo.data(), photo.size(), face), 1);
+    ASSERT_EQ(idpass_lite_face128dbuf(
+                  ctx, photo.data(), photo.size(), facebuf.data()), 1);
+    ASSERT_EQ(std::memcmp(facebuf.data(), face, sizeof face), 0);
+
+    // A card without a face never opens with a photo
+    m_ident.clear_photo();
+    _ident.resize(m_ident.ByteSizeLong());
+    m_ident.SerializeToArray(_ident.data(), _ident.size());
+    std::vector<unsigned char> noface(idpass_lite_create_card_with_face_into(
+        ctx, _ident.data(), _ident.size(), nullptr, 0));
+    ASSERT_EQ(idpass_lite_create_card_with_face_into(
+                  ctx, _ident.data(), _ident.size(), noface.data(), noface.size()),
+              (int)noface.size());
+    ASSERT_EQ(idpass_lite_verify_card_with_face_into(ctx,
+                                                     noface.data(),
+                                                     noface.size(),
+                                                     photo.data(),
+                                                     photo.size(),
+                                                     into.data(),
+                                                     into.size()),
+              -1);
+}
+
 int main(int argc, char* argv[])
 {
     if (argc > 1) {
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2020 Newlogic Pte. Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+* Synthetic camera frames for the QR scanner. A QR code bitmap, as
+* returned by idpass_lite_qrpixel, is warped with its 4 module quiet
+* zone onto a quadrilateral of a grayscale frame, by the inverse of the
+* transform from the unit square to the quadrilateral. The corners of
+* quad are x, y pairs in the order top left, top right, bottom right and
+* bottom left of the symbol. The frame also gets a horizontal lighting
+* gradient and a uniform pixel noise of up to noise gray levels.
+*/
+
+inline void qrframe_render(const unsigned char* pixels,
+                           int qrsize,
+                           const double (&quad)[8],
+                           int noise,
+                           int width,
+                           int height,
+                           std::vector<unsigned char>& frame)
+{
+    double dx1 = quad[2] - quad[4], dx2 = quad[6] - quad[4];
+    double dy1 = quad[3] - quad[5], dy2 = quad[7] - quad[5];
+    double sx = quad[0] - quad[2] + quad[4] - quad[6];
+    double sy = quad[1] - quad[3] + quad[5] - quad[7];
+    double den = dx1 * dy2 - dx2 * dy1;
+    double g = (sx * dy2 - dx2 * sy) / den;
+    double h = (dx1 * sy - sx * dy1) / den;
+    double m[9] = {quad[2] - quad[0] + g * quad[2],
+                   quad[6] - quad[0] + h * quad[6],
+                   quad[0],
+                   quad[3] - quad[1] + g * quad[3],
+                   quad[7] - quad[1] + h * quad[7],
+                   quad[1],
+                   g,
+                   h,
+                   1};
+    double inv[9] = {m[4] * m[8] - m[5] * m[7],
+                     m[2] * m[7] - m[1] * m[8],
+                     m[1] * m[5] - m[2] * m[4],
+                     m[5] * m[6] - m[3] * m[8],
+                     m[0] * m[8] - m[2] * m[6],
+                     m[2] * m[3] - m[0] * m[5],
+                     m[3] * m[7] - m[4] * m[6],
+                     m[1] * m[6] - m[0] * m[7],
+                     m[0] * m[4] - m[1] * m[3]};
+
+    unsigned int seed = 1;
+    frame.assign(width * height, 0);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double w = inv[6] * x + inv[7] * y + inv[8];
+            double u = (inv[0] * x + inv[1] * y + inv[2]) / w;
+            double v = (inv[3] * x + inv[4] * y + inv[5]) / w;
+            int mx = (int)std::floor(u * (qrsize + 8)) - 4;
+            int my = (int)std::floor(v * (qrsize + 8)) - 4;
+            bool dark = mx >= 0 && my >= 0 && mx < qrsize && my < qrsize
+                        && (pixels[(my * qrsize + mx) / 8] >> ((my * qrsize + mx) % 8))
+                               & 1;
+            seed = seed * 1103515245 + 12345;
+            int shade = (dark ? 40 : 200) - x / 16;
+            if (noise > 0) {
+                shade += (int)(seed >> 16) % (2 * noise + 1) - noise;
+            }
+            frame[y * width + x] = std::max(0, std::min(255, shade));
+        }
+    }
+}
+
+/**
+* The corners, as taken by qrframe_render, of a square of side pixels
+* centered on cx, cy and turned by degrees clockwise.
+*/
+
+inline void qrframe_square(double cx,
+                           double cy,
+                           double side,
+                           double degrees,
+                           double (&quad)[8])
+{
+    const double corners[8] = {-1, -1, 1, -1, 1, 1, -1, 1};
+    double a = degrees * 3.14159265358979323846 / 180;
+    for (int i = 0; i < 4; i++) {
+        double x = corners[2 * i] * side / 2;
+        double y = corners[2 * i + 1] * side / 2;
+        quad[2 * i] = cx + x * std::cos(a) - y * std::sin(a);
+        quad[2 * i + 1] = cy + x * std::sin(a) + y * std::cos(a);
+    }
+}